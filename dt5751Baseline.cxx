@@ -0,0 +1,220 @@
+/*****************************************************************************/
+/**
+\file dt5751Baseline.cxx
+
+## Contents
+
+This file contains the class implementation for the baseline tracking.
+ *****************************************************************************/
+
+#include "dt5751Baseline.hxx"
+#include <algorithm>
+#include <cmath>
+
+const uint32_t dt5751Baseline::kMinWindows;
+
+//
+//--------------------------------------------------------------------------------
+dt5751Baseline::dt5751Baseline()
+: first_module_(0), target_(900), tolerance_(2), dac_per_adc_(-64), max_dac_step_(256), samples_(16),
+  max_spread_(10)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Allocate the per-channel state (frontend init)
+ *
+ * \param   [in]  firstModuleID  module ID of the first board of the frontend
+ * \param   [in]  numModules     boards of the frontend
+ */
+void dt5751Baseline::Init(int firstModuleID, int numModules)
+{
+  first_module_ = firstModuleID;
+  Channel empty = { 0, 0, 0, false };
+  channels_.assign((size_t)numModules*4, empty);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the tracking parameters (begin of run)
+ *
+ * \param   [in]  target      baseline wanted, ADC counts
+ * \param   [in]  tolerance   error left alone, ADC counts
+ * \param   [in]  dacPerAdc   DAC counts moving the baseline by one ADC count (signed)
+ * \param   [in]  maxDacStep  largest DAC change of one Update()
+ * \param   [in]  samples     samples of a window
+ * \param   [in]  maxSpread   largest max - min of a window without pulse
+ */
+void dt5751Baseline::Configure(int target, int tolerance, int dacPerAdc, int maxDacStep, int samples,
+                               int maxSpread)
+{
+  target_ = target;
+  tolerance_ = std::max(tolerance, 0);
+  dac_per_adc_ = dacPerAdc;
+  max_dac_step_ = std::max(maxDacStep, 0);
+  samples_ = std::max(samples, 1);
+  max_spread_ = std::max(maxSpread, 0);
+  Reset();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Forget the windows not used yet (the corrections are kept)
+ */
+void dt5751Baseline::Reset()
+{
+  for (size_t i = 0; i < channels_.size(); i++) {
+    channels_[i].sum = 0;
+    channels_[i].count = 0;
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Add a window of samples to the estimate of a channel, unless it holds a pulse
+ */
+void dt5751Baseline::AddWindow_(int module, int channel, const uint16_t *samples, uint32_t n)
+{
+  if (n == 0 || channel < 0 || channel >= 4)
+    return;
+  n = std::min(n, samples_);
+
+  uint32_t sum = 0;
+  int lo = samples[0], hi = samples[0];
+  for (uint32_t i = 0; i < n; i++) {
+    sum += samples[i];
+    lo = std::min(lo, (int)samples[i]);
+    hi = std::max(hi, (int)samples[i]);
+  }
+  if (hi - lo > max_spread_)
+    return;
+
+  Channel &c = channels_[module*4 + channel];
+  c.sum += (double)sum/n;
+  c.count++;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Sample the fragments of an event (dt5751EventBuilder monitor)
+ */
+void dt5751Baseline::Observe(const std::vector<dt5751EventBuilder::Fragment> &fragments)
+{
+  for (size_t i = 0; i < fragments.size(); i++) {
+    const dt5751EventBuilder::Fragment &f = fragments[i];
+    int module = f.module->GetModuleID() - first_module_;
+    if (module < 0 || module*4 >= (int)channels_.size() || f.module->IsDESMode())
+      continue;
+
+    const dt5751Decoder::Kernels &kernels = f.module->GetKernels();
+    uint32_t flags = f.module->GetBankFlags();
+    uint32_t size_words = f.event[0] & 0x0FFFFFFF;
+
+    if (flags & dt5751Decoder::kZleFlag) {
+      // Decoded from a copy with the flags of the data format
+      event_.assign(f.event, f.event + size_words);
+      event_[1] |= flags;
+      if (!kernels.decode(&event_[0], size_words, decoded_) &&
+          !dt5751Decoder::Decode(&event_[0], size_words, decoded_))
+        continue;
+      for (size_t c = 0; c < decoded_.size(); c++) {
+        const dt5751Decoder::Channel &ch = decoded_[c];
+        if (!ch.segments.empty() && ch.segments[0].count)
+          AddWindow_(module, ch.channel, &ch.samples[0], ch.segments[0].count);
+      }
+      continue;
+    }
+
+    uint32_t mask = f.event[1] & 0xFF;
+    int nch = __builtin_popcount(mask);
+    if (nch == 0 || size_words < 4)
+      continue;
+    uint32_t words = (size_words - 4)/nch;
+    const DWORD *src = f.event + 4;
+    for (int c = 0; c < nch; c++, src += words) {
+      int channel = __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (flags & dt5751Decoder::kPack25Flag) {
+        // Only the words of the window
+        uint32_t w = std::min(words, dt5751Decoder::WordsForSamples(samples_, true));
+        unpacked_.resize(dt5751Decoder::SamplesInWords(w, true));
+        uint32_t n = w ? kernels.unpack(src, w, &unpacked_[0]) : 0;
+        AddWindow_(module, channel, n ? &unpacked_[0] : NULL, n);
+      } else {
+        // Pack 2: the samples are the 16-bit halves of the words, in order
+        AddWindow_(module, channel, (const uint16_t *)src, 2*words);
+      }
+    }
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Estimate the baselines and correct the DAC and the levels
+ *
+ * Called at safe points during the run, main thread: the register writes go
+ * through the slow control queues of the link threads.
+ *
+ * \param   [in]  modules  boards of the frontend
+ * \return  number of channels whose correction changed
+ */
+int dt5751Baseline::Update(std::vector<dt5751CONET2> &modules)
+{
+  int changed = 0;
+  for (size_t m = 0; m < modules.size() && m*4 < channels_.size(); m++) {
+    dt5751CONET2 &module = modules[m];
+    for (int ch = 0; ch < 4; ch++) {
+      Channel &c = channels_[m*4 + ch];
+      if (c.count < kMinWindows)
+        continue;
+      double estimate = c.sum/c.count;
+      c.sum = 0;
+      c.count = 0;
+      if (c.settling) {
+        c.settling = false;
+        continue;
+      }
+      c.baseline = estimate;
+      if (!module.IsConnected() || module.IsOffline())
+        continue;
+
+      // DAC step towards the target, within the DAC range
+      double error = target_ - c.baseline;
+      int step = 0;
+      if (std::fabs(error) > tolerance_)
+        step = std::max(std::min((int)lround(error*dac_per_adc_), max_dac_step_), -max_dac_step_);
+      int dac = (int)module.GetChannelDac(ch);
+      step = std::max(std::min(dac + step, 0xFFFF), 0) - dac;
+
+      // Levels follow the baseline expected after the step
+      double expected = c.baseline + (dac_per_adc_ ? (double)step/dac_per_adc_ : 0);
+      dt5751CONET2::BaselineCorrection corr = module.GetBaselineCorrection(ch);
+      dt5751CONET2::BaselineCorrection next = { corr.dac + step, (int)lround(expected - target_) };
+      if (next.dac == corr.dac && next.shift == corr.shift)
+        continue;
+
+      if (!module.SetBaselineCorrection(ch, next))
+        cm_msg(MERROR, "dt5751Baseline", "Cannot correct the baseline of module %d channel %d",
+               module.GetModuleID(), ch);
+      c.settling = (step != 0);
+      changed++;
+    }
+  }
+  return changed;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,90 @@
+/*****************************************************************************/
+/**
+\file dt5751Baseline.hxx
+
+## Contents
+
+This file contains the class definition for the baseline tracking: the
+baseline of each channel is estimated from sampled waveforms and held at a
+target by small steps of its DAC offset, the self-trigger threshold and the
+ZLE baseline following it.
+ *****************************************************************************/
+
+#ifndef DT5751BASELINE_HXX_INCLUDE
+#define DT5751BASELINE_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+#include "dt5751EventBuilder.hxx"
+
+/**
+ * Baseline tracking of the boards of the frontend (main thread only).
+ *
+ * As a dt5751EventBuilder monitor it sees one event in "sample interval",
+ * before the level-2 filter.  The baseline estimate of a channel is the
+ * mean of the first samples of its record (of its first interval for ZLE
+ * data, the samples before the threshold crossing); windows whose spread
+ * exceeds "max spread" hold a pulse and are ignored.
+ *
+ * Update() is called at safe points (the periodic buffer level readout):
+ * for each channel with enough windows since the previous call, a baseline
+ * further than the tolerance from the target moves the DAC by "DAC per ADC"
+ * counts per ADC count of the error, at most "max DAC step" at a time.  The
+ * ADC levels of the ODB (self-trigger threshold, ZLE baseline) are meant for
+ * a baseline at the target; they are shifted by the distance of the
+ * baseline expected after the step to the target, so that they keep their
+ * distance to the actual baseline.  After a step the windows of the next
+ * period are dropped: they may come from events taken before the new DAC
+ * value settled (board and ring buffers).  The corrections are kept by the
+ * dt5751CONET2 objects across runs and written again by InitializeForAcq(),
+ * so a run starts where the previous one left off.
+ *
+ * The two ADCs of a channel in DES mode share its samples; boards in DES
+ * mode are not tracked.
+ */
+class dt5751Baseline : public dt5751EventBuilder::Monitor
+{
+
+public:
+
+  static const uint32_t kMinWindows = 4;   //!< Windows needed for an estimate
+
+  dt5751Baseline();
+
+  void Init(int firstModuleID, int numModules);
+  void Configure(int target, int tolerance, int dacPerAdc, int maxDacStep, int samples, int maxSpread);
+  void Reset();
+
+  void Observe(const std::vector<dt5751EventBuilder::Fragment> &fragments);
+  int Update(std::vector<dt5751CONET2> &modules);
+
+  double GetBaseline(int module, int channel) const {   //!< Last estimate, module index in the frontend
+    return channels_[module*4 + channel].baseline;
+  }
+
+private:
+
+  struct Channel {
+    double sum;             //!< Window means since the last Update()
+    uint32_t count;
+    double baseline;        //!< Last estimate, 0 if none yet
+    bool settling;          //!< DAC just moved, windows of the next period dropped
+  };
+
+  void AddWindow_(int module, int channel, const uint16_t *samples, uint32_t n);
+
+  int first_module_;
+  int target_;              //!< ADC counts
+  int tolerance_;
+  int dac_per_adc_;         //!< DAC counts per ADC count, signed
+  int max_dac_step_;
+  uint32_t samples_;        //!< Samples of a window
+  int max_spread_;
+  std::vector<Channel> channels_;   //!< [module][channel]
+  std::vector<uint16_t> unpacked_;  //!< Pack 2.5 window
+  std::vector<DWORD> event_;        //!< ZLE event copied with its header flags
+  std::vector<dt5751Decoder::Channel> decoded_;
+};
+
+#endif // DT5751BASELINE_HXX_INCLUDE
@@ -0,0 +1,173 @@
+/*****************************************************************************/
+/**
+\file dt5751Batch.cxx
+
+## Contents
+
+This file contains the class implementation for the trigger batching.
+ *****************************************************************************/
+
+#include "dt5751Batch.hxx"
+#include "dt5751Metrics.hxx"
+#include <algorithm>
+
+const uint32_t dt5751Batch::kPartial;
+
+//
+//--------------------------------------------------------------------------------
+dt5751Batch::dt5751Batch()
+: max_triggers_(1), max_latency_ns_(0), max_event_bytes_(0), target_(1), rate_hz_(0),
+  start_ns_(0), last_close_ns_(0), mark_(0), max_trigger_bytes_(0)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the batching parameters (begin of run)
+ *
+ * \param   [in]  maxTriggers    triggers per MIDAS event at most, 1 to disable batching
+ * \param   [in]  maxLatencyUs   longest time the first trigger of an event waits for the others
+ * \param   [in]  maxEventBytes  size of the MIDAS events
+ */
+void dt5751Batch::Configure(int maxTriggers, DWORD maxLatencyUs, DWORD maxEventBytes)
+{
+  max_triggers_ = std::max(maxTriggers, 1);
+  max_latency_ns_ = (uint64_t)maxLatencyUs*1000;
+  max_event_bytes_ = maxEventBytes;
+  entries_.reserve(max_triggers_);
+  Reset();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Forget the rate of the previous run
+ */
+void dt5751Batch::Reset()
+{
+  entries_.clear();
+  target_ = 1;
+  rate_hz_ = 0;
+  last_close_ns_ = 0;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Start a new event (after bk_init32)
+ */
+void dt5751Batch::Begin(char *pevent)
+{
+  entries_.clear();
+  start_ns_ = dt5751Metrics::NowNs();
+  max_trigger_bytes_ = 0;
+  Mark(pevent);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Remember where the banks of the next trigger start
+ */
+void dt5751Batch::Mark(char *pevent)
+{
+  mark_ = ((BANK_HEADER *)pevent)->data_size;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Keep the banks created since Mark() as one trigger
+ *
+ * \param   [in]  pevent     event being composed
+ * \param   [in]  ttt        trigger time tag of the trigger
+ * \param   [in]  fragments  board fragments of the trigger
+ * \param   [in]  partial    fragments missing (partially merged)
+ */
+void dt5751Batch::Add(char *pevent, uint32_t ttt, DWORD fragments, bool partial)
+{
+  Entry e;
+  e.offset = mark_;
+  e.size = ((BANK_HEADER *)pevent)->data_size - mark_;
+  e.ttt = ttt;
+  e.flags = (fragments & ~kPartial) | (partial ? kPartial : 0);
+  entries_.push_back(e);
+  max_trigger_bytes_ = std::max(max_trigger_bytes_, e.size);
+  Mark(pevent);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Drop the banks created since Mark()
+ */
+void dt5751Batch::Rollback(char *pevent)
+{
+  ((BANK_HEADER *)pevent)->data_size = mark_;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Check whether another trigger should be added to the event
+ *
+ * \return  false once the target is reached, the latency cap is over, or
+ *          the event could not hold another trigger as large as the largest
+ *          one so far and the index bank
+ */
+bool dt5751Batch::WantMore(char *pevent) const
+{
+  if ((int)entries_.size() >= target_)
+    return false;
+  if (dt5751Metrics::NowNs() - start_ns_ >= max_latency_ns_)
+    return false;
+  uint64_t needed = (uint64_t)bk_size(pevent) + 2*(uint64_t)max_trigger_bytes_ +
+                    sizeof(BANK32) + (entries_.size() + 1)*sizeof(Entry);
+  return needed <= max_event_bytes_;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Write the index bank and update the rate and the target
+ *
+ * \return  triggers in the event
+ */
+int dt5751Batch::Close(char *pevent)
+{
+  uint64_t now = dt5751Metrics::NowNs();
+  int n = (int)entries_.size();
+
+  if (n > 0) {
+    DWORD *pdata;
+    bk_create(pevent, "EVIX", TID_DWORD, (void **)&pdata);
+    for (int i = 0; i < n; i++) {
+      *pdata++ = entries_[i].offset;
+      *pdata++ = entries_[i].size;
+      *pdata++ = entries_[i].ttt;
+      *pdata++ = entries_[i].flags;
+    }
+    bk_close(pevent, pdata);
+  }
+
+  // Rate over the time covered by this event, smoothed over a few events
+  if (last_close_ns_ && now > last_close_ns_) {
+    double rate = n*1e9/(double)(now - last_close_ns_);
+    rate_hz_ = (rate_hz_ > 0) ? 0.75*rate_hz_ + 0.25*rate : rate;
+  }
+  last_close_ns_ = now;
+
+  double wanted = rate_hz_*max_latency_ns_*1e-9;
+  target_ = (int)std::min(std::max(wanted, 1.0), (double)max_triggers_);
+  return n;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
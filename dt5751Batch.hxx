@@ -0,0 +1,87 @@
+/*****************************************************************************/
+/**
+\file dt5751Batch.hxx
+
+## Contents
+
+This file contains the class definition for the trigger batching of the
+data equipment: several merged triggers are packed into one MIDAS event,
+followed by an index bank (EVIX) giving where the banks of each trigger are.
+ *****************************************************************************/
+
+#ifndef DT5751BATCH_HXX_INCLUDE
+#define DT5751BATCH_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+#include "midas.h"
+
+/**
+ * Batches of triggers in one MIDAS event (main thread only).
+ *
+ * read_event_from_ring_bufs() builds one trigger after the other into the
+ * same event: Mark() before the banks of a trigger, then Add() to keep them
+ * or Rollback() to drop them (skipped partial event).  WantMore() tells
+ * whether to wait for another trigger: the batch stops at the target number
+ * of triggers, when the oldest trigger has waited for the latency cap, or
+ * when the next trigger might not fit in the event.  The target follows the
+ * trigger rate (rate x latency cap, between 1 and the maximum), so that a
+ * slow run is not delayed and a fast one fills its events.
+ *
+ * Close() appends the EVIX bank, 4 DWORDs per trigger:
+ * - offset of its first bank in bytes, from the end of the BANK_HEADER
+ * - size of its banks in bytes
+ * - trigger time tag of its first board fragment
+ * - number of board fragments, bit 31 set for a partially merged trigger
+ *
+ * The banks of successive triggers have the same names; an analyzer splits
+ * the event with the offsets.  Without batching (maximum of 1 trigger per
+ * event) no EVIX bank is written and the events are unchanged.
+ */
+class dt5751Batch
+{
+
+public:
+
+  static const uint32_t kPartial = 0x80000000;    //!< EVIX word 3: partially merged
+
+  dt5751Batch();
+
+  void Configure(int maxTriggers, DWORD maxLatencyUs, DWORD maxEventBytes);
+  void Reset();
+  bool IsEnabled() const { return max_triggers_ > 1; }
+
+  void Begin(char *pevent);
+  void Mark(char *pevent);
+  void Add(char *pevent, uint32_t ttt, DWORD fragments, bool partial);
+  void Rollback(char *pevent);
+  bool WantMore(char *pevent) const;
+  int Close(char *pevent);
+
+  int GetNumTriggers() const { return (int)entries_.size(); }
+  int GetTarget() const { return target_; }
+  double GetRate() const { return rate_hz_; }
+
+private:
+
+  struct Entry {
+    uint32_t offset;        //!< First bank, bytes after the BANK_HEADER
+    uint32_t size;          //!< Bytes of the banks of the trigger
+    uint32_t ttt;
+    uint32_t flags;         //!< Fragments | kPartial
+  };
+
+  std::vector<Entry> entries_;
+  int max_triggers_;
+  uint64_t max_latency_ns_;
+  DWORD max_event_bytes_;
+  int target_;              //!< Triggers wanted in the current event
+  double rate_hz_;          //!< Smoothed trigger rate, 0 until measured
+  uint64_t start_ns_;       //!< First trigger of the current event
+  uint64_t last_close_ns_;  //!< Previous Close(), 0 at start of run
+  uint32_t mark_;           //!< Bank bytes at the last Mark()
+  uint32_t max_trigger_bytes_;  //!< Largest trigger of the current event
+};
+
+#endif // DT5751BATCH_HXX_INCLUDE
@@ -8,7 +8,10 @@ This file contains the class implementation for the DT5751 module driver.
  *****************************************************************************/
 
 #include "dt5751CONET2.hxx"
-#include <execinfo.h>
+#include "dt5751Decoder.hxx"
+#include "dt5751Metrics.hxx"
+#include "dt5751RegProfile.hxx"
+#include "dt5751Trace.hxx"
 #include <algorithm>
 #include <vector>
 #include <cmath>
@@ -67,7 +70,7 @@ const char * dt5751CONET2::config_str_board[] = {\
     NULL
 };
 
-const char dt5751CONET2::history_settings[][NAME_LENGTH] = { "eStored", "busy", "rb_level" };
+const char dt5751CONET2::history_settings[][NAME_LENGTH] = { "eStored", "busy", "rb_level", "spill_kB" };
 
 /**
  * \brief   Constructor for the module object
@@ -79,17 +82,36 @@ const char dt5751CONET2::history_settings[][NAME_LENGTH] = { "eStored", "busy",
  * \param   [in]  board     Board number on the optical link
  * \param   [in]  moduleID  Unique ID assigned to module
  */
+const uint64_t dt5751CONET2::kNoTimestamp;
+
 dt5751CONET2::dt5751CONET2(int feindex, int link, int board, int moduleID, HNDLE hDB)
-: feIndex_(feindex), link_(link), board_(board), moduleID_(moduleID), odb_handle_(hDB), num_events_in_rb_(0)
+: feIndex_(feindex), link_(link), board_(board), moduleID_(moduleID), odb_handle_(hDB), num_events_in_rb_(0),
+  readout_stamps_(new ReadoutStamp[kNumReadoutStamps]()), stamp_write_seq_(0), stamp_read_seq_(0),
+  newest_ttt_(0)
 {
+  settings_index_ = moduleID % 8;
   device_handle_ = -1;
   settings_handle_ = 0;
   settings_loaded_ = false;
   settings_touched_ = false;
   running_= false;
+  paused_ = false;
   data_type_ = RawPack2;
   rb_handle_ = -1;
   verbosity_ = 0;
+  offline_ = false;
+  link_queue_ = NULL;
+  slow_control_ = SlowControl();
+  trig_post_ = PostedWrite();
+  ctl_post_ = PostedWrite();
+  ctl_op_ = CtlNone;
+  acq_ctl_ = 0;
+  des_mode_ = false;
+  ettt_ = false;
+  last_ttt_ = 0;
+  ttt_epoch_ = 0;
+  memset(baseline_corr_, 0, sizeof(baseline_corr_));
+  SelectKernels_(0);
 
   // Start by assuming the board is enabled; will be overriden by ODB later.
   config.enable = true;
@@ -103,17 +125,36 @@ dt5751CONET2::dt5751CONET2(int feindex, int link, int board, int moduleID, HNDLE
 dt5751CONET2::dt5751CONET2(dt5751CONET2&& other) noexcept
 : feIndex_(std::move(other.feIndex_)), link_(std::move(other.link_)), board_(std::move(other.board_)),
     moduleID_(std::move(other.moduleID_)), odb_handle_(std::move(other.odb_handle_)),
-        num_events_in_rb_(other.num_events_in_rb_.load())
+        num_events_in_rb_(other.num_events_in_rb_.load()),
+        readout_stamps_(std::move(other.readout_stamps_)), stamp_write_seq_(other.stamp_write_seq_),
+        stamp_read_seq_(other.stamp_read_seq_), newest_ttt_(other.newest_ttt_.load())
 {
+  settings_index_ = other.settings_index_;
   device_handle_ = std::move(other.device_handle_);
   settings_handle_ = std::move(other.settings_handle_);
   settings_loaded_ = std::move(other.settings_loaded_);
   settings_touched_ = std::move(other.settings_touched_);
   running_= std::move(other.running_);
+  paused_ = other.paused_;
   data_type_ = std::move(other.data_type_);
   rb_handle_ = std::move(other.rb_handle_);
   data_type_ = std::move(other.data_type_);
   verbosity_ = std::move(other.verbosity_);
+  offline_ = other.offline_;
+  link_queue_ = other.link_queue_;
+  slow_control_ = other.slow_control_;
+  trig_post_ = PostedWrite();   // no write in flight while moving
+  ctl_post_ = PostedWrite();
+  ctl_op_ = CtlNone;
+  acq_ctl_ = other.acq_ctl_;
+  des_mode_ = other.des_mode_;
+  kernels_ = other.kernels_;
+  memcpy(bank_name_, other.bank_name_, sizeof(bank_name_));
+  bank_flags_ = other.bank_flags_;
+  ettt_ = other.ettt_;
+  last_ttt_ = other.last_ttt_;
+  ttt_epoch_ = other.ttt_epoch_;
+  memcpy(baseline_corr_, other.baseline_corr_, sizeof(baseline_corr_));
   config = std::move(other.config);
 
 
@@ -126,16 +167,37 @@ dt5751CONET2& dt5751CONET2::operator=(dt5751CONET2&& other) noexcept
     link_ = std::move(other.link_);
     board_ = std::move(other.board_);
     moduleID_ = std::move(other.moduleID_);
+    settings_index_ = other.settings_index_;
     odb_handle_ = std::move(other.odb_handle_);
     num_events_in_rb_ = other.num_events_in_rb_.load();
+    readout_stamps_ = std::move(other.readout_stamps_);
+    stamp_write_seq_ = other.stamp_write_seq_;
+    stamp_read_seq_ = other.stamp_read_seq_;
+    newest_ttt_ = other.newest_ttt_.load();
     device_handle_ = std::move(other.device_handle_);
     settings_handle_ = std::move(other.settings_handle_);
     settings_loaded_ = std::move(other.settings_loaded_);
     settings_touched_ = std::move(other.settings_touched_);
     running_= std::move(other.running_);
+    paused_ = other.paused_;
     rb_handle_ = std::move(other.rb_handle_);
     data_type_ = std::move(other.data_type_);
     verbosity_ = std::move(other.verbosity_);
+    offline_ = other.offline_;
+    link_queue_ = other.link_queue_;
+    slow_control_ = other.slow_control_;
+    trig_post_ = PostedWrite();
+    ctl_post_ = PostedWrite();
+    ctl_op_ = CtlNone;
+    acq_ctl_ = other.acq_ctl_;
+    des_mode_ = other.des_mode_;
+    kernels_ = other.kernels_;
+    memcpy(bank_name_, other.bank_name_, sizeof(bank_name_));
+    bank_flags_ = other.bank_flags_;
+    ettt_ = other.ettt_;
+    last_ttt_ = other.last_ttt_;
+    ttt_epoch_ = other.ttt_epoch_;
+    memcpy(baseline_corr_, other.baseline_corr_, sizeof(baseline_corr_));
     config = std::move(other.config);
 
   }
@@ -180,7 +242,27 @@ std::string dt5751CONET2::GetName()
  */
 bool dt5751CONET2::IsConnected()
 {
-  return (device_handle_ >= 0) && config.enable;
+  return (device_handle_ >= 0 || offline_) && config.enable;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Use the module without hardware
+ *
+ * The module counts as connected and enabled; its ring buffer is filled with
+ * PushFragment() instead of ReadEvent().  Run start/stop only set the running
+ * flag; register accesses return CAENComm_DeviceNotFound, reads with the
+ * value set to 0.  Used by dt5751bench and dt5751Replay.
+ *
+ * \param   [in]  type  data type of the fragments that will be pushed
+ */
+void dt5751CONET2::SetOffline(DataType type)
+{
+  offline_ = true;
+  data_type_ = type;
+  config.enable = true;
+  SelectKernels_(0);
 }
 
 //
@@ -321,6 +403,7 @@ void * dt5751CONET2::connectThread(void * arg){
       << t_args->dt5751->link_ << ","
       << t_args->dt5751->board_ << ")" << std::endl;
 
+  // The link number selects the A3818 too: the links of the cards of a PC are numbered card by card
   *(t_args->errcode) = CAENComm_OpenDevice(CAENComm_OpticalLink, t_args->dt5751->link_, t_args->dt5751->board_,
       0, &(t_args->dt5751->device_handle_));
   pthread_cond_signal(t_args->cv);
@@ -379,6 +462,73 @@ bool dt5751CONET2::StartRun()
 {
   if (verbosity_) std::cout << GetName() << "::StartRun()\n";
 
+  return PrepareRun() && BeginRunControl(CtlStart) && EndRunControl();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Start data acquisition
+ *
+ * Write to Acquisition Control reg to put board in STOP mode.
+ * Set _running flag false.
+ *
+ * \return  CAENComm Error Code (see CAENComm.h)
+ */
+bool dt5751CONET2::StopRun()
+{
+  if (verbosity_) std::cout << GetName() << "::StopRun()\n";
+
+  return BeginRunControl(CtlStop) && EndRunControl();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Gate the triggers, keeping the board armed
+ *
+ * Clear the trigger source enable mask.  The acquisition keeps running:
+ * events already in the board buffers can still be read out and the
+ * trigger time tag keeps counting, so nothing is lost or reset.
+ *
+ * \return  true on success
+ */
+bool dt5751CONET2::PauseRun()
+{
+  if (verbosity_) std::cout << GetName() << "::PauseRun()\n";
+
+  return BeginRunControl(CtlPause) && EndRunControl();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Restore the trigger sources gated by PauseRun()
+ *
+ * Uses the trigger source of the ODB record, which may have been changed
+ * during the pause; the other settings are only applied by StartRun().
+ *
+ * \return  true on success
+ */
+bool dt5751CONET2::ResumeRun()
+{
+  if (verbosity_) std::cout << GetName() << "::ResumeRun()\n";
+
+  return BeginRunControl(CtlResume) && EndRunControl();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Configure the board for the next run, without starting it
+ *
+ * Re-read the ODB record, it may have changed, and apply it.  The board is
+ * then started by BeginRunControl(CtlStart).
+ *
+ * \return  true on success
+ */
+bool dt5751CONET2::PrepareRun()
+{
   if (IsRunning()) {
     cm_msg(MERROR,"StartRun","Board %d already started", this->GetModuleID());
     return false;
@@ -388,6 +538,13 @@ bool dt5751CONET2::StartRun()
     return false;
   }
 
+  paused_ = false;
+  last_ttt_ = 0;      // The time tag restarts with the run
+  ttt_epoch_ = 0;
+  newest_ttt_ = 0;
+  if (offline_)
+    return true;
+
 	std::cout << "reinitializing" << std::endl;
 
   gettimeofday(&last_sw_trig_time, NULL);
@@ -398,100 +555,127 @@ bool dt5751CONET2::StartRun()
 	
 	int status = InitializeForAcq();
 	if (status == -1){std::cout << "Failed to Acq " << std::endl; return false;  }
-
-  CAENComm_ErrorCode e = AcqCtl_(DT5751_RUN_START);
-  if (e == CAENComm_Success){
-    running_=true;
-	}else{
-		std::cout << "Failed to start run... " << std::endl;
-    return false;
-	}	
   return true;
 }
 
 //
 //--------------------------------------------------------------------------------
 /**
- * \brief   Start data acquisition
+ * \brief   Start a run control operation, EndRunControl() completes it
  *
- * Write to Acquisition Control reg to put board in STOP mode.
- * Set _running flag false.
+ * Each operation is a single register write, posted to the link queue ahead
+ * of the slow control.  Starting the operation on all boards before waiting
+ * lets the links carry it out in parallel, so that the boards start, stop or
+ * pause within one link transaction of each other rather than one after the
+ * other.  Main thread only.
  *
- * \return  CAENComm Error Code (see CAENComm.h)
+ * \param   [in]  op  operation
+ * \return  false if the operation is not possible in the current state
  */
-bool dt5751CONET2::StopRun()
+bool dt5751CONET2::BeginRunControl(RunControl op)
 {
-  if (verbosity_) std::cout << GetName() << "::StopRun()\n";
+  const char *names[] = { "WriteReg", "StartRun", "StopRun", "PauseRun", "ResumeRun" };
+  ctl_post_.queued = false;
+  ctl_post_.cmd.result = CAENComm_Success;
+  ctl_op_ = CtlNone;
 
-  if (!IsRunning()) {
-    cm_msg(MERROR,"StopRun","Board %d already stopped", this->GetModuleID());
-    return false;
-  }
   if (!IsConnected()) {
-    cm_msg(MERROR,"StopRun","Board %d disconnected", this->GetModuleID());
+    cm_msg(MERROR, names[op], "Board %d disconnected", this->GetModuleID());
     return false;
   }
 
-  CAENComm_ErrorCode e = AcqCtl_(DT5751_RUN_STOP);
-  if (e == CAENComm_Success)
-    running_=false;
-  else
+  DWORD address = 0, val = 0;
+  switch (op) {
+  case CtlStart:
+    if (IsRunning()) {
+      cm_msg(MERROR, names[op], "Board %d already started", this->GetModuleID());
+      return false;
+    }
+    address = DT5751_ACQUISITION_CONTROL;
+    val = acq_ctl_ | 0x4;
+    break;
+  case CtlStop:
+    if (!IsRunning()) {
+      cm_msg(MERROR, names[op], "Board %d already stopped", this->GetModuleID());
+      return false;
+    }
+    address = DT5751_ACQUISITION_CONTROL;
+    val = acq_ctl_ & ~0x4;
+    break;
+  case CtlPause:
+    if (!IsRunning()) {
+      cm_msg(MERROR, names[op], "Board %d not started", this->GetModuleID());
+      return false;
+    }
+    if (paused_) return true;
+    address = DT5751_TRIG_SRCE_EN_MASK;
+    val = 0;
+    break;
+  case CtlResume:
+    if (!paused_) {
+      cm_msg(MERROR, names[op], "Board %d not paused", this->GetModuleID());
+      return false;
+    }
+    address = DT5751_TRIG_SRCE_EN_MASK;
+    val = config.trigger_source;
+    break;
+  default:
     return false;
+  }
 
+  ctl_op_ = op;
+  if (!offline_)
+    BeginWrite_(ctl_post_, address, val);
   return true;
 }
 
-
 //
 //--------------------------------------------------------------------------------
 /**
- * \brief   Control data acquisition
- *
- * Write to Acquisition Control reg
+ * \brief   Wait for the operation started by BeginRunControl() and update the state
  *
- * \param   [in]  operation acquisition mode (see dt5751.h)
- * \return  CAENComm Error Code (see CAENComm.h)
+ * \return  true on success
  */
-CAENComm_ErrorCode dt5751CONET2::AcqCtl_(uint32_t operation)
+bool dt5751CONET2::EndRunControl()
 {
+  RunControl op = ctl_op_;
+  ctl_op_ = CtlNone;
+  if (EndWrite_(ctl_post_) != CAENComm_Success) {
+    switch (op) {
+    case CtlStart:
+      std::cout << "Failed to start run... " << std::endl;
+      break;
+    case CtlPause:
+      cm_msg(MERROR,"PauseRun","Could not gate the triggers of board %d", this->GetModuleID());
+      break;
+    case CtlResume:
+      cm_msg(MERROR,"ResumeRun","Could not restore the triggers of board %d", this->GetModuleID());
+      break;
+    default:
+      break;
+    }
+    return false;
+  }
 
-  uint32_t reg;
-  CAENComm_ErrorCode sCAEN;
-
-  sCAEN = CAENComm_Read32(device_handle_, DT5751_ACQUISITION_CONTROL, &reg);
-
-  switch (operation) {
-  case DT5751_RUN_START:
-    sCAEN = CAENComm_Write32(device_handle_, DT5751_ACQUISITION_CONTROL, (reg | 0x4));
-    break;
-  case DT5751_RUN_STOP:
-    sCAEN = CAENComm_Write32(device_handle_, DT5751_ACQUISITION_CONTROL, (reg & ~( 0x4)));
-
-    break;
-  case DT5751_REGISTER_RUN_MODE:
-    sCAEN = CAENComm_Write32(device_handle_, DT5751_ACQUISITION_CONTROL, 0x100);
-    break;
-  case DT5751_SIN_RUN_MODE:
-    sCAEN = CAENComm_Write32(device_handle_, DT5751_ACQUISITION_CONTROL, 0x101);
+  switch (op) {
+  case CtlStart:
+    running_ = true;
     break;
-  case DT5751_SIN_GATE_RUN_MODE:
-    sCAEN = CAENComm_Write32(device_handle_, DT5751_ACQUISITION_CONTROL, 0x102);
+  case CtlStop:
+    running_ = false;
+    paused_ = false;
     break;
-  case DT5751_MULTI_BOARD_SYNC_MODE:
-    sCAEN = CAENComm_Write32(device_handle_, DT5751_ACQUISITION_CONTROL, 0x103);
+  case CtlPause:
+    paused_ = true;
     break;
-  case DT5751_COUNT_ACCEPTED_TRIGGER:
-    sCAEN = CAENComm_Write32(device_handle_, DT5751_ACQUISITION_CONTROL, (reg & ~( 0x8)));
-    break;
-  case DT5751_COUNT_ALL_TRIGGER:
-    sCAEN = CAENComm_Write32(device_handle_, DT5751_ACQUISITION_CONTROL, (reg | 0x8));
+  case CtlResume:
+    gettimeofday(&last_sw_trig_time, NULL);
+    paused_ = false;
     break;
   default:
-    printf("operation %d not defined\n", operation);
     break;
   }
-  return sCAEN;
-
+  return true;
 }
 
 //
@@ -514,6 +698,9 @@ CAENComm_ErrorCode dt5751CONET2::WriteChannelConfig_(uint32_t operation)
 /**
  * \brief   Read 32-bit register
  *
+ * Called from another thread than the link thread, the read is queued as
+ * slow control and done by the link thread between two readouts.
+ *
  * \param   [in]  address  address of the register to read
  * \param   [out] val      value read from register
  * \return  CAENComm Error Code (see CAENComm.h)
@@ -524,7 +711,31 @@ CAENComm_ErrorCode dt5751CONET2::ReadReg_(DWORD address, DWORD *val)
     std::cout << GetName() << "::ReadReg(" << std::hex << address << ")" << std::endl;
     printf("Module: %d, verbosity: %d\n", this->GetModuleID(), verbosity_);
   }
-  return CAENComm_Read32(device_handle_, address, val);
+  if (offline_) {
+    *val = 0;
+    return CAENComm_DeviceNotFound;
+  }
+
+  if (link_queue_ && !link_queue_->IsOwner())
+    return RunOnLink_(dt5751LinkQueue::SlowControl, [=]() { return (int)Read32_(address, val); });
+  return Read32_(address, val);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Read 32-bit register on the calling thread, profiled
+ */
+CAENComm_ErrorCode dt5751CONET2::Read32_(DWORD address, DWORD *val)
+{
+  dt5751RegProfile &profile = dt5751RegProfile::Instance();
+  if (!profile.IsEnabled())
+    return CAENComm_Read32(device_handle_, address, val);
+
+  uint64_t start_ns = dt5751Metrics::NowNs();
+  CAENComm_ErrorCode sCAEN = CAENComm_Read32(device_handle_, address, val);
+  profile.Record(moduleID_, address, false, dt5751Metrics::NowNs() - start_ns, sCAEN != CAENComm_Success);
+  return sCAEN;
 }
 
 //
@@ -532,33 +743,87 @@ CAENComm_ErrorCode dt5751CONET2::ReadReg_(DWORD address, DWORD *val)
 /**
  * \brief   Write to 32-bit register
  *
+ * Queued as slow control like ReadReg_() when not on the link thread.
+ *
  * \param   [in]  address  address of the register to write to
  * \param   [in]  val      value to write to the register
  * \return  CAENComm Error Code (see CAENComm.h)
  */
 CAENComm_ErrorCode dt5751CONET2::WriteReg_(DWORD address, DWORD val)
 {
+  if (verbosity_ >= 2) std::cout << GetName() << "::WriteReg(" << std::hex << address << "," << val << ")" << std::endl;
+  if (offline_) return CAENComm_DeviceNotFound;
 
-#define SIZE 100
+  if (link_queue_ && !link_queue_->IsOwner())
+    return RunOnLink_(dt5751LinkQueue::SlowControl, [=]() { return (int)Write32_(address, val); });
+  return Write32_(address, val);
+}
 
-  if(address == 0x8108){
-    int nptrs, j;
-    void *buffer[SIZE];
-    char **strings;
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Write to 32-bit register on the calling thread, profiled
+ */
+CAENComm_ErrorCode dt5751CONET2::Write32_(DWORD address, DWORD val)
+{
+  dt5751RegProfile &profile = dt5751RegProfile::Instance();
+  if (!profile.IsEnabled())
+    return CAENComm_Write32(device_handle_, address, val);
 
-    nptrs = backtrace(buffer, SIZE);
-    //printf("backtrace() returned %d addresses\n", nptrs);
+  uint64_t start_ns = dt5751Metrics::NowNs();
+  CAENComm_ErrorCode sCAEN = CAENComm_Write32(device_handle_, address, val);
+  profile.Record(moduleID_, address, true, dt5751Metrics::NowNs() - start_ns, sCAEN != CAENComm_Success);
+  return sCAEN;
+}
 
-    strings = backtrace_symbols(buffer, nptrs);
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Read several 32-bit registers in one transaction on the calling thread, profiled
+ *
+ * \param   [in]  address  addresses of the registers to read
+ * \param   [in]  n        number of registers
+ * \param   [out] val      values read
+ * \return  CAENComm Error Code of the first failed read, CAENComm_Success otherwise
+ */
+CAENComm_ErrorCode dt5751CONET2::MultiRead32_(uint32_t *address, int n, uint32_t *val)
+{
+  std::vector<CAENComm_ErrorCode> errors(n, CAENComm_Success);
+  dt5751RegProfile &profile = dt5751RegProfile::Instance();
+  uint64_t start_ns = profile.IsEnabled() ? dt5751Metrics::NowNs() : 0;
+
+  CAENComm_ErrorCode sCAEN = CAENComm_MultiRead32(device_handle_, address, n, val, errors.data());
+  for (int i = 0; i < n && sCAEN == CAENComm_Success; i++)
+    sCAEN = errors[i];
+
+  // One round trip, shared between the registers
+  if (profile.IsEnabled()) {
+    uint64_t ns = (dt5751Metrics::NowNs() - start_ns)/n;
+    for (int i = 0; i < n; i++)
+      profile.Record(moduleID_, address[i], false, ns, errors[i] != CAENComm_Success);
+  }
+  return sCAEN;
+}
 
-    //for (j = 0; j < nptrs; j++)
-    //    printf("%s\n", strings[j]);
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Hand a register access to the link thread and wait for it
+ *
+ * \param   [in]  prio  link queue priority
+ * \param   [in]  fn    access returning a CAENComm Error Code
+ * \return  CAENComm Error Code (see CAENComm.h)
+ */
+CAENComm_ErrorCode dt5751CONET2::RunOnLink_(dt5751LinkQueue::Priority prio, const std::function<int()> &fn)
+{
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  uint64_t start_ns = dt5751Metrics::NowNs();
 
-    free(strings);
-  }
+  CAENComm_ErrorCode sCAEN = (CAENComm_ErrorCode)link_queue_->Run(prio, fn);
 
-  if (verbosity_ >= 2) std::cout << GetName() << "::WriteReg(" << std::hex << address << "," << val << ")" << std::endl;
-  return CAENComm_Write32(device_handle_, address, val);
+  metrics.Add(moduleID_, dt5751Metrics::LinkCommands);
+  metrics.Observe(moduleID_, dt5751Metrics::LinkCmdNs, dt5751Metrics::NowNs() - start_ns);
+  return sCAEN;
 }
 
 //
@@ -591,7 +856,7 @@ bool dt5751CONET2::Poll(DWORD *val)
     return false;
   }
 
-  CAENComm_ErrorCode sCAEN = CAENComm_Read32(device_handle_, DT5751_EVENT_STORED, val);
+  CAENComm_ErrorCode sCAEN = ReadReg_(DT5751_EVENT_STORED, val);
   return (sCAEN == CAENComm_Success);
 }
 
@@ -606,17 +871,65 @@ bool dt5751CONET2::CheckEvent()
   //this->ReadReg(DT5751_READOUT_STATUS, &vmeStat);
   //return (vmeStat & 0x1);
   this->ReadReg(DT5751_ACQUISITION_STATUS, &vmeStat);
-  return ( (vmeStat >> 3) & 0x1);
+  bool ready = ((vmeStat >> 3) & 0x1);
+  dt5751Trace::Instance().Record(dt5751Trace::CheckEvent, moduleID_, ready);
+  return ready;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Number of events stored in the board (link scheduler)
+ *
+ * \return  DT5751_EVENT_STORED, -1 on communication error
+ */
+int dt5751CONET2::GetEventsStored()
+{
+  DWORD eStored;
+  if (ReadReg_(DT5751_EVENT_STORED, &eStored) != CAENComm_Success)
+    return -1;
+  dt5751Trace::Instance().Record(dt5751Trace::CheckEvent, moduleID_, eStored);
+  return (int)eStored;
 }
 
 //
 //--------------------------------------------------------------------------------
+/**
+ * \brief   Read the next event into the ring buffer and hand it to the main thread
+ *
+ * \param   [in]  wp  ring buffer write pointer (rb_get_wp())
+ * \return  false on communication error
+ */
 bool dt5751CONET2::ReadEvent(void *wp)
+{
+  uint64_t start_ns = dt5751Metrics::NowNs();
+  DWORD dwords_read_total = 0;
+
+  bool ok = ReadEventToBuffer(wp, &dwords_read_total);
+  PublishEvent_((const DWORD *)wp, dwords_read_total, start_ns);
+  return ok;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Read the next event without publishing it
+ *
+ * Used by the link thread to spill events to disk; buf must hold
+ * DT5751_MAX_EVENT_SIZE bytes.
+ *
+ * \param   [in]  buf         destination
+ * \param   [out] size_words  event size in DWORDs
+ * \return  false on communication error
+ */
+bool dt5751CONET2::ReadEventToBuffer(void *buf, DWORD *size_words)
 {
   CAENComm_ErrorCode sCAEN;
   
-  DWORD size_remaining_dwords, to_read_dwords, *pdata = (DWORD *)wp;
+  DWORD size_remaining_dwords, to_read_dwords, *pdata = (DWORD *)buf;
   int dwords_read_total = 0, dwords_read = 0;
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  dt5751Trace &trace = dt5751Trace::Instance();
 
 	// Block read to get all data from board.  
   sCAEN = ReadReg_(DT5751_EVENT_SIZE, &size_remaining_dwords);
@@ -625,7 +938,9 @@ bool dt5751CONET2::ReadEvent(void *wp)
     //calculate amount of data to be read in this iteration
     to_read_dwords = (size_remaining_dwords > MAX_BLT_READ_SIZE_BYTES/sizeof(DWORD)) ?
       MAX_BLT_READ_SIZE_BYTES/sizeof(DWORD) : size_remaining_dwords;
-    sCAEN = CAENComm_BLTRead(device_handle_, DT5751_EVENT_READOUT_BUFFER, (DWORD *)pdata, to_read_dwords, &dwords_read);
+    trace.Record(dt5751Trace::BltStart, moduleID_, to_read_dwords*sizeof(DWORD));
+    sCAEN = CAENComm_BLTRead(device_handle_, DT5751_EVENT_READOUT_BUFFER, (DWORD *)pdata, to_read_dwords*sizeof(DWORD), &dwords_read);
+    trace.Record(dt5751Trace::BltEnd, moduleID_, dwords_read*sizeof(DWORD));
     
     if (verbosity_>=2) std::cout << sCAEN << " = BLTRead(handle=" << device_handle_
                                  << ", addr=" << DT5751_EVENT_READOUT_BUFFER
@@ -633,21 +948,84 @@ bool dt5751CONET2::ReadEvent(void *wp)
                                  << ", to_read_dwords=" << to_read_dwords
                                  << ", dwords_read returned " << dwords_read << ");" << std::endl;
   
+    metrics.Add(moduleID_, dt5751Metrics::BltCalls);
+    metrics.Observe(moduleID_, dt5751Metrics::BltBytes, dwords_read*sizeof(DWORD));
+
     //increment pointers/counters
     dwords_read_total += dwords_read;
     size_remaining_dwords -= dwords_read;
     pdata += dwords_read;
   }
   
-  rb_increment_wp(this->GetRingBufferHandle(), dwords_read_total*sizeof(int));
-  
-  this->IncrementNumEventsInRB(); //atomic
-  if (sCAEN != CAENComm_Success) 
+  *size_words = dwords_read_total;
+
+  if (sCAEN != CAENComm_Success) {
+    trace.Record(dt5751Trace::ReadError, moduleID_, (uint32_t)sCAEN);
     cm_msg(MERROR,"ReadEvent", "Communication error: %d", sCAEN);
+  }
 
   return (sCAEN == CAENComm_Success);
 }
 
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Copy a fragment into the ring buffer as if read from the board
+ *
+ * Offline counterpart of ReadEvent() (benchmarks, replay); the fragment is
+ * handed to the main thread the same way.  Also publishes an event already
+ * read at the write pointer by ReadEventToBuffer() (data == wp, no copy).
+ *
+ * \param   [in]  data        DT5751 event, starting with the header
+ * \param   [in]  size_words  size of the event in DWORDs
+ * \return  false if the ring buffer stayed full
+ */
+bool dt5751CONET2::PushFragment(const DWORD *data, DWORD size_words)
+{
+  uint64_t start_ns = dt5751Metrics::NowNs();
+  void *wp;
+
+  int status = rb_get_wp(this->GetRingBufferHandle(), &wp, 100);
+  if (status == DB_TIMEOUT)
+    return false;
+
+  if (wp != (void *)data)
+    memcpy(wp, data, size_words*sizeof(DWORD));
+  PublishEvent_((const DWORD *)wp, size_words, start_ns);
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Hand an event written at the ring buffer write pointer to the main thread
+ *
+ * \param   [in]  size_words  event size in DWORDs
+ * \param   [in]  start_ns    when the readout started (dt5751Metrics::NowNs())
+ */
+void dt5751CONET2::PublishEvent_(const DWORD *event, DWORD size_words, uint64_t start_ns)
+{
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+
+  // Time tag of the newest event, see GetNewestExtendedTimestamp()
+  if (size_words >= 4)
+    newest_ttt_.store(((uint64_t)((event[1] >> 8) & 0xFFFF) << 32) | event[3], std::memory_order_relaxed);
+
+  rb_increment_wp(this->GetRingBufferHandle(), size_words*sizeof(DWORD));
+
+  // Stamp the event before publishing it to the main thread
+  uint64_t done_ns = dt5751Metrics::NowNs();
+  ReadoutStamp &stamp = readout_stamps_[stamp_write_seq_ % kNumReadoutStamps];
+  stamp.ns.store(done_ns, std::memory_order_relaxed);
+  stamp.seq.store(stamp_write_seq_++, std::memory_order_relaxed);
+  metrics.Observe(moduleID_, dt5751Metrics::ReadoutNs, done_ns - start_ns);
+
+  this->IncrementNumEventsInRB(); //atomic
+  metrics.Add(moduleID_, dt5751Metrics::BytesRead, size_words*sizeof(DWORD));
+  metrics.Add(moduleID_, dt5751Metrics::EventsRead);
+  metrics.Observe(moduleID_, dt5751Metrics::EventBytes, size_words*sizeof(DWORD));
+}
+
 
 DWORD dt5751CONET2::PeekRBTimestamp() {
 
@@ -668,6 +1046,202 @@ DWORD dt5751CONET2::PeekRBTimestamp() {
   return (*(src+3));
 }
 
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Extended trigger time tag of the next event of the ring buffer
+ *
+ * \param   [out] sizeWords  size of the event, if not NULL
+ * \return  time tag in 8 ns ticks since the start of the run, kNoTimestamp on error
+ */
+uint64_t dt5751CONET2::PeekRBExtendedTimestamp(uint32_t *sizeWords) {
+
+  DWORD *src=NULL;
+  int status = rb_get_rp(this->GetRingBufferHandle(), (void**)&src, 5000);
+  if (status == DB_TIMEOUT) {
+    cm_msg(MERROR,"PeekRBExtendedTimestamp", "Got rp timeout for module %d", this->GetModuleID());
+    return kNoTimestamp;
+  }
+
+  if ((*src & 0xF0000000) != 0xA0000000){
+    cm_msg(MERROR,"PeekRBExtendedTimestamp","Incorrect hearder for board:%d (0x%x)", this->GetModuleID(), *src);
+    return kNoTimestamp;
+  }
+
+  if (sizeWords)
+    *sizeWords = *src & 0x0FFFFFFF;
+  return ExtendTimestamp_(src);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Extended trigger time tag of an event
+ *
+ * With the extended time tag of the firmware (FP I/O control bits [22:21]
+ * = 2), bits [47:32] are in header word 1 [23:8] and bits [31:0] in word 3.
+ * Otherwise the 31-bit time tag is extended in software, counting its
+ * rollovers (every 17 s) between the events read; a board must then not
+ * stay a whole rollover period without an event.
+ */
+uint64_t dt5751CONET2::ExtendTimestamp_(const DWORD *src) const
+{
+  if (ettt_)
+    return ((uint64_t)((src[1] >> 8) & 0xFFFF) << 32) | src[3];
+
+  uint32_t ttt = src[3] & 0x7FFFFFFF;
+  uint64_t ext = ttt_epoch_ + ttt;
+  if (ttt < last_ttt_)
+    ext += 0x80000000ull;   // Rolled over since the last event
+  return ext;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Extended trigger time tag of the newest event of the ring buffer
+ *
+ * Only valid while the ring buffer holds events.  Without the extended time
+ * tag of the firmware, the time tag is extended from the last event copied,
+ * so the ring buffer must not span a whole rollover period.
+ *
+ * \return  time tag in 8 ns ticks since the start of the run
+ */
+uint64_t dt5751CONET2::GetNewestExtendedTimestamp()
+{
+  uint64_t raw = newest_ttt_.load(std::memory_order_relaxed);
+  if (ettt_)
+    return raw;
+  return ttt_epoch_ + last_ttt_ + (((uint32_t)raw - last_ttt_) & 0x7FFFFFFF);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Software extension of the 31-bit time tag of an event being released
+ */
+void dt5751CONET2::ConsumeTimestamp_(const DWORD *src)
+{
+  if (ettt_)
+    return;
+  uint32_t ttt = src[3] & 0x7FFFFFFF;
+  if (ttt < last_ttt_)
+    ttt_epoch_ += 0x80000000ull;
+  last_ttt_ = ttt;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Next event of the ring buffer, left in place
+ *
+ * \return  first word of the event (flags of header word 1 not set yet),
+ *          NULL if the ring buffer is empty or corrupted
+ */
+const DWORD *dt5751CONET2::PeekRBEvent()
+{
+  DWORD *src=NULL;
+  if (this->GetNumEventsInRB() == 0 ||
+      rb_get_rp(this->GetRingBufferHandle(), (void**)&src, 0) != DB_SUCCESS)
+    return NULL;
+  if ((*src & 0xF0000000) != 0xA0000000){
+    cm_msg(MERROR,"PeekRBEvent","Incorrect header for board:%d (0x%x)", this->GetModuleID(), *src);
+    return NULL;
+  }
+  return src;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Drop the next event of the ring buffer (rejected by the level-2 filter)
+ *
+ * \return  false if the ring buffer is empty or corrupted
+ */
+bool dt5751CONET2::SkipEvent()
+{
+  const DWORD *src = PeekRBEvent();
+  if (!src)
+    return false;
+
+  uint32_t size_words = *src & 0x0FFFFFFF;
+  ConsumeTimestamp_(src);
+  stamp_read_seq_++;
+  this->DecrementNumEventsInRB(); //atomic
+  rb_increment_rp(this->GetRingBufferHandle(), size_words*sizeof(uint32_t));
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   DAC offset of a channel, baseline correction included
+ */
+DWORD dt5751CONET2::GetChannelDac(int channel) const
+{
+  int dac = (int)(config.dac[channel] & 0xFFFF) + baseline_corr_[channel].dac;
+  return (DWORD)std::max(std::min(dac, 0xFFFF), 0);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   ADC level (threshold, baseline) of the ODB shifted by the baseline correction
+ */
+DWORD dt5751CONET2::CorrectedLevel_(DWORD level, int channel) const
+{
+  int shifted = (int)(level & 0xFFF) + baseline_corr_[channel].shift;
+  return (level & ~0xFFFu) | (DWORD)std::max(std::min(shifted, 0xFFF), 0);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Write the DAC, self-trigger threshold and ZLE baseline of a channel
+ *
+ * A ZLE baseline of 0 in the ODB is left alone.  The ZLE threshold is
+ * relative to the ZLE baseline and is not changed.
+ */
+CAENComm_ErrorCode dt5751CONET2::WriteChannelLevels_(int channel)
+{
+  CAENComm_ErrorCode sCAEN;
+  if (config.has_zle_firmware) {
+    sCAEN = WriteReg_(DT5751ZLE_CHANNEL_THRESHOLD + (channel<<8),
+                      CorrectedLevel_(config.selftrigger_threshold[channel], channel));
+    if (sCAEN == CAENComm_Success && config.zle_baseline[channel])
+      sCAEN = WriteReg_(DT5751ZLE_ZS_BASELINE + (channel<<8),
+                        CorrectedLevel_(config.zle_baseline[channel], channel));
+  } else {
+    sCAEN = WriteReg_(DT5751RAW_CHANNEL_THRESHOLD + (channel<<8),
+                      CorrectedLevel_(config.selftrigger_threshold[channel], channel));
+  }
+  if (sCAEN == CAENComm_Success)
+    sCAEN = WriteReg_(DT5751_CHANNEL_DAC + (channel<<8), GetChannelDac(channel));
+  return sCAEN;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the baseline correction of a channel and write its registers
+ *
+ * Called by the baseline tracking during a run (main thread): the writes go
+ * through the slow control queue of the link thread, between two readouts.
+ *
+ * \param   [in]  channel  0 to 3
+ * \param   [in]  corr     DAC and level corrections
+ * \return  false if the registers could not be written
+ */
+bool dt5751CONET2::SetBaselineCorrection(int channel, const BaselineCorrection &corr)
+{
+  if (channel < 0 || channel >= 4)
+    return false;
+  baseline_corr_[channel] = corr;
+  if (offline_ || !IsConnected())
+    return true;
+  return (WriteChannelLevels_(channel) == CAENComm_Success);
+}
+
 int dt5751CONET2::PeekRBEventID() {
 
   DWORD *src=NULL;
@@ -689,92 +1263,151 @@ int dt5751CONET2::PeekRBEventID() {
 
 //
 //--------------------------------------------------------------------------------
-bool dt5751CONET2::FillEventBank(char * pevent, uint32_t &timestamp)
+/**
+ * \brief   Drop the events left in the ring buffer
+ *
+ * The ring buffers live as long as the frontend; this empties them at the
+ * end of a run.  Must not be called while the link thread writes to it.
+ *
+ * \return  number of events discarded, -1 if the buffer could not be
+ *          walked (it must then be recreated)
+ */
+int dt5751CONET2::DiscardRBEvents()
+{
+  int n = 0;
+  DWORD *src = NULL;
+
+  while (this->GetNumEventsInRB() > 0 &&
+         rb_get_rp(this->GetRingBufferHandle(), (void**)&src, 0) == DB_SUCCESS) {
+    if ((*src & 0xF0000000) != 0xA0000000){
+      cm_msg(MERROR,"DiscardRBEvents","Incorrect hearder for board:%d (0x%x)", this->GetModuleID(), *src);
+      n = -1;
+      break;
+    }
+    uint32_t size_words = *src & 0x0FFFFFFF;
+    if (rb_increment_rp(this->GetRingBufferHandle(), size_words*sizeof(uint32_t)) != DB_SUCCESS) {
+      n = -1;
+      break;
+    }
+    this->DecrementNumEventsInRB(); //atomic
+    n++;
+  }
+  this->ResetNumEventsInRB();
+  return n;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Copy the next event of the ring buffer into a new bank
+ *
+ * \param   [in]  pevent     event being composed
+ * \param   [out] timestamp  trigger time tag of the event
+ * \param   [in]  merge_ns   time the builder selected this fragment
+ *                           (dt5751Metrics::NowNs(), 0 for now)
+ * \return  true on success
+ */
+bool dt5751CONET2::FillEventBank(char * pevent, uint32_t &timestamp, uint64_t merge_ns)
 {
   if (! this->IsConnected()) {
     cm_msg(MERROR,"FillEventBank","Board %d disconnected", this->GetModuleID());
     return false;
   }
 
-  DWORD *src=NULL;
   DWORD *dest=NULL;
 
+  // >>> create data bank
+ // printf("Bank size (before %s): %u\n", bank_name_, bk_size(pevent));
+  bk_create(pevent, bank_name_, TID_DWORD, (void **)&dest);
+
+  uint32_t limit_size = (DT5751_MAX_EVENT_SIZE-bk_size(pevent))/4; // what space is left in the event (in DWORDS)
+  int size_copied = CopyEvent(dest, limit_size, merge_ns, &timestamp);
+  if (size_copied < 0)
+    return false;
+
+  //Close data bank
+  bk_close(pevent, dest + size_copied);
+  dt5751Trace::Instance().Record(dt5751Trace::BankClose, moduleID_, size_copied*sizeof(uint32_t));
+
+  return true;
+
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Copy the next event of the ring buffer and release it
+ *
+ * Sets the data format flags of the header (see dt5751Decoder.hxx) and
+ * truncates an event longer than the room given.  Shared by FillEventBank()
+ * and the time frames of the streaming mode, which copy several events into
+ * one bank.
+ *
+ * \param   [out] dest        copy of the event
+ * \param   [in]  limitWords  words available at dest
+ * \param   [in]  merge_ns    time the builder selected this fragment
+ *                            (dt5751Metrics::NowNs(), 0 for now)
+ * \param   [out] timestamp   trigger time tag of the event
+ * \return  words copied, -1 on error
+ */
+int dt5751CONET2::CopyEvent(DWORD *dest, uint32_t limitWords, uint64_t merge_ns, uint32_t *timestamp)
+{
+  DWORD *src=NULL;
+
   int status = rb_get_rp(this->GetRingBufferHandle(), (void**)&src, 5000);
   if (status == DB_TIMEOUT) {
-    cm_msg(MERROR,"FillEventBank", "Got rp timeout for module %d", this->GetModuleID());
+    cm_msg(MERROR,"CopyEvent", "Got rp timeout for module %d", this->GetModuleID());
     printf("### num events: %d\n", this->GetNumEventsInRB());
-    return false;
+    return -1;
   }
 
   if ((*src & 0xF0000000) != 0xA0000000){
-    cm_msg(MERROR,"FillEventBank","Incorrect hearder for board:%d (0x%x)", this->GetModuleID(), *src);
-    return false;
+    cm_msg(MERROR,"CopyEvent","Incorrect hearder for board:%d (0x%x)", this->GetModuleID(), *src);
+    return -1;
   }
 
   uint32_t size_words = *src & 0x0FFFFFFF;
   uint32_t size_copied = size_words;
-	timestamp = src[3];
-
-  // >>> create data bank
-  char bankName[5];
-  snprintf(bankName, sizeof(bankName), "W2%02d", this->GetModuleID());
-  if(this->IsZLEData()){
-    snprintf(bankName, sizeof(bankName), "ZL%02d", this->GetModuleID());
-  }
-  else{
-    snprintf(bankName, sizeof(bankName), "W2%02d", this->GetModuleID());
-  }
- // printf("Bank size (before %s): %u, event size: %u\n", bankName, bk_size(pevent), size_words);
-  bk_create(pevent, bankName, TID_DWORD, (void **)&dest);
-
-  uint32_t limit_size = (DT5751_MAX_EVENT_SIZE-bk_size(pevent))/4; // what space is left in the event (in DWORDS)
-  if (size_words > limit_size) {
-//    printf("Event with size: %u (Module %02d) bigger than max %u, event truncated\n", size_words, this->GetModuleID(), limit_size);
-    cm_msg(MERROR,"FillEventBank","Event with size: %u (Module %02d) bigger than max %u, event truncated", size_words, this->GetModuleID(), limit_size);
-    if(this->IsZLEData()){
-      uint32_t toBeCopyed = 4; // Starting with the header
-			// We need to find out how many channels we can copy before reaching the limit...
-			int i;
-			for (i=4; i>0 ; --i){ //We have potentially 4 channels to copy
-        uint32_t channelSize = 0;
-				channelSize = *(src+toBeCopyed); // Get the size of the data for this channel
-				if (toBeCopyed + channelSize > limit_size) break; 
-				toBeCopyed += channelSize; // We have enough space for this channel
-			}
-			size_copied = toBeCopyed + i; //This it the size of the headers, the filled channel, and the "empty channels size" padding.
-			//    printf("will be copied: %u out of %u (%d channels)\n", size_copied, size_words, (8-i));
-      cm_msg(MERROR,"FillEventBank","will be copied: %u out of %u (%d channels)", size_copied, size_words, (8-i));
-      *(src + 0) = 0xA0000000 + size_copied; // Adjust the event size
-			for ( ; i>0 ; --i){
-				*(src + toBeCopyed+(i-1)) = (uint32_t) 0x1; // Pad the empty channel size = 1 DWORDS
-			}
-		}
-		else {
-			//      printf("Raw mode with long waveforms, exceeding the limit: event skipped\n");
-      cm_msg(MERROR,"FillEventBank","Raw mode with long waveforms, exceeding the limit: event skipped. Size dwords %d from module %d. Free space left %d dwords of %d bytes.", size_words, this->GetModuleID(), limit_size, DT5751_MAX_EVENT_SIZE);
-      *(src + 0) = 0xA0000004; // Event Size set to 0 data (4 DWORDS for the the header ==> TO be checked !)
-			size_copied = 4;
-		}
+  *timestamp = src[3];
+  ConsumeTimestamp_(src);
+
+  if (size_words > limitWords) {
+    cm_msg(MERROR,"CopyEvent","Event with size: %u (Module %02d) bigger than max %u, event truncated", size_words, this->GetModuleID(), limitWords);
+    // The kernels of the run assume its number of channels
+    const dt5751Decoder::Kernels *kernels = kernels_;
+    if (kernels->num_channels != __builtin_popcount(src[1] & 0xFF))
+      kernels = &dt5751Decoder::GetKernels(kernels->zle, kernels->pack25, 0);
+    size_copied = kernels->truncate(src, limitWords);
+    cm_msg(MERROR,"CopyEvent","will be copied: %u out of %u dwords (channel mask 0x%x), %u dwords of %d bytes left", size_copied, size_words, src[1] & 0xFF, limitWords, DT5751_MAX_EVENT_SIZE);
   } 
 
-	// Mess with the bank structure; use bit 26 of word 2 to indicate if it is ZLE...
-	if(this->IsZLEData()){
-		uint32_t new_value = (src[1] | 0x4000000);
-		src[1] = new_value;
-	}
+	// Mess with the bank structure; use bit 26 of word 2 to indicate if it is ZLE,
+	// bits 25 and 24 for pack 2.5 and DES (see dt5751Decoder.hxx)
+	src[1] |= bank_flags_;
 
 	// copy data over.
   memcpy(dest, src, size_copied*sizeof(uint32_t));
 
+  ReadoutStamp &stamp = readout_stamps_[stamp_read_seq_ % kNumReadoutStamps];
+  bool have_stamp = (stamp.seq.load(std::memory_order_relaxed) == stamp_read_seq_);
+  uint64_t readout_ns = stamp.ns.load(std::memory_order_relaxed);
+  stamp_read_seq_++;
+
   this->DecrementNumEventsInRB(); //atomic
   rb_increment_rp(this->GetRingBufferHandle(), size_words*sizeof(uint32_t));
 
-  //Close data bank
-  bk_close(pevent, dest + size_copied);
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  metrics.Add(moduleID_, dt5751Metrics::EventsBuilt);
 
+  uint64_t close_ns = dt5751Metrics::NowNs();
+  if (merge_ns == 0) merge_ns = close_ns;
+  if (have_stamp && merge_ns >= readout_ns) {
+    metrics.Observe(moduleID_, dt5751Metrics::RbWaitNs, merge_ns - readout_ns);
+    metrics.Observe(moduleID_, dt5751Metrics::TotalNs, close_ns - readout_ns);
+  }
+  metrics.Observe(moduleID_, dt5751Metrics::BankNs, close_ns - merge_ns);
 
-  return true;
-
+  return size_copied;
 }
 
 
@@ -787,22 +1420,16 @@ bool dt5751CONET2::FillBufferLevelBank(char * pevent)
     return false;
   }
 
-  DWORD *pdata, eStored, almostFull;
+  DWORD *pdata;
   int rb_level;
   char statBankName[5];
-  CAENComm_ErrorCode sCAEN;
 
   snprintf(statBankName, sizeof(statBankName), "BL%02d", this->GetModuleID());
   bk_create(pevent, statBankName, TID_DWORD, (void **)&pdata);
 
-  //Get dt5751 buffer level
-  sCAEN = ReadReg_(DT5751_EVENT_STORED, &eStored);
-
-  if (config.has_zle_firmware) {
-    almostFull = 0;
-  } else {
-    sCAEN = ReadReg_(DT5751RAW_ALMOST_FULL_LEVEL, &almostFull);
-  }
+  //Get dt5751 buffer level from the last snapshot (see UpdateSlowControl())
+  DWORD eStored = slow_control_.event_stored;
+  DWORD almostFull = slow_control_.almost_full;
   
   //Get ring buffer level
   rb_get_buffer_level(this->GetRingBufferHandle(), &rb_level);
@@ -830,16 +1457,72 @@ bool dt5751CONET2::FillBufferLevelBank(char * pevent)
 
   *pdata++ = rb_level;
 
-  if(busy)
-    printf(" %d(B)/%u ", eStored, rb_level);
-  else
-    printf(" %d/%u", eStored, rb_level);
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  *pdata++ = metrics.GetGauge(moduleID_, dt5751Metrics::SpillBytes) >> 10;
 
+  metrics.SetGauge(moduleID_, dt5751Metrics::EventsStored, eStored);
+  metrics.SetGauge(moduleID_, dt5751Metrics::Busy, busy);
+  metrics.SetGauge(moduleID_, dt5751Metrics::RbLevel, rb_level);
 
   bk_close(pevent, pdata);
 
-  return (sCAEN == CAENComm_Success);
+  return slow_control_.ok;
+
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Refresh the slow-control snapshot if older than maxAgeNs
+ *
+ * Buffer level, almost full level, acquisition status and the four ADC
+ * temperatures are read with one CAENComm_MultiRead32(), so the periodic
+ * equipments cost a single round trip per board and period on the link.
+ *
+ * \param   [in]  maxAgeNs  keep a snapshot younger than this
+ * \return  true if the snapshot was read successfully
+ */
+bool dt5751CONET2::UpdateSlowControl(uint64_t maxAgeNs)
+{
+  uint64_t now = dt5751Metrics::NowNs();
+  if (slow_control_.ns != 0 && now - slow_control_.ns < maxAgeNs)
+    return slow_control_.ok;
+
+  SlowControl sc = SlowControl();
+  sc.ns = now;
+  if (offline_) {
+    sc.ok = true;
+    slow_control_ = sc;
+    return true;
+  }
 
+  uint32_t address[8], val[8];
+  int n = 0;
+  address[n++] = DT5751_EVENT_STORED;
+  address[n++] = DT5751_ACQUISITION_STATUS;
+  for (int i = 0; i < 4; i++)
+    address[n++] = DT5751_CHANNEL_TEMPERATURE | (i << 8);
+  if (!config.has_zle_firmware)
+    address[n++] = DT5751RAW_ALMOST_FULL_LEVEL;
+
+  CAENComm_ErrorCode sCAEN;
+  if (link_queue_ && !link_queue_->IsOwner())
+    sCAEN = RunOnLink_(dt5751LinkQueue::SlowControl, [&]() { return (int)MultiRead32_(address, n, val); });
+  else
+    sCAEN = MultiRead32_(address, n, val);
+
+  sc.event_stored = val[0];
+  sc.acq_status = val[1];
+  for (int i = 0; i < 4; i++)
+    sc.temperature[i] = val[2 + i];
+  sc.almost_full = config.has_zle_firmware ? 0 : val[6];
+  sc.ok = (sCAEN == CAENComm_Success);
+  bool was_ok = slow_control_.ok || slow_control_.ns == 0;
+  slow_control_ = sc;
+
+  if (!sc.ok && was_ok)   // once per failure, the equipments ask every period
+    cm_msg(MERROR, "UpdateSlowControl", "Slow-control read failed for module %d (error %d)", moduleID_, sCAEN);
+  return sc.ok;
 }
 //
 //--------------------------------------------------------------------------------
@@ -850,7 +1533,7 @@ bool dt5751CONET2::FillBufferLevelBank(char * pevent)
  * issue a software trigger if enough time has elapsed since we last sent a trigger.
  */
 void dt5751CONET2::IssueSwTrigIfNeeded() {
-  if (config.sw_trig_rate_Hz > 0) {
+  if (config.sw_trig_rate_Hz > 0 && !paused_) {
     timeval now;
     gettimeofday(&now, NULL);
 
@@ -872,16 +1555,124 @@ void dt5751CONET2::IssueSwTrigIfNeeded() {
  * \return  CAENComm Error Code (see CAENComm.h)
  */
 bool dt5751CONET2::SendTrigger()
+{
+  return BeginTrigger() && EndTrigger();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Start sending a software trigger, EndTrigger() waits for it
+ *
+ * On the link queue, the trigger goes ahead of the slow control.  Starting
+ * the triggers of all boards before waiting lets the links send them in
+ * parallel (see dt5751TrigGen).
+ *
+ * \return  false if the board is disconnected
+ */
+bool dt5751CONET2::BeginTrigger()
 {
   if (verbosity_) std::cout << GetName() << "::SendTrigger()" << std::endl;
+  trig_post_.queued = false;
   if (!IsConnected()) {
     cm_msg(MERROR,"SendTrigger","Board %d disconnected", this->GetModuleID());
+    trig_post_.cmd.result = CAENComm_DeviceNotFound;
     return false;
   }
 
   if (verbosity_) std::cout << "Sending Trigger (l,b) = (" << link_ << "," << board_ << ")" << std::endl;
 
-  return (WriteReg(DT5751_SW_TRIGGER, 0x1) == CAENComm_Success);
+  dt5751Metrics::Instance().Add(moduleID_, dt5751Metrics::SwTriggers);
+  BeginWrite_(trig_post_, DT5751_SW_TRIGGER, 0x1);
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Wait for the trigger started by BeginTrigger()
+ *
+ * \return  true if the trigger was sent
+ */
+bool dt5751CONET2::EndTrigger()
+{
+  return (EndWrite_(trig_post_) == CAENComm_Success);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Start writing a register, EndWrite() waits for it
+ *
+ * Same as WriteReg() split in two, so that the frontend can write the same
+ * register (DT5751_SW_CLEAR, DT5751_SW_CLOCK_SYNCH...) on all boards with
+ * the links working in parallel.  Main thread only.
+ *
+ * \param   [in]  address  address of the register
+ * \param   [in]  val      value to write
+ * \return  false if the board is disconnected
+ */
+bool dt5751CONET2::BeginWrite(DWORD address, DWORD val)
+{
+  ctl_post_.queued = false;
+  ctl_op_ = CtlNone;
+  if (!IsConnected()) {
+    cm_msg(MERROR,"WriteReg","Board %d disconnected", this->GetModuleID());
+    ctl_post_.cmd.result = CAENComm_DeviceNotFound;
+    return false;
+  }
+  if (offline_) {
+    ctl_post_.cmd.result = CAENComm_Success;
+    return true;
+  }
+  BeginWrite_(ctl_post_, address, val);
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Wait for the write started by BeginWrite()
+ *
+ * \return  true if the register was written
+ */
+bool dt5751CONET2::EndWrite()
+{
+  return (EndWrite_(ctl_post_) == CAENComm_Success);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Write a register, through the link queue ahead of the slow control
+ *           when the link thread is serving it
+ */
+void dt5751CONET2::BeginWrite_(PostedWrite &post, DWORD address, DWORD val)
+{
+  if (link_queue_ && !offline_ && !link_queue_->IsOwner()) {
+    post.fn = [this, address, val]() { return (int)Write32_(address, val); };
+    post.cmd.fn = &post.fn;
+    post.start_ns = dt5751Metrics::NowNs();
+    link_queue_->Submit(dt5751LinkQueue::Trigger, &post.cmd);
+    post.queued = true;
+  } else {
+    post.cmd.result = WriteReg_(address, val);
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode dt5751CONET2::EndWrite_(PostedWrite &post)
+{
+  if (post.queued) {
+    link_queue_->Wait(&post.cmd);
+    post.queued = false;
+
+    dt5751Metrics &metrics = dt5751Metrics::Instance();
+    metrics.Add(moduleID_, dt5751Metrics::LinkCommands);
+    metrics.Observe(moduleID_, dt5751Metrics::LinkCmdNs, dt5751Metrics::NowNs() - post.start_ns);
+  }
+  return (CAENComm_ErrorCode)post.cmd.result;
 }
 
 //
@@ -908,9 +1699,9 @@ int dt5751CONET2::SetBoardRecord(HNDLE h, void(*cb_func)(INT,INT,void*))
   char set_str[200];
 
   if(feIndex_ == -1)
-    snprintf(set_str, sizeof(set_str), "/Equipment/DT5751_Data/Settings/Board%d", moduleID_ % 8);
+    snprintf(set_str, sizeof(set_str), "/Equipment/DT5751_Data/Settings/Board%d", settings_index_);
   else
-    snprintf(set_str, sizeof(set_str), "/Equipment/DT5751_Data%02d/Settings/Board%d", feIndex_, moduleID_ % 8);
+    snprintf(set_str, sizeof(set_str), "/Equipment/DT5751_Data%02d/Settings/Board%d", feIndex_, settings_index_);
 
   if (verbosity_) std::cout << GetName() << "::SetBoardRecord(" << h << "," << set_str << ",...)" << std::endl;
   int status,size;
@@ -984,6 +1775,38 @@ int dt5751CONET2::SetHistoryRecord(HNDLE h, void(*cb_func)(INT,INT,void*))
       sizeof(history_settings)/NAME_LENGTH, TID_STRING);
 
   if (status != DB_SUCCESS) cm_msg(MINFO,"SetHistoryRecord","Key %s not found", names_path);
+
+  // Per-period counter increments in the MTxx bank
+  char metrics_names[dt5751Metrics::NumCounters][NAME_LENGTH];
+  for (int i = 0; i < dt5751Metrics::NumCounters; i++)
+    snprintf(metrics_names[i], NAME_LENGTH, "%s", dt5751Metrics::counter_names[i]);
+
+  snprintf(tmp, sizeof(tmp), "Names MT%02d", this->moduleID_);
+  snprintf(names_path, sizeof(names_path), "%s%s", settings_path, tmp);
+  db_create_key(h, 0, names_path, TID_STRING);
+  status = db_find_key(h, 0, names_path, &path_key);
+  if (status == DB_SUCCESS)
+    db_set_data(h, path_key, metrics_names, sizeof(metrics_names),
+        dt5751Metrics::NumCounters, TID_STRING);
+  else
+    cm_msg(MINFO,"SetHistoryRecord","Key %s not found", names_path);
+
+  // Latency percentiles in the LTxx bank
+  const char *stages[] = { "readout", "rb_wait", "bank", "total" };
+  const char *quantiles[] = { "p50", "p90", "p99", "max" };
+  char latency_names[16][NAME_LENGTH];
+  for (int i = 0; i < 16; i++)
+    snprintf(latency_names[i], NAME_LENGTH, "%s_%s_us", stages[i/4], quantiles[i%4]);
+
+  snprintf(tmp, sizeof(tmp), "Names LT%02d", this->moduleID_);
+  snprintf(names_path, sizeof(names_path), "%s%s", settings_path, tmp);
+  db_create_key(h, 0, names_path, TID_STRING);
+  status = db_find_key(h, 0, names_path, &path_key);
+  if (status == DB_SUCCESS)
+    db_set_data(h, path_key, latency_names, sizeof(latency_names), 16, TID_STRING);
+  else
+    cm_msg(MINFO,"SetHistoryRecord","Key %s not found", names_path);
+
   return status;
 }
 
@@ -1024,6 +1847,7 @@ int dt5751CONET2::InitializeForAcq()
     cm_msg(MERROR,"InitializeForAcq","Board %d already started", this->GetModuleID());
     return -1;
   }
+  if (offline_) return 0;   // Nothing to set up, data type given by SetOffline()
         
   CAENComm_ErrorCode sCAEN;
         
@@ -1104,9 +1928,9 @@ int dt5751CONET2::InitializeForAcq()
   char rdb_str[200];
 
   if(feIndex_ == -1)
-    snprintf(rdb_str, sizeof(rdb_str), "/Equipment/DT5751_Data/Readback/Board%d/Board type", moduleID_ % 8);
+    snprintf(rdb_str, sizeof(rdb_str), "/Equipment/DT5751_Data/Readback/Board%d/Board type", settings_index_);
   else
-    snprintf(rdb_str, sizeof(rdb_str), "/Equipment/DT5751_Data%02d/Readback/Board%d/Board type", feIndex_, moduleID_ % 8);
+    snprintf(rdb_str, sizeof(rdb_str), "/Equipment/DT5751_Data%02d/Readback/Board%d/Board type", feIndex_, settings_index_);
 
   db_set_value(odb_handle_, 0, rdb_str, &version, sizeof(version), 1, TID_DWORD);
 
@@ -1115,9 +1939,15 @@ int dt5751CONET2::InitializeForAcq()
   case RawPack2:
     ss_fw_datatype << "Raw Data";
     break;
+  case RawPack25:
+    ss_fw_datatype << "Raw Data, pack 2.5";
+    break;
   case ZLEPack2:
     ss_fw_datatype << "ZLE Data";
     break;
+  case ZLEPack25:
+    ss_fw_datatype << "ZLE Data, pack 2.5";
+    break;
   case UnrecognizedDataFormat:
     ss_fw_datatype << "Unrecognized data format";
     break;
@@ -1127,7 +1957,8 @@ int dt5751CONET2::InitializeForAcq()
   }
 
   // Initial acquisition mode. We'll set more bits for enabling the board later.
-  WriteReg_(DT5751_ACQUISITION_CONTROL,     config.acq_mode);
+  acq_ctl_ = config.acq_mode;
+  WriteReg_(DT5751_ACQUISITION_CONTROL,     acq_ctl_);
 
   if (config.has_zle_firmware) {
 	  WriteReg_(DT5751_BOARD_CONFIG,               0); // Many fewer options.
@@ -1163,10 +1994,8 @@ int dt5751CONET2::InitializeForAcq()
 	for (int iChan=0; iChan<4; iChan++) {
 
     if (config.has_zle_firmware) {
-  		WriteReg_(DT5751ZLE_CHANNEL_THRESHOLD + (iChan<<8), config.selftrigger_threshold[iChan]);
       WriteReg_(DT5751ZLE_ZS_NSAMP_BEFORE   + (iChan<<8), config.zle_bins_before[iChan]);
       WriteReg_(DT5751ZLE_ZS_NSAMP_AFTER    + (iChan<<8), config.zle_bins_after[iChan]);
-      WriteReg_(DT5751ZLE_ZS_BASELINE       + (iChan<<8), config.zle_baseline[iChan]);
 
       DWORD thresh_comp = config.zle_signed_threshold[iChan] > 0 ? config.zle_signed_threshold[iChan] : (0x80000000 | (-1*config.zle_signed_threshold[iChan]));
       WriteReg_(DT5751ZLE_ZS_THRESHOLD      + (iChan<<8), thresh_comp);
@@ -1188,10 +2017,9 @@ int dt5751CONET2::InitializeForAcq()
       }
 
       WriteReg_(DT5751ZLE_INPUT_CONTROL + (iChan<<8), input_control);
-    } else {
-  		WriteReg_(DT5751RAW_CHANNEL_THRESHOLD + (iChan<<8), config.selftrigger_threshold[iChan]);
     }
-		WriteReg_(DT5751_CHANNEL_DAC         + (iChan<<8), config.dac[iChan]);	
+    // Self-trigger threshold, ZLE baseline and DAC, baseline tracking included
+    WriteChannelLevels_(iChan);
 	}		
 
 	// Wait for 200ms after channing DAC offsets, before starting calibration. 
@@ -1199,7 +2027,9 @@ int dt5751CONET2::InitializeForAcq()
 
 	// Start the ADC calibration
 	DWORD temp;
-	int desmode = ReadReg_(DT5751_BOARD_CONFIG, &temp) & (1<<12);
+	ReadReg_(DT5751_BOARD_CONFIG, &temp);
+	int desmode = temp & (1<<12);
+	des_mode_ = (desmode != 0);
 
 	if(desmode) {
 	   // disable even channels
@@ -1209,6 +2039,13 @@ int dt5751CONET2::InitializeForAcq()
 	   WriteReg_(DT5751_CHANNEL_EN_MASK, temp);
  	} 
 
+	// Extended trigger time tag in the pattern field of the header
+	ettt_ = ((config.fp_io_ctrl >> 21) & 0x3) == 2;
+
+	// Per-event kernels for the final data format and channels
+	ReadReg_(DT5751_CHANNEL_EN_MASK, &temp);
+	SelectKernels_(temp);
+
 	ReadReg_(DT5751_ADC_CALIBRATION, &temp);
 	temp = temp & ~(1<<1);
   	WriteReg_(DT5751_ADC_CALIBRATION , temp);
@@ -1276,6 +2113,26 @@ int dt5751CONET2::InitializeForAcq()
   return 0;
 }
 
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Select the per-event kernels and bank settings of the data format
+ *
+ * Called once the format is known (InitializeForAcq(), SetOffline()), so
+ * that FillEventBank() does not test it for every event.
+ *
+ * \param   [in]  channelMask  enabled channels, 0 if not known
+ */
+void dt5751CONET2::SelectKernels_(DWORD channelMask)
+{
+  kernels_ = &dt5751Decoder::GetKernels(IsZLEData(), IsPack25Data(),
+                                         __builtin_popcount(channelMask & 0xFF));
+  snprintf(bank_name_, sizeof(bank_name_), "%s%02d", IsZLEData() ? "ZL" : "W2", moduleID_);
+  bank_flags_ = (IsZLEData() ? dt5751Decoder::kZleFlag : 0) |
+                (IsPack25Data() ? dt5751Decoder::kPack25Flag : 0) |
+                (des_mode_ ? dt5751Decoder::kDesFlag : 0);
+}
+
 //
 //--------------------------------------------------------------------------------
 /**
@@ -1287,22 +2144,41 @@ int dt5751CONET2::InitializeForAcq()
  */
 dt5751CONET2::DataType dt5751CONET2::GetDataType()
 {
-        
-  // Set ZLE or Raw
-  int dataType = ((config.board_config >> 11) & 0x1);
-	if(config.enable_zle){
-		data_type_ = ZLEPack2;
-		printf("ZLEPack2 type: %x %x %x\n",dataType, config.board_config, ((config.board_config >> 16) & 0xF));
-		return ZLEPack2;		
-	}else{
-		data_type_ = RawPack2;
-		printf("RawPack2 type: %x %x %x\n",dataType, config.board_config, ((config.board_config >> 16) & 0xF));      
-		return RawPack2;
-	}
+  // Pack 2.5 is BOARD_CONFIG bit 11, only with the raw firmware (the ZLE
+  // firmware is run with BOARD_CONFIG cleared)
+  bool pack25 = !config.has_zle_firmware && ((config.board_config >> 11) & 0x1);
 
-	printf("Unrecognized type: %x %x %x\n",dataType, config.board_config, ((config.board_config >> 16) & 0xF));
-	return UnrecognizedDataFormat;
+  if (config.enable_zle)
+    data_type_ = pack25 ? ZLEPack25 : ZLEPack2;
+  else
+    data_type_ = pack25 ? RawPack25 : RawPack2;
+  printf("%s type: %x %x %x\n", pack25 ? (config.enable_zle ? "ZLEPack25" : "RawPack25") :
+         (config.enable_zle ? "ZLEPack2" : "RawPack2"), pack25, config.board_config,
+         ((config.board_config >> 16) & 0xF));
+  return data_type_;
+}
 
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Get DES mode setting
+ *
+ * \return  true if the board samples in DES mode (BOARD_CONFIG bit 12, read back by InitializeForAcq())
+ */
+bool dt5751CONET2::IsDESMode()
+{
+  return des_mode_;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Get pack 2.5 setting
+ *
+ * \return  true if the samples are packed 5 in 2 words
+ */
+bool dt5751CONET2::IsPack25Data(){
+  return ((data_type_ == RawPack25)||(data_type_ == ZLEPack25));
 }
 
 //
@@ -17,11 +17,14 @@ This file contains the class definition for the DT5751 module driver.
 #include <stdlib.h>
 #include <sys/time.h>
 #include <atomic>
+#include <memory>
 #include <vector>
 
 #include <CAENComm.h>
 #include <CAENVMElib.h>
 #include "odt5751drv.h"
+#include "dt5751LinkQueue.hxx"
+#include "dt5751Decoder.hxx"
 
 #include "midas.h"
 #include "msystem.h"
@@ -82,6 +85,15 @@ public:
     ZLEPack25,               //!< 3: ZLE data, 2.5 packing
     UnrecognizedDataFormat
   };
+  static const uint64_t kNoTimestamp = ~0ull;  //!< PeekRBExtendedTimestamp() error
+
+  enum RunControl {
+    CtlNone,                 //!< Plain register write (BeginWrite())
+    CtlStart,                //!< Set the run bit, after PrepareRun()
+    CtlStop,                 //!< Clear the run bit
+    CtlPause,                //!< Gate the triggers (PauseRun())
+    CtlResume                //!< Restore the triggers (ResumeRun())
+  };
   struct DT5751_CONFIG_SETTINGS {
     BOOL      enable;
     BOOL      has_zle_firmware;         //!< Some registers only valid for ZLE or non-ZLE FW
@@ -132,19 +144,38 @@ public:
   bool Disconnect();
   bool StartRun();
   bool StopRun();
+  bool PauseRun();
+  bool ResumeRun();
+  bool PrepareRun();
+  bool BeginRunControl(RunControl);
+  bool EndRunControl();
+  bool BeginWrite(DWORD, DWORD);
+  bool EndWrite();
+  bool IsPaused() { return paused_; }     //! returns true if triggers are gated by PauseRun()
   bool IsConnected();
   bool IsEnabled() { return config.enable; }
   bool IsRunning();
   bool ReadReg(DWORD, DWORD*);
   bool WriteReg(DWORD, DWORD);
   bool CheckEvent();
+  int GetEventsStored();
   bool ReadEvent(void *);
-  bool FillEventBank(char *, uint32_t &timestamp);
+  bool ReadEventToBuffer(void *, DWORD *);
+  bool PushFragment(const DWORD *, DWORD);
+  bool FillEventBank(char *, uint32_t &timestamp, uint64_t merge_ns = 0);
+  int CopyEvent(DWORD *dest, uint32_t limitWords, uint64_t merge_ns, uint32_t *timestamp);
   bool FillBufferLevelBank(char *);
+  bool UpdateSlowControl(uint64_t maxAgeNs);
   bool IsZLEData();
+  bool IsPack25Data();
+  bool IsDESMode();
+  const dt5751Decoder::Kernels &GetKernels() const { return *kernels_; }
+  uint32_t GetBankFlags() const { return bank_flags_; }   //!< Set in header word 1 by FillEventBank()
 
   void IssueSwTrigIfNeeded();
   bool SendTrigger();
+  bool BeginTrigger();
+  bool EndTrigger();
   bool Poll(DWORD*);
   int SetBoardRecord(HNDLE h, void(*cb_func)(INT,INT,void*));
   int SetHistoryRecord(HNDLE h, void(*cb_func)(INT,INT,void*));
@@ -181,7 +212,14 @@ public:
     return num_events_in_rb_.load();
   }
   int PeekRBEventID();
+  int DiscardRBEvents();
   DWORD PeekRBTimestamp();
+  uint64_t PeekRBExtendedTimestamp(uint32_t *sizeWords = NULL);
+  uint64_t GetNewestExtendedTimestamp();
+  const DWORD *PeekRBEvent();
+  bool SkipEvent();
+  bool HasExtendedTimestamp() { return ettt_; }  //! returns true if the firmware extends the time tag
+  const char *GetBankName() { return bank_name_; }  //! returns the W2xx/ZLxx data bank name
   DataType GetDataType();
   int GetVerbosity(){
     return verbosity_;
@@ -189,6 +227,16 @@ public:
   void SetVerbosity(int verbosity){
     verbosity_ = verbosity;
   }
+  void SetOffline(DataType type);
+  void SetSettingsIndex(int index) {     //! set n of the ODB Board<n> settings and readback
+    settings_index_ = index;
+  }
+  void SetLinkQueue(dt5751LinkQueue *q) { //! route accesses from other threads through the link thread
+    link_queue_ = q;
+  }
+  bool IsOffline() {                      //! returns true if not attached to hardware
+    return offline_;
+  }
 
   /* These are atomic with sequential memory ordering. See below */
   void IncrementNumEventsInRB() {         //! Increment Number of events in ring buffer
@@ -199,6 +247,38 @@ public:
   }
   void ResetNumEventsInRB() {             //! Reset Number of events in ring buffer
     num_events_in_rb_=0;
+    stamp_write_seq_ = stamp_read_seq_ = 0;
+    // Stamps of the previous run would match the restarted sequence numbers
+    for (int i = 0; readout_stamps_ && i < kNumReadoutStamps; i++)
+      readout_stamps_[i].seq.store(UINT64_MAX, std::memory_order_relaxed);
+    last_ttt_ = 0;
+    ttt_epoch_ = 0;
+    newest_ttt_ = 0;
+  }
+
+  /* Corrections of the baseline tracking (dt5751Baseline), on top of the ODB
+   * settings and kept across runs: InitializeForAcq() applies them too */
+  struct BaselineCorrection {
+    int dac;                //!< DAC counts added to config.dac
+    int shift;              //!< ADC counts added to the self-trigger threshold and the ZLE baseline
+  };
+  bool SetBaselineCorrection(int channel, const BaselineCorrection &corr);
+  const BaselineCorrection &GetBaselineCorrection(int channel) const {
+    return baseline_corr_[channel];
+  }
+  DWORD GetChannelDac(int channel) const;
+
+  /* Slow-control registers, read together by UpdateSlowControl() */
+  struct SlowControl {
+    DWORD event_stored;     //!< DT5751_EVENT_STORED
+    DWORD almost_full;      //!< DT5751RAW_ALMOST_FULL_LEVEL, 0 with the ZLE firmware
+    DWORD acq_status;       //!< DT5751_ACQUISITION_STATUS
+    DWORD temperature[4];   //!< DT5751_CHANNEL_TEMPERATURE of each ADC
+    bool ok;                //!< All registers read successfully
+    uint64_t ns;            //!< Time of the snapshot (dt5751Metrics::NowNs()), 0 if none
+  };
+  const SlowControl& GetSlowControl() { //! returns the last slow-control snapshot
+    return slow_control_;
   }
 
 private:
@@ -214,6 +294,7 @@ private:
   link_,                  //!< Optical link number
   board_,                 //!< Module/Board number
   moduleID_;              //!< Unique module ID
+  int settings_index_;    //!< n of the ODB Board<n> keys, unique in the frontend
 
   int device_handle_;     //!< physical device handle
   HNDLE odb_handle_;      //!< main ODB handle
@@ -222,11 +303,22 @@ private:
   bool settings_loaded_;  //!< ODB settings loaded
   bool settings_touched_; //!< ODB settings touched
   bool running_;          //!< Run in progress
+  bool paused_;           //!< Triggers gated by PauseRun(), acquisition still running
   DataType data_type_;    //!< Data type for all channels:
+  bool des_mode_;         //!< DES mode, odd channels only at 0.5 ns per sample
+  const dt5751Decoder::Kernels *kernels_; //!< Kernels of the data format, set by SelectKernels_()
+  char bank_name_[5];     //!< W2xx or ZLxx
+  uint32_t bank_flags_;   //!< Flags of header word 1 (dt5751Decoder::kZleFlag...)
+  bool ettt_;             //!< Extended time tag in the header (FP I/O control [22:21] = 2)
+  uint32_t last_ttt_;     //!< Time tag of the last event copied (main thread)
+  uint64_t ttt_epoch_;    //!< Rollovers of the time tag so far, in ticks (main thread)
+  BaselineCorrection baseline_corr_[4];   //!< Per channel, see SetBaselineCorrection()
   int verbosity_;         //!< Make the driver verbose
                           //!< 0: off
                           //!< 1: normal
                           //!< 2: very verbose
+  bool offline_;          //!< No hardware, fragments come from PushFragment()
+  dt5751LinkQueue *link_queue_; //!< Command queue of the link thread, NULL for direct access
   /* We use an atomic types here to get lock-free (no pthread mutex lock or spinlock)
    * read-modify-write. operator++(int) and operator++() on an atomic<integral> use
    * atomic::fetch_add() and operator--(int) and operator--() use atomic::fetch_sub().
@@ -235,15 +327,55 @@ private:
    * incrementation and an increment/decrement of this variable.   */
   std::atomic<int> num_events_in_rb_;  //!< Number of events stored in ring buffer
 
+  /* BLT completion time of each event in the ring buffer, indexed by event
+   * sequence number.  Written by the link thread before the event is published
+   * through num_events_in_rb_, read back by FillEventBank() for the latency
+   * histograms.  The sequence number detects entries overwritten because the
+   * backlog exceeded kNumReadoutStamps. */
+  struct ReadoutStamp {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> ns;
+  };
+  static const int kNumReadoutStamps = 8192;
+  std::unique_ptr<ReadoutStamp[]> readout_stamps_;
+  uint64_t stamp_write_seq_;  //!< Next stamp to write (link thread)
+  uint64_t stamp_read_seq_;   //!< Next stamp to read (main thread)
+  std::atomic<uint64_t> newest_ttt_;  //!< Time tag of the newest event (link thread), header word 1 [23:8] and word 3
+
   timeval last_sw_trig_time;
+  SlowControl slow_control_;  //!< Last UpdateSlowControl() (main thread)
+
+  /* Register write posted to the link queue, waited for later */
+  struct PostedWrite {
+    dt5751LinkQueue::Command cmd;
+    std::function<int()> fn;
+    bool queued;            //!< Submitted, not waited for yet
+    uint64_t start_ns;
+    PostedWrite() : cmd(), queued(false), start_ns(0) {}
+  };
+  PostedWrite trig_post_;     //!< Software trigger in flight (BeginTrigger())
+  PostedWrite ctl_post_;      //!< Run control or broadcast write in flight (BeginRunControl())
+  RunControl ctl_op_;         //!< Operation of ctl_post_
+  DWORD acq_ctl_;             //!< DT5751_ACQUISITION_CONTROL written by InitializeForAcq()
 
   Bool_t kFALSE = false;
 
     /* Private methods */
-  CAENComm_ErrorCode AcqCtl_(uint32_t);
+  void PublishEvent_(const DWORD *, DWORD, uint64_t);
+  void SelectKernels_(DWORD);
+  uint64_t ExtendTimestamp_(const DWORD *) const;
+  void ConsumeTimestamp_(const DWORD *);
   CAENComm_ErrorCode WriteChannelConfig_(uint32_t);
+  CAENComm_ErrorCode WriteChannelLevels_(int);
+  DWORD CorrectedLevel_(DWORD, int) const;
   CAENComm_ErrorCode ReadReg_(DWORD, DWORD*);
   CAENComm_ErrorCode WriteReg_(DWORD, DWORD);
+  CAENComm_ErrorCode Read32_(DWORD, DWORD*);
+  CAENComm_ErrorCode Write32_(DWORD, DWORD);
+  CAENComm_ErrorCode MultiRead32_(uint32_t *, int, uint32_t *);
+  CAENComm_ErrorCode RunOnLink_(dt5751LinkQueue::Priority, const std::function<int()> &);
+  void BeginWrite_(PostedWrite &, DWORD, DWORD);
+  CAENComm_ErrorCode EndWrite_(PostedWrite &);
 };
 
 #endif // DT5751_HXX_INCLUDE
@@ -0,0 +1,364 @@
+/*****************************************************************************/
+/**
+\file dt5751Decoder.cxx
+
+## Contents
+
+This file contains the class implementation for the DT5751 event decoder.
+ *****************************************************************************/
+
+#include "dt5751Decoder.hxx"
+#include <stddef.h>
+
+const uint32_t dt5751Decoder::kZleFlag;
+const uint32_t dt5751Decoder::kPack25Flag;
+const uint32_t dt5751Decoder::kDesFlag;
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Parse and check the event header
+ *
+ * \param   [in]  event       first word of the event
+ * \param   [in]  size_words  words available at event (bank size)
+ * \param   [out] header      parsed header
+ * \return  false if the header is invalid or the event longer than size_words
+ */
+bool dt5751Decoder::ParseHeader(const uint32_t *event, uint32_t size_words, Header *header)
+{
+  if (size_words < 4 || (event[0] & 0xF0000000) != 0xA0000000)
+    return false;
+
+  header->size_words = event[0] & 0x0FFFFFFF;
+  header->board_id = event[1] >> 27;
+  header->channel_mask = event[1] & 0xFF;
+  header->num_channels = __builtin_popcount(header->channel_mask);
+  header->counter = event[2] & 0xFFFFFF;
+  header->ttt = event[3] & 0x7FFFFFFF;
+  header->zle = (event[1] & kZleFlag) != 0;
+  header->pack25 = (event[1] & kPack25Flag) != 0;
+  header->des = (event[1] & kDesFlag) != 0;
+  return header->size_words >= 4 && header->size_words <= size_words;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Samples held by a number of data words
+ */
+uint32_t dt5751Decoder::SamplesInWords(uint32_t words, bool pack25)
+{
+  if (!pack25)
+    return 2*words;
+  return (words/2)*5 + (words%2)*2;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Data words needed for a number of samples
+ */
+uint32_t dt5751Decoder::WordsForSamples(uint32_t samples, bool pack25)
+{
+  if (!pack25)
+    return (samples + 1)/2;
+  uint32_t rem = samples%5;
+  return (samples/5)*2 + (rem == 0 ? 0 : (rem <= 2 ? 1 : 2));
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Unpack data words into samples
+ *
+ * \param   [in]  src     data words
+ * \param   [in]  words   number of words
+ * \param   [in]  pack25  pack 2.5, otherwise pack 2
+ * \param   [out] dst     SamplesInWords(words) samples
+ * \return  number of samples written
+ */
+uint32_t dt5751Decoder::Unpack(const uint32_t *src, uint32_t words, bool pack25, uint16_t *dst)
+{
+  return pack25 ? Unpack_<true>(src, words, dst) : Unpack_<false>(src, words, dst);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Unpack kernel of one packing
+ *
+ * The loops carry no dependency between words so that the compiler can
+ * vectorize them.
+ */
+template <bool Pack25>
+uint32_t dt5751Decoder::Unpack_(const uint32_t * __restrict__ src, uint32_t words,
+                                uint16_t * __restrict__ dst)
+{
+  if (!Pack25) {
+    for (uint32_t w = 0; w < words; w++) {
+      dst[2*w] = src[w] & 0xFFFF;
+      dst[2*w + 1] = src[w] >> 16;
+    }
+    return 2*words;
+  }
+
+  uint32_t pairs = words/2;
+  for (uint32_t p = 0; p < pairs; p++) {
+    uint32_t a = src[2*p], b = src[2*p + 1];
+    dst[5*p] = a & 0xFFF;
+    dst[5*p + 1] = (a >> 12) & 0xFFF;
+    dst[5*p + 2] = ((a >> 24) & 0x3F) | ((b & 0x3F) << 6);
+    dst[5*p + 3] = (b >> 6) & 0xFFF;
+    dst[5*p + 4] = (b >> 18) & 0xFFF;
+  }
+  uint32_t n = 5*pairs;
+  if (words & 1) {
+    dst[n++] = src[words - 1] & 0xFFF;
+    dst[n++] = (src[words - 1] >> 12) & 0xFFF;
+  }
+  return n;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Pack samples into data words (emulation and tests)
+ *
+ * \param   [in]  src      samples, 12 bits at most for pack 2.5
+ * \param   [in]  samples  number of samples
+ * \param   [in]  pack25   pack 2.5, otherwise pack 2
+ * \param   [out] dst      WordsForSamples(samples) words
+ * \return  number of words written
+ */
+uint32_t dt5751Decoder::Pack(const uint16_t *src, uint32_t samples, bool pack25, uint32_t *dst)
+{
+  uint32_t n = 0;
+  if (!pack25) {
+    for (uint32_t i = 0; i < samples; i += 2)
+      dst[n++] = src[i] | (i + 1 < samples ? (uint32_t)src[i + 1] << 16 : 0);
+    return n;
+  }
+
+  for (uint32_t i = 0; i < samples; i += 5) {
+    uint32_t s[5] = { 0, 0, 0, 0, 0 };
+    for (uint32_t k = 0; k < 5 && i + k < samples; k++)
+      s[k] = src[i + k] & 0xFFF;
+    dst[n++] = s[0] | (s[1] << 12) | ((s[2] & 0x3F) << 24);
+    if (samples - i > 2)
+      dst[n++] = (s[2] >> 6) | (s[3] << 6) | (s[4] << 18);
+  }
+  return n;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Words of each channel of a raw (not ZLE) event
+ */
+uint32_t dt5751Decoder::RawChannelWords(const Header &header)
+{
+  if (header.num_channels == 0)
+    return 0;
+  return (header.size_words - 4)/header.num_channels;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Decode the channels of an event
+ *
+ * Dispatches on the format of the header; a caller decoding a whole run
+ * should rather get the kernels once with GetKernels().
+ *
+ * \param   [in]  event       first word of the event
+ * \param   [in]  size_words  words available at event (bank size)
+ * \param   [out] channels    one entry per channel present
+ * \return  false if the event is malformed
+ */
+bool dt5751Decoder::Decode(const uint32_t *event, uint32_t size_words, std::vector<Channel> &channels)
+{
+  Header header;
+  channels.clear();
+  if (!ParseHeader(event, size_words, &header))
+    return false;
+  return GetKernels(header.zle, header.pack25, header.num_channels).decode(event, size_words, channels);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Decode kernel of one format
+ *
+ * An event with another number of channels than NumChannels (when not 0)
+ * is rejected.
+ */
+template <bool Zle, bool Pack25, int NumChannels>
+bool dt5751Decoder::Decode_(const uint32_t *event, uint32_t size_words, std::vector<Channel> &channels)
+{
+  Header header;
+  channels.clear();
+  if (!ParseHeader(event, size_words, &header) || header.zle != Zle || header.pack25 != Pack25)
+    return false;
+  if (NumChannels && header.num_channels != NumChannels)
+    return false;
+
+  const int nch = NumChannels ? NumChannels : header.num_channels;
+  const uint32_t *src = event + 4;
+  const uint32_t *end = event + header.size_words;
+  const uint32_t raw_words = nch ? (header.size_words - 4)/nch : 0;
+  const double ns_per_sample = header.des ? 0.5 : 1.0;
+
+  channels.resize(nch);
+  uint32_t mask = header.channel_mask;
+  for (int i = 0; i < nch; i++) {
+    Channel &c = channels[i];
+    c.channel = __builtin_ctz(mask);
+    mask &= mask - 1;
+    c.ns_per_sample = ns_per_sample;
+
+    uint32_t words;
+    if (Zle) {
+      if (src >= end || *src < 1 || src + *src > end)
+        return false;
+      words = *src;
+      if (!DecodeZle_<Pack25>(src + 1, words - 1, c))
+        return false;
+    } else {
+      words = raw_words;
+      c.record_samples = SamplesInWords(words, Pack25);
+      c.samples.resize(c.record_samples);
+      if (words)
+        Unpack_<Pack25>(src, words, &c.samples[0]);
+      Segment seg = { 0, c.record_samples };
+      c.segments.assign(1, seg);
+    }
+    src += words;
+  }
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Decode the control and data words of a ZLE channel (size word excluded)
+ */
+template <bool Pack25>
+bool dt5751Decoder::DecodeZle_(const uint32_t *src, uint32_t words, Channel &ch)
+{
+  uint32_t pos = 0;      // Words of the record covered so far
+  uint32_t i = 0;
+  ch.samples.clear();
+  ch.segments.clear();
+
+  while (i < words) {
+    uint32_t ctrl = src[i++];
+    uint32_t len = ctrl & 0x1FFFFF;
+    if (ctrl & 0x80000000) {
+      if (i + len > words)
+        return false;
+      Segment seg;
+      seg.first = SamplesInWords(pos, Pack25);
+      seg.count = SamplesInWords(len, Pack25);
+      size_t at = ch.samples.size();
+      ch.samples.resize(at + seg.count);
+      if (len)
+        Unpack_<Pack25>(src + i, len, &ch.samples[at]);
+      ch.segments.push_back(seg);
+      i += len;
+    }
+    pos += len;
+  }
+  ch.record_samples = SamplesInWords(pos, Pack25);
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Truncate an event in place to at most limit_words (size of a bank)
+ *
+ * Whole channels are kept.  The ZLE channels that do not fit are replaced by
+ * their size word alone (empty channel); the raw channels that do not fit are
+ * dropped from the channel mask.  The header size is updated.
+ *
+ * \param   [in,out] event        event with a valid header
+ * \param   [in]     limit_words  words available, 4 + number of channels at least
+ * \return  new size of the event in words
+ */
+template <bool Zle, int NumChannels>
+uint32_t dt5751Decoder::Truncate_(uint32_t *event, uint32_t limit_words)
+{
+  const uint32_t size = event[0] & 0x0FFFFFFF;
+  const int nch = NumChannels ? NumChannels : __builtin_popcount(event[1] & 0xFF);
+  if (size <= limit_words || size < 4)
+    return size;
+
+  uint32_t kept;
+  if (Zle) {
+    kept = 4;
+    int i = nch;
+    for (; i > 0; i--) {
+      uint32_t channelSize = event[kept];
+      if (kept + channelSize + (i - 1) > limit_words || channelSize < 1)
+        break;
+      kept += channelSize;
+    }
+    // Empty channels for the remaining ones
+    for (; i > 0; i--)
+      event[kept++] = 1;
+  } else {
+    const uint32_t channelWords = nch ? (size - 4)/nch : 0;
+    int fit = channelWords ? (int)((limit_words - 4)/channelWords) : nch;
+    if (fit > nch)
+      fit = nch;
+    uint32_t mask = event[1] & 0xFF;
+    uint32_t keptMask = 0;
+    for (int i = 0; i < fit; i++) {
+      keptMask |= mask & -mask;
+      mask &= mask - 1;
+    }
+    event[1] = (event[1] & ~0xFFu) | keptMask;
+    kept = 4 + fit*channelWords;
+  }
+  event[0] = (event[0] & 0xF0000000) | kept;
+  return kept;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Kernels of a data format
+ *
+ * \param   [in]  zle          ZLE data, otherwise raw
+ * \param   [in]  pack25       pack 2.5, otherwise pack 2
+ * \param   [in]  numChannels  channels of every event, 0 (or out of range) if not known
+ */
+const dt5751Decoder::Kernels &dt5751Decoder::GetKernels(bool zle, bool pack25, int numChannels)
+{
+#define DT5751_KERNELS(Z, P, N) \
+  { Z, P, N, &Decode_<Z, P, N>, &Unpack_<P>, &Truncate_<Z, N> }
+#define DT5751_KERNELS_N(Z, P) \
+  DT5751_KERNELS(Z, P, 0), DT5751_KERNELS(Z, P, 1), DT5751_KERNELS(Z, P, 2), \
+  DT5751_KERNELS(Z, P, 3), DT5751_KERNELS(Z, P, 4)
+
+  static const Kernels table[2][2][kMaxChannels + 1] = {
+    { { DT5751_KERNELS_N(false, false) }, { DT5751_KERNELS_N(false, true) } },
+    { { DT5751_KERNELS_N(true, false) }, { DT5751_KERNELS_N(true, true) } }
+  };
+
+#undef DT5751_KERNELS_N
+#undef DT5751_KERNELS
+
+  if (numChannels < 0 || numChannels > kMaxChannels)
+    numChannels = 0;
+  return table[zle][pack25][numChannels];
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
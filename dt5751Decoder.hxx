@@ -0,0 +1,124 @@
+/*****************************************************************************/
+/**
+\file dt5751Decoder.hxx
+
+## Contents
+
+This file contains the class definition for the DT5751 event decoder: event
+header parsing, sample packing (pack 2 and pack 2.5) and the decoding of
+raw and ZLE channel data, including the DES (dual edge sampling) mode.  It
+is used by the frontend for the size accounting of the banks and can be
+used as is by the analyzers of the W2xx/ZLxx banks.
+ *****************************************************************************/
+
+#ifndef DT5751DECODER_HXX_INCLUDE
+#define DT5751DECODER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+/**
+ * Decoder of one DT5751 event (a W2xx or ZLxx bank).
+ *
+ * Event header (4 words):
+ * - word 0: 0xA in [31:28], event size in words, header included, in [27:0]
+ * - word 1: board ID in [31:27], channel mask in [7:0], and the flags set
+ *   by dt5751CONET2::FillEventBank(): kZleFlag, kPack25Flag, kDesFlag
+ * - word 2: event counter in [23:0]
+ * - word 3: trigger time tag in [30:0]
+ *
+ * The enabled channels follow in increasing order, all with the same number
+ * of words for raw data.  A ZLE channel starts with its size in words (size
+ * word included), followed by control words: bit 31 set for a stored
+ * interval, its length in words in [20:0]; a stored interval is followed by
+ * its data words.
+ *
+ * Pack 2 holds 2 samples per word: the first one in [15:0], the second one
+ * in [31:16].  Pack 2.5 holds 5 samples in 2 words, 12-bit fields:
+ * - even word: s0 in [11:0], s1 in [23:12], s2[5:0] in [29:24]
+ * - odd word:  s2[11:6] in [5:0], s3 in [17:6], s4 in [29:18]
+ * so a word pair is 20% smaller than in pack 2.  A channel ending on an even
+ * word holds 2 samples in it; one ending on a full pair is padded with 0
+ * samples up to 5.
+ *
+ * In DES mode only the odd channels are enabled; each carries the samples
+ * of its ADC and of the ADC of the even channel, interleaved in time order,
+ * so it holds twice as many samples at 0.5 ns instead of 1 ns.
+ *
+ * The per-event work is done by kernels specialized at compile time on the
+ * data type (raw/ZLE, pack 2/2.5) and the number of channels.  GetKernels()
+ * picks them once, when the format is known (run start), so that the loops
+ * over the words have no format test and can be vectorized; the kernels
+ * for 0 channels take the number of channels from each header.
+ */
+class dt5751Decoder
+{
+
+public:
+
+  static const uint32_t kZleFlag = 0x4000000;    //!< Header word 1: ZLE data
+  static const uint32_t kPack25Flag = 0x2000000; //!< Header word 1: pack 2.5
+  static const uint32_t kDesFlag = 0x1000000;    //!< Header word 1: DES mode
+
+  struct Header {
+    uint32_t size_words;    //!< Event size, header included
+    int board_id;
+    uint32_t channel_mask;
+    int num_channels;       //!< Channels present in the data
+    uint32_t counter;
+    uint32_t ttt;
+    bool zle;
+    bool pack25;
+    bool des;
+  };
+
+  struct Segment {
+    uint32_t first;         //!< First sample of the interval in the record
+    uint32_t count;         //!< Samples of the interval in Channel::samples
+  };
+
+  struct Channel {
+    int channel;
+    double ns_per_sample;             //!< 1, or 0.5 in DES mode
+    uint32_t record_samples;          //!< Samples of the full record
+    std::vector<uint16_t> samples;    //!< Stored samples, segment after segment
+    std::vector<Segment> segments;    //!< One for raw data, the stored intervals for ZLE
+  };
+
+  static bool ParseHeader(const uint32_t *event, uint32_t size_words, Header *header);
+
+  static uint32_t SamplesInWords(uint32_t words, bool pack25);
+  static uint32_t WordsForSamples(uint32_t samples, bool pack25);
+  static uint32_t Unpack(const uint32_t *src, uint32_t words, bool pack25, uint16_t *dst);
+  static uint32_t Pack(const uint16_t *src, uint32_t samples, bool pack25, uint32_t *dst);
+
+  static const int kMaxChannels = 4;             //!< Channels of a DT5751
+
+  /* Kernels of one format */
+  struct Kernels {
+    bool zle;
+    bool pack25;
+    int num_channels;       //!< 0 for any
+    bool (*decode)(const uint32_t *event, uint32_t size_words, std::vector<Channel> &channels);
+    uint32_t (*unpack)(const uint32_t *src, uint32_t words, uint16_t *dst);
+    uint32_t (*truncate)(uint32_t *event, uint32_t limit_words);
+  };
+
+  static const Kernels &GetKernels(bool zle, bool pack25, int numChannels);
+
+  static uint32_t RawChannelWords(const Header &header);
+  static bool Decode(const uint32_t *event, uint32_t size_words, std::vector<Channel> &channels);
+
+private:
+
+  template <bool Pack25>
+  static uint32_t Unpack_(const uint32_t *src, uint32_t words, uint16_t *dst);
+  template <bool Zle, bool Pack25, int NumChannels>
+  static bool Decode_(const uint32_t *event, uint32_t size_words, std::vector<Channel> &channels);
+  template <bool Zle, int NumChannels>
+  static uint32_t Truncate_(uint32_t *event, uint32_t limit_words);
+  template <bool Pack25>
+  static bool DecodeZle_(const uint32_t *src, uint32_t words, Channel &ch);
+};
+
+#endif // DT5751DECODER_HXX_INCLUDE
@@ -0,0 +1,473 @@
+/*****************************************************************************/
+/**
+\file dt5751EventBuilder.cxx
+
+## Contents
+
+This file contains the class implementation for the event builder.
+ *****************************************************************************/
+
+#include "dt5751EventBuilder.hxx"
+#include "dt5751Metrics.hxx"
+#include "dt5751Trace.hxx"
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Constructor
+ *
+ * \param   [in]  modules  boards controlled by this frontend, read through
+ *                         their ring buffers
+ */
+dt5751EventBuilder::dt5751EventBuilder(std::vector<dt5751CONET2> &modules)
+: modules_(modules), filter_(NULL), decision_(Filter::Accept), monitor_(NULL),
+  monitor_interval_(1), monitor_countdown_(0), merge_(true), threshold_(50), write_partial_(false), draining_(false), module_to_read_(-1),
+  min_timestamp_(0), num_fragments_(0), num_connected_(0), stream_(false), frame_ticks_(1),
+  overlap_ticks_(0), frame_timeout_ns_(0), frame_valid_(false), frame_complete_(false), frame_start_(0),
+  frame_number_(0), straggler_ns_(0)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the merging parameters (ODB Settings of the data equipment)
+ *
+ * \param   [in]  merge              merge fragments by trigger time tag
+ * \param   [in]  matchingThreshold  max TTT difference within an event
+ * \param   [in]  writePartial       keep events with missing fragments
+ */
+void dt5751EventBuilder::Configure(bool merge, DWORD matchingThreshold, bool writePartial)
+{
+  merge_ = merge;
+  threshold_ = matchingThreshold;
+  write_partial_ = writePartial;
+  draining_ = false;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Hand the fragments of some events to a monitor before they are copied
+ *
+ * \param   [in]  monitor   NULL for none
+ * \param   [in]  interval  one event in interval is observed (level-2 filter ignored)
+ */
+void dt5751EventBuilder::SetMonitor(Monitor *monitor, int interval)
+{
+  monitor_ = monitor;
+  monitor_interval_ = std::max(interval, 1);
+  monitor_countdown_ = 0;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the streaming parameters (begin of run)
+ *
+ * \param   [in]  stream        build time frames instead of triggers
+ * \param   [in]  frameTicks    frame width (8 ns ticks)
+ * \param   [in]  overlapTicks  fragments repeated from the previous frame (8 ns ticks)
+ * \param   [in]  timeoutNs     longest wait for the boards behind the first one past a frame
+ */
+void dt5751EventBuilder::ConfigureStreaming(bool stream, uint64_t frameTicks, uint64_t overlapTicks,
+                                            uint64_t timeoutNs)
+{
+  stream_ = stream;
+  frame_ticks_ = std::max(frameTicks, (uint64_t)1);
+  overlap_ticks_ = std::min(overlapTicks, frame_ticks_);
+  frame_timeout_ns_ = timeoutNs;
+  frame_valid_ = false;
+  frame_complete_ = false;
+  frame_start_ = 0;
+  frame_number_ = 0;
+  straggler_ns_ = 0;
+  streams_.assign(modules_.size(), Stream());
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Check whether an event can be built
+ *
+ * When merging, an event is ready once every connected board has data in its
+ * ring buffer (any board while draining at the end of a run, the fragments
+ * still missing will never come).  Otherwise any board with data will do, and
+ * the one with the most events backlogged is selected so that boards are
+ * read fairly.  In streaming mode, see IsFrameReady_().
+ *
+ * \return  true if Build() can be called
+ */
+bool dt5751EventBuilder::IsEventReady()
+{
+  module_to_read_ = -1;
+
+  if (stream_)
+    return IsFrameReady_();
+
+  if (merge_) {
+    bool anyData = false;
+    for (std::vector<dt5751CONET2>::iterator it = modules_.begin(); it != modules_.end(); ++it) {
+      if (!it->IsConnected())
+        continue;
+      if (it->GetNumEventsInRB() > 0)
+        anyData = true;
+      else if (!draining_)
+        return false;
+    }
+    return anyData;
+  }
+
+  int maxNumEvents = -1;
+  for (std::vector<dt5751CONET2>::iterator it = modules_.begin(); it != modules_.end(); ++it) {
+    if (!it->IsConnected())
+      continue;
+    int numEvents = it->GetNumEventsInRB();
+    if (numEvents > 0 && numEvents > maxNumEvents) {
+      module_to_read_ = it->GetModuleID();
+      maxNumEvents = numEvents;
+    }
+  }
+  return (module_to_read_ >= 0);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Copy the fragments of the next event into banks
+ *
+ * When merging, the lowest trigger time tag at the head of the ring buffers
+ * (taking the 31-bit rollover into account) selects the event, and every
+ * fragment within the matching threshold of it is added.  Without merging,
+ * one fragment of the board selected by IsEventReady() is added.  The
+ * fragments are selected first and handed to the filter, if any, so that
+ * a rejected event is dropped without copying anything.
+ *
+ * \param   [in]  pevent      event being composed (bk_init32 already done)
+ * \param   [out] timestamps  trigger time tag of each fragment added
+ * \return  outcome; the event should not be sent for Skipped, NoData and Filtered
+ */
+dt5751EventBuilder::Outcome dt5751EventBuilder::Build(char *pevent, std::vector<uint32_t> &timestamps)
+{
+  int64_t minTimestamp = 0xFFFFFFFF;
+  int64_t rolloverTime = 0x80000000;
+  num_connected_ = 0;
+  num_fragments_ = 0;
+  decision_ = Filter::Accept;
+  selected_.clear();
+
+  if (merge_) {
+    // Merge by timestamp
+    for (std::vector<dt5751CONET2>::iterator it = modules_.begin(); it != modules_.end(); ++it) {
+      if (! it->IsConnected()) continue;   // Skip unconnected board
+
+      num_connected_++;
+      if (draining_ && it->GetNumEventsInRB() == 0) continue;
+
+      int64_t thisTimestamp = it->PeekRBTimestamp();
+
+      if (minTimestamp == 0xFFFFFFFF) {
+        // First timestamp
+        minTimestamp = thisTimestamp;
+      } else if (std::abs(thisTimestamp - minTimestamp) > rolloverTime / 2) {
+        // Had rollover
+        if (thisTimestamp > minTimestamp) {
+          minTimestamp = thisTimestamp;
+        }
+      } else if (thisTimestamp < minTimestamp) {
+        // No rollover
+        minTimestamp = thisTimestamp;
+      }
+    }
+  }
+  min_timestamp_ = (uint32_t)minTimestamp;
+
+  // Fragments are selected from here on
+  uint64_t merge_ns = dt5751Metrics::NowNs();
+  dt5751Trace &trace = dt5751Trace::Instance();
+  trace.Record(dt5751Trace::MergeDecision, -1, (uint32_t)minTimestamp);
+
+  for (std::vector<dt5751CONET2>::iterator it = modules_.begin(); it != modules_.end(); ++it) {
+    if (! it->IsConnected()) continue;   // Skip unconnected board
+
+    if (!merge_ && it->GetModuleID() != module_to_read_) {
+      continue;
+    }
+
+    if (merge_ && it->GetNumEventsInRB() == 0) {
+      if (draining_) continue;
+      cm_msg(MERROR,"read_trigger_event", "Error: no events in RB for module %d.  Stopping run.", it->GetModuleID());
+      return NoData;
+    }
+
+    DWORD thisTimestamp = it->PeekRBTimestamp();
+    DWORD deltaTimestamp = thisTimestamp - minTimestamp;
+
+    if (deltaTimestamp > 0x7FFFFFFF) {
+      // Handle rollover
+      deltaTimestamp -= 0x7FFFFFFF;
+    }
+
+    if (merge_ && deltaTimestamp > threshold_) {
+      trace.Record(dt5751Trace::FragmentSkipped, it->GetModuleID(), thisTimestamp);
+      continue;
+    }
+    trace.Record(dt5751Trace::FragmentMerged, it->GetModuleID(), thisTimestamp);
+    selected_.push_back(it - modules_.begin());
+
+    if (!merge_) {
+      // Only saving data from 1 board.
+      break;
+    }
+  }
+
+  Outcome outcome = Complete;
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  if (merge_) {
+    if ((DWORD)selected_.size() == num_connected_) {
+      metrics.Add(dt5751Metrics::kGlobal, dt5751Metrics::MergeComplete);
+    } else if (write_partial_) {
+      metrics.Add(dt5751Metrics::kGlobal, dt5751Metrics::MergePartial);
+      outcome = Partial;
+    } else {
+      metrics.Add(dt5751Metrics::kGlobal, dt5751Metrics::MergeSkipped);
+      outcome = Skipped;
+    }
+  }
+
+  // Level-2 filter and monitor on the events to be written
+  bool observe = monitor_ && outcome != Skipped && --monitor_countdown_ <= 0;
+  if ((filter_ || observe) && outcome != Skipped && !selected_.empty()) {
+    fragments_.clear();
+    for (size_t i = 0; i < selected_.size(); i++) {
+      Fragment f;
+      f.module = &modules_[selected_[i]];
+      f.event = f.module->PeekRBEvent();
+      if (!f.event)
+        return NoData;
+      fragments_.push_back(f);
+    }
+
+    // Before the filter: the rejected events sample the baselines as well
+    if (observe) {
+      monitor_->Observe(fragments_);
+      monitor_countdown_ = monitor_interval_;
+    }
+
+    if (filter_) {
+      decision_ = filter_->Evaluate(fragments_);
+      if (decision_ == Filter::Reject) {
+        for (size_t i = 0; i < selected_.size(); i++)
+          modules_[selected_[i]].SkipEvent();
+        metrics.Add(dt5751Metrics::kGlobal, dt5751Metrics::L2Rejected);
+        return Filtered;
+      }
+      metrics.Add(dt5751Metrics::kGlobal, decision_ == Filter::Accept ?
+                  dt5751Metrics::L2Accepted : dt5751Metrics::L2Prescaled);
+    }
+  }
+
+  for (size_t i = 0; i < selected_.size(); i++) {
+    // >>> Fill Event bank
+    uint32_t timestamp;
+    modules_[selected_[i]].FillEventBank(pevent, timestamp, merge_ns);
+
+    // Save timestamp for ZLE bank.
+    timestamps.push_back((timestamp & 0x7fffffff));
+    num_fragments_++;
+  }
+
+  return outcome;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Check whether the next time frame can be built (streaming mode)
+ *
+ * The frame is ready once every connected board has its newest fragment past
+ * the end of the frame, when draining, or when the newest fragment of any
+ * board is frame timeout past the end in data time: a board with a low rate
+ * (nothing in the frame) does not hold back the others.  Should the data stop,
+ * the frame is built frame timeout after the first board got past its end,
+ * in wall clock time.  Frames without any fragment are skipped.
+ */
+bool dt5751EventBuilder::IsFrameReady_()
+{
+  uint64_t minHead = dt5751CONET2::kNoTimestamp;
+  int connected = 0;
+  for (std::vector<dt5751CONET2>::iterator it = modules_.begin(); it != modules_.end(); ++it) {
+    if (!it->IsConnected())
+      continue;
+    connected++;
+    if (it->GetNumEventsInRB() > 0)
+      minHead = std::min(minHead, it->PeekRBExtendedTimestamp());
+  }
+  if (minHead == dt5751CONET2::kNoTimestamp)
+    return false;
+
+  if (!frame_valid_ || minHead >= frame_start_ + frame_ticks_) {
+    frame_start_ = minHead - minHead % frame_ticks_;
+    frame_valid_ = true;
+    straggler_ns_ = 0;
+  }
+
+  uint64_t end = frame_start_ + frame_ticks_;
+  uint64_t maxNewest = 0;
+  int passed = 0;
+  for (std::vector<dt5751CONET2>::iterator it = modules_.begin(); it != modules_.end(); ++it) {
+    if (!it->IsConnected() || it->GetNumEventsInRB() == 0)
+      continue;
+    uint64_t newest = it->GetNewestExtendedTimestamp();
+    maxNewest = std::max(maxNewest, newest);
+    if (newest >= end)
+      passed++;
+  }
+
+  frame_complete_ = (passed == connected);
+  if (frame_complete_ || draining_)
+    return true;
+  if (passed == 0)
+    return false;
+  // Timeout in 8 ns ticks of data time
+  if (maxNewest - end >= frame_timeout_ns_/8)
+    return true;
+  uint64_t now = dt5751Metrics::NowNs();
+  if (straggler_ns_ == 0)
+    straggler_ns_ = now;
+  return now - straggler_ns_ >= frame_timeout_ns_;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Copy the fragments of the next time frame into banks (streaming mode)
+ *
+ * Each board gets one bank with the fragments repeated from the previous
+ * frame, then all the fragments of its ring buffer before the end of the
+ * frame (or until the event is full).  The FRAM bank follows.
+ *
+ * \param   [in]  pevent  event being composed (bk_init32 already done)
+ * \return  Complete, Partial (boards not past the end of the frame) or NoData
+ */
+dt5751EventBuilder::Outcome dt5751EventBuilder::BuildFrame(char *pevent)
+{
+  if (streams_.size() != modules_.size())
+    streams_.resize(modules_.size());
+
+  const uint64_t start = frame_start_;
+  const uint64_t end = start + frame_ticks_;
+  uint64_t merge_ns = dt5751Metrics::NowNs();
+  dt5751Trace &trace = dt5751Trace::Instance();
+  trace.Record(dt5751Trace::MergeDecision, -1, (uint32_t)start);
+
+  num_connected_ = 0;
+  num_fragments_ = 0;
+  for (std::vector<dt5751CONET2>::iterator it = modules_.begin(); it != modules_.end(); ++it)
+    num_connected_ += it->IsConnected() ? 1 : 0;
+
+  // FRAM words, and room kept for them
+  std::vector<DWORD> fram;
+  fram.reserve(5 + 3*num_connected_);
+  const uint32_t reserve = (5 + 3*num_connected_)*sizeof(DWORD) + 64;
+
+  for (size_t i = 0; i < modules_.size(); i++) {
+    dt5751CONET2 &module = modules_[i];
+    if (!module.IsConnected())
+      continue;
+
+    Stream &st = streams_[i];
+    DWORD *dest, *p;
+    bk_create(pevent, module.GetBankName(), TID_DWORD, (void **)&dest);
+    p = dest;
+    int64_t left = (int64_t)DT5751_MAX_EVENT_SIZE - bk_size(pevent) - reserve;
+    uint32_t room = (left > 0) ? left/sizeof(DWORD) : 0;
+
+    // Overlap with the previous frame
+    DWORD overlapped = 0;
+    for (size_t k = 0, off = 0; k < st.tail_ts.size(); k++) {
+      uint32_t words = st.tail[off] & 0x0FFFFFFF;
+      if (st.tail_ts[k] + overlap_ticks_ >= start && words <= room) {
+        memcpy(p, &st.tail[off], words*sizeof(DWORD));
+        p += words;
+        room -= words;
+        overlapped++;
+      }
+      off += words;
+    }
+    st.tail.clear();
+    st.tail_ts.clear();
+
+    // Fragments of the frame, in ring buffer order
+    DWORD fragments = 0;
+    while (module.GetNumEventsInRB() > 0) {
+      uint32_t words;
+      uint64_t ts = module.PeekRBExtendedTimestamp(&words);
+      if (ts == dt5751CONET2::kNoTimestamp) {
+        bk_close(pevent, p);
+        return NoData;
+      }
+      // A fragment that does not fit waits for the next frame, unless the bank is empty (truncated)
+      if (ts >= end || (words > room && (p != dest || room < kMinFragmentWords)))
+        break;
+      uint32_t ttt;
+      int n = module.CopyEvent(p, room, merge_ns, &ttt);
+      if (n < 0) {
+        bk_close(pevent, p);
+        return NoData;
+      }
+      if (overlap_ticks_ && ts + overlap_ticks_ >= end) {
+        st.tail.insert(st.tail.end(), p, p + n);
+        st.tail_ts.push_back(ts);
+      }
+      trace.Record(dt5751Trace::FragmentMerged, module.GetModuleID(), ttt);
+      p += n;
+      room -= n;
+      fragments++;
+    }
+    bk_close(pevent, p);
+    trace.Record(dt5751Trace::BankClose, module.GetModuleID(), (p - dest)*sizeof(DWORD));
+
+    fram.push_back(module.GetModuleID());
+    fram.push_back(overlapped);
+    fram.push_back(fragments);
+    if (fragments)
+      num_fragments_++;
+  }
+
+  DWORD *pdata;
+  bk_create(pevent, "FRAM", TID_DWORD, (void **)&pdata);
+  *pdata++ = (DWORD)frame_number_;
+  *pdata++ = (DWORD)start;
+  *pdata++ = (DWORD)(start >> 32);
+  *pdata++ = (DWORD)frame_ticks_;
+  *pdata++ = (DWORD)overlap_ticks_;
+  for (size_t k = 0; k < fram.size(); k++)
+    *pdata++ = fram[k];
+  bk_close(pevent, pdata);
+
+  min_timestamp_ = (uint32_t)start;
+  frame_start_ = end;
+  frame_number_++;
+  straggler_ns_ = 0;
+
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  if (frame_complete_) {
+    metrics.Add(dt5751Metrics::kGlobal, dt5751Metrics::MergeComplete);
+    return Complete;
+  }
+  metrics.Add(dt5751Metrics::kGlobal, dt5751Metrics::MergePartial);
+  return Partial;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,147 @@
+/*****************************************************************************/
+/**
+\file dt5751EventBuilder.hxx
+
+## Contents
+
+This file contains the class definition for the event builder: it selects
+the fragments waiting in the per-board ring buffers that belong to the same
+trigger (by trigger time tag) and copies them into the MIDAS event.  Shared
+by the frontend (read_event_from_ring_bufs()) and dt5751bench.
+
+In streaming mode (triggerless, self-triggered data) it instead cuts the
+data into fixed time frames of the extended trigger time tag; a MIDAS event
+holds one frame: a bank per board with all its fragments of the frame, one
+after the other, and a FRAM bank:
+- word 0: frame number
+- words 1-2: start of the frame (extended time tag, 8 ns ticks), low word first
+- word 3: frame width, word 4: overlap (ticks)
+- then 3 words per board bank, in the order of the banks: module ID,
+  fragments repeated from the end of the previous frame (overlap), fragments
+  of the frame
+Each frame repeats the fragments of the last "overlap" ticks of the previous
+frame, so that consecutive frames overlap by that margin.  A frame is built
+once every board has data past its end, or once a board has data "frame
+timeout" past its end (in data time, so that quiet boards do not hold the
+frames back; in wall clock time after the first board got past the end if
+the data stops).  Boards without data are then left out; a late fragment
+goes into the next frame.  The boards are read sequentially, each ring
+buffer up to the end of the frame, with no matching between boards.
+
+A level-2 filter (SetFilter()) checks each merged event in the ring
+buffers before any bank is created, and the events it rejects are dropped
+without being copied.  A monitor (SetMonitor()) samples the waveforms of
+one event in every N, also in the ring buffers and before the filter.
+Neither applies to the time frames of the streaming mode.
+ *****************************************************************************/
+
+#ifndef DT5751EVENTBUILDER_HXX_INCLUDE
+#define DT5751EVENTBUILDER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+#include "dt5751CONET2.hxx"
+
+class dt5751EventBuilder
+{
+
+public:
+
+  enum Outcome {
+    Complete,              //!< Fragment from every connected board, or unmerged readout
+    Partial,               //!< Boards missing, event kept
+    Skipped,               //!< Boards missing, event to be dropped
+    NoData,                //!< A ring buffer was empty while merging
+    Filtered               //!< Rejected by the level-2 filter, fragments dropped
+  };
+
+  /* Fragment of the event being built, still in its ring buffer */
+  struct Fragment {
+    dt5751CONET2 *module;
+    const DWORD *event;     //!< Header flags of word 1 not set yet
+  };
+
+  /* Level-2 filter, see SetFilter() */
+  class Filter {
+  public:
+    enum Decision {
+      Accept,
+      Prescaled,           //!< Failed, kept by the prescaler
+      Reject
+    };
+    virtual ~Filter() {}
+    virtual Decision Evaluate(const std::vector<Fragment> &fragments) = 0;
+  };
+
+  /* Waveform sampling, see SetMonitor() */
+  class Monitor {
+  public:
+    virtual ~Monitor() {}
+    virtual void Observe(const std::vector<Fragment> &fragments) = 0;
+  };
+
+  dt5751EventBuilder(std::vector<dt5751CONET2> &modules);
+
+  void Configure(bool merge, DWORD matchingThreshold, bool writePartial);
+  void ConfigureStreaming(bool stream, uint64_t frameTicks, uint64_t overlapTicks, uint64_t timeoutNs);
+  bool IsStreaming() const { return stream_; }
+  bool IsMerging() const { return merge_; }
+  void SetFilter(Filter *filter) { filter_ = filter; }       //!< NULL to write every event
+  Filter::Decision GetDecision() const { return decision_; } //!< Of the last event built
+  void SetMonitor(Monitor *monitor, int interval);            //!< NULL for none
+  void SetDraining(bool draining) { draining_ = draining; }   //!< End of run, see IsEventReady()
+
+  bool IsEventReady();
+  Outcome Build(char *pevent, std::vector<uint32_t> &timestamps);
+  Outcome BuildFrame(char *pevent);
+
+  int GetModuleToRead() const { return module_to_read_; }   //!< Unmerged: board selected by IsEventReady()
+  uint32_t GetMinTimestamp() const { return min_timestamp_; }
+  const std::vector<int> &GetSelected() const { return selected_; }   //!< Modules of the last event built
+  DWORD GetNumFragments() const { return num_fragments_; }
+  DWORD GetNumConnectedBoards() const { return num_connected_; }
+  uint64_t GetFrameNumber() const { return frame_number_; }   //!< Streaming: next frame
+
+private:
+
+  /* Streaming state of one board */
+  struct Stream {
+    std::vector<DWORD> tail;          //!< Fragments of the overlap at the end of the last frame
+    std::vector<uint64_t> tail_ts;    //!< Their extended time tags
+  };
+
+  static const uint32_t kMinFragmentWords = 16;   //!< Room for a truncated fragment
+
+  bool IsFrameReady_();
+
+  std::vector<dt5751CONET2> &modules_;
+  Filter *filter_;
+  Filter::Decision decision_;
+  Monitor *monitor_;
+  int monitor_interval_;    //!< Events written between two observed
+  int monitor_countdown_;
+  std::vector<int> selected_;       //!< Modules of the event being built
+  std::vector<Fragment> fragments_; //!< Handed to the filter
+  bool merge_;              //!< Merge fragments by trigger time tag
+  DWORD threshold_;         //!< Max TTT difference for fragments of the same event
+  bool write_partial_;      //!< Keep events with missing fragments
+  bool draining_;           //!< No more fragments will arrive, build what is left
+  int module_to_read_;      //!< Unmerged readout: module with the longest backlog
+  uint32_t min_timestamp_;  //!< TTT of the last event built
+  DWORD num_fragments_;     //!< Fragments in the last event built
+  DWORD num_connected_;     //!< Connected boards when the last event was built
+
+  bool stream_;             //!< Time frames instead of triggers
+  uint64_t frame_ticks_;    //!< Frame width
+  uint64_t overlap_ticks_;  //!< Fragments repeated from the previous frame
+  uint64_t frame_timeout_ns_;   //!< Longest wait for the boards behind (data and wall clock time)
+  bool frame_valid_;        //!< frame_start_ set
+  bool frame_complete_;     //!< Every board past the end when IsEventReady() returned true
+  uint64_t frame_start_;    //!< Start of the next frame
+  uint64_t frame_number_;
+  uint64_t straggler_ns_;   //!< First board seen past the end of the frame, 0 if none yet
+  std::vector<Stream> streams_;     //!< Per module
+};
+
+#endif // DT5751EVENTBUILDER_HXX_INCLUDE
@@ -0,0 +1,215 @@
+/*****************************************************************************/
+/**
+\file dt5751L2Filter.cxx
+
+## Contents
+
+This file contains the class implementation for the level-2 trigger filter.
+ *****************************************************************************/
+
+#include "dt5751L2Filter.hxx"
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//
+//--------------------------------------------------------------------------------
+dt5751L2Filter::dt5751L2Filter()
+: threshold_(50), baseline_samples_(16), min_channels_(1), min_boards_(1), window_ns_(0),
+  prescale_(0), failed_(0), channels_(0), boards_(0)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the filter parameters (begin of run)
+ *
+ * \param   [in]  threshold        ADC counts from the baseline
+ * \param   [in]  baselineSamples  samples averaged for the baseline
+ * \param   [in]  minChannels      channels over threshold in the window
+ * \param   [in]  minBoards        boards with a channel over threshold in the window
+ * \param   [in]  windowNs         coincidence window
+ * \param   [in]  prescale         keep one failing event in prescale, 0 for none
+ */
+void dt5751L2Filter::Configure(int threshold, int baselineSamples, int minChannels, int minBoards,
+                               DWORD windowNs, DWORD prescale)
+{
+  threshold_ = std::max(threshold, 0);
+  baseline_samples_ = std::max(baselineSamples, 1);
+  min_boards_ = std::max(minBoards, 1);
+  min_channels_ = std::max(minChannels, min_boards_);
+  window_ns_ = windowNs;
+  prescale_ = prescale;
+  Reset();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   First sample further than threshold from the baseline
+ *
+ * \param   [in]  samples          samples of a record or ZLE interval
+ * \param   [in]  n                number of samples
+ * \param   [in]  baselineSamples  first samples averaged for the baseline
+ * \param   [in]  threshold        ADC counts
+ * \return  index of the sample, -1 if none
+ */
+int dt5751L2Filter::FirstOverThreshold(const uint16_t *samples, uint32_t n, uint32_t baselineSamples,
+                                       int threshold)
+{
+  if (n == 0)
+    return -1;
+
+  uint32_t nb = std::min(baselineSamples, n);
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i < nb; i++)
+    sum += samples[i];
+  int baseline = sum/nb;
+  int lo = std::max(baseline - threshold, -1);
+  int hi = std::min(baseline + threshold, 0x7FFF);
+
+  uint32_t i = 0;
+#ifdef __SSE2__
+  // Samples are at most 12 bits: signed 16-bit comparisons are enough
+  const __m128i vlo = _mm_set1_epi16((short)lo);
+  const __m128i vhi = _mm_set1_epi16((short)hi);
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(samples + i));
+    __m128i over = _mm_or_si128(_mm_cmpgt_epi16(v, vhi), _mm_cmplt_epi16(v, vlo));
+    int bits = _mm_movemask_epi8(over);
+    if (bits)
+      return i + __builtin_ctz(bits)/2;
+  }
+#endif
+  for (; i < n; i++) {
+    if ((int)samples[i] > hi || (int)samples[i] < lo)
+      return i;
+  }
+  return -1;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Hit times of the channels over threshold of one fragment
+ *
+ * \param   [in]  f         fragment, in its ring buffer
+ * \param   [in]  board     position of the fragment in the event
+ * \param   [in]  offsetNs  its trigger time tag relative to the first fragment
+ */
+void dt5751L2Filter::AddHits_(const dt5751EventBuilder::Fragment &f, int board, double offsetNs)
+{
+  const dt5751Decoder::Kernels &kernels = f.module->GetKernels();
+  uint32_t flags = f.module->GetBankFlags();
+  double ns_per_sample = (flags & dt5751Decoder::kDesFlag) ? 0.5 : 1.0;
+  uint32_t size_words = f.event[0] & 0x0FFFFFFF;
+
+  if (flags & dt5751Decoder::kZleFlag) {
+    // Decoded from a copy with the flags of the data format
+    event_.assign(f.event, f.event + size_words);
+    event_[1] |= flags;
+    if (!kernels.decode(&event_[0], size_words, decoded_) &&
+        !dt5751Decoder::Decode(&event_[0], size_words, decoded_))
+      return;
+    for (size_t c = 0; c < decoded_.size(); c++) {
+      const dt5751Decoder::Channel &ch = decoded_[c];
+      uint32_t pos = 0;
+      for (size_t s = 0; s < ch.segments.size(); s++) {
+        const dt5751Decoder::Segment &seg = ch.segments[s];
+        int first = seg.count ? FirstOverThreshold(&ch.samples[pos], seg.count, baseline_samples_,
+                                                   threshold_) : -1;
+        if (first >= 0) {
+          Hit h = { offsetNs + (seg.first + first)*ch.ns_per_sample, board };
+          hits_.push_back(h);
+          break;
+        }
+        pos += seg.count;
+      }
+    }
+    return;
+  }
+
+  int nch = __builtin_popcount(f.event[1] & 0xFF);
+  if (nch == 0 || size_words < 4)
+    return;
+  uint32_t words = (size_words - 4)/nch;
+  const DWORD *src = f.event + 4;
+  for (int c = 0; c < nch; c++, src += words) {
+    int first;
+    if (flags & dt5751Decoder::kPack25Flag) {
+      samples_.resize(dt5751Decoder::SamplesInWords(words, true));
+      uint32_t n = words ? kernels.unpack(src, words, &samples_[0]) : 0;
+      first = FirstOverThreshold(&samples_[0], n, baseline_samples_, threshold_);
+    } else {
+      // Pack 2: the samples are the 16-bit halves of the words, in order
+      first = FirstOverThreshold((const uint16_t *)src, 2*words, baseline_samples_, threshold_);
+    }
+    if (first >= 0) {
+      Hit h = { offsetNs + first*ns_per_sample, board };
+      hits_.push_back(h);
+    }
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Apply the coincidence condition to the fragments of an event
+ *
+ * \return  Accept, Prescaled (failed, kept by the prescaler) or Reject
+ */
+dt5751EventBuilder::Filter::Decision
+dt5751L2Filter::Evaluate(const std::vector<dt5751EventBuilder::Fragment> &fragments)
+{
+  hits_.clear();
+  channels_ = 0;
+  boards_ = 0;
+  if (fragments.empty())
+    return Reject;
+
+  uint32_t ref = fragments[0].event[3] & 0x7FFFFFFF;
+  for (size_t i = 0; i < fragments.size(); i++) {
+    // Signed 31-bit difference, rollover included
+    int32_t delta = (int32_t)(((fragments[i].event[3] - ref) & 0x7FFFFFFF) << 1) >> 1;
+    AddHits_(fragments[i], (int)i, delta*8.0);
+  }
+
+  // Sliding window over the sorted hit times
+  std::sort(hits_.begin(), hits_.end());
+  board_hits_.assign(fragments.size(), 0);
+  bool pass = false;
+  int boards = 0;
+  size_t end = 0;
+  for (size_t i = 0; i < hits_.size() && !pass; i++) {
+    while (end < hits_.size() && hits_[end].ns - hits_[i].ns <= window_ns_) {
+      if (board_hits_[hits_[end].board]++ == 0)
+        boards++;
+      end++;
+    }
+    int channels = (int)(end - i);
+    if (channels > channels_ || (channels == channels_ && boards > boards_)) {
+      channels_ = channels;
+      boards_ = boards;
+    }
+    pass = channels >= min_channels_ && boards >= min_boards_;
+    if (--board_hits_[hits_[i].board] == 0)
+      boards--;
+  }
+
+  if (pass)
+    return Accept;
+  if (prescale_ && (++failed_ % prescale_) == 0)
+    return Prescaled;
+  return Reject;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
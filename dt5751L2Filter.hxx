@@ -0,0 +1,83 @@
+/*****************************************************************************/
+/**
+\file dt5751L2Filter.hxx
+
+## Contents
+
+This file contains the class definition for the software level-2 trigger
+filter of the data equipment: a multiplicity/coincidence condition on the
+channels over threshold of the merged fragments, evaluated before the banks
+are created, with a prescaler for the rejected events.
+ *****************************************************************************/
+
+#ifndef DT5751L2FILTER_HXX_INCLUDE
+#define DT5751L2FILTER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+#include "dt5751EventBuilder.hxx"
+
+/**
+ * Level-2 filter plugged into dt5751EventBuilder (main thread only).
+ *
+ * A channel is over threshold when one of its samples differs from its
+ * baseline (mean of the first samples of the record, or of each ZLE
+ * interval) by more than the threshold, in either direction.  Its hit time
+ * is the first such sample: trigger time tag of the fragment (8 ns ticks)
+ * plus the sample position (1 ns, 0.5 ns in DES mode).  Pack 2 raw data is
+ * scanned in place in the ring buffer, 8 samples at a time with SSE2; pack
+ * 2.5 and ZLE data are decoded first.
+ *
+ * The event passes when, within a window of the hit times, at least "min
+ * channels" channels are over threshold on at least "min boards" boards.
+ * One failing event in "prescale" is kept anyway (0 keeps none), so that
+ * the rejected sample can still be studied; GetChannels() and GetBoards()
+ * give the best coincidence found for the L2FL bank.
+ */
+class dt5751L2Filter : public dt5751EventBuilder::Filter
+{
+
+public:
+
+  dt5751L2Filter();
+
+  void Configure(int threshold, int baselineSamples, int minChannels, int minBoards,
+                 DWORD windowNs, DWORD prescale);
+  void Reset() { failed_ = 0; }
+
+  Decision Evaluate(const std::vector<dt5751EventBuilder::Fragment> &fragments);
+
+  int GetChannels() const { return channels_; }   //!< Channels in the best window of the last event
+  int GetBoards() const { return boards_; }       //!< Boards in that window
+
+  static int FirstOverThreshold(const uint16_t *samples, uint32_t n, uint32_t baselineSamples,
+                                int threshold);
+
+private:
+
+  struct Hit {
+    double ns;              //!< Relative to the first fragment
+    int board;              //!< Position of the fragment in the event
+    bool operator<(const Hit &h) const { return ns < h.ns; }
+  };
+
+  void AddHits_(const dt5751EventBuilder::Fragment &f, int board, double offsetNs);
+
+  int threshold_;           //!< ADC counts from the baseline
+  uint32_t baseline_samples_;
+  int min_channels_;
+  int min_boards_;
+  double window_ns_;
+  DWORD prescale_;          //!< Keep one failing event in prescale, 0 for none
+  DWORD failed_;            //!< Failing events since the start of run
+  int channels_;
+  int boards_;
+  std::vector<Hit> hits_;
+  std::vector<int> board_hits_;     //!< Hits of each board in the window
+  std::vector<uint16_t> samples_;   //!< Pack 2.5 channel unpacked
+  std::vector<DWORD> event_;        //!< ZLE event copied with its header flags
+  std::vector<dt5751Decoder::Channel> decoded_;
+};
+
+#endif // DT5751L2FILTER_HXX_INCLUDE
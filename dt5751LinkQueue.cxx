@@ -0,0 +1,181 @@
+/*****************************************************************************/
+/**
+\file dt5751LinkQueue.cxx
+
+## Contents
+
+This file contains the class implementation for the link command queue.
+ *****************************************************************************/
+
+#include "dt5751LinkQueue.hxx"
+#include <limits.h>
+
+thread_local dt5751LinkQueue *dt5751LinkQueue::served_ = NULL;
+
+//
+//--------------------------------------------------------------------------------
+dt5751LinkQueue::dt5751LinkQueue()
+: pending_(0), serving_(false)
+{
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&done_cond_, NULL);
+  for (int p = 0; p < NumPriorities; p++)
+    executed_[p] = 0;
+}
+
+//
+//--------------------------------------------------------------------------------
+dt5751LinkQueue::~dt5751LinkQueue()
+{
+  pthread_cond_destroy(&done_cond_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Execute a command on the link (any thread but the owner)
+ *
+ * \param   [in]  prio  queue to use while the owner is serving
+ * \param   [in]  fn    hardware access, must not call Run() itself
+ * \return  value returned by fn
+ */
+int dt5751LinkQueue::Run(Priority prio, const std::function<int()> &fn)
+{
+  Command cmd = { &fn, 0, false };
+  Submit(prio, &cmd);
+  return Wait(&cmd);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Queue a command without waiting for it (any thread but the owner)
+ *
+ * \param   [in]  prio  queue to use while the owner is serving
+ * \param   [in]  cmd   command, fn set; cmd and *fn must stay valid until Wait()
+ */
+void dt5751LinkQueue::Submit(Priority prio, Command *cmd)
+{
+  cmd->done = false;
+  pthread_mutex_lock(&mutex_);
+
+  if (!serving_) {
+    // Owner parked, nothing else uses the link
+    cmd->result = (*cmd->fn)();
+    cmd->done = true;
+    executed_[prio].fetch_add(1, std::memory_order_relaxed);
+    pthread_mutex_unlock(&mutex_);
+    return;
+  }
+
+  queue_[prio].push_back(cmd);
+  pending_.fetch_add(1, std::memory_order_release);
+  pthread_mutex_unlock(&mutex_);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Wait for a command queued by Submit()
+ *
+ * \return  value returned by its fn
+ */
+int dt5751LinkQueue::Wait(Command *cmd)
+{
+  pthread_mutex_lock(&mutex_);
+  while (!cmd->done)
+    pthread_cond_wait(&done_cond_, &mutex_);
+  pthread_mutex_unlock(&mutex_);
+  return cmd->result;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Take ownership of the link (link thread, before the first readout)
+ */
+void dt5751LinkQueue::StartServing()
+{
+  pthread_mutex_lock(&mutex_);
+  serving_ = true;
+  served_ = this;
+  pthread_mutex_unlock(&mutex_);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Run the queued commands (link thread, between readout passes)
+ *
+ * \param   [in]  maxSlowControl  slow-control commands to run at most
+ * \return  number of commands executed
+ */
+int dt5751LinkQueue::Serve(int maxSlowControl)
+{
+  if (pending_.load(std::memory_order_acquire) == 0)
+    return 0;
+
+  pthread_mutex_lock(&mutex_);
+  int n = Execute_(Trigger, INT_MAX);
+  n += Execute_(SlowControl, maxSlowControl);
+  pthread_mutex_unlock(&mutex_);
+  return n;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Release the link (link thread, before parking)
+ *
+ * Commands still queued are executed first; later ones run directly in the
+ * calling thread.
+ */
+void dt5751LinkQueue::StopServing()
+{
+  pthread_mutex_lock(&mutex_);
+  while (pending_.load(std::memory_order_relaxed) > 0) {
+    for (int p = 0; p < NumPriorities; p++)
+      Execute_((Priority)p, INT_MAX);
+  }
+  serving_ = false;
+  served_ = NULL;
+  pthread_mutex_unlock(&mutex_);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Run up to max commands of one queue, mutex_ held
+ *
+ * The lock is released while a command runs so that other threads can queue.
+ */
+int dt5751LinkQueue::Execute_(Priority prio, int max)
+{
+  int n = 0;
+  while (n < max && !queue_[prio].empty()) {
+    Command *cmd = queue_[prio].front();
+    queue_[prio].pop_front();
+
+    pthread_mutex_unlock(&mutex_);
+    cmd->result = (*cmd->fn)();
+    pthread_mutex_lock(&mutex_);
+
+    cmd->done = true;
+    pending_.fetch_sub(1, std::memory_order_relaxed);
+    executed_[prio].fetch_add(1, std::memory_order_relaxed);
+    n++;
+  }
+  if (n)
+    pthread_cond_broadcast(&done_cond_);
+  return n;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,81 @@
+/*****************************************************************************/
+/**
+\file dt5751LinkQueue.hxx
+
+## Contents
+
+This file contains the class definition for the link command queue: the
+register accesses other threads make on the boards of an optical link
+(software triggers, buffer level and temperature reads, run control) are
+handed to the link thread that owns it and run between two readout
+passes, so they never interleave with the BLTs on the link.
+ *****************************************************************************/
+
+#ifndef DT5751LINKQUEUE_HXX_INCLUDE
+#define DT5751LINKQUEUE_HXX_INCLUDE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+
+/**
+ * Single-owner command queue of an optical link.
+ *
+ * While the owner (the link thread) is serving, Run() from any other thread
+ * queues the command and blocks until the owner has executed it (Submit()
+ * and Wait() split the two, to keep several links busy at once).  The owner
+ * reads out first, then calls Serve(): all queued triggers, then a bounded
+ * number of slow-control commands.  While the owner is parked, Run()
+ * executes the command directly, the owner cannot start serving meanwhile.
+ */
+class dt5751LinkQueue
+{
+
+public:
+
+  enum Priority {
+    Trigger,                //!< Software triggers and run control
+    SlowControl,            //!< Everything else
+    NumPriorities
+  };
+
+  struct Command {
+    const std::function<int()> *fn;
+    int result;
+    bool done;
+  };
+
+  dt5751LinkQueue();
+  ~dt5751LinkQueue();
+
+  int Run(Priority prio, const std::function<int()> &fn);
+  void Submit(Priority prio, Command *cmd);
+  int Wait(Command *cmd);
+  bool IsOwner() const { return served_ == this; }   //!< Calling thread is serving this queue
+
+  /* Owner thread only */
+  void StartServing();
+  int Serve(int maxSlowControl);
+  void StopServing();
+
+  uint64_t GetNumExecuted(Priority prio) const {   //!< Commands run through the queue
+    return executed_[prio].load(std::memory_order_relaxed);
+  }
+
+private:
+
+  int Execute_(Priority prio, int max);
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t done_cond_;            //!< Broadcast when commands complete
+  std::deque<Command *> queue_[NumPriorities];
+  std::atomic<int> pending_;            //!< Queued commands, checked without the lock
+  bool serving_;                        //!< Owner between StartServing() and StopServing()
+  std::atomic<uint64_t> executed_[NumPriorities];
+
+  static thread_local dt5751LinkQueue *served_;   //!< Queue served by the calling thread
+};
+
+#endif // DT5751LINKQUEUE_HXX_INCLUDE
@@ -0,0 +1,118 @@
+/*****************************************************************************/
+/**
+\file dt5751LinkScheduler.cxx
+
+## Contents
+
+This file contains the class implementation for the daisy-chain readout
+scheduler.
+ *****************************************************************************/
+
+#include "dt5751LinkScheduler.hxx"
+#include "dt5751Metrics.hxx"
+#include <algorithm>
+
+const uint64_t dt5751LinkScheduler::kMinBackoffNs;
+
+//
+//--------------------------------------------------------------------------------
+dt5751LinkScheduler::dt5751LinkScheduler()
+: modules_(NULL), first_board_(0), max_events_(1), max_backoff_ns_(kMinBackoffNs)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the boards of the link
+ *
+ * \param   [in]  modules     modules of the frontend
+ * \param   [in]  firstBoard  index of the first board of the link in modules
+ * \param   [in]  numBoards   boards daisy chained on the link
+ */
+void dt5751LinkScheduler::Init(std::vector<dt5751CONET2> &modules, int firstBoard, int numBoards)
+{
+  modules_ = &modules;
+  first_board_ = firstBoard;
+  boards_.assign(numBoards, Board());
+  visits_.reserve(numBoards);
+  Reset();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the scheduling parameters (link thread parked)
+ *
+ * \param   [in]  maxEventsPerVisit  events read from a board before moving to the next one
+ * \param   [in]  maxBackoffNs       longest time an empty board is not polled
+ */
+void dt5751LinkScheduler::Configure(int maxEventsPerVisit, uint64_t maxBackoffNs)
+{
+  max_events_ = std::max(maxEventsPerVisit, 1);
+  max_backoff_ns_ = std::max(maxBackoffNs, kMinBackoffNs);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Poll every board on the next Poll() (start of run)
+ */
+void dt5751LinkScheduler::Reset()
+{
+  for (size_t i = 0; i < boards_.size(); i++) {
+    boards_[i].backoff_ns = 0;
+    boards_[i].next_poll_ns = 0;
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Poll the boards that are due and order them by occupancy
+ *
+ * \return  boards to visit, fullest first; valid until the next call
+ */
+const std::vector<dt5751LinkScheduler::Visit> &dt5751LinkScheduler::Poll()
+{
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  uint64_t now = dt5751Metrics::NowNs();
+  visits_.clear();
+
+  for (size_t i = 0; i < boards_.size(); i++) {
+    Board &b = boards_[i];
+    dt5751CONET2 &module = (*modules_)[first_board_ + i];
+    if (!module.IsEnabled() || !module.IsConnected() || module.IsOffline())
+      continue;
+    if (now < b.next_poll_ns) {
+      metrics.Add(module.GetModuleID(), dt5751Metrics::PollsSkipped);
+      continue;
+    }
+
+    metrics.Add(module.GetModuleID(), dt5751Metrics::BoardPolls);
+    int stored = module.GetEventsStored();
+    if (stored > 0) {
+      b.backoff_ns = 0;
+      b.next_poll_ns = 0;
+      Visit v = { first_board_ + (int)i, stored, std::min(stored, max_events_) };
+      visits_.push_back(v);
+    } else if (stored == 0) {
+      b.backoff_ns = b.backoff_ns ? std::min(2*b.backoff_ns, max_backoff_ns_) : kMinBackoffNs;
+      b.next_poll_ns = now + b.backoff_ns;
+    }
+  }
+
+  // Fullest first; ties keep the daisy chain order
+  std::stable_sort(visits_.begin(), visits_.end(),
+                   [](const Visit &a, const Visit &b) { return a.stored > b.stored; });
+  return visits_;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,67 @@
+/*****************************************************************************/
+/**
+\file dt5751LinkScheduler.hxx
+
+## Contents
+
+This file contains the class definition for the readout scheduler of a
+daisy chain: it decides which boards of an optical link the link thread
+reads on each pass, and how many events from each, from the number of
+events stored in every board.
+ *****************************************************************************/
+
+#ifndef DT5751LINKSCHEDULER_HXX_INCLUDE
+#define DT5751LINKSCHEDULER_HXX_INCLUDE
+
+#include <stdint.h>
+#include <vector>
+
+#include "dt5751CONET2.hxx"
+
+/**
+ * Occupancy-first readout scheduler of one link (link thread only).
+ *
+ * Poll() reads DT5751_EVENT_STORED of each enabled board of the link and
+ * returns the boards holding events, fullest first, each with the number of
+ * events to read in one visit (at most the events per visit), so that the
+ * stored count replaces a CheckEvent() round trip per event.  A board found
+ * empty is not polled again for a backoff period that doubles, up to the
+ * configured maximum, while it stays empty; an idle board therefore costs
+ * its busy neighbours almost no link time.
+ */
+class dt5751LinkScheduler
+{
+
+public:
+
+  struct Visit {
+    int index;              //!< Board, index in the module vector
+    int stored;             //!< DT5751_EVENT_STORED when polled
+    int events;             //!< Events to read in this visit
+  };
+
+  static const uint64_t kMinBackoffNs = 20000;   //!< First backoff of an empty board
+
+  dt5751LinkScheduler();
+
+  void Init(std::vector<dt5751CONET2> &modules, int firstBoard, int numBoards);
+  void Configure(int maxEventsPerVisit, uint64_t maxBackoffNs);
+  void Reset();
+  const std::vector<Visit> &Poll();
+
+private:
+
+  struct Board {
+    uint64_t backoff_ns;    //!< Current backoff, 0 while the board has events
+    uint64_t next_poll_ns;  //!< No EVENT_STORED read before this time
+  };
+
+  std::vector<dt5751CONET2> *modules_;
+  int first_board_;
+  std::vector<Board> boards_;
+  std::vector<Visit> visits_;
+  int max_events_;                   //!< Events read from a board per visit at most
+  uint64_t max_backoff_ns_;
+};
+
+#endif // DT5751LINKSCHEDULER_HXX_INCLUDE
@@ -0,0 +1,262 @@
+/*****************************************************************************/
+/**
+\file dt5751Metrics.cxx
+
+## Contents
+
+This file contains the class implementation for the frontend metrics registry.
+ *****************************************************************************/
+
+#include "dt5751Metrics.hxx"
+#include <stdio.h>
+#include <math.h>
+
+const char *dt5751Metrics::counter_names[NumCounters] = {
+  "blt_calls", "bytes_read", "events_read", "read_errors", "rb_stalls",
+  "rb_wp_timeouts", "events_built", "merge_complete", "merge_partial", "merge_skipped",
+  "spill_events", "unspill_events", "link_commands", "sw_triggers",
+  "board_polls", "polls_skipped", "midas_events",
+  "l2_accepted", "l2_prescaled", "l2_rejected"
+};
+const char *dt5751Metrics::gauge_names[NumGauges] = {
+  "events_stored", "busy", "rb_level_bytes", "spill_bytes"
+};
+const char *dt5751Metrics::histogram_names[NumHistograms] = {
+  "blt_bytes", "event_bytes", "readout_ns", "rb_wait_ns", "bank_ns", "total_ns", "link_cmd_ns"
+};
+
+thread_local int dt5751Metrics::thread_slot_ = 0;
+
+//
+//--------------------------------------------------------------------------------
+dt5751Metrics::dt5751Metrics()
+: num_slots_(0), first_module_(0), num_modules_(0)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Registry shared by the whole frontend
+ */
+dt5751Metrics& dt5751Metrics::Instance()
+{
+  static dt5751Metrics instance;
+  return instance;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Allocate the per-thread slots
+ *
+ * Must be called before any thread records a metric.  Slot 0 belongs to the
+ * main thread.
+ *
+ * \param   [in]  numSlots       Number of threads recording metrics
+ * \param   [in]  firstModuleID  Lowest module ID controlled by this frontend
+ * \param   [in]  numModules     Number of modules controlled by this frontend
+ */
+void dt5751Metrics::Init(int numSlots, int firstModuleID, int numModules)
+{
+  num_slots_ = numSlots;
+  first_module_ = firstModuleID;
+  num_modules_ = numModules;
+
+  int rows = num_modules_ + 1;  // + FE-wide row
+  slots_.clear();
+  for (int i = 0; i < num_slots_; i++) {
+    // Value-initialized (zeroed); padded so slots never share a cache line
+    slots_.emplace_back(new std::atomic<uint64_t>[rows*kRowSize + 2*kPad]());
+  }
+  gauges_.reset(new std::atomic<int64_t>[rows*NumGauges]());
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Select the slot used by the calling thread
+ *
+ * \param   [in]  slot  0 for the main thread, 1+n for link thread n
+ */
+void dt5751Metrics::SetThreadSlot(int slot)
+{
+  thread_slot_ = slot;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Histogram bucket for a value
+ *
+ * Values below kSubBuckets have their own bucket; above that each power of two
+ * is split in kSubBuckets linear buckets (relative resolution <= 25%).
+ */
+int dt5751Metrics::Bucket(uint64_t value)
+{
+  if (value < (uint64_t)kSubBuckets)
+    return (int)value;
+  int e = 63 - __builtin_clzll(value);
+  int sub = (int)(value >> (e - 2)) & (kSubBuckets - 1);
+  return (e - 1)*kSubBuckets + sub;
+}
+
+//
+//--------------------------------------------------------------------------------
+uint64_t dt5751Metrics::BucketUpperBound(int bucket)
+{
+  if (bucket < kSubBuckets)
+    return bucket;
+  int e = bucket/kSubBuckets + 1;
+  uint64_t sub = bucket % kSubBuckets;
+  return ((kSubBuckets + sub + 1) << (e - 2)) - 1;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Sum all thread slots
+ *
+ * \param   [out] snap  aggregated values
+ */
+void dt5751Metrics::Collect(Snapshot &snap) const
+{
+  int rows = num_modules_ + 1;
+  snap.counters.assign(rows*NumCounters, 0);
+  snap.gauges.assign(rows*NumGauges, 0);
+  snap.buckets.assign(rows*NumHistograms*kNumBuckets, 0);
+
+  for (int s = 0; s < num_slots_; s++) {
+    const std::atomic<uint64_t> *slot = slots_[s].get() + kPad;
+    for (int r = 0; r < rows; r++) {
+      const std::atomic<uint64_t> *row = slot + r*kRowSize;
+      for (int c = 0; c < NumCounters; c++)
+        snap.counters[r*NumCounters + c] += row[c].load(std::memory_order_relaxed);
+      for (int b = 0; b < NumHistograms*kNumBuckets; b++)
+        snap.buckets[r*NumHistograms*kNumBuckets + b] += row[NumCounters + b].load(std::memory_order_relaxed);
+    }
+  }
+  for (int g = 0; g < rows*NumGauges; g++)
+    snap.gauges[g] = gauges_[g].load(std::memory_order_relaxed);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Histogram percentile
+ *
+ * \param   [in]  q  quantile in [0,1]
+ * \return  upper bound of the bucket holding the quantile, 0 if empty
+ */
+uint64_t dt5751Metrics::Percentile(const Snapshot &snap, int module, Histogram h, double q) const
+{
+  const uint64_t *b = &snap.buckets[(Row(module)*NumHistograms + h)*kNumBuckets];
+  uint64_t total = 0;
+  for (int i = 0; i < kNumBuckets; i++)
+    total += b[i];
+  if (total == 0)
+    return 0;
+
+  uint64_t target = (uint64_t)ceil(q*total);
+  if (target == 0) target = 1;
+  uint64_t sum = 0;
+  for (int i = 0; i < kNumBuckets; i++) {
+    sum += b[i];
+    if (sum >= target)
+      return BucketUpperBound(i);
+  }
+  return BucketUpperBound(kNumBuckets - 1);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Counter and histogram increments between two snapshots
+ *
+ * Used to get percentiles over the last publishing period only.  Gauges are
+ * taken from the newest snapshot.
+ */
+void dt5751Metrics::Difference(const Snapshot &now, const Snapshot &before, Snapshot &delta) const
+{
+  delta = now;
+  if (before.counters.size() == now.counters.size()) {
+    for (unsigned int i = 0; i < now.counters.size(); i++)
+      delta.counters[i] -= before.counters[i];
+  }
+  if (before.buckets.size() == now.buckets.size()) {
+    for (unsigned int i = 0; i < now.buckets.size(); i++)
+      delta.buckets[i] -= before.buckets[i];
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Write the snapshot in Prometheus text exposition format
+ *
+ * The file is written next to its final location and renamed so that a
+ * scraper never sees a partial file.
+ *
+ * \param   [in]  path  output file
+ * \return  true on success
+ */
+bool dt5751Metrics::WritePrometheus(const char *path, const Snapshot &snap) const
+{
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f)
+    return false;
+
+  int rows = num_modules_ + 1;
+  char label[32];
+
+  for (int c = 0; c < NumCounters; c++) {
+    fprintf(f, "# TYPE dt5751_%s_total counter\n", counter_names[c]);
+    for (int r = 0; r < rows; r++) {
+      int module = (r == num_modules_) ? kGlobal : first_module_ + r;
+      if (module == kGlobal) snprintf(label, sizeof(label), "fe");
+      else snprintf(label, sizeof(label), "%d", module);
+      fprintf(f, "dt5751_%s_total{module=\"%s\"} %llu\n", counter_names[c], label,
+              (unsigned long long)snap.counters[r*NumCounters + c]);
+    }
+  }
+  for (int g = 0; g < NumGauges; g++) {
+    fprintf(f, "# TYPE dt5751_%s gauge\n", gauge_names[g]);
+    for (int r = 0; r < num_modules_; r++) {
+      fprintf(f, "dt5751_%s{module=\"%d\"} %lld\n", gauge_names[g], first_module_ + r,
+              (long long)snap.gauges[r*NumGauges + g]);
+    }
+  }
+  const double quantiles[] = { 0.5, 0.9, 0.99 };
+  for (int h = 0; h < NumHistograms; h++) {
+    fprintf(f, "# TYPE dt5751_%s summary\n", histogram_names[h]);
+    for (int r = 0; r < num_modules_; r++) {
+      int module = first_module_ + r;
+      uint64_t count = 0;
+      const uint64_t *b = &snap.buckets[(r*NumHistograms + h)*kNumBuckets];
+      for (int i = 0; i < kNumBuckets; i++)
+        count += b[i];
+      if (count == 0)
+        continue;
+      for (unsigned int q = 0; q < sizeof(quantiles)/sizeof(quantiles[0]); q++)
+        fprintf(f, "dt5751_%s{module=\"%d\",quantile=\"%g\"} %llu\n", histogram_names[h], module,
+                quantiles[q], (unsigned long long)Percentile(snap, module, (Histogram)h, quantiles[q]));
+      fprintf(f, "dt5751_%s_count{module=\"%d\"} %llu\n", histogram_names[h], module,
+              (unsigned long long)count);
+    }
+  }
+
+  bool ok = (fclose(f) == 0);
+  if (ok)
+    ok = (rename(tmp.c_str(), path) == 0);
+  return ok;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
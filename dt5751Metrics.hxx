@@ -0,0 +1,164 @@
+/*****************************************************************************/
+/**
+\file dt5751Metrics.hxx
+
+## Contents
+
+This file contains the class definition for the frontend metrics registry.
+Counters and fixed-bucket histograms are kept per thread so that the
+acquisition threads never share a cache line; the main thread aggregates
+them periodically (see read_buffer_level()).
+ *****************************************************************************/
+
+#ifndef DT5751METRICS_HXX_INCLUDE
+#define DT5751METRICS_HXX_INCLUDE
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Lock-free metrics registry.
+ *
+ * Each thread that records metrics owns one slot (see SetThreadSlot()).  A slot
+ * is only ever written by its owner, so updates are a relaxed load/store pair
+ * without any locked instruction.  Collect() sums all slots and may run
+ * concurrently with the writers.
+ *
+ * Module indices are the unique module IDs; metrics that are not specific to
+ * a board (merge outcomes) are recorded with module kGlobal.
+ */
+class dt5751Metrics
+{
+
+public:
+
+  enum Counter {
+    BltCalls,               //!< CAENComm_BLTRead calls
+    BytesRead,              //!< Bytes transferred from the board
+    EventsRead,             //!< Events written to the ring buffer
+    ReadErrors,             //!< Failed readouts
+    RbStalls,               //!< Readouts skipped, ring buffer above 75% and no spill room
+    RbWpTimeouts,           //!< rb_get_wp timeouts
+    EventsBuilt,            //!< Fragments copied into a MIDAS bank
+    MergeComplete,          //!< Events with a fragment from every board
+    MergePartial,           //!< Partially merged events written
+    MergeSkipped,           //!< Partially merged events dropped
+    SpillEvents,            //!< Events written to the spill queue
+    UnspillEvents,          //!< Events moved back from the spill queue
+    LinkCommands,           //!< Register accesses handed to the link thread
+    SwTriggers,             //!< Software triggers sent
+    BoardPolls,             //!< DT5751_EVENT_STORED reads of the link scheduler
+    PollsSkipped,           //!< Polls skipped, board empty and backing off
+    MidasEvents,            //!< MIDAS events sent by the data equipment (several triggers when batching)
+    L2Accepted,             //!< Events passing the level-2 filter
+    L2Prescaled,            //!< Events failing the level-2 filter, kept by the prescaler
+    L2Rejected,             //!< Events dropped by the level-2 filter
+    NumCounters
+  };
+  enum Gauge {
+    EventsStored,           //!< DT5751_EVENT_STORED
+    Busy,                   //!< Busy deduced from EVENT_STORED/almost full
+    RbLevel,                //!< Ring buffer level in bytes
+    SpillBytes,             //!< Spill queue depth in bytes
+    NumGauges
+  };
+  enum Histogram {
+    BltBytes,               //!< Size of each BLT
+    EventBytes,             //!< Size of each event read
+    ReadoutNs,              //!< First BLT start to BLT completion
+    RbWaitNs,               //!< BLT completion to merge (ring buffer wait)
+    BankNs,                 //!< Merge to bk_close
+    TotalNs,                //!< BLT completion to bk_close
+    LinkCmdNs,              //!< Register access through the link queue, wait included
+    NumHistograms
+  };
+
+  static const int kGlobal = -1;           //!< Module index for FE-wide metrics
+  static const int kSubBuckets = 4;        //!< Histogram buckets per power of two
+  static const int kNumBuckets = 64 * kSubBuckets;
+
+  static const char *counter_names[NumCounters];
+  static const char *gauge_names[NumGauges];
+  static const char *histogram_names[NumHistograms];
+
+  /** Aggregated copy of all slots */
+  struct Snapshot {
+    std::vector<uint64_t> counters;        //!< [row][counter]
+    std::vector<int64_t>  gauges;          //!< [row][gauge]
+    std::vector<uint64_t> buckets;         //!< [row][histogram][bucket]
+  };
+
+  static dt5751Metrics& Instance();
+
+  void Init(int numSlots, int firstModuleID, int numModules);
+  static void SetThreadSlot(int slot);
+
+  /* Hot path */
+  void Add(int module, Counter c, uint64_t n = 1) {
+    std::atomic<uint64_t> &v = Slot()[Row(module)*kRowSize + c];
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+  void Observe(int module, Histogram h, uint64_t value) {
+    std::atomic<uint64_t> &v = Slot()[Row(module)*kRowSize + NumCounters + h*kNumBuckets + Bucket(value)];
+    v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+  void SetGauge(int module, Gauge g, int64_t value) {
+    gauges_[Row(module)*NumGauges + g].store(value, std::memory_order_relaxed);
+  }
+
+  /* Aggregation (main thread) */
+  void Collect(Snapshot &snap) const;
+  uint64_t GetCounter(const Snapshot &snap, int module, Counter c) const {
+    return snap.counters[Row(module)*NumCounters + c];
+  }
+  int64_t GetGauge(const Snapshot &snap, int module, Gauge g) const {
+    return snap.gauges[Row(module)*NumGauges + g];
+  }
+  int64_t GetGauge(int module, Gauge g) const {
+    return gauges_[Row(module)*NumGauges + g].load(std::memory_order_relaxed);
+  }
+  uint64_t Percentile(const Snapshot &snap, int module, Histogram h, double q) const;
+  void Difference(const Snapshot &now, const Snapshot &before, Snapshot &delta) const;
+  bool WritePrometheus(const char *path, const Snapshot &snap) const;
+
+  int GetNumModules() const { return num_modules_; }
+  int GetFirstModuleID() const { return first_module_; }
+
+  static int Bucket(uint64_t value);
+  static uint64_t BucketUpperBound(int bucket);
+
+  /** Monotonic time in ns used for the latency histograms */
+  static uint64_t NowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+  }
+
+private:
+
+  static const int kRowSize = NumCounters + NumHistograms*kNumBuckets;
+  static const int kPad = 8;               //!< 64 bytes between slots
+
+  dt5751Metrics();
+
+  int Row(int module) const {
+    return (module == kGlobal) ? num_modules_ : module - first_module_;
+  }
+  std::atomic<uint64_t> *Slot() {
+    return slots_[thread_slot_].get() + kPad;
+  }
+
+  int num_slots_;
+  int first_module_;
+  int num_modules_;
+  std::vector<std::unique_ptr<std::atomic<uint64_t>[]> > slots_;
+  std::unique_ptr<std::atomic<int64_t>[]> gauges_;
+
+  static thread_local int thread_slot_;
+};
+
+#endif // DT5751METRICS_HXX_INCLUDE
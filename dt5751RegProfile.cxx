@@ -0,0 +1,224 @@
+/*****************************************************************************/
+/**
+\file dt5751RegProfile.cxx
+
+## Contents
+
+This file contains the class implementation for the register access profiler.
+ *****************************************************************************/
+
+#include "dt5751RegProfile.hxx"
+#include "dt5751Metrics.hxx"
+#include <algorithm>
+#include <vector>
+
+//
+//--------------------------------------------------------------------------------
+dt5751RegProfile::dt5751RegProfile()
+: enabled_(false), first_module_(0), num_modules_(0), modules_per_link_(1), dropped_(0), start_ns_(0)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Profiler shared by the whole frontend
+ */
+dt5751RegProfile& dt5751RegProfile::Instance()
+{
+  static dt5751RegProfile instance;
+  return instance;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Allocate the tables; must be called before enabling
+ *
+ * \param   [in]  firstModuleID   Lowest module ID controlled by this frontend
+ * \param   [in]  numModules      Number of modules controlled by this frontend
+ * \param   [in]  modulesPerLink  Daisy-chained modules per optical link
+ */
+void dt5751RegProfile::Init(int firstModuleID, int numModules, int modulesPerLink)
+{
+  SetEnabled(false);
+  first_module_ = firstModuleID;
+  num_modules_ = numModules;
+  modules_per_link_ = (modulesPerLink > 0) ? modulesPerLink : 1;
+  entries_.reset(new Entry[num_modules_*kMaxEntries]());
+  Reset();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Clear all entries (begin of run, no access in progress)
+ */
+void dt5751RegProfile::Reset()
+{
+  for (int i = 0; entries_ && i < num_modules_*kMaxEntries; i++) {
+    Entry &e = entries_[i];
+    e.key.store(kEmpty, std::memory_order_relaxed);
+    e.count.store(0, std::memory_order_relaxed);
+    e.errors.store(0, std::memory_order_relaxed);
+    e.total_ns.store(0, std::memory_order_relaxed);
+    e.max_ns.store(0, std::memory_order_relaxed);
+    for (int b = 0; b < kNumBuckets; b++)
+      e.buckets[b].store(0, std::memory_order_relaxed);
+  }
+  dropped_ = 0;
+  start_ns_ = dt5751Metrics::NowNs();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Account one register access
+ *
+ * \param   [in]  module   module ID
+ * \param   [in]  address  register address
+ * \param   [in]  write    true for a write
+ * \param   [in]  ns       round trip of the CAENComm call
+ * \param   [in]  error    the call failed
+ */
+void dt5751RegProfile::Record(int module, uint32_t address, bool write, uint64_t ns, bool error)
+{
+  int row = module - first_module_;
+  if (!entries_ || row < 0 || row >= num_modules_)
+    return;
+
+  uint32_t key = (address & 0xFFFF) | (write ? kWriteBit : 0);
+  Entry *table = &entries_[row*kMaxEntries];
+  uint32_t h = (key*2654435761u) >> 24;   // kMaxEntries = 256
+
+  for (int i = 0; i < kMaxEntries; i++) {
+    Entry &e = table[(h + i) & (kMaxEntries - 1)];
+    uint32_t k = e.key.load(std::memory_order_acquire);
+    if (k == kEmpty) {
+      if (!e.key.compare_exchange_strong(k, key) && k != key)
+        continue;   // claimed by another address meanwhile
+    } else if (k != key) {
+      continue;
+    }
+
+    e.count.fetch_add(1, std::memory_order_relaxed);
+    if (error) e.errors.fetch_add(1, std::memory_order_relaxed);
+    e.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t m = e.max_ns.load(std::memory_order_relaxed);
+    while (ns > m && !e.max_ns.compare_exchange_weak(m, ns, std::memory_order_relaxed))
+      ;
+    int b = dt5751Metrics::Bucket(ns);
+    e.buckets[b < kNumBuckets ? b : kNumBuckets - 1].fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  dropped_.fetch_add(1, std::memory_order_relaxed);
+}
+
+//
+//--------------------------------------------------------------------------------
+uint64_t dt5751RegProfile::GetNumAccesses() const
+{
+  uint64_t n = 0;
+  for (int i = 0; entries_ && i < num_modules_*kMaxEntries; i++)
+    n += entries_[i].count.load(std::memory_order_relaxed);
+  return n;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Time since the last Reset()
+ */
+double dt5751RegProfile::GetSeconds() const
+{
+  return (dt5751Metrics::NowNs() - start_ns_)*1e-9;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Write the per-link totals and the per-address table
+ *
+ * Addresses are sorted by the total time spent accessing them.  Latencies
+ * are in us; the percentiles are bucket upper bounds (<= 25% resolution).
+ *
+ * \param   [in]  fp  output file
+ * \return  true on success
+ */
+bool dt5751RegProfile::WriteSummary(FILE *fp) const
+{
+  if (!entries_)
+    return false;
+
+  double seconds = GetSeconds();
+  std::vector<const Entry *> used;
+  std::vector<int> used_row;
+  int numLinks = (num_modules_ + modules_per_link_ - 1)/modules_per_link_;
+  std::vector<uint64_t> reads(numLinks, 0), writes(numLinks, 0), link_ns(numLinks, 0);
+
+  for (int i = 0; i < num_modules_*kMaxEntries; i++) {
+    const Entry &e = entries_[i];
+    if (e.key.load(std::memory_order_relaxed) == kEmpty) continue;
+    int row = i/kMaxEntries;
+    int link = row/modules_per_link_;
+    uint64_t count = e.count.load(std::memory_order_relaxed);
+    if (e.key.load(std::memory_order_relaxed) & kWriteBit) writes[link] += count;
+    else reads[link] += count;
+    link_ns[link] += e.total_ns.load(std::memory_order_relaxed);
+    used.push_back(&e);
+    used_row.push_back(row);
+  }
+
+  fprintf(fp, "# DT5751 register access profile over %.1f s\n", seconds);
+  for (int l = 0; l < numLinks; l++) {
+    fprintf(fp, "# link %d: %.0f reads/s, %.0f writes/s, %.3f%% of the time in register accesses\n", l,
+            reads[l]/seconds, writes[l]/seconds, 100.*link_ns[l]*1e-9/seconds);
+  }
+  uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+  if (dropped)
+    fprintf(fp, "# %llu accesses not profiled (table full)\n", (unsigned long long)dropped);
+
+  // Most expensive first
+  std::vector<int> order(used.size());
+  for (unsigned int i = 0; i < order.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&used](int a, int b) {
+    return used[a]->total_ns.load(std::memory_order_relaxed) > used[b]->total_ns.load(std::memory_order_relaxed);
+  });
+
+  fprintf(fp, "module,op,address,count,per_s,errors,mean_us,p50_us,p99_us,max_us,total_ms\n");
+  for (unsigned int i = 0; i < order.size(); i++) {
+    const Entry &e = *used[order[i]];
+    uint32_t key = e.key.load(std::memory_order_relaxed);
+    uint64_t count = e.count.load(std::memory_order_relaxed);
+    uint64_t total_ns = e.total_ns.load(std::memory_order_relaxed);
+
+    uint64_t max_ns = e.max_ns.load(std::memory_order_relaxed);
+    double pct[2] = {0.5, 0.99};
+    double pct_us[2] = {0, 0};
+    for (int p = 0; p < 2; p++) {
+      uint64_t target = (uint64_t)(pct[p]*count + 0.5), seen = 0;
+      for (int b = 0; b < kNumBuckets; b++) {
+        seen += e.buckets[b].load(std::memory_order_relaxed);
+        if (seen >= target && seen > 0) {
+          pct_us[p] = std::min(dt5751Metrics::BucketUpperBound(b), max_ns)*1e-3;
+          break;
+        }
+      }
+    }
+
+    fprintf(fp, "%d,%s,0x%04X,%llu,%.1f,%llu,%.2f,%.2f,%.2f,%.2f,%.3f\n", first_module_ + used_row[order[i]],
+            (key & kWriteBit) ? "W" : "R", key & 0xFFFF, (unsigned long long)count, count/seconds,
+            (unsigned long long)e.errors.load(std::memory_order_relaxed), count ? total_ns*1e-3/count : 0.,
+            pct_us[0], pct_us[1], max_ns*1e-3, total_ns*1e-6);
+  }
+  return true;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,76 @@
+/*****************************************************************************/
+/**
+\file dt5751RegProfile.hxx
+
+## Contents
+
+This file contains the class definition for the register access profiler:
+call counts, errors and round-trip latency histograms per module, register
+address and direction, recorded in dt5751CONET2::ReadReg_() and WriteReg_()
+when enabled.  A summary is written at the end of each run to find the
+access patterns that take link time away from the BLTs.
+ *****************************************************************************/
+
+#ifndef DT5751REGPROFILE_HXX_INCLUDE
+#define DT5751REGPROFILE_HXX_INCLUDE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <memory>
+
+/**
+ * Register access profiler.
+ *
+ * Each module has an open-addressing table keyed by address and direction;
+ * entries are claimed with a compare-and-swap and updated with relaxed
+ * atomic adds since the link thread and the main thread both access
+ * registers.  When disabled, Record() is never reached (see IsEnabled()).
+ */
+class dt5751RegProfile
+{
+
+public:
+
+  static const int kMaxEntries = 256;      //!< Distinct address/direction pairs per module
+  static const int kNumBuckets = 128;      //!< dt5751Metrics::Bucket() buckets, up to ~1 s
+
+  static dt5751RegProfile& Instance();
+
+  void Init(int firstModuleID, int numModules, int modulesPerLink);
+  void SetEnabled(bool enable) { enabled_.store(enable, std::memory_order_relaxed); }
+  bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+  void Reset();
+
+  void Record(int module, uint32_t address, bool write, uint64_t ns, bool error);
+
+  uint64_t GetNumAccesses() const;
+  double GetSeconds() const;
+  bool WriteSummary(FILE *fp) const;
+
+private:
+
+  struct Entry {
+    std::atomic<uint32_t> key;             //!< address | kWriteBit, kEmpty if unused
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<uint64_t> buckets[kNumBuckets];
+  };
+
+  static const uint32_t kEmpty = 0xFFFFFFFF;
+  static const uint32_t kWriteBit = 0x80000000;
+
+  dt5751RegProfile();
+
+  std::atomic<bool> enabled_;
+  int first_module_;
+  int num_modules_;
+  int modules_per_link_;
+  std::unique_ptr<Entry[]> entries_;       //!< [module][entry]
+  std::atomic<uint64_t> dropped_;          //!< Accesses that found the table full
+  uint64_t start_ns_;                      //!< Last Reset()
+};
+
+#endif // DT5751REGPROFILE_HXX_INCLUDE
@@ -0,0 +1,433 @@
+/*****************************************************************************/
+/**
+\file dt5751Replay.cxx
+
+## Contents
+
+This file contains the class implementation for the replay driver.
+
+The MIDAS file is parsed directly (event header, bank header, 16-bit, 32-bit
+and 64-bit aligned banks) through zlib, so no ODB or midasio is needed and
+the driver can also be used by dt5751bench.  Special events (ODB dumps at
+begin and end of run, messages) are skipped.
+
+At the recorded rate the events are paced on the trigger time tag of their
+first fragment (8 ns ticks); gaps longer than half the 31-bit TTT period
+(~8.6 s) are not reproduced.
+ *****************************************************************************/
+
+#include "dt5751Replay.hxx"
+#include "dt5751Decoder.hxx"
+#include "dt5751Metrics.hxx"
+#include "dt5751Trace.hxx"
+#include <string.h>
+#include <unistd.h>
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Constructor
+ *
+ * \param   [in]  modules  boards controlled by this frontend; the ones present
+ *                         in the file must be set offline before Start()
+ */
+dt5751Replay::dt5751Replay(std::vector<dt5751CONET2> &modules)
+: modules_(modules), file_(NULL), have_zmq_(false), speed_(0), thread_started_(false), stop_(false),
+  finished_(false), num_events_(0), num_fragments_(0), have_ttt_(false), last_ttt_(0), replay_ns_(0),
+  start_ns_(0)
+{
+  pthread_mutex_init(&zmq_mutex_, NULL);
+}
+
+//
+//--------------------------------------------------------------------------------
+dt5751Replay::~dt5751Replay()
+{
+  Close();
+  pthread_mutex_destroy(&zmq_mutex_);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Open a MIDAS file and find which modules it has data for
+ *
+ * The first events are scanned for W2xx/ZLxx banks of the modules and for
+ * ZMQ0 banks, then the file is rewound.
+ *
+ * \param   [in]  filename  .mid or .mid.gz file
+ * \return  true if the file has data for at least one module
+ */
+bool dt5751Replay::Open(const std::string &filename)
+{
+  Close();
+
+  file_ = gzopen(filename.c_str(), "rb");
+  if (file_ == NULL) {
+    cm_msg(MERROR, "Replay", "Cannot open replay file %s", filename.c_str());
+    return false;
+  }
+  gzbuffer(file_, 1024*1024);
+  filename_ = filename;
+
+  module_types_.assign(modules_.size(), -1);
+  have_zmq_ = false;
+
+  const int scan_events = 1000;
+  for (int n = 0; n < scan_events && ReadEvent_(); n++) {
+    for (unsigned int i = 0; i < modules_.size(); i++) {
+      char name[5];
+      DWORD size;
+      const DWORD *bank;
+      snprintf(name, sizeof(name), "W2%02d", modules_[i].GetModuleID());
+      if ((bank = FindBank_(name, &size)) != NULL)
+        module_types_[i] = (size >= 8 && (bank[1] & dt5751Decoder::kPack25Flag)) ?
+          dt5751CONET2::RawPack25 : dt5751CONET2::RawPack2;
+      snprintf(name, sizeof(name), "ZL%02d", modules_[i].GetModuleID());
+      if ((bank = FindBank_(name, &size)) != NULL)
+        module_types_[i] = (size >= 8 && (bank[1] & dt5751Decoder::kPack25Flag)) ?
+          dt5751CONET2::ZLEPack25 : dt5751CONET2::ZLEPack2;
+    }
+    DWORD size;
+    if (FindBank_("ZMQ0", &size))
+      have_zmq_ = true;
+  }
+
+  int nModules = 0;
+  for (unsigned int i = 0; i < module_types_.size(); i++) {
+    if (module_types_[i] >= 0) nModules++;
+  }
+  if (nModules == 0) {
+    cm_msg(MERROR, "Replay", "No DT5751 banks for the modules of this frontend in %s", filename.c_str());
+    Close();
+    return false;
+  }
+
+  cm_msg(MINFO, "Replay", "Replaying %s: %d module(s)%s", filename.c_str(), nModules,
+         have_zmq_ ? ", with chronobox banks" : "");
+  return Rewind();
+}
+
+//
+//--------------------------------------------------------------------------------
+void dt5751Replay::Close()
+{
+  Stop();
+  if (file_ != NULL) {
+    gzclose(file_);
+    file_ = NULL;
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Go back to the first event (begin of run); the replay thread must be stopped
+ */
+bool dt5751Replay::Rewind()
+{
+  if (file_ == NULL || thread_started_)
+    return false;
+
+  if (gzrewind(file_) != 0) {
+    cm_msg(MERROR, "Replay", "Cannot rewind %s", filename_.c_str());
+    return false;
+  }
+  finished_ = false;
+  num_events_ = 0;
+  num_fragments_ = 0;
+
+  pthread_mutex_lock(&zmq_mutex_);
+  zmq_queue_.clear();
+  pthread_mutex_unlock(&zmq_mutex_);
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+bool dt5751Replay::HasModule(int moduleID) const
+{
+  return GetDataType(moduleID) != dt5751CONET2::UnrecognizedDataFormat;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Data type of a module in the file (from the bank name)
+ *
+ * \return  RawPack2, ZLEPack2 (or their pack 2.5 variants, from the header
+ *          flags) or UnrecognizedDataFormat if absent
+ */
+dt5751CONET2::DataType dt5751Replay::GetDataType(int moduleID) const
+{
+  for (unsigned int i = 0; i < modules_.size() && i < module_types_.size(); i++) {
+    if (modules_[i].GetModuleID() == moduleID && module_types_[i] >= 0)
+      return (dt5751CONET2::DataType)module_types_[i];
+  }
+  return dt5751CONET2::UnrecognizedDataFormat;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Start (or resume) pushing fragments from the replay thread
+ *
+ * The ring buffers of the offline modules must exist.
+ */
+bool dt5751Replay::Start()
+{
+  if (file_ == NULL)
+    return false;
+  if (thread_started_)
+    return true;
+
+  stop_ = false;
+  have_ttt_ = false;   // pacing restarts from now
+  int status = pthread_create(&tid_, NULL, &dt5751Replay::ThreadFunc_, (void*)this);
+  if (status) {
+    cm_msg(MERROR, "Replay", "Couldn't create replay thread. Return code: %d", status);
+    return false;
+  }
+  thread_started_ = true;
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Stop the replay thread; the file position is kept for Start()
+ */
+void dt5751Replay::Stop()
+{
+  if (!thread_started_)
+    return;
+
+  stop_ = true;
+  pthread_join(tid_, NULL);
+  thread_started_ = false;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Take the next ZMQ0 bank, in file order
+ *
+ * \param   [out] data      bank data
+ * \param   [in]  maxBytes  size of data
+ * \return  bank size in bytes, 0 if none is queued
+ */
+int dt5751Replay::PopZmqBank(DWORD *data, int maxBytes)
+{
+  int bytes = 0;
+  pthread_mutex_lock(&zmq_mutex_);
+  if (!zmq_queue_.empty()) {
+    std::vector<DWORD> &bank = zmq_queue_.front();
+    bytes = bank.size()*sizeof(DWORD);
+    if (bytes > maxBytes) bytes = maxBytes & ~3;
+    memcpy(data, &bank[0], bytes);
+    zmq_queue_.pop_front();
+  }
+  pthread_mutex_unlock(&zmq_mutex_);
+  return bytes;
+}
+
+//
+//--------------------------------------------------------------------------------
+void *dt5751Replay::ThreadFunc_(void *arg)
+{
+  // Takes the place of the first link thread
+  dt5751Metrics::SetThreadSlot(1);
+  dt5751Trace::SetThreadSlot(1);
+
+  ((dt5751Replay *)arg)->Run_();
+  return NULL;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Replay loop: one MIDAS event at a time, until the end of the file or Stop()
+ *
+ * The ZMQ0 bank is queued before the fragments so that it is available when
+ * the event builder gets them.  A full ring buffer blocks the loop as a full
+ * board buffer would.
+ */
+void dt5751Replay::Run_()
+{
+  while (!stop_) {
+    if (!ReadEvent_()) {
+      finished_ = true;
+      cm_msg(MINFO, "Replay", "Replay of %s finished: %llu events, %llu fragments", filename_.c_str(),
+             (unsigned long long)num_events_, (unsigned long long)num_fragments_);
+      return;
+    }
+
+    DWORD size;
+    const DWORD *zmq = FindBank_("ZMQ0", &size);
+    if (zmq != NULL) {
+      pthread_mutex_lock(&zmq_mutex_);
+      zmq_queue_.push_back(std::vector<DWORD>(zmq, zmq + size/sizeof(DWORD)));
+      pthread_mutex_unlock(&zmq_mutex_);
+    }
+
+    bool paced = false;
+    for (unsigned int i = 0; i < modules_.size(); i++) {
+      if (module_types_[i] < 0 || !modules_[i].IsConnected()) continue;
+
+      char name[5];
+      bool zle = (module_types_[i] == dt5751CONET2::ZLEPack2 || module_types_[i] == dt5751CONET2::ZLEPack25);
+      snprintf(name, sizeof(name), "%s%02d", zle ? "ZL" : "W2",
+               modules_[i].GetModuleID());
+      const DWORD *fragment = FindBank_(name, &size);
+      if (fragment == NULL) continue;
+
+      DWORD size_words = fragment[0] & 0x0FFFFFFF;
+      if ((fragment[0] & 0xF0000000) != 0xA0000000 || size_words < 4 || size_words*sizeof(DWORD) > size) {
+        cm_msg(MERROR, "Replay", "Bad %s bank in event %llu (header 0x%x, bank size %u)", name,
+               (unsigned long long)num_events_, fragment[0], size);
+        continue;
+      }
+
+      if (!paced) {
+        Pace_(fragment[3]);
+        paced = true;
+      }
+
+      while (!modules_[i].PushFragment(fragment, size_words)) {
+        if (stop_) return;
+      }
+      num_fragments_++;
+    }
+    num_events_++;
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Read the next event with banks into event_
+ *
+ * \return  false at the end of the file or on a read error
+ */
+bool dt5751Replay::ReadEvent_()
+{
+  while (1) {
+    EVENT_HEADER header;
+    int n = gzread(file_, &header, sizeof(header));
+    if (n == 0)
+      return false;
+    if (n != (int)sizeof(header)) {
+      cm_msg(MERROR, "Replay", "Truncated event header in %s", filename_.c_str());
+      return false;
+    }
+
+    event_.resize(header.data_size);
+    if (header.data_size > 0 &&
+        gzread(file_, &event_[0], header.data_size) != (int)header.data_size) {
+      cm_msg(MERROR, "Replay", "Truncated event in %s", filename_.c_str());
+      return false;
+    }
+
+    if (header.event_id == EVENTID_BOR || header.event_id == EVENTID_EOR ||
+        header.event_id == EVENTID_MESSAGE)
+      continue;   // ODB dumps and messages
+    if (header.data_size < sizeof(BANK_HEADER))
+      continue;
+    return true;
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Find a bank in the current event
+ *
+ * \param   [in]  name        bank name
+ * \param   [out] size_bytes  bank data size
+ * \return  bank data, NULL if not found
+ */
+const DWORD *dt5751Replay::FindBank_(const char *name, DWORD *size_bytes) const
+{
+  if (event_.size() < sizeof(BANK_HEADER))
+    return NULL;
+
+  const BANK_HEADER *pbh = (const BANK_HEADER *)&event_[0];
+  bool is32 = (pbh->flags & BANK_FORMAT_32BIT) != 0;
+  bool is32a = (pbh->flags & BANK_FORMAT_64BIT_ALIGNED) != 0;
+
+  const char *p = (const char *)(pbh + 1);
+  const char *end = &event_[0] + event_.size();
+  if (p + pbh->data_size < end)
+    end = p + pbh->data_size;
+
+  while (p < end) {
+    DWORD data_size;
+    size_t header_size;
+    if (is32a) {
+      data_size = ((const BANK32A *)p)->data_size;
+      header_size = sizeof(BANK32A);
+    } else if (is32) {
+      data_size = ((const BANK32 *)p)->data_size;
+      header_size = sizeof(BANK32);
+    } else {
+      data_size = ((const BANK *)p)->data_size;
+      header_size = sizeof(BANK);
+    }
+
+    const char *data = p + header_size;
+    if (data + data_size > end)
+      break;
+    if (strncmp(p, name, 4) == 0) {
+      *size_bytes = data_size;
+      return (const DWORD *)data;
+    }
+    p = data + ALIGN8(data_size);
+  }
+  return NULL;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Wait until an event is due at the requested replay speed
+ *
+ * \param   [in]  ttt  trigger time tag of the event (31 bits, 8 ns ticks)
+ */
+void dt5751Replay::Pace_(uint32_t ttt)
+{
+  if (speed_ <= 0)
+    return;
+
+  uint64_t now = dt5751Metrics::NowNs();
+  if (!have_ttt_) {
+    have_ttt_ = true;
+    last_ttt_ = ttt;
+    replay_ns_ = 0;
+    start_ns_ = now;
+    return;
+  }
+
+  // Signed difference of the 31-bit counters; fragments of unmerged files
+  // may be slightly out of order
+  int32_t delta = (int32_t)((ttt - last_ttt_) << 1) >> 1;
+  if (delta > 0) {
+    replay_ns_ += (uint64_t)delta*8;
+    last_ttt_ = ttt;
+  }
+
+  uint64_t due = start_ns_ + (uint64_t)(replay_ns_/speed_);
+  while (now < due && !stop_) {
+    uint64_t wait_us = (due - now)/1000;
+    usleep(wait_us > 10000 ? 10000 : wait_us);
+    now = dt5751Metrics::NowNs();
+  }
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
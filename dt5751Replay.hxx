@@ -0,0 +1,85 @@
+/*****************************************************************************/
+/**
+\file dt5751Replay.hxx
+
+## Contents
+
+This file contains the class definition for the replay driver: it reads the
+W2xx/ZLxx/ZMQ0 banks of a recorded MIDAS file (.mid or .mid.gz) and pushes
+the DT5751 fragments into the ring buffers of offline modules
+(dt5751CONET2::SetOffline()), in place of the link threads.  The event
+builder and everything downstream run unchanged on the recorded data.
+ *****************************************************************************/
+
+#ifndef DT5751REPLAY_HXX_INCLUDE
+#define DT5751REPLAY_HXX_INCLUDE
+
+#include <stdint.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "dt5751CONET2.hxx"
+
+class dt5751Replay
+{
+
+public:
+
+  dt5751Replay(std::vector<dt5751CONET2> &modules);
+  ~dt5751Replay();
+
+  bool Open(const std::string &filename);
+  void Close();
+  bool IsOpen() const { return file_ != NULL; }
+  bool Rewind();
+
+  bool HasModule(int moduleID) const;
+  dt5751CONET2::DataType GetDataType(int moduleID) const;
+  bool HasZmq() const { return have_zmq_; }
+
+  void SetSpeed(double speed) { speed_ = speed; }   //!< 0: as fast as possible, 1: recorded rate
+  bool Start();
+  void Stop();
+  bool IsFinished() const { return finished_; }      //!< End of file reached, all fragments pushed
+
+  int PopZmqBank(DWORD *data, int maxBytes);
+  uint64_t GetNumEvents() const { return num_events_; }
+  uint64_t GetNumFragments() const { return num_fragments_; }
+
+private:
+
+  static void *ThreadFunc_(void *);
+  void Run_();
+  bool ReadEvent_();
+  const DWORD *FindBank_(const char *name, DWORD *size_bytes) const;
+  void Pace_(uint32_t ttt);
+
+  std::vector<dt5751CONET2> &modules_;
+  std::string filename_;
+  gzFile file_;                      //!< Reads plain and gzip-compressed files
+  std::vector<char> event_;          //!< Banks of the current MIDAS event
+  std::vector<int> module_types_;    //!< DataType per module index, -1 if absent from the file
+  bool have_zmq_;                    //!< File has ZMQ0 (chronobox) banks
+  double speed_;
+
+  pthread_t tid_;
+  bool thread_started_;
+  std::atomic<bool> stop_;           //!< Request to the replay thread to return
+  std::atomic<bool> finished_;
+  std::atomic<uint64_t> num_events_;
+  std::atomic<uint64_t> num_fragments_;
+
+  pthread_mutex_t zmq_mutex_;
+  std::deque<std::vector<DWORD> > zmq_queue_;   //!< ZMQ0 banks, one per replayed event
+
+  bool have_ttt_;                    //!< Pacing: first trigger time tag seen
+  uint32_t last_ttt_;
+  uint64_t replay_ns_;               //!< Recorded time elapsed since the first event
+  uint64_t start_ns_;                //!< Wall clock at the first event
+};
+
+#endif // DT5751REPLAY_HXX_INCLUDE
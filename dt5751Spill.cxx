@@ -0,0 +1,312 @@
+/*****************************************************************************/
+/**
+\file dt5751Spill.cxx
+
+## Contents
+
+This file contains the class implementation for the spill queue.
+ *****************************************************************************/
+
+#include "dt5751Spill.hxx"
+#include "dt5751CONET2.hxx"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+//
+//--------------------------------------------------------------------------------
+dt5751Spill::dt5751Spill()
+: fd_(-1), direct_(false), failed_(false), capacity_(0), wpos_(0), rpos_(0), wbuf_(NULL), wblock_(0),
+  rbuf_(NULL), rblock_(UINT64_MAX), have_front_(false), num_events_(0), depth_(0)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+dt5751Spill::~dt5751Spill()
+{
+  Close();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Open and preallocate the spill file
+ *
+ * O_DIRECT is used if the file system accepts it, so that spilled data does
+ * not go through (and evict) the page cache.
+ *
+ * \param   [in]  path           spill file, created if needed
+ * \param   [in]  capacityBytes  file size, rounded down to kBlockBytes
+ * \return  true on success
+ */
+bool dt5751Spill::Open(const std::string &path, uint64_t capacityBytes)
+{
+  Close();
+
+  capacity_ = capacityBytes - capacityBytes % kBlockBytes;
+  if (capacity_ < 4*kBlockBytes) {
+    cm_msg(MERROR, "dt5751Spill", "Spill size of %s too small (%llu bytes)", path.c_str(),
+           (unsigned long long)capacityBytes);
+    return false;
+  }
+
+  direct_ = true;
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644);
+  if (fd_ < 0 && errno == EINVAL) {
+    direct_ = false;
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  }
+  if (fd_ < 0) {
+    cm_msg(MERROR, "dt5751Spill", "Cannot open %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  int err = posix_fallocate(fd_, 0, capacity_);
+  if (err) {
+    cm_msg(MERROR, "dt5751Spill", "Cannot allocate %llu bytes for %s: %s", (unsigned long long)capacity_,
+           path.c_str(), strerror(err));
+    Close();
+    return false;
+  }
+
+  void *w = NULL, *r = NULL;
+  if (posix_memalign(&w, 4096, kBlockBytes) || posix_memalign(&r, 4096, kBlockBytes)) {
+    free(w);
+    cm_msg(MERROR, "dt5751Spill", "Cannot allocate the spill buffers for %s", path.c_str());
+    Close();
+    return false;
+  }
+  wbuf_ = (char *)w;
+  rbuf_ = (char *)r;
+  path_ = path;
+  Clear();
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+void dt5751Spill::Close()
+{
+  if (fd_ >= 0)
+    close(fd_);
+  fd_ = -1;
+  free(wbuf_);
+  free(rbuf_);
+  wbuf_ = rbuf_ = NULL;
+  Clear();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Drop every record and forget an I/O error (end of run, or the
+ *          link thread giving up on the queue)
+ *
+ * The error was reported once when it happened; the next run tries the file
+ * again.
+ */
+void dt5751Spill::Clear()
+{
+  failed_ = false;
+  wpos_ = rpos_ = wblock_ = 0;
+  rblock_ = UINT64_MAX;
+  have_front_ = false;
+  num_events_ = 0;
+  depth_ = 0;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Check whether a record of the given size can be pushed
+ *
+ * One block is kept free so that the block being filled never overwrites
+ * the one holding the next record to pop.
+ *
+ * \param   [in]  bytes  fragment size
+ */
+bool dt5751Spill::HasRoom(uint64_t bytes) const
+{
+  if (fd_ < 0 || failed_)
+    return false;
+  uint64_t rblock = rpos_ - rpos_ % kBlockBytes;
+  return wpos_ + sizeof(DWORD) + bytes + kBlockBytes <= rblock + capacity_;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Append a fragment
+ *
+ * \param   [in]  data        DT5751 event, starting with the header
+ * \param   [in]  size_words  size of the event in DWORDs
+ * \return  false if there is no room or on I/O error
+ */
+bool dt5751Spill::Push(const DWORD *data, DWORD size_words)
+{
+  if (!HasRoom(size_words*sizeof(DWORD)))
+    return false;
+
+  if (!Write_(&size_words, sizeof(DWORD)) || !Write_(data, size_words*sizeof(DWORD)))
+    return false;
+
+  num_events_++;
+  depth_.store(wpos_ - rpos_, std::memory_order_relaxed);
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Oldest fragment, valid until Pop()
+ *
+ * \param   [out] size_words  size of the fragment in DWORDs
+ * \return  fragment, NULL if the queue is empty or unreadable
+ */
+const DWORD *dt5751Spill::Front(DWORD *size_words)
+{
+  if (IsEmpty() || failed_)
+    return NULL;
+
+  if (!have_front_) {
+    DWORD n;
+    if (!Read_(rpos_, &n, sizeof(DWORD)))
+      return NULL;
+    // A size read back from disk: check it before allocating
+    if (n == 0 || n > DT5751_MAX_EVENT_SIZE/sizeof(DWORD) ||
+        sizeof(DWORD)*((uint64_t)n + 1) > wpos_ - rpos_) {
+      cm_msg(MERROR, "dt5751Spill", "Corrupted record of %u words in %s", n, path_.c_str());
+      failed_ = true;
+      return NULL;
+    }
+    front_.resize(n);
+    if (!Read_(rpos_ + sizeof(DWORD), front_.data(), n*sizeof(DWORD)))
+      return NULL;
+    have_front_ = true;
+  }
+  *size_words = front_.size();
+  return front_.data();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Remove the fragment returned by Front()
+ */
+void dt5751Spill::Pop()
+{
+  if (!have_front_)
+    return;
+  rpos_ += sizeof(DWORD)*(front_.size() + 1);
+  have_front_ = false;
+  num_events_--;
+  depth_.store(wpos_ - rpos_, std::memory_order_relaxed);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Copy bytes at the write position, writing out each completed block
+ */
+bool dt5751Spill::Write_(const void *src, uint64_t n)
+{
+  const char *p = (const char *)src;
+  while (n > 0) {
+    uint64_t off = wpos_ - wblock_;
+    uint64_t chunk = std::min(n, kBlockBytes - off);
+    memcpy(wbuf_ + off, p, chunk);
+    wpos_ += chunk;
+    p += chunk;
+    n -= chunk;
+
+    if (wpos_ - wblock_ == kBlockBytes) {
+      if (!FileIO_(true, wbuf_, wblock_))
+        return false;
+      wblock_ += kBlockBytes;
+    }
+  }
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Copy bytes from a logical position, from the file or the block being filled
+ */
+bool dt5751Spill::Read_(uint64_t pos, void *dst, uint64_t n)
+{
+  char *p = (char *)dst;
+  while (n > 0) {
+    uint64_t block = pos - pos % kBlockBytes;
+    uint64_t off = pos - block;
+    uint64_t chunk = std::min(n, kBlockBytes - off);
+    const char *src;
+
+    if (block == wblock_) {
+      src = wbuf_ + off;
+    } else {
+      if (block != rblock_) {
+        if (!FileIO_(false, rbuf_, block))
+          return false;
+        rblock_ = block;
+      }
+      src = rbuf_ + off;
+    }
+    memcpy(p, src, chunk);
+    pos += chunk;
+    p += chunk;
+    n -= chunk;
+  }
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Write or read one whole block
+ *
+ * Falls back to buffered I/O if the file system rejects O_DIRECT transfers.
+ *
+ * \param   [in]  write  true to write buf, false to read into buf
+ * \param   [in]  buf    block buffer, 4096-byte aligned
+ * \param   [in]  block  logical position of the block
+ * \return  false on I/O error; the queue is then unusable
+ */
+bool dt5751Spill::FileIO_(bool write, char *buf, uint64_t block)
+{
+  off_t offset = block % capacity_;
+  uint64_t done = 0;
+
+  while (done < kBlockBytes) {
+    ssize_t n = write ? pwrite(fd_, buf + done, kBlockBytes - done, offset + done)
+                      : pread(fd_, buf + done, kBlockBytes - done, offset + done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EINVAL && direct_) {
+      direct_ = false;
+      fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+      continue;
+    }
+    if (n <= 0) {
+      cm_msg(MERROR, "dt5751Spill", "%s of %s failed: %s", write ? "Write" : "Read", path_.c_str(),
+             n < 0 ? strerror(errno) : "end of file");
+      failed_ = true;
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
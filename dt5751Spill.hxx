@@ -0,0 +1,89 @@
+/*****************************************************************************/
+/**
+\file dt5751Spill.hxx
+
+## Contents
+
+This file contains the class definition for the spill queue: a disk-backed
+FIFO of DT5751 fragments used by a link thread when the ring buffer of its
+board is above the high-water mark, so that a short stall downstream is
+absorbed on local disk instead of turning into deadtime at the board.
+ *****************************************************************************/
+
+#ifndef DT5751SPILL_HXX_INCLUDE
+#define DT5751SPILL_HXX_INCLUDE
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "midas.h"
+
+/**
+ * Disk-backed fragment FIFO.
+ *
+ * The file is preallocated and used as a circular log of records (size in
+ * DWORDs followed by the fragment).  Records are packed into kBlockBytes
+ * blocks that are written and read whole, with O_DIRECT when the file
+ * system supports it; the block being filled is read back from memory.
+ *
+ * Push(), Front() and Pop() are called by the link thread only.  The main
+ * thread may read the depth at any time and Clear() the queue while the
+ * link thread is parked; the link thread clears it itself when it gives up
+ * on a failed queue.
+ */
+class dt5751Spill
+{
+
+public:
+
+  static const uint64_t kBlockBytes = 1 << 20;   //!< Unit of the file writes and reads
+
+  dt5751Spill();
+  ~dt5751Spill();
+
+  bool Open(const std::string &path, uint64_t capacityBytes);
+  void Close();
+  bool IsOpen() const { return fd_ >= 0; }
+  bool IsFailed() const { return failed_; }        //!< I/O error or corrupted record, until Clear()
+  bool IsDirect() const { return direct_; }        //!< File opened with O_DIRECT
+
+  bool HasRoom(uint64_t bytes) const;
+  bool Push(const DWORD *data, DWORD size_words);
+  const DWORD *Front(DWORD *size_words);
+  void Pop();
+  void Clear();
+
+  bool IsEmpty() const { return num_events_.load(std::memory_order_relaxed) == 0; }
+  int GetNumEvents() const { return num_events_.load(std::memory_order_relaxed); }
+  uint64_t GetDepthBytes() const { return depth_.load(std::memory_order_relaxed); }
+
+private:
+
+  bool Write_(const void *src, uint64_t n);
+  bool Read_(uint64_t pos, void *dst, uint64_t n);
+  bool FileIO_(bool write, char *buf, uint64_t block);
+
+  int fd_;
+  bool direct_;
+  bool failed_;                      //!< I/O error, the queue is unusable until Clear()
+  std::string path_;
+  uint64_t capacity_;                //!< File size, multiple of kBlockBytes
+
+  /* Logical positions in bytes since the last Clear(); file offset is pos % capacity_ */
+  uint64_t wpos_;                    //!< End of the last record pushed
+  uint64_t rpos_;                    //!< Start of the next record to pop
+  char *wbuf_;                       //!< Block being filled
+  uint64_t wblock_;                  //!< Logical start of wbuf_
+  char *rbuf_;                       //!< Last block read from the file
+  uint64_t rblock_;                  //!< Logical start of rbuf_, UINT64_MAX if none
+
+  std::vector<DWORD> front_;         //!< Copy of the next record
+  bool have_front_;
+
+  std::atomic<int> num_events_;
+  std::atomic<uint64_t> depth_;      //!< wpos_ - rpos_
+};
+
+#endif // DT5751SPILL_HXX_INCLUDE
@@ -0,0 +1,168 @@
+/*****************************************************************************/
+/**
+\file dt5751Timing.cxx
+
+## Contents
+
+This file contains the class implementation for the online timing monitor.
+ *****************************************************************************/
+
+#include "dt5751Timing.hxx"
+#include <algorithm>
+
+const uint32_t dt5751Timing::kChronobox;
+
+//
+//--------------------------------------------------------------------------------
+dt5751Timing::dt5751Timing()
+: first_module_(0), num_modules_(0), num_pairs_(0), num_hists_(0), bin_ticks_(1)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Allocate the histograms (frontend init)
+ *
+ * \param   [in]  firstModuleID  module ID of the first board of the frontend
+ * \param   [in]  numModules     boards of the frontend
+ */
+void dt5751Timing::Init(int firstModuleID, int numModules)
+{
+  first_module_ = firstModuleID;
+  num_modules_ = numModules;
+  num_pairs_ = numModules*(numModules - 1)/2;
+  num_hists_ = num_pairs_ + numModules;
+  words_.reset(new std::atomic<uint64_t>[(size_t)num_hists_*kStride]);
+  prev_.assign((size_t)num_hists_*kStride, 0);
+  Configure(bin_ticks_);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the bin width and clear the histograms (begin of run)
+ */
+void dt5751Timing::Configure(uint32_t binTicks)
+{
+  bin_ticks_ = std::max(std::min(binTicks, (uint32_t)0x7FFFFFFF), (uint32_t)1);
+  for (size_t i = 0; i < prev_.size(); i++) {
+    words_[i].store(0, std::memory_order_relaxed);
+    prev_[i] = 0;
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   One entry in a histogram
+ */
+void dt5751Timing::Add_(int hist, int32_t diff)
+{
+  std::atomic<uint64_t> *h = &words_[(size_t)hist*kStride];
+
+  // Bin 0 is the underflow, kNumBins + 1 the overflow
+  int64_t bin = (diff >= 0 ? diff/bin_ticks_ : -((-(int64_t)diff - 1)/bin_ticks_) - 1) + kNumBins/2 + 1;
+  bin = std::max(std::min(bin, (int64_t)kNumBins + 1), (int64_t)0);
+
+  h[0].store(h[0].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  h[1].store(h[1].load(std::memory_order_relaxed) + (uint64_t)(int64_t)diff, std::memory_order_relaxed);
+  h[2 + bin].store(h[2 + bin].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Add the time tag differences of a merged event
+ *
+ * \param   [in]  modules       indices of the boards of the event in the frontend,
+ *                              in increasing order (dt5751EventBuilder::GetSelected())
+ * \param   [in]  ttt           their trigger time tags, same order
+ * \param   [in]  chronoboxTtt  time tag of the chronobox bank, NULL if none
+ */
+void dt5751Timing::Fill(const std::vector<int> &modules, const uint32_t *ttt, const uint32_t *chronoboxTtt)
+{
+  int n = (int)modules.size();
+  for (int i = 0; i < n; i++) {
+    if (modules[i] < 0 || modules[i] >= num_modules_)
+      continue;
+    for (int j = i + 1; j < n; j++) {
+      if (modules[j] > modules[i] && modules[j] < num_modules_)
+        Add_(PairIndex_(modules[i], modules[j]), Difference_(ttt[i], ttt[j]));
+    }
+    if (chronoboxTtt)
+      Add_(num_pairs_ + modules[i], Difference_(*chronoboxTtt, ttt[i]));
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Write one histogram of the TDIF bank, counts since the previous bank
+ */
+DWORD *dt5751Timing::PutHistogram_(DWORD *pdata, int hist, uint32_t moduleA, uint32_t moduleB)
+{
+  *pdata++ = moduleA;
+  *pdata++ = moduleB;
+
+  size_t base = (size_t)hist*kStride;
+  for (int w = 0; w < kStride; w++) {
+    uint64_t now = words_[base + w].load(std::memory_order_relaxed);
+    uint64_t delta = now - prev_[base + w];
+    prev_[base + w] = now;
+    *pdata++ = (DWORD)delta;
+    if (w == 1)
+      *pdata++ = (DWORD)(delta >> 32);    // Sum, high word
+  }
+  return pdata;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Append the TDIF bank (counts since the previous call)
+ */
+void dt5751Timing::FillBank(char *pevent)
+{
+  if (num_hists_ == 0)
+    return;
+
+  DWORD *pdata;
+  bk_create(pevent, "TDIF", TID_DWORD, (void **)&pdata);
+  *pdata++ = kNumBins;
+  *pdata++ = bin_ticks_;
+  *pdata++ = num_hists_;
+
+  for (int a = 0; a < num_modules_; a++) {
+    for (int b = a + 1; b < num_modules_; b++)
+      pdata = PutHistogram_(pdata, PairIndex_(a, b), first_module_ + a, first_module_ + b);
+  }
+  for (int a = 0; a < num_modules_; a++)
+    pdata = PutHistogram_(pdata, num_pairs_ + a, first_module_ + a, kChronobox);
+  bk_close(pevent, pdata);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Mean difference of a histogram since Configure(), in ticks
+ *
+ * \param   [in]  hist  histogram, in the order of the TDIF bank
+ */
+double dt5751Timing::GetMean(int hist) const
+{
+  if (hist < 0 || hist >= num_hists_)
+    return 0;
+  uint64_t entries = words_[(size_t)hist*kStride].load(std::memory_order_relaxed);
+  int64_t sum = (int64_t)words_[(size_t)hist*kStride + 1].load(std::memory_order_relaxed);
+  return entries ? (double)sum/entries : 0;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
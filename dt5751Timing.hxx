@@ -0,0 +1,87 @@
+/*****************************************************************************/
+/**
+\file dt5751Timing.hxx
+
+## Contents
+
+This file contains the class definition for the online timing monitor of
+the merged events: histograms of the trigger time tag differences between
+the boards of each pair, and between each board and the chronobox,
+published periodically in a TDIF bank (see read_buffer_level()).
+ *****************************************************************************/
+
+#ifndef DT5751TIMING_HXX_INCLUDE
+#define DT5751TIMING_HXX_INCLUDE
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "midas.h"
+
+/**
+ * Lock-free time tag difference histograms.
+ *
+ * One histogram per pair of boards (a, b), a before b in the frontend, of
+ * TTT(b) - TTT(a), and one per board of TTT(board) - TTT(chronobox), in 8 ns
+ * ticks and taking the 31-bit rollover into account.  Each has kNumBins
+ * bins of "bin width" ticks centred on 0, an underflow and an overflow bin,
+ * the number of entries and the sum of the differences.  Fill() adds one
+ * entry per histogram concerned by the event: a relaxed load/store per
+ * word, no locked instruction and no allocation.  It is called by one
+ * thread (the main thread, read_trigger()); FillBank() may run in another.
+ *
+ * TDIF bank, counts since the previous bank:
+ * - word 0: bins per histogram (kNumBins), word 1: bin width (ticks),
+ *   word 2: number of histograms
+ * - then the pair histograms, (0,1), (0,2)... (1,2)..., followed by the
+ *   chronobox histograms of the boards, each with: module ID of a, module
+ *   ID of b (kChronobox for the chronobox histograms, where a is the
+ *   board), entries, sum of the differences (ticks, signed, low word then
+ *   high word), underflow, kNumBins bins, overflow
+ * The mean of each histogram shows the clock drift between two boards, its
+ * width against the matching threshold the margin of the merging.
+ */
+class dt5751Timing
+{
+
+public:
+
+  static const int kNumBins = 64;
+  static const uint32_t kChronobox = 0xFFFFFFFF;   //!< TDIF: module ID of the chronobox
+
+  dt5751Timing();
+
+  void Init(int firstModuleID, int numModules);
+  void Configure(uint32_t binTicks);
+
+  void Fill(const std::vector<int> &modules, const uint32_t *ttt, const uint32_t *chronoboxTtt);
+  void FillBank(char *pevent);
+
+  int GetNumHistograms() const { return num_hists_; }
+  double GetMean(int hist) const;    //!< Since Configure(), in ticks
+
+private:
+
+  static const int kStride = kNumBins + 4;   //!< entries, sum, underflow, bins, overflow
+
+  int PairIndex_(int a, int b) const {
+    return a*num_modules_ - a*(a + 1)/2 + (b - a - 1);
+  }
+  void Add_(int hist, int32_t diff);
+  DWORD *PutHistogram_(DWORD *pdata, int hist, uint32_t moduleA, uint32_t moduleB);
+  static int32_t Difference_(uint32_t from, uint32_t to) {
+    return (int32_t)(((to - from) & 0x7FFFFFFF) << 1) >> 1;
+  }
+
+  int first_module_;
+  int num_modules_;
+  int num_pairs_;           //!< Board pair histograms, before the chronobox ones
+  int num_hists_;
+  int32_t bin_ticks_;
+  std::unique_ptr<std::atomic<uint64_t>[]> words_;   //!< [hist][kStride]
+  std::vector<uint64_t> prev_;                        //!< At the previous FillBank()
+};
+
+#endif // DT5751TIMING_HXX_INCLUDE
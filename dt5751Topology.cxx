@@ -0,0 +1,219 @@
+/*****************************************************************************/
+/**
+\file dt5751Topology.cxx
+
+## Contents
+
+This file contains the class implementation for the readout topology.
+ *****************************************************************************/
+
+#include "dt5751Topology.hxx"
+#include "midas.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+
+//
+//--------------------------------------------------------------------------------
+dt5751Topology::dt5751Topology()
+: cards_(1), links_per_card_(1), links_per_fe_(1), boards_per_link_(1), boards_total_(1), numa_node_(1, -1)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the layout and check that the frontends split it evenly
+ *
+ * \param   [in]  cards          A3818 cards in the host
+ * \param   [in]  linksPerCard   optical ports of each card
+ * \param   [in]  linksPerFe     links read by each frontend
+ * \param   [in]  boardsPerLink  daisy-chained boards per link
+ * \param   [in]  boardsTotal    boards of all the frontends
+ * \return  false if the layout is inconsistent
+ */
+bool dt5751Topology::Configure(int cards, int linksPerCard, int linksPerFe, int boardsPerLink, int boardsTotal)
+{
+  if (cards < 1 || linksPerCard < 1 || linksPerFe < 1 || boardsPerLink < 1 || boardsTotal < 1) {
+    cm_msg(MERROR, "Topology", "Invalid topology: %d A3818, %d links per A3818, %d links per frontend, "
+           "%d boards per link, %d boards", cards, linksPerCard, linksPerFe, boardsPerLink, boardsTotal);
+    return false;
+  }
+  if ((cards*linksPerCard) % linksPerFe != 0) {
+    cm_msg(MERROR, "Topology", "The %d links of the %d A3818 cannot be split in frontends of %d links",
+           cards*linksPerCard, cards, linksPerFe);
+    return false;
+  }
+  if (boardsTotal % (linksPerFe*boardsPerLink) != 0) {
+    cm_msg(MERROR, "Topology", "%d boards cannot be split in frontends of %d links with %d boards each",
+           boardsTotal, linksPerFe, boardsPerLink);
+    return false;
+  }
+
+  cards_ = cards;
+  links_per_card_ = linksPerCard;
+  links_per_fe_ = linksPerFe;
+  boards_per_link_ = boardsPerLink;
+  boards_total_ = boardsTotal;
+  numa_node_.assign(cards, -1);
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the NUMA node of each card
+ *
+ * \param   [in]  nodes  comma-separated node of each card, in link order;
+ *                       empty to take them from the a3818 driver in sysfs
+ * \return  false if the list does not have one node per card
+ */
+bool dt5751Topology::SetNumaNodes(const std::string &nodes)
+{
+  std::vector<int> list;
+  if (nodes.empty()) {
+    list = FindA3818Nodes_();
+    if ((int)list.size() != cards_) {
+      // No NUMA placement, the link threads use the default cores
+      cm_msg(MINFO, "Topology", "Found %d A3818 in sysfs for %d configured, NUMA node unknown",
+             (int)list.size(), cards_);
+      numa_node_.assign(cards_, -1);
+      return true;
+    }
+  } else {
+    std::stringstream ss(nodes);
+    std::string item;
+    while (std::getline(ss, item, ','))
+      list.push_back(atoi(item.c_str()));
+    if ((int)list.size() != cards_) {
+      cm_msg(MERROR, "Topology", "\"%s\" gives %d NUMA nodes for %d A3818", nodes.c_str(), (int)list.size(),
+             cards_);
+      return false;
+    }
+  }
+  numa_node_ = list;
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Link number of a link of a frontend, across all the cards of the host
+ *
+ * \param   [in]  feIndex  frontend index
+ * \param   [in]  feLink   link of the frontend, 0 to GetLinksPerFe() - 1
+ */
+int dt5751Topology::GetLink(int feIndex, int feLink) const
+{
+  return (feIndex*links_per_fe_ + feLink) % (cards_*links_per_card_);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   NUMA node of a card, -1 if unknown
+ */
+int dt5751Topology::GetNumaNode(int card) const
+{
+  if (card < 0 || card >= (int)numa_node_.size())
+    return -1;
+  return numa_node_[card];
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   CPUs of a NUMA node
+ *
+ * \param   [in]  node  NUMA node
+ * \param   [out] mask  its CPUs
+ * \return  false if the node is unknown or has no CPU
+ */
+bool dt5751Topology::GetNodeCpus(int node, cpu_set_t *mask)
+{
+  CPU_ZERO(mask);
+  if (node < 0)
+    return false;
+
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return false;
+
+  // Ranges like "0-7,16-23"
+  int first, last, n = 0;
+  char sep;
+  while (fscanf(f, "%d", &first) == 1) {
+    last = first;
+    sep = fgetc(f);
+    if (sep == '-') {
+      if (fscanf(f, "%d", &last) != 1) break;
+      sep = fgetc(f);
+    }
+    for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++, n++)
+      CPU_SET(cpu, mask);
+    if (sep != ',') break;
+  }
+  fclose(f);
+  return n > 0;
+}
+
+//
+//--------------------------------------------------------------------------------
+int dt5751Topology::GetNumCpus()
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   NUMA node of each card bound to the a3818 driver, in PCI address order
+ *
+ * The driver numbers the cards in probe order, which follows the PCI address.
+ */
+std::vector<int> dt5751Topology::FindA3818Nodes_()
+{
+  std::vector<int> nodes;
+  std::vector<std::string> devices;
+  const char *driver = "/sys/bus/pci/drivers/a3818";
+
+  DIR *dir = opendir(driver);
+  if (!dir)
+    return nodes;
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    // Devices are the entries named after their PCI address (dddd:bb:dd.f)
+    if (strchr(ent->d_name, ':'))
+      devices.push_back(ent->d_name);
+  }
+  closedir(dir);
+  std::sort(devices.begin(), devices.end());
+
+  for (size_t i = 0; i < devices.size(); i++) {
+    std::string path = std::string(driver) + "/" + devices[i] + "/numa_node";
+    int node = -1;
+    FILE *f = fopen(path.c_str(), "r");
+    if (f) {
+      if (fscanf(f, "%d", &node) != 1) node = -1;
+      fclose(f);
+    }
+    nodes.push_back(node);
+  }
+  return nodes;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,64 @@
+/*****************************************************************************/
+/**
+\file dt5751Topology.hxx
+
+## Contents
+
+This file contains the class definition for the readout topology: how many
+A3818 cards the host has, how their optical links are shared among the
+frontends and which NUMA node each card sits on.  It is read from the ODB at
+startup, so the same binary runs any layout.
+ *****************************************************************************/
+
+#ifndef DT5751TOPOLOGY_HXX_INCLUDE
+#define DT5751TOPOLOGY_HXX_INCLUDE
+
+#include <sched.h>
+#include <string>
+#include <vector>
+
+/**
+ * Readout topology of one host.
+ *
+ * The links of all the A3818 cards of the host are numbered consecutively
+ * (card c has links c*linksPerCard to (c+1)*linksPerCard - 1), which is also
+ * the link number CAENComm_OpenDevice() takes.  Frontend i reads linksPerFe
+ * consecutive links starting at i*linksPerFe, wrapping around on the next
+ * host, so that a frontend may span several cards.
+ */
+class dt5751Topology
+{
+
+public:
+
+  dt5751Topology();
+
+  bool Configure(int cards, int linksPerCard, int linksPerFe, int boardsPerLink, int boardsTotal);
+  bool SetNumaNodes(const std::string &nodes);
+
+  int GetNumCards() const { return cards_; }
+  int GetLinksPerFe() const { return links_per_fe_; }
+  int GetBoardsPerLink() const { return boards_per_link_; }
+  int GetBoardsPerFe() const { return links_per_fe_*boards_per_link_; }
+  int GetNumFrontends() const { return boards_total_/GetBoardsPerFe(); }
+
+  int GetLink(int feIndex, int feLink) const;
+  int GetCard(int feIndex, int feLink) const { return GetLink(feIndex, feLink)/links_per_card_; }
+  int GetNumaNode(int card) const;
+
+  static bool GetNodeCpus(int node, cpu_set_t *mask);
+  static int GetNumCpus();
+
+private:
+
+  static std::vector<int> FindA3818Nodes_();
+
+  int cards_;                        //!< A3818 cards in the host
+  int links_per_card_;               //!< Optical ports of each card
+  int links_per_fe_;                 //!< Links (and link threads) of each frontend
+  int boards_per_link_;              //!< Daisy-chained boards per link
+  int boards_total_;                 //!< Boards of all the frontends
+  std::vector<int> numa_node_;       //!< NUMA node of each card, -1 if unknown
+};
+
+#endif // DT5751TOPOLOGY_HXX_INCLUDE
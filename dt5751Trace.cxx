@@ -0,0 +1,158 @@
+/*****************************************************************************/
+/**
+\file dt5751Trace.cxx
+
+## Contents
+
+This file contains the class implementation for the acquisition flight recorder.
+ *****************************************************************************/
+
+#include "dt5751Trace.hxx"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+const char *dt5751Trace::type_names[NumTypes] = {
+  "BltStart", "BltEnd", "CheckEvent", "RbLevel", "RbStall", "ReadError",
+  "MergeDecision", "FragmentMerged", "FragmentSkipped", "BankClose", "ZmqRecv",
+  "RunStart", "RunStop", "SwTrigger"
+};
+
+thread_local int dt5751Trace::thread_slot_ = 0;
+
+//
+//--------------------------------------------------------------------------------
+dt5751Trace::dt5751Trace()
+: enabled_(false), mask_(0), tsc_hz_(1e9), num_slots_(0)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Flight recorder shared by the whole frontend
+ */
+dt5751Trace& dt5751Trace::Instance()
+{
+  static dt5751Trace instance;
+  return instance;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Allocate the per-thread rings
+ *
+ * Must be called before recording is enabled.
+ *
+ * \param   [in]  numSlots        Number of threads recording
+ * \param   [in]  recordsPerSlot  Ring size, rounded up to a power of two
+ */
+void dt5751Trace::Init(int numSlots, int recordsPerSlot)
+{
+  SetEnabled(false);
+
+  uint64_t size = 1;
+  while (size < (uint64_t)recordsPerSlot)
+    size <<= 1;
+  mask_ = size - 1;
+
+  num_slots_ = numSlots;
+  rings_.reset(new Ring[num_slots_]);
+  for (int i = 0; i < num_slots_; i++) {
+    rings_[i].head.store(0);
+    rings_[i].records.reset(new dt5751TraceRecord[size]());
+  }
+  tsc_hz_ = CalibrateTsc();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Measure the time stamp counter frequency against CLOCK_MONOTONIC
+ */
+double dt5751Trace::CalibrateTsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  timespec t0, t1, wait = { 0, 20000000 };
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t c0 = Tsc();
+  nanosleep(&wait, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  uint64_t c1 = Tsc();
+  double dt = (t1.tv_sec - t0.tv_sec) + 1e-9*(t1.tv_nsec - t0.tv_nsec);
+  return (dt > 0) ? (c1 - c0)/dt : 1e9;
+#else
+  return 1e9;
+#endif
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Write all rings to a file
+ *
+ * \param   [in]  path    output file
+ * \param   [in]  reason  short description stored in the header
+ * \return  true on success
+ */
+bool dt5751Trace::Dump(const char *path, const char *reason)
+{
+  if (num_slots_ == 0)
+    return false;
+
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return false;
+
+  dt5751TraceFileHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, DT5751_TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.version = DT5751_TRACE_VERSION;
+  hdr.num_slots = num_slots_;
+  hdr.tsc_hz = tsc_hz_;
+  hdr.dump_tsc = Tsc();
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  hdr.dump_time_ns = (uint64_t)now.tv_sec*1000000000ull + now.tv_nsec;
+  snprintf(hdr.reason, sizeof(hdr.reason), "%s", reason);
+  bool ok = (fwrite(&hdr, sizeof(hdr), 1, f) == 1);
+
+  uint64_t size = mask_ + 1;
+  std::vector<dt5751TraceRecord> copy;
+  for (int s = 0; s < num_slots_ && ok; s++) {
+    Ring &ring = rings_[s];
+    uint64_t head = ring.head.load(std::memory_order_acquire);
+    uint64_t first = (head > size) ? head - size : 0;
+    copy.clear();
+    for (uint64_t i = first; i < head; i++)
+      copy.push_back(ring.records[i & mask_]);
+
+    // Drop what the writer overwrote while we were copying
+    uint64_t head_after = ring.head.load(std::memory_order_acquire);
+    uint64_t overwritten = (head_after > first + size) ? head_after - (first + size) : 0;
+    if (overwritten > copy.size())
+      overwritten = copy.size();
+
+    dt5751TraceSlotHeader shdr;
+    shdr.slot = s;
+    shdr.num_records = copy.size() - overwritten;
+    ok = (fwrite(&shdr, sizeof(shdr), 1, f) == 1);
+    if (ok && shdr.num_records)
+      ok = (fwrite(&copy[overwritten], sizeof(dt5751TraceRecord), shdr.num_records, f) == shdr.num_records);
+  }
+
+  if (fclose(f) != 0)
+    ok = false;
+  return ok;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,139 @@
+/*****************************************************************************/
+/**
+\file dt5751Trace.hxx
+
+## Contents
+
+This file contains the class definition for the acquisition flight recorder:
+a per-thread, fixed-size ring of compact binary records of the hot path
+(BLTs, CheckEvent results, ring buffer levels, merge decisions, ZMQ receives)
+that is dumped to a file when something goes wrong.  dt5751trace2json
+converts a dump to the Chrome trace JSON format.
+ *****************************************************************************/
+
+#ifndef DT5751TRACE_HXX_INCLUDE
+#define DT5751TRACE_HXX_INCLUDE
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define DT5751_TRACE_MAGIC   "DT51TRC1"
+#define DT5751_TRACE_VERSION 1
+
+//! One trace record (16 bytes)
+struct dt5751TraceRecord {
+  uint64_t tsc;            //!< Time stamp counter
+  uint16_t type;           //!< dt5751Trace::Type
+  int16_t  module;         //!< Module ID, -1 if not board specific
+  uint32_t value;          //!< Type dependent payload
+};
+
+//! Dump file header, followed per slot by a dt5751TraceSlotHeader and its records
+struct dt5751TraceFileHeader {
+  char     magic[8];       //!< DT5751_TRACE_MAGIC
+  uint32_t version;        //!< DT5751_TRACE_VERSION
+  uint32_t num_slots;      //!< Number of thread slots that follow
+  double   tsc_hz;         //!< Time stamp counter frequency
+  uint64_t dump_tsc;       //!< Time stamp counter at dump time
+  uint64_t dump_time_ns;   //!< Wall clock (CLOCK_REALTIME) at dump time
+  char     reason[80];     //!< Why the dump was taken
+};
+
+struct dt5751TraceSlotHeader {
+  uint32_t slot;           //!< 0: main thread, 1+n: link thread n, then the trigger generator
+  uint32_t num_records;    //!< Records that follow, oldest first
+};
+
+/**
+ * Flight recorder.
+ *
+ * Each thread owns one ring (see SetThreadSlot()) and is its only writer, so
+ * recording is a handful of stores and one release store of the head index.
+ * Dump() may run from any thread while the writers continue; records that
+ * were overwritten during the copy are discarded.
+ */
+class dt5751Trace
+{
+
+public:
+
+  enum Type {
+    BltStart,              //!< value: requested bytes
+    BltEnd,                //!< value: bytes read
+    CheckEvent,            //!< value: 1 if an event is ready, or EVENT_STORED (link scheduler)
+    RbLevel,               //!< value: ring buffer level in bytes
+    RbStall,               //!< value: ring buffer level in bytes
+    ReadError,             //!< value: CAENComm error code
+    MergeDecision,         //!< value: lowest trigger time tag
+    FragmentMerged,        //!< value: trigger time tag of the fragment
+    FragmentSkipped,       //!< value: trigger time tag of the fragment
+    BankClose,             //!< value: bank size in bytes
+    ZmqRecv,               //!< value: bytes received, 0 on timeout
+    RunStart,              //!< value: run number
+    RunStop,               //!< value: run number
+    SwTrigger,             //!< value: lateness in us (dt5751TrigGen)
+    NumTypes
+  };
+
+  static const char *type_names[NumTypes];
+
+  static dt5751Trace& Instance();
+
+  void Init(int numSlots, int recordsPerSlot);
+  static void SetThreadSlot(int slot) { thread_slot_ = slot; }
+  void SetEnabled(bool enable) { enabled_.store(enable, std::memory_order_relaxed); }
+  bool IsEnabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  /* Hot path */
+  void Record(Type type, int module, uint32_t value) {
+    if (!enabled_.load(std::memory_order_relaxed))
+      return;
+    Ring &ring = rings_[thread_slot_];
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    dt5751TraceRecord &r = ring.records[head & mask_];
+    r.tsc = Tsc();
+    r.type = type;
+    r.module = module;
+    r.value = value;
+    ring.head.store(head + 1, std::memory_order_release);
+  }
+
+  bool Dump(const char *path, const char *reason);
+  double GetTscHz() const { return tsc_hz_; }
+
+  static uint64_t Tsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+#endif
+  }
+
+private:
+
+  struct Ring {
+    std::atomic<uint64_t> head;                        //!< Records written so far
+    std::unique_ptr<dt5751TraceRecord[]> records;
+    char pad[64];                                      //!< Keep heads on separate lines
+  };
+
+  dt5751Trace();
+  static double CalibrateTsc();
+
+  std::atomic<bool> enabled_;
+  uint64_t mask_;
+  double tsc_hz_;
+  int num_slots_;
+  std::unique_ptr<Ring[]> rings_;
+
+  static thread_local int thread_slot_;
+};
+
+#endif // DT5751TRACE_HXX_INCLUDE
@@ -0,0 +1,275 @@
+/*****************************************************************************/
+/**
+\file dt5751TrigGen.cxx
+
+## Contents
+
+This file contains the class implementation for the software trigger generator.
+ *****************************************************************************/
+
+#include "dt5751TrigGen.hxx"
+#include "dt5751Metrics.hxx"
+#include "dt5751Trace.hxx"
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+//! Longest sleep, so that Stop() is noticed at low rates
+static const uint64_t kMaxSleepNs = 100000000;
+
+//
+//--------------------------------------------------------------------------------
+dt5751TrigGen::dt5751TrigGen(std::vector<dt5751CONET2> &modules)
+: modules_(modules), thread_slot_(0), pattern_(Off), period_ns_(0), burst_size_(1), burst_period_ns_(0),
+  all_boards_(true), rng_(std::random_device()()), exp_(1.0), burst_index_(0), thread_started_(false),
+  stop_(false), paused_(false), sent_(0), missed_(0), errors_(0), late_ns_(0), max_late_ns_(0), start_ns_(0),
+  stop_ns_(0)
+{
+}
+
+//
+//--------------------------------------------------------------------------------
+dt5751TrigGen::~dt5751TrigGen()
+{
+  Stop();
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Pattern from its ODB name (off, fixed, poisson, burst)
+ *
+ * \param   [in]  name     pattern name, case insensitive
+ * \param   [out] pattern  parsed pattern
+ * \return  false if the name is unknown
+ */
+bool dt5751TrigGen::ParsePattern(const std::string &name, Pattern *pattern)
+{
+  const char *names[] = { "off", "fixed", "poisson", "burst" };
+  for (int i = 0; i < 4; i++) {
+    if (strcasecmp(name.c_str(), names[i]) == 0) {
+      *pattern = (Pattern)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Set the pattern for the next Start() and clear the counters of the
+ *          previous run (begin of run, generator stopped)
+ *
+ * \param   [in]  pattern       trigger pattern, Off to disable the generator
+ * \param   [in]  rateHz        fixed and burst: trigger rate; Poisson: mean rate
+ * \param   [in]  burstSize     triggers per burst
+ * \param   [in]  burstPeriodS  time between the starts of two bursts
+ * \param   [in]  allBoards     trigger every board, otherwise the first one only
+ * \return  false if the settings are invalid (the generator is then disabled)
+ */
+bool dt5751TrigGen::Configure(Pattern pattern, double rateHz, int burstSize, double burstPeriodS, bool allBoards)
+{
+  if (!thread_started_) {
+    sent_ = missed_ = errors_ = late_ns_ = max_late_ns_ = 0;
+    start_ns_ = 0;
+    stop_ns_ = 0;
+  }
+
+  pattern_ = Off;
+  if (pattern == Off)
+    return true;
+
+  if (rateHz <= 0 || rateHz > 1e7) {
+    cm_msg(MERROR, "TrigGen", "Invalid software trigger rate %g Hz", rateHz);
+    return false;
+  }
+  period_ns_ = (uint64_t)(1e9/rateHz);
+
+  if (pattern == Burst) {
+    if (burstSize < 1 || burstPeriodS*1e9 < (double)burstSize*period_ns_) {
+      cm_msg(MERROR, "TrigGen", "Invalid burst: %d triggers at %g Hz do not fit in %g s", burstSize, rateHz,
+             burstPeriodS);
+      return false;
+    }
+    burst_size_ = burstSize;
+    burst_period_ns_ = (uint64_t)(burstPeriodS*1e9);
+  }
+
+  all_boards_ = allBoards;
+  pattern_ = pattern;
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Start the generator thread with a fresh schedule and counters
+ */
+bool dt5751TrigGen::Start()
+{
+  if (pattern_ == Off)
+    return false;
+  if (thread_started_)
+    return true;
+
+  stop_ = false;
+  paused_ = false;
+  sent_ = missed_ = errors_ = late_ns_ = max_late_ns_ = 0;
+  burst_index_ = 0;
+  start_ns_ = dt5751Metrics::NowNs();
+  stop_ns_ = 0;
+
+  int status = pthread_create(&tid_, NULL, &dt5751TrigGen::ThreadFunc_, (void*)this);
+  if (status) {
+    cm_msg(MERROR, "TrigGen", "Couldn't create the software trigger thread. Return code: %d", status);
+    return false;
+  }
+  thread_started_ = true;
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Stop the generator thread; the counters are kept until the next Configure()
+ *          or Start()
+ */
+void dt5751TrigGen::Stop()
+{
+  if (!thread_started_)
+    return;
+
+  stop_ = true;
+  pthread_join(tid_, NULL);
+  thread_started_ = false;
+  stop_ns_ = dt5751Metrics::NowNs();
+}
+
+//
+//--------------------------------------------------------------------------------
+double dt5751TrigGen::GetMeanLatenessUs() const
+{
+  uint64_t n = sent_;
+  return n ? late_ns_*1e-3/n : 0.;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Time between Start() and Stop() (or now)
+ */
+double dt5751TrigGen::GetSeconds() const
+{
+  uint64_t end = stop_ns_ ? (uint64_t)stop_ns_ : dt5751Metrics::NowNs();
+  return (end - start_ns_)*1e-9;
+}
+
+//
+//--------------------------------------------------------------------------------
+void *dt5751TrigGen::ThreadFunc_(void *arg)
+{
+  dt5751TrigGen *gen = (dt5751TrigGen *)arg;
+  dt5751Metrics::SetThreadSlot(gen->thread_slot_);
+  dt5751Trace::SetThreadSlot(gen->thread_slot_);
+
+  gen->Run_();
+  return NULL;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Time to the next tick
+ */
+uint64_t dt5751TrigGen::NextInterval_()
+{
+  switch (pattern_) {
+  case Poisson:
+    return (uint64_t)(exp_(rng_)*period_ns_);
+  case Burst:
+    if (++burst_index_ < burst_size_)
+      return period_ns_;
+    burst_index_ = 0;
+    return burst_period_ns_ - (burst_size_ - 1)*period_ns_;
+  default:
+    return period_ns_;
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Generator loop: sleep to the absolute deadline, trigger, schedule the next tick
+ */
+void dt5751TrigGen::Run_()
+{
+  // First tick one period from now; NextInterval_() would count it as the second of the burst
+  uint64_t deadline = dt5751Metrics::NowNs() + (pattern_ == Burst ? period_ns_ : NextInterval_());
+
+  while (!stop_) {
+    uint64_t now = dt5751Metrics::NowNs();
+    if (now < deadline) {
+      uint64_t wake = std::min(deadline, now + kMaxSleepNs);
+      timespec ts;
+      ts.tv_sec = wake/1000000000ull;
+      ts.tv_nsec = wake%1000000000ull;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      continue;
+    }
+
+    if (!paused_) {
+      uint64_t late = now - deadline;
+      Fire_();
+      sent_++;
+      late_ns_ += late;
+      if (late > max_late_ns_) max_late_ns_ = late;
+      dt5751Trace::Instance().Record(dt5751Trace::SwTrigger, -1, (uint32_t)std::min<uint64_t>(late/1000, UINT32_MAX));
+    }
+
+    // Drop the ticks that are already due instead of catching up in a burst
+    deadline += NextInterval_();
+    now = dt5751Metrics::NowNs();
+    while (deadline < now) {
+      if (!paused_) missed_++;
+      deadline += NextInterval_();
+    }
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Send one software trigger to every board (or the first one)
+ *
+ * All the triggers are queued before waiting, so each link sends its own
+ * at the end of its current readout pass.
+ */
+void dt5751TrigGen::Fire_()
+{
+  std::vector<dt5751CONET2>::iterator it, last = modules_.begin();
+  for (it = modules_.begin(); it != modules_.end(); ++it) {
+    if (!it->IsConnected() || it->IsOffline())
+      continue;
+    if (!it->BeginTrigger())
+      errors_++;
+    last = it + 1;
+    if (!all_boards_)
+      break;
+  }
+  for (it = modules_.begin(); it != last; ++it) {
+    if (!it->IsConnected() || it->IsOffline())
+      continue;
+    if (!it->EndTrigger())
+      errors_++;
+  }
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
@@ -0,0 +1,101 @@
+/*****************************************************************************/
+/**
+\file dt5751TrigGen.hxx
+
+## Contents
+
+This file contains the class definition for the software trigger generator:
+a thread that sends software triggers to the boards on absolute
+CLOCK_MONOTONIC deadlines (clock_nanosleep), with a fixed-rate, Poisson or
+burst pattern, independently of how often MIDAS calls poll_event().  It is
+meant for throughput and deadtime tests at rates the per-board
+"Software trigger rate (Hz)" cannot reach.
+ *****************************************************************************/
+
+#ifndef DT5751TRIGGEN_HXX_INCLUDE
+#define DT5751TRIGGEN_HXX_INCLUDE
+
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "dt5751CONET2.hxx"
+
+/**
+ * Software trigger generator.
+ *
+ * Each tick sends one software trigger to every connected board, or to the
+ * first one only when the others take their trigger from its TRG-OUT.  The
+ * triggers go through the link queues with trigger priority; a tick whose
+ * deadline has already passed when the previous one completes is dropped
+ * and counted as missed rather than sent late in a burst.
+ */
+class dt5751TrigGen
+{
+
+public:
+
+  enum Pattern {
+    Off,
+    Fixed,                  //!< Evenly spaced at the rate
+    Poisson,                //!< Exponential intervals of mean 1/rate
+    Burst                   //!< burst_size triggers at the rate, once per burst period
+  };
+
+  dt5751TrigGen(std::vector<dt5751CONET2> &modules);
+  ~dt5751TrigGen();
+
+  void SetThreadSlot(int slot) { thread_slot_ = slot; }   //!< dt5751Metrics/dt5751Trace slot, before Start()
+
+  static bool ParsePattern(const std::string &name, Pattern *pattern);
+  bool Configure(Pattern pattern, double rateHz, int burstSize, double burstPeriodS, bool allBoards);
+  bool IsEnabled() const { return pattern_ != Off; }
+
+  bool Start();
+  void Stop();
+  bool IsRunning() const { return thread_started_; }
+  void SetPaused(bool paused) { paused_ = paused; }  //!< Keep the schedule, send nothing
+
+  uint64_t GetNumSent() const { return sent_; }       //!< Ticks sent
+  uint64_t GetNumMissed() const { return missed_; }   //!< Ticks dropped, deadline passed
+  uint64_t GetNumErrors() const { return errors_; }   //!< Failed SendTrigger()
+  double GetMeanLatenessUs() const;
+  double GetMaxLatenessUs() const { return max_late_ns_*1e-3; }
+  double GetSeconds() const;
+
+private:
+
+  static void *ThreadFunc_(void *);
+  void Run_();
+  uint64_t NextInterval_();
+  void Fire_();
+
+  std::vector<dt5751CONET2> &modules_;
+  int thread_slot_;                  //!< dt5751Metrics/dt5751Trace slot of the generator thread
+  Pattern pattern_;
+  uint64_t period_ns_;               //!< 1/rate
+  int burst_size_;
+  uint64_t burst_period_ns_;
+  bool all_boards_;
+  std::mt19937_64 rng_;
+  std::exponential_distribution<double> exp_;   //!< Poisson intervals, in periods
+  int burst_index_;
+
+  pthread_t tid_;
+  bool thread_started_;
+  std::atomic<bool> stop_;           //!< Request to the generator thread to return
+  std::atomic<bool> paused_;
+
+  std::atomic<uint64_t> sent_;
+  std::atomic<uint64_t> missed_;
+  std::atomic<uint64_t> errors_;
+  std::atomic<uint64_t> late_ns_;    //!< Sum of tick start minus deadline
+  std::atomic<uint64_t> max_late_ns_;
+  uint64_t start_ns_;
+  std::atomic<uint64_t> stop_ns_;
+};
+
+#endif // DT5751TRIGGEN_HXX_INCLUDE
@@ -0,0 +1,393 @@
+/*****************************************************************************/
+/**
+\file dt5751bench.cxx
+
+## Contents
+
+Microbenchmark of the event path downstream of the board readout: ring
+buffer handoff (dt5751CONET2::PushFragment()), the merge loop
+(dt5751EventBuilder, PeekRBTimestamp()) and bank creation
+(dt5751CONET2::FillEventBank()).  One producer thread per board pushes
+synthetic DT5751 fragments while the main thread builds events, as the link
+threads and read_event_from_ring_bufs() do in the frontend.
+
+A matrix of board counts, samples per channel, raw/ZLE and merge on/off is
+run and one line per point is printed, CSV by default or JSON lines with -j:
+
+    dt5751bench [-n events] [-b 1,2,4,8] [-s 256,2048,16384] [-f raw,zle,raw25,zle25]
+                [-m on,off] [-t] [-j]
+
+- events_per_s : MIDAS events built per second (producers included)
+- gb_per_s     : bank payload built per second
+- cycles_per_event / ns_per_event : time stamp counter ticks spent in
+  dt5751EventBuilder::Build() per event (main thread only)
+
+-t enables the flight recorder to measure its overhead.
+
+With -r a recorded MIDAS file is replayed as fast as possible through
+dt5751Replay instead (one line, merging per -m, samples reported as 0):
+
+    dt5751bench -r run01234.mid.gz [-m on] [-j]
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "dt5751CONET2.hxx"
+#include "dt5751Decoder.hxx"
+#include "dt5751EventBuilder.hxx"
+#include "dt5751Metrics.hxx"
+#include "dt5751Replay.hxx"
+#include "dt5751Trace.hxx"
+
+#define BENCH_RB_SIZE (32*1024*1024)  //!< Ring buffer size per board
+#define BENCH_NUM_TEMPLATES 16         //!< Different waveforms per board
+#define BENCH_TTT_STEP 1250            //!< 10 us between triggers
+#define BENCH_REPLAY_MODULES 32        //!< Module IDs looked for in replayed files
+
+struct BenchPoint {
+  int boards;
+  int samples;        //!< per channel
+  bool zle;
+  bool pack25;
+  bool merge;
+};
+
+struct Producer {
+  dt5751CONET2 *module;
+  int slot;
+  int events;
+  std::vector<std::vector<DWORD> > fragments;
+  pthread_t tid;
+};
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Make a DT5751 event: 4 channels, pack 2 or 2.5, a pulse on some channels
+ *
+ * ZLE fragments keep 32 words around each pulse, each channel starting with
+ * its size word (see dt5751Decoder.hxx).
+ */
+static void MakeFragment(int board, int samples, bool zle, bool pack25, std::vector<DWORD> &ev)
+{
+  const int nch = 4;
+  const int baseline = 800;
+  ev.assign(4, 0);
+  ev[1] = ((DWORD)board << 27) | 0xF | (zle ? dt5751Decoder::kZleFlag : 0) | (pack25 ? dt5751Decoder::kPack25Flag : 0);
+
+  std::vector<uint16_t> wf(samples);
+  std::vector<uint32_t> packed(dt5751Decoder::WordsForSamples(samples, pack25));
+  for (int ch = 0; ch < nch; ch++) {
+    bool hit = (rand() % 10) < 3;
+    int pos = samples/4;
+    for (int i = 0; i < samples; i++) {
+      int s = baseline + (rand() % 5) - 2;
+      if (hit && i >= pos && i < pos + 60)
+        s -= (int)(200*exp(-(i - pos)/15.));
+      wf[i] = (uint16_t)s;
+    }
+    DWORD words = dt5751Decoder::Pack(&wf[0], samples, pack25, &packed[0]);
+    if (!zle) {
+      ev.insert(ev.end(), packed.begin(), packed.begin() + words);
+      continue;
+    }
+    size_t size_pos = ev.size();
+    ev.push_back(0);
+    if (!hit) {
+      ev.push_back(words);                          // skip everything
+    } else {
+      DWORD at = dt5751Decoder::WordsForSamples(pos, pack25);
+      DWORD first = at > 8 ? (at - 8) & ~1u : 0;
+      DWORD good = std::min<DWORD>(32, words - first);
+      if (first) ev.push_back(first);
+      ev.push_back(0x80000000 | good);
+      ev.insert(ev.end(), packed.begin() + first, packed.begin() + first + good);
+      if (first + good < words) ev.push_back(words - first - good);
+    }
+    ev[size_pos] = ev.size() - size_pos;
+  }
+  ev[0] = 0xA0000000 | (DWORD)ev.size();
+}
+
+//
+//--------------------------------------------------------------------------------
+static void *ProducerThread(void *arg)
+{
+  Producer *p = (Producer *)arg;
+  dt5751Metrics::SetThreadSlot(p->slot);
+  dt5751Trace::SetThreadSlot(p->slot);
+
+  for (int k = 0; k < p->events; k++) {
+    std::vector<DWORD> &ev = p->fragments[k % p->fragments.size()];
+    ev[2] = k & 0xFFFFFF;
+    ev[3] = ((DWORD)k * BENCH_TTT_STEP) & 0x7FFFFFFF;
+    while (!p->module->PushFragment(&ev[0], ev.size()))
+      ;
+  }
+  return NULL;
+}
+
+//
+//--------------------------------------------------------------------------------
+static bool RunPoint(const BenchPoint &pt, int numEvents, bool json, std::vector<char> &evbuf)
+{
+  std::vector<dt5751CONET2> modules;
+  modules.reserve(pt.boards);
+  for (int b = 0; b < pt.boards; b++) {
+    modules.emplace_back(0, b, 0, b, 0);
+    modules.back().SetOffline(pt.zle ? (pt.pack25 ? dt5751CONET2::ZLEPack25 : dt5751CONET2::ZLEPack2) :
+                              (pt.pack25 ? dt5751CONET2::RawPack25 : dt5751CONET2::RawPack2));
+  }
+
+  std::vector<Producer> producers(pt.boards);
+  size_t fragment_words = 0;
+  for (int b = 0; b < pt.boards; b++) {
+    Producer &p = producers[b];
+    p.module = &modules[b];
+    p.slot = b + 1;
+    p.events = numEvents;
+    p.fragments.resize(BENCH_NUM_TEMPLATES);
+    for (int t = 0; t < BENCH_NUM_TEMPLATES; t++) {
+      MakeFragment(b, pt.samples, pt.zle, pt.pack25, p.fragments[t]);
+      if (p.fragments[t].size() > fragment_words)
+        fragment_words = p.fragments[t].size();
+    }
+    int rb_handle;
+    if (rb_create(BENCH_RB_SIZE, fragment_words*sizeof(DWORD) + 1024, &rb_handle) != DB_SUCCESS) {
+      fprintf(stderr, "rb_create failed\n");
+      return false;
+    }
+    modules[b].SetRingBufferHandle(rb_handle);
+  }
+
+  dt5751Metrics::Instance().Init(pt.boards + 1, 0, pt.boards);
+  dt5751EventBuilder builder(modules);
+  builder.Configure(pt.merge, 50, false);
+
+  uint64_t expected = pt.merge ? numEvents : (uint64_t)numEvents * pt.boards;
+  uint64_t built = 0, bytes = 0, cycles = 0;
+  std::vector<uint32_t> timestamps;
+  char *pevent = &evbuf[sizeof(EVENT_HEADER)];
+
+  uint64_t start_ns = dt5751Metrics::NowNs();
+  for (int b = 0; b < pt.boards; b++)
+    pthread_create(&producers[b].tid, NULL, ProducerThread, &producers[b]);
+
+  while (built < expected) {
+    if (!builder.IsEventReady()) {
+      sched_yield();
+      continue;
+    }
+    bk_init32(pevent);
+    timestamps.clear();
+    uint64_t t0 = dt5751Trace::Tsc();
+    builder.Build(pevent, timestamps);
+    cycles += dt5751Trace::Tsc() - t0;
+    bytes += bk_size(pevent);
+    built++;
+  }
+  double seconds = (dt5751Metrics::NowNs() - start_ns)*1e-9;
+
+  for (int b = 0; b < pt.boards; b++) {
+    pthread_join(producers[b].tid, NULL);
+    rb_delete(modules[b].GetRingBufferHandle());
+  }
+
+  double cyc = (double)cycles/built;
+  double ns = cyc/dt5751Trace::Instance().GetTscHz()*1e9;
+  const char *format = pt.zle ? (pt.pack25 ? "zle25" : "zle") : (pt.pack25 ? "raw25" : "raw");
+  if (json)
+    printf("{\"boards\":%d,\"samples\":%d,\"format\":\"%s\",\"merge\":%s,\"events\":%llu,\"seconds\":%.4f,"
+           "\"events_per_s\":%.1f,\"gb_per_s\":%.4f,\"cycles_per_event\":%.1f,\"ns_per_event\":%.1f}\n",
+           pt.boards, pt.samples, format, pt.merge ? "true" : "false", (unsigned long long)built, seconds,
+           built/seconds, bytes/seconds*1e-9, cyc, ns);
+  else
+    printf("%d,%d,%s,%d,%llu,%.4f,%.1f,%.4f,%.1f,%.1f\n", pt.boards, pt.samples, format, pt.merge,
+           (unsigned long long)built, seconds, built/seconds, bytes/seconds*1e-9, cyc, ns);
+  fflush(stdout);
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * \brief   Build every event of a recorded file, reading it from the replay thread
+ */
+static bool RunReplay(const char *filename, bool merge, bool json, std::vector<char> &evbuf)
+{
+  std::vector<dt5751CONET2> modules;
+  modules.reserve(BENCH_REPLAY_MODULES);
+  for (int b = 0; b < BENCH_REPLAY_MODULES; b++)
+    modules.emplace_back(0, b, 0, b, 0);
+
+  dt5751Replay replay(modules);
+  if (!replay.Open(filename))
+    return false;
+
+  int boards = 0;
+  for (int b = 0; b < BENCH_REPLAY_MODULES; b++) {
+    if (!replay.HasModule(b)) continue;
+    modules[b].SetOffline(replay.GetDataType(b));
+    // Fragment size is unknown in advance; pages are only touched as used
+    int rb_handle;
+    if (rb_create(2*DT5751_MAX_EVENT_SIZE + 10000, DT5751_MAX_EVENT_SIZE, &rb_handle) != DB_SUCCESS) {
+      fprintf(stderr, "rb_create failed\n");
+      return false;
+    }
+    modules[b].SetRingBufferHandle(rb_handle);
+    boards++;
+  }
+
+  dt5751Metrics::Instance().Init(2, 0, BENCH_REPLAY_MODULES);
+  dt5751EventBuilder builder(modules);
+  builder.Configure(merge, 50, false);
+
+  uint64_t built = 0, bytes = 0, cycles = 0;
+  std::vector<uint32_t> timestamps;
+  std::vector<DWORD> zmq(256);
+  char *pevent = &evbuf[sizeof(EVENT_HEADER)];
+
+  uint64_t start_ns = dt5751Metrics::NowNs();
+  replay.Start();
+
+  while (1) {
+    bool finished = replay.IsFinished();   // before looking at the ring buffers
+    if (!builder.IsEventReady()) {
+      if (finished) break;
+      sched_yield();
+      continue;
+    }
+    bk_init32(pevent);
+    timestamps.clear();
+    uint64_t t0 = dt5751Trace::Tsc();
+    builder.Build(pevent, timestamps);
+    cycles += dt5751Trace::Tsc() - t0;
+    bytes += bk_size(pevent) + replay.PopZmqBank(&zmq[0], zmq.size()*sizeof(DWORD));
+    built++;
+  }
+  double seconds = (dt5751Metrics::NowNs() - start_ns)*1e-9;
+
+  replay.Close();
+  for (int b = 0; b < BENCH_REPLAY_MODULES; b++) {
+    if (modules[b].IsOffline())
+      rb_delete(modules[b].GetRingBufferHandle());
+  }
+  if (built == 0) {
+    fprintf(stderr, "No events built from %s\n", filename);
+    return false;
+  }
+
+  double cyc = (double)cycles/built;
+  double ns = cyc/dt5751Trace::Instance().GetTscHz()*1e9;
+  if (json)
+    printf("{\"boards\":%d,\"samples\":0,\"format\":\"replay\",\"merge\":%s,\"events\":%llu,\"seconds\":%.4f,"
+           "\"events_per_s\":%.1f,\"gb_per_s\":%.4f,\"cycles_per_event\":%.1f,\"ns_per_event\":%.1f}\n",
+           boards, merge ? "true" : "false", (unsigned long long)built, seconds,
+           built/seconds, bytes/seconds*1e-9, cyc, ns);
+  else
+    printf("%d,0,replay,%d,%llu,%.4f,%.1f,%.4f,%.1f,%.1f\n", boards, merge,
+           (unsigned long long)built, seconds, built/seconds, bytes/seconds*1e-9, cyc, ns);
+  fflush(stdout);
+  return true;
+}
+
+//
+//--------------------------------------------------------------------------------
+static std::vector<std::string> Split(const char *s)
+{
+  std::vector<std::string> out;
+  std::string item;
+  for (; *s; s++) {
+    if (*s == ',') { out.push_back(item); item.clear(); }
+    else item += *s;
+  }
+  if (!item.empty()) out.push_back(item);
+  return out;
+}
+
+//
+//--------------------------------------------------------------------------------
+int main(int argc, char *argv[])
+{
+  int numEvents = 0;   // auto
+  std::vector<std::string> boards = Split("1,2,4,8");
+  std::vector<std::string> samples = Split("256,2048,16384");
+  std::vector<std::string> formats = Split("raw,zle");
+  std::vector<std::string> merges = Split("on,off");
+  bool json = false, trace = false;
+  const char *replayFile = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0) json = true;
+    else if (strcmp(argv[i], "-t") == 0) trace = true;
+    else if (i + 1 < argc && strcmp(argv[i], "-n") == 0) numEvents = atoi(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "-b") == 0) boards = Split(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "-s") == 0) samples = Split(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "-f") == 0) formats = Split(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "-m") == 0) merges = Split(argv[++i]);
+    else if (i + 1 < argc && strcmp(argv[i], "-r") == 0) replayFile = argv[++i];
+    else {
+      fprintf(stderr, "usage: %s [-n events] [-b 1,2,4,8] [-s 256,2048,16384] [-f raw,zle,raw25,zle25] [-m on,off] [-t] [-j]\n"
+                      "       %s -r file.mid[.gz] [-m on|off] [-t] [-j]\n", argv[0], argv[0]);
+      return 1;
+    }
+  }
+
+  int maxBoards = 1;
+  for (unsigned int i = 0; i < boards.size(); i++)
+    maxBoards = std::max(maxBoards, atoi(boards[i].c_str()));
+  if (replayFile) maxBoards = 1;   // main thread and replay thread
+  dt5751Trace::Instance().Init(maxBoards + 1, 65536);
+  dt5751Trace::Instance().SetEnabled(trace);
+  dt5751Metrics::SetThreadSlot(0);
+  dt5751Trace::SetThreadSlot(0);
+
+  std::vector<char> evbuf(sizeof(EVENT_HEADER) + DT5751_MAX_EVENT_SIZE);
+
+  if (!json)
+    printf("boards,samples,format,merge,events,seconds,events_per_s,gb_per_s,cycles_per_event,ns_per_event\n");
+
+  if (replayFile)
+    return RunReplay(replayFile, merges.empty() || merges[0] == "on", json, evbuf) ? 0 : 1;
+
+  for (unsigned int b = 0; b < boards.size(); b++)
+    for (unsigned int s = 0; s < samples.size(); s++)
+      for (unsigned int f = 0; f < formats.size(); f++)
+        for (unsigned int m = 0; m < merges.size(); m++) {
+          BenchPoint pt;
+          pt.boards = atoi(boards[b].c_str());
+          pt.samples = atoi(samples[s].c_str()) & ~1;
+          pt.zle = (formats[f] == "zle" || formats[f] == "zle25");
+          pt.pack25 = (formats[f] == "raw25" || formats[f] == "zle25");
+          pt.merge = (merges[m] == "on");
+          if (pt.boards <= 0 || pt.samples < 64)
+            continue;
+          int n = numEvents;
+          if (n <= 0) {
+            // About 256 MB of fragments per point
+            double bytes = pt.boards * (16.0 + 4*pt.samples*2);
+            n = (int)std::min(200000.0, std::max(2000.0, 256e6/bytes));
+          }
+          if (!RunPoint(pt, n, json, evbuf))
+            return 1;
+        }
+
+  return 0;
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
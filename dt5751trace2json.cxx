@@ -0,0 +1,121 @@
+/*****************************************************************************/
+/**
+\file dt5751trace2json.cxx
+
+## Contents
+
+Convert a flight recorder dump (see dt5751Trace) to the Chrome trace event
+JSON format, viewable in chrome://tracing or https://ui.perfetto.dev
+
+    dt5751trace2json dump.bin > dump.json
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "dt5751Trace.hxx"
+
+/* Print a JSON string value, quotes included */
+static void print_json_string(const char *s, size_t max)
+{
+  putchar('"');
+  for (size_t i = 0; i < max && s[i]; i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+      printf("\\%c", c);
+    else if (c < 0x20)
+      printf("\\u%04x", c);
+    else
+      putchar(c);
+  }
+  putchar('"');
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <trace dump>\n", argv[0]);
+    return 1;
+  }
+
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  dt5751TraceFileHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, DT5751_TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+    fprintf(stderr, "%s: not a dt5751 trace dump\n", argv[1]);
+    return 1;
+  }
+  if (hdr.version != DT5751_TRACE_VERSION) {
+    fprintf(stderr, "%s: unsupported version %u\n", argv[1], hdr.version);
+    return 1;
+  }
+
+  std::vector<std::vector<dt5751TraceRecord> > slots(hdr.num_slots);
+  uint64_t min_tsc = hdr.dump_tsc;
+  for (uint32_t s = 0; s < hdr.num_slots; s++) {
+    dt5751TraceSlotHeader shdr;
+    if (fread(&shdr, sizeof(shdr), 1, f) != 1 || shdr.slot >= hdr.num_slots) {
+      fprintf(stderr, "%s: truncated dump\n", argv[1]);
+      return 1;
+    }
+    slots[shdr.slot].resize(shdr.num_records);
+    if (shdr.num_records &&
+        fread(&slots[shdr.slot][0], sizeof(dt5751TraceRecord), shdr.num_records, f) != shdr.num_records) {
+      fprintf(stderr, "%s: truncated dump\n", argv[1]);
+      return 1;
+    }
+    if (shdr.num_records && slots[shdr.slot][0].tsc < min_tsc)
+      min_tsc = slots[shdr.slot][0].tsc;
+  }
+  fclose(f);
+
+  // The reason may come from the ODB
+  printf("{\"otherData\":{\"reason\":");
+  print_json_string(hdr.reason, sizeof(hdr.reason));
+  printf(",\"tsc_hz\":%.0f},\n\"traceEvents\":[\n", hdr.tsc_hz);
+  printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"main\"}}");
+  for (uint32_t s = 1; s < hdr.num_slots; s++) {
+    // The trigger generator follows the link threads
+    bool generator = false;
+    for (size_t i = 0; i < slots[s].size() && !generator; i++)
+      generator = (slots[s][i].type == dt5751Trace::SwTrigger);
+    if (generator)
+      printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"sw trigger\"}}", s);
+    else
+      printf(",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"link %u\"}}", s, s - 1);
+  }
+
+  for (uint32_t s = 0; s < hdr.num_slots; s++) {
+    for (size_t i = 0; i < slots[s].size(); i++) {
+      const dt5751TraceRecord &r = slots[s][i];
+      double ts = (r.tsc - min_tsc)/hdr.tsc_hz*1e6;
+      const char *name = (r.type < dt5751Trace::NumTypes) ? dt5751Trace::type_names[r.type] : "Unknown";
+
+      switch (r.type) {
+      case dt5751Trace::BltStart:
+        printf(",\n{\"name\":\"BLT\",\"ph\":\"B\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"args\":{\"module\":%d,\"requested\":%u}}",
+               s, ts, r.module, r.value);
+        break;
+      case dt5751Trace::BltEnd:
+        printf(",\n{\"name\":\"BLT\",\"ph\":\"E\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"args\":{\"bytes\":%u}}",
+               s, ts, r.value);
+        break;
+      case dt5751Trace::RbLevel:
+        printf(",\n{\"name\":\"rb_level M%02d\",\"ph\":\"C\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"args\":{\"bytes\":%u}}",
+               r.module, s, ts, r.value);
+        break;
+      default:
+        printf(",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"args\":{\"module\":%d,\"value\":%u}}",
+               name, s, ts, r.module, r.value);
+        break;
+      }
+    }
+  }
+  printf("\n]}\n");
+
+  return 0;
+}
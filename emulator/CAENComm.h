@@ -0,0 +1,66 @@
+/*****************************************************************************/
+/**
+\file emulator/CAENComm.h
+
+## Contents
+
+Stand-in for the CAENComm library header, declaring the subset of the API
+used by this frontend with the same names, values and signatures.  It is only
+on the include path when building with -DDT5751_EMULATOR=ON, in which case
+the functions are provided by the DT5751 emulator (CAENCommEmu.cxx) instead
+of libCAENComm.
+ *****************************************************************************/
+
+#ifndef __CAENCOMM_H
+#define __CAENCOMM_H
+
+#include <stdint.h>
+
+#define STDCALL
+
+typedef enum CAENComm_ConnectionType {
+  CAENComm_USB = 0,
+  CAENComm_OpticalLink = 1,
+  CAENComm_PCI_OpticalLink = 1,
+  CAENComm_PCIE_OpticalLink = 2,
+  CAENComm_PCIE = 3,
+} CAENComm_ConnectionType;
+
+typedef enum CAENComm_ErrorCode {
+  CAENComm_Success          =  0,
+  CAENComm_VMEBusError      = -1,
+  CAENComm_CommError        = -2,
+  CAENComm_GenericError     = -3,
+  CAENComm_InvalidParam     = -4,
+  CAENComm_InvalidLinkType  = -5,
+  CAENComm_InvalidHandler   = -6,
+  CAENComm_CommTimeout      = -7,
+  CAENComm_DeviceNotFound   = -8,
+  CAENComm_MaxDevicesError  = -9,
+  CAENComm_DeviceAlreadyOpen = -10,
+  CAENComm_NotSupported     = -11,
+  CAENComm_UnusedBridge     = -12,
+  CAENComm_Terminated       = -13,
+} CAENComm_ErrorCode;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+CAENComm_ErrorCode STDCALL CAENComm_OpenDevice(CAENComm_ConnectionType LinkType, int LinkNum, int ConetNode, uint32_t VMEBaseAddress, int *handle);
+CAENComm_ErrorCode STDCALL CAENComm_CloseDevice(int handle);
+CAENComm_ErrorCode STDCALL CAENComm_Write32(int handle, uint32_t Address, uint32_t Data);
+CAENComm_ErrorCode STDCALL CAENComm_Read32(int handle, uint32_t Address, uint32_t *Data);
+CAENComm_ErrorCode STDCALL CAENComm_MultiRead32(int handle, uint32_t *Address, int nCycles, uint32_t *data, CAENComm_ErrorCode *ErrorCode);
+CAENComm_ErrorCode STDCALL CAENComm_MultiWrite32(int handle, uint32_t *Address, int nCycles, uint32_t *data, CAENComm_ErrorCode *ErrorCode);
+CAENComm_ErrorCode STDCALL CAENComm_BLTRead(int handle, uint32_t Address, uint32_t *Buff, int BltSize, int *nw);
+CAENComm_ErrorCode STDCALL CAENComm_MBLTRead(int handle, uint32_t Address, uint32_t *Buff, int BltSize, int *nw);
+CAENComm_ErrorCode STDCALL CAENComm_IRQDisable(int handle);
+CAENComm_ErrorCode STDCALL CAENComm_IRQEnable(int handle);
+CAENComm_ErrorCode STDCALL CAENComm_IRQWait(int handle, uint32_t Timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __CAENCOMM_H
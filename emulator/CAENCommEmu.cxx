@@ -0,0 +1,877 @@
+/*****************************************************************************/
+/**
+\file CAENCommEmu.cxx
+
+## Contents
+
+In-process DT5751 emulator implementing the subset of the CAENComm API used
+by this frontend, so that feodt5751 and odt5751 can be run and benchmarked
+on any Linux box without an A3818 or boards.  Link it instead of
+libCAENComm with the CMake option -DDT5751_EMULATOR=ON.
+
+What is modelled:
+ - the register map of dt5751Raw.h (plain R/W registers, read-only status
+   and firmware registers, write-only commands);
+ - buffer organization (1<<N buffers, or record length based for the ZLE
+   firmware), the almost-full level and EVENT_FULL;
+ - triggers at a configurable rate (fixed or Poisson) shared by all boards
+   so that fragments can be merged, gated by the trigger source mask and
+   the SW trigger;
+ - record length (custom size), post/pre trigger, DES mode, pack 2 and
+   pack 2.5 raw and ZLE output with the 31-bit trigger time tag rolling over
+   at 17.2 s, or the 48-bit extended one (FP I/O control [22:21] = 2);
+ - CONET2 bandwidth and latency, shared between the boards of a daisy chain.
+
+Configuration is taken from the environment when the first device is
+opened:
+
+| Variable               | Default | Meaning                                  |
+|------------------------|---------|------------------------------------------|
+| DT5751EMU_RATE_HZ      | 1000    | Trigger rate, 0 for SW triggers only     |
+| DT5751EMU_POISSON      | 0       | 1 for exponential trigger spacing        |
+| DT5751EMU_LINK_MBPS    | 85      | Link bandwidth in MB/s, 0 for unlimited  |
+| DT5751EMU_LATENCY_US   | 10      | Round trip per BLT/register access       |
+| DT5751EMU_ZLE_FW       | 0       | 1 to emulate the ZLE firmware            |
+| DT5751EMU_HIT_PROB     | 0.3     | Probability of a pulse per channel       |
+| DT5751EMU_TTT_START    | 0       | Initial TTT, e.g. 0x7ff00000 for rollover|
+| DT5751EMU_LINKS        | 8       | Optical links available                  |
+| DT5751EMU_BOARDS       | 8       | Boards per link (CONET nodes)            |
+| DT5751EMU_SEED         | 1       | Random seed                              |
+| DT5751EMU_VERBOSE      | 0       | Print the configuration on first open    |
+ *****************************************************************************/
+
+#include "CAENComm.h"
+#include "dt5751Raw.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+
+namespace {
+
+const int kMaxHandles = 256;
+const int kNumRegisters = 0x10000/4;
+const int kNumChannels = 4;
+const uint32_t kSramSamplesPerChannel = 1800000;
+const uint32_t kMaxBuffers = 1024;
+const uint32_t kTtsTicksPerSecond = 125000000;  // 8 ns TTT ticks
+const uint32_t kAmcFwRev = 0x0c020007;
+const uint32_t kRocFwRev = 0x17200410;
+const uint32_t kBoardInfo = 0x00040805;         // 4 ch, DT5751 (type 0x05)
+const size_t kMaxTemplateWords = 4*1024*1024;   // per board
+const uint64_t kSyncStartNs = 100000000;        // run starts closer than this share the triggers
+
+struct EmuConfig {
+  double rate_hz;
+  bool poisson;
+  double link_mbps;
+  double latency_us;
+  bool zle_fw;
+  double hit_prob;
+  uint32_t ttt_start;
+  int links;
+  int boards_per_link;
+  uint32_t seed;
+  bool verbose;
+};
+
+double EnvDouble(const char *name, double def)
+{
+  const char *s = getenv(name);
+  return (s && *s) ? strtod(s, NULL) : def;
+}
+
+const EmuConfig &Config()
+{
+  static EmuConfig config = [] {
+    EmuConfig c;
+    c.rate_hz         = EnvDouble("DT5751EMU_RATE_HZ", 1000);
+    c.poisson         = EnvDouble("DT5751EMU_POISSON", 0) != 0;
+    c.link_mbps       = EnvDouble("DT5751EMU_LINK_MBPS", 85);
+    c.latency_us      = EnvDouble("DT5751EMU_LATENCY_US", 10);
+    c.zle_fw          = EnvDouble("DT5751EMU_ZLE_FW", 0) != 0;
+    c.hit_prob        = EnvDouble("DT5751EMU_HIT_PROB", 0.3);
+    c.ttt_start       = (uint32_t)EnvDouble("DT5751EMU_TTT_START", 0) & 0x7FFFFFFF;
+    c.links           = (int)EnvDouble("DT5751EMU_LINKS", 8);
+    c.boards_per_link = (int)EnvDouble("DT5751EMU_BOARDS", 8);
+    c.seed            = (uint32_t)EnvDouble("DT5751EMU_SEED", 1);
+    c.verbose         = EnvDouble("DT5751EMU_VERBOSE", 0) != 0;
+    if (c.verbose)
+      printf("DT5751 emulator: rate %g Hz%s, link %g MB/s, latency %g us, %s firmware, "
+             "%d links x %d boards\n", c.rate_hz, c.poisson ? " (Poisson)" : "",
+             c.link_mbps, c.latency_us, c.zle_fw ? "ZLE" : "raw", c.links, c.boards_per_link);
+    return c;
+  }();
+  return config;
+}
+
+uint64_t NowNs()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+void SleepUntilNs(uint64_t t)
+{
+  uint64_t now = NowNs();
+  if (t <= now)
+    return;
+  if (t - now < 50000) {
+    // Too short for the scheduler, spin
+    while (NowNs() < t)
+      ;
+    return;
+  }
+  timespec ts;
+  ts.tv_sec = t / 1000000000ull;
+  ts.tv_nsec = t % 1000000000ull;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+uint64_t SplitMix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ull;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+  return x ^ (x >> 31);
+}
+
+/**
+ * Trigger schedule shared by all boards: trigger k happens at epoch plus
+ * the sum of TriggerGapNs(0..k), so boards that are started together see the
+ * same triggers with the same time tags.
+ */
+struct TriggerClock {
+  std::mutex mutex;
+  uint64_t epoch_ns;
+  int running_boards;
+};
+
+TriggerClock g_clock;
+
+uint64_t TriggerGapNs(uint64_t k)
+{
+  const EmuConfig &c = Config();
+  double mean = 1e9 / c.rate_hz;
+  if (!c.poisson)
+    return (uint64_t)mean;
+  double u = ((SplitMix64(k ^ ((uint64_t)c.seed << 32)) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+  return (uint64_t)(-log(u) * mean) + 1;
+}
+
+/** Event waiting in the board memory; the data comes from a template */
+struct StoredEvent {
+  uint32_t counter;
+  uint32_t ttt;
+  uint32_t ttt_high;      // Extended time tag [47:32], header word 1 [23:8]
+  uint32_t tmpl;
+};
+
+/** Optical link shared by a daisy chain */
+struct Link {
+  std::mutex mutex;
+  uint64_t free_ns = 0;
+};
+
+Link g_links[64];
+
+struct Board {
+  std::mutex mutex;
+  int link = 0;
+  int node = 0;
+  bool open = false;
+  uint32_t regs[kNumRegisters];
+
+  bool running = false;
+  uint64_t run_start_ns = 0;
+  uint64_t epoch_ns = 0;
+  uint64_t next_trigger = 0;           //!< Index of the next trigger
+  uint64_t next_trigger_ns = 0;        //!< Its time
+  uint32_t event_counter = 0;
+  uint64_t lost_triggers = 0;
+  std::deque<StoredEvent> events;
+  uint32_t read_offset = 0;            //!< Words of the front event already read
+  bool irq_enabled = false;
+
+  std::vector<std::vector<uint32_t> > templates;
+  bool templates_dirty = true;
+  std::mt19937 rng;
+
+  uint32_t &Reg(uint32_t addr) { return regs[(addr & 0xFFFF) >> 2]; }
+};
+
+std::mutex g_boards_mutex;
+std::unique_ptr<Board> g_boards[64][8];
+std::atomic<Board *> g_handles[kMaxHandles];
+
+//
+//--------------------------------------------------------------------------------
+void ResetRegisters(Board &b)
+{
+  memset(b.regs, 0, sizeof(b.regs));
+  b.Reg(DT5751_BOARD_CONFIG) = 0x10;
+  b.Reg(DT5751_TRIG_SRCE_EN_MASK) = 0xC0000000;
+  b.Reg(DT5751_CHANNEL_EN_MASK) = 0xF;
+  b.Reg(DT5751RAW_POST_TRIGGER_SETTING) = 0;
+  for (int ch = 0; ch < kNumChannels; ch++) {
+    b.Reg(DT5751_CHANNEL_DAC + (ch << 8)) = 0x8000;
+    b.Reg(DT5751ZLE_ZS_THRESHOLD + (ch << 8)) = 0x80000000 | 20;
+  }
+  b.events.clear();
+  b.read_offset = 0;
+  b.event_counter = 0;
+  b.templates_dirty = true;
+}
+
+//
+//--------------------------------------------------------------------------------
+uint32_t NumBuffers(Board &b, uint32_t words_per_event)
+{
+  if (Config().zle_fw) {
+    uint32_t n = kSramSamplesPerChannel / 2 / (words_per_event ? words_per_event : 1);
+    return n < 1 ? 1 : (n > kMaxBuffers ? kMaxBuffers : n);
+  }
+  uint32_t code = b.Reg(DT5751RAW_BUFFER_ORGANIZATION) & 0xF;
+  return 1u << (code > 10 ? 10 : code);
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * Samples per channel from the record length settings (see the factors in
+ * custom/dt5751_control.html).
+ */
+uint32_t SamplesPerChannel(Board &b)
+{
+  bool des = (b.Reg(DT5751_BOARD_CONFIG) >> 12) & 0x1;
+  uint32_t custom = b.Reg(DT5751RAW_CUSTOM_SIZE);
+  uint32_t max_samples = kSramSamplesPerChannel;
+  if (!Config().zle_fw)
+    max_samples /= (1u << ((b.Reg(DT5751RAW_BUFFER_ORGANIZATION) & 0xF) > 10 ? 10 : (b.Reg(DT5751RAW_BUFFER_ORGANIZATION) & 0xF)));
+  uint32_t samples = custom ? (uint32_t)(custom * 4.66) : max_samples;
+  if (samples > max_samples) samples = max_samples;
+  if (des) samples *= 2;
+  return (samples & ~1u) ? (samples & ~1u) : 2;
+}
+
+//
+//--------------------------------------------------------------------------------
+/** Baseline in ADC counts from the channel DAC offset */
+int Baseline(Board &b, int ch)
+{
+  uint32_t dac = b.Reg(DT5751_CHANNEL_DAC + (ch << 8)) & 0xFFFF;
+  return 1023 - (int)((uint64_t)dac * 1023 / 65535);
+}
+
+//
+//--------------------------------------------------------------------------------
+void GenerateWaveform(Board &b, int ch, uint32_t samples, std::vector<uint16_t> &wf)
+{
+  const EmuConfig &c = Config();
+  std::normal_distribution<double> noise(0, 1.5);
+  std::uniform_real_distribution<double> uni(0, 1);
+  int baseline = Baseline(b, ch);
+  bool negative = (b.Reg(DT5751_BOARD_CONFIG) >> 6) & 0x1;
+
+  wf.resize(samples);
+  for (uint32_t i = 0; i < samples; i++)
+    wf[i] = (uint16_t)baseline;
+
+  if (uni(b.rng) < c.hit_prob) {
+    uint32_t pos;
+    if (c.zle_fw)
+      pos = b.Reg(DT5751ZLE_PRE_TRIGGER_SETTING) * 4;
+    else
+      pos = samples - b.Reg(DT5751RAW_POST_TRIGGER_SETTING) * 16 % samples;
+    if (pos >= samples) pos = samples / 2;
+    double amp = 50 + 250*uni(b.rng);
+    for (uint32_t i = pos; i < samples && i < pos + 200; i++) {
+      double t = i - pos;
+      double v = amp * (1 - exp(-t/1.5)) * exp(-t/20.);
+      int s = negative ? baseline - (int)v : baseline + (int)v;
+      wf[i] = (uint16_t)s;
+    }
+  }
+  for (uint32_t i = 0; i < samples; i++) {
+    int s = wf[i] + (int)lround(noise(b.rng));
+    wf[i] = (uint16_t)(s < 0 ? 0 : (s > 1023 ? 1023 : s));
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * ZLE encoding of one channel: a size word (including itself) followed by
+ * control words, bit 31 set for a stored (good) interval and the length in
+ * words in [20:0], each good control word followed by its data.
+ */
+void EncodeZle(Board &b, int ch, const std::vector<uint16_t> &wf, std::vector<uint32_t> &out)
+{
+  uint32_t nwords = wf.size() / 2;
+  size_t size_pos = out.size();
+  out.push_back(0);
+
+  bool zle = !((b.Reg(DT5751ZLE_INPUT_CONTROL + (ch << 8)) >> 7) & 0x1);
+  std::vector<char> good(nwords, zle ? 0 : 1);
+  if (zle) {
+    uint32_t treg = b.Reg(DT5751ZLE_ZS_THRESHOLD + (ch << 8));
+    int thr = (int)(treg & 0x7FFFFFFF);
+    bool below = treg & 0x80000000;
+    int baseline = b.Reg(DT5751ZLE_ZS_BASELINE + (ch << 8)) & 0x3FF;
+    if (baseline == 0) baseline = Baseline(b, ch);
+    uint32_t before = b.Reg(DT5751ZLE_ZS_NSAMP_BEFORE + (ch << 8));
+    uint32_t after = b.Reg(DT5751ZLE_ZS_NSAMP_AFTER + (ch << 8));
+    for (uint32_t w = 0; w < nwords; w++) {
+      for (int k = 0; k < 2; k++) {
+        int s = wf[2*w + k];
+        if ((below && s < baseline - thr) || (!below && s > baseline + thr)) {
+          uint32_t lo = w > before ? w - before : 0;
+          uint32_t hi = w + after < nwords ? w + after : nwords - 1;
+          for (uint32_t i = lo; i <= hi; i++)
+            good[i] = 1;
+        }
+      }
+    }
+  }
+
+  uint32_t w = 0;
+  while (w < nwords) {
+    uint32_t start = w;
+    char g = good[w];
+    while (w < nwords && good[w] == g)
+      w++;
+    out.push_back((g ? 0x80000000u : 0) | ((w - start) & 0x1FFFFF));
+    if (g) {
+      for (uint32_t i = start; i < w; i++)
+        out.push_back(wf[2*i] | ((uint32_t)wf[2*i + 1] << 16));
+    }
+  }
+  out[size_pos] = out.size() - size_pos;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * Pack 2.5 encoding of one channel: 5 samples in 2 words, 12-bit fields,
+ * the third sample split over the two words (see dt5751Decoder.hxx).
+ */
+void EncodePack25(const std::vector<uint16_t> &wf, std::vector<uint32_t> &out)
+{
+  uint32_t n = wf.size();
+  for (uint32_t i = 0; i < n; i += 5) {
+    uint32_t s0 = wf[i];
+    uint32_t s1 = i + 1 < n ? wf[i + 1] : 0;
+    uint32_t s2 = i + 2 < n ? wf[i + 2] : 0;
+    uint32_t s3 = i + 3 < n ? wf[i + 3] : 0;
+    uint32_t s4 = i + 4 < n ? wf[i + 4] : 0;
+    out.push_back(s0 | (s1 << 12) | ((s2 & 0x3F) << 24));
+    if (n - i > 2)
+      out.push_back((s2 >> 6) | (s3 << 6) | (s4 << 18));
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * Regenerate the waveform templates after a configuration change.  Header
+ * words 1-3 are filled in when the event is read out.
+ */
+void BuildTemplates(Board &b)
+{
+  uint32_t mask = b.Reg(DT5751_CHANNEL_EN_MASK) & 0xF;
+  uint32_t samples = SamplesPerChannel(b);
+  int nch = __builtin_popcount(mask);
+  size_t approx_words = 4 + (size_t)nch * (samples / 2 + 2);
+  size_t ntemplates = kMaxTemplateWords / approx_words;
+  if (ntemplates > 16) ntemplates = 16;
+  if (ntemplates < 1) ntemplates = 1;
+
+  std::vector<uint16_t> wf;
+  b.templates.assign(ntemplates, std::vector<uint32_t>());
+  for (size_t t = 0; t < ntemplates; t++) {
+    std::vector<uint32_t> &ev = b.templates[t];
+    ev.reserve(approx_words);
+    ev.resize(4, 0);
+    for (int ch = 0; ch < kNumChannels; ch++) {
+      if (!(mask & (1 << ch)))
+        continue;
+      GenerateWaveform(b, ch, samples, wf);
+      if (Config().zle_fw) {
+        EncodeZle(b, ch, wf, ev);
+      } else if ((b.Reg(DT5751_BOARD_CONFIG) >> 11) & 0x1) {
+        EncodePack25(wf, ev);
+      } else {
+        for (uint32_t i = 0; i + 1 < samples; i += 2)
+          ev.push_back(wf[i] | ((uint32_t)wf[i + 1] << 16));
+      }
+    }
+    ev[0] = 0xA0000000 | (uint32_t)ev.size();
+  }
+  b.templates_dirty = false;
+}
+
+//
+//--------------------------------------------------------------------------------
+bool TriggerEnabled(Board &b)
+{
+  return (b.Reg(DT5751_TRIG_SRCE_EN_MASK) & 0x7FFFFFFF) != 0;
+}
+
+//
+//--------------------------------------------------------------------------------
+void StoreTrigger(Board &b, uint64_t t_ns)
+{
+  // Stored events refer to the templates, a new format applies once they are read
+  if (b.templates_dirty && b.events.empty())
+    BuildTemplates(b);
+  uint32_t capacity = NumBuffers(b, b.templates[0].size());
+  uint32_t almost_full = b.Reg(DT5751RAW_ALMOST_FULL_LEVEL);
+  if (b.events.size() >= capacity || (almost_full && b.events.size() >= almost_full)) {
+    b.lost_triggers++;
+    return;
+  }
+  StoredEvent ev;
+  ev.counter = b.event_counter++ & 0xFFFFFF;
+  // Whole seconds and remainder: the product in ns would overflow after minutes
+  uint64_t elapsed_ns = t_ns - b.epoch_ns;
+  uint64_t ticks = elapsed_ns / 1000000000ull * kTtsTicksPerSecond +
+                   elapsed_ns % 1000000000ull * kTtsTicksPerSecond / 1000000000ull;
+  ticks += Config().ttt_start;
+  if (((b.Reg(DT5751_FP_IO_CONTROL) >> 21) & 0x3) == 2) {
+    // Extended time tag: 48 bits, the pattern field carries the upper ones
+    ev.ttt = (uint32_t)ticks;
+    ev.ttt_high = (uint32_t)(ticks >> 32) & 0xFFFF;
+  } else {
+    ev.ttt = (uint32_t)ticks & 0x7FFFFFFF;
+    ev.ttt_high = 0;
+  }
+  ev.tmpl = ev.counter % b.templates.size();
+  b.events.push_back(ev);
+}
+
+//
+//--------------------------------------------------------------------------------
+/** Store all triggers that happened up to now */
+void Advance(Board &b, uint64_t now)
+{
+  if (!b.running || Config().rate_hz <= 0)
+    return;
+  bool enabled = TriggerEnabled(b);
+  while (b.next_trigger_ns <= now) {
+    if (enabled && b.next_trigger_ns >= b.run_start_ns)
+      StoreTrigger(b, b.next_trigger_ns);
+    b.next_trigger_ns += TriggerGapNs(++b.next_trigger);
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+void StartRun(Board &b)
+{
+  uint64_t now = NowNs();
+  {
+    std::lock_guard<std::mutex> lock(g_clock.mutex);
+    if (g_clock.running_boards++ == 0)
+      g_clock.epoch_ns = now;
+    b.epoch_ns = g_clock.epoch_ns;
+  }
+  b.running = true;
+  // Boards started in a quick sequence behave as if started by the same S-IN
+  b.run_start_ns = (now - b.epoch_ns < kSyncStartNs) ? b.epoch_ns : now;
+  b.next_trigger = 0;
+  b.next_trigger_ns = b.epoch_ns + (Config().rate_hz > 0 ? TriggerGapNs(0) : 0);
+  if (b.templates_dirty && b.events.empty())
+    BuildTemplates(b);
+}
+
+//
+//--------------------------------------------------------------------------------
+void StopRun(Board &b)
+{
+  Advance(b, NowNs());
+  b.running = false;
+  std::lock_guard<std::mutex> lock(g_clock.mutex);
+  if (g_clock.running_boards > 0)
+    g_clock.running_boards--;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * Account for a transaction on the optical link and wait until it is done.
+ * Boards on the same link share its bandwidth.
+ */
+void LinkTransfer(Board &b, uint32_t bytes)
+{
+  const EmuConfig &c = Config();
+  uint64_t cost = (uint64_t)(c.latency_us * 1000);
+  if (c.link_mbps > 0)
+    cost += (uint64_t)(bytes * 1000.0 / c.link_mbps);
+  if (cost == 0)
+    return;
+  Link &link = g_links[b.link];
+  uint64_t end;
+  {
+    std::lock_guard<std::mutex> lock(link.mutex);
+    uint64_t now = NowNs();
+    uint64_t start = link.free_ns > now ? link.free_ns : now;
+    end = start + cost;
+    link.free_ns = end;
+  }
+  SleepUntilNs(end);
+}
+
+//
+//--------------------------------------------------------------------------------
+uint32_t ReadRegister(Board &b, uint32_t addr)
+{
+  addr &= 0xFFFF;
+  Advance(b, NowNs());
+  if (addr >= 0x1000 && addr < 0x8000) {
+    switch (addr & 0xF0FF) {
+    case DT5751_CHANNEL_STATUS:      return 0x40;  // calibration done
+    case DT5751_FPGA_FWREV:          return kAmcFwRev;
+    case DT5751_CHANNEL_TEMPERATURE: return 40 + ((addr >> 8) & 0xF);
+    default:                         return b.Reg(addr);
+    }
+  }
+  switch (addr) {
+  case DT5751_ACQUISITION_STATUS: {
+    uint32_t capacity = NumBuffers(b, b.templates.empty() ? 4 : b.templates[0].size());
+    return (b.running ? 0x4 : 0) | (b.events.empty() ? 0 : 0x8) |
+      (b.events.size() >= capacity ? 0x10 : 0) | 0x80 | 0x100;
+  }
+  case DT5751_READOUT_STATUS:    return (b.events.empty() ? 0 : 0x1);
+  case DT5751_EVENT_STORED:      return b.events.size();
+  case DT5751_EVENT_SIZE: {
+    if (b.events.empty())
+      return 0;
+    return b.templates[b.events.front().tmpl].size() - b.read_offset;
+  }
+  case DT5751_BOARD_INFO:        return kBoardInfo;
+  case DT5751_ROC_FPGA_FW_REV:   return kRocFwRev;
+  case DT5751_BOARD_FAILURE_STATUS: return 0;
+  default:                       return b.Reg(addr);
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+void WriteRegister(Board &b, uint32_t addr, uint32_t data)
+{
+  addr &= 0xFFFF;
+  Advance(b, NowNs());
+  switch (addr) {
+  case DT5751_SW_RESET:
+    if (b.running) StopRun(b);
+    ResetRegisters(b);
+    return;
+  case DT5751_SW_CLEAR:
+    b.events.clear();
+    b.read_offset = 0;
+    b.event_counter = 0;
+    return;
+  case DT5751_SW_TRIGGER:
+    if (b.running && (b.Reg(DT5751_TRIG_SRCE_EN_MASK) & 0x80000000))
+      StoreTrigger(b, NowNs());
+    return;
+  case DT5751_ACQUISITION_CONTROL: {
+    bool run = data & 0x4;
+    b.Reg(addr) = data;
+    if (run && !b.running) StartRun(b);
+    else if (!run && b.running) StopRun(b);
+    return;
+  }
+  case DT5751_BOARD_CFG_BIT_SET:
+    b.Reg(DT5751_BOARD_CONFIG) |= data;
+    b.templates_dirty = true;
+    return;
+  case DT5751_BOARD_CFG_BIT_CLR:
+    b.Reg(DT5751_BOARD_CONFIG) &= ~data;
+    b.templates_dirty = true;
+    return;
+  case DT5751_TRIG_SRCE_EN_MASK:
+  case DT5751_FP_TRIGGER_OUT_EN_MASK:
+  case DT5751_BLT_EVENT_NB:
+  case DT5751_INTERRUPT_EVT_NB:
+  case DT5751RAW_ALMOST_FULL_LEVEL:
+  case DT5751_MONITOR_MODE:
+  case DT5751_SCRATCH:
+    b.Reg(addr) = data;
+    return;
+  default:
+    // Anything else may change the event format
+    b.Reg(addr) = data;
+    b.templates_dirty = true;
+    return;
+  }
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * Copy up to max_words of event data, honouring DT5751_BLT_EVENT_NB.
+ */
+int ReadData(Board &b, uint32_t *buf, int max_words)
+{
+  Advance(b, NowNs());
+  uint32_t max_events = b.Reg(DT5751_BLT_EVENT_NB);
+  uint32_t events_done = 0;
+  int nw = 0;
+  while (nw < max_words && !b.events.empty()) {
+    const StoredEvent &ev = b.events.front();
+    const std::vector<uint32_t> &tmpl = b.templates[ev.tmpl];
+    uint32_t remaining = tmpl.size() - b.read_offset;
+    uint32_t n = (uint32_t)(max_words - nw) < remaining ? (uint32_t)(max_words - nw) : remaining;
+    memcpy(buf + nw, &tmpl[b.read_offset], n*sizeof(uint32_t));
+
+    uint32_t header[4] = {
+      tmpl[0],
+      ((b.Reg(DT5751_BOARD_ID) & 0x1F) << 27) | (ev.ttt_high << 8) | (b.Reg(DT5751_CHANNEL_EN_MASK) & 0xF),
+      ev.counter,
+      ev.ttt
+    };
+    for (uint32_t i = b.read_offset; i < 4 && i < b.read_offset + n; i++)
+      buf[nw + i - b.read_offset] = header[i];
+
+    nw += n;
+    b.read_offset += n;
+    if (b.read_offset == tmpl.size()) {
+      b.events.pop_front();
+      b.read_offset = 0;
+      if (max_events && ++events_done >= max_events)
+        break;
+    }
+  }
+  return nw;
+}
+
+//
+//--------------------------------------------------------------------------------
+Board *GetBoard(int handle)
+{
+  if (handle < 0 || handle >= kMaxHandles)
+    return NULL;
+  return g_handles[handle].load(std::memory_order_acquire);
+}
+
+} // namespace
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode CAENComm_OpenDevice(CAENComm_ConnectionType LinkType, int LinkNum, int ConetNode,
+                                       uint32_t VMEBaseAddress, int *handle)
+{
+  const EmuConfig &c = Config();
+  (void)LinkType; (void)VMEBaseAddress;
+  if (LinkNum < 0 || LinkNum >= c.links || LinkNum >= 64 || ConetNode < 0 ||
+      ConetNode >= c.boards_per_link || ConetNode >= 8)
+    return CAENComm_DeviceNotFound;
+
+  std::lock_guard<std::mutex> lock(g_boards_mutex);
+  std::unique_ptr<Board> &slot = g_boards[LinkNum][ConetNode];
+  if (!slot) {
+    slot.reset(new Board);
+    slot->link = LinkNum;
+    slot->node = ConetNode;
+    slot->rng.seed(c.seed ^ (LinkNum << 8) ^ ConetNode);
+    ResetRegisters(*slot);
+  }
+  if (slot->open)
+    return CAENComm_DeviceAlreadyOpen;
+
+  for (int h = 0; h < kMaxHandles; h++) {
+    if (g_handles[h].load() == NULL) {
+      slot->open = true;
+      g_handles[h].store(slot.get(), std::memory_order_release);
+      *handle = h;
+      return CAENComm_Success;
+    }
+  }
+  return CAENComm_MaxDevicesError;
+}
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode CAENComm_CloseDevice(int handle)
+{
+  Board *b = GetBoard(handle);
+  if (!b)
+    return CAENComm_InvalidHandler;
+  std::lock_guard<std::mutex> lock(g_boards_mutex);
+  b->open = false;
+  g_handles[handle].store(NULL, std::memory_order_release);
+  return CAENComm_Success;
+}
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode CAENComm_Read32(int handle, uint32_t Address, uint32_t *Data)
+{
+  Board *b = GetBoard(handle);
+  if (!b)
+    return CAENComm_InvalidHandler;
+  {
+    std::lock_guard<std::mutex> lock(b->mutex);
+    *Data = ReadRegister(*b, Address);
+  }
+  LinkTransfer(*b, 4);
+  return CAENComm_Success;
+}
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode CAENComm_Write32(int handle, uint32_t Address, uint32_t Data)
+{
+  Board *b = GetBoard(handle);
+  if (!b)
+    return CAENComm_InvalidHandler;
+  {
+    std::lock_guard<std::mutex> lock(b->mutex);
+    WriteRegister(*b, Address, Data);
+  }
+  LinkTransfer(*b, 4);
+  return CAENComm_Success;
+}
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode CAENComm_MultiRead32(int handle, uint32_t *Address, int nCycles, uint32_t *data,
+                                        CAENComm_ErrorCode *ErrorCode)
+{
+  Board *b = GetBoard(handle);
+  if (!b)
+    return CAENComm_InvalidHandler;
+  {
+    std::lock_guard<std::mutex> lock(b->mutex);
+    for (int i = 0; i < nCycles; i++) {
+      data[i] = ReadRegister(*b, Address[i]);
+      if (ErrorCode) ErrorCode[i] = CAENComm_Success;
+    }
+  }
+  LinkTransfer(*b, 8*nCycles);
+  return CAENComm_Success;
+}
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode CAENComm_MultiWrite32(int handle, uint32_t *Address, int nCycles, uint32_t *data,
+                                         CAENComm_ErrorCode *ErrorCode)
+{
+  Board *b = GetBoard(handle);
+  if (!b)
+    return CAENComm_InvalidHandler;
+  {
+    std::lock_guard<std::mutex> lock(b->mutex);
+    for (int i = 0; i < nCycles; i++) {
+      WriteRegister(*b, Address[i], data[i]);
+      if (ErrorCode) ErrorCode[i] = CAENComm_Success;
+    }
+  }
+  LinkTransfer(*b, 8*nCycles);
+  return CAENComm_Success;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * Block transfer from the event readout buffer.  As in CAENComm, BltSize is
+ * in bytes and nw returns the number of 32-bit words read.
+ */
+CAENComm_ErrorCode CAENComm_BLTRead(int handle, uint32_t Address, uint32_t *Buff, int BltSize, int *nw)
+{
+  Board *b = GetBoard(handle);
+  if (!b)
+    return CAENComm_InvalidHandler;
+  if ((Address & 0xFFFF) >= 0x1000 || BltSize < 0)
+    return CAENComm_InvalidParam;
+  {
+    std::lock_guard<std::mutex> lock(b->mutex);
+    *nw = ReadData(*b, Buff, (BltSize + 3) / 4);
+  }
+  LinkTransfer(*b, *nw * 4);
+  return CAENComm_Success;
+}
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode CAENComm_MBLTRead(int handle, uint32_t Address, uint32_t *Buff, int BltSize, int *nw)
+{
+  return CAENComm_BLTRead(handle, Address, Buff, BltSize, nw);
+}
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode CAENComm_IRQEnable(int handle)
+{
+  Board *b = GetBoard(handle);
+  if (!b)
+    return CAENComm_InvalidHandler;
+  std::lock_guard<std::mutex> lock(b->mutex);
+  b->irq_enabled = true;
+  return CAENComm_Success;
+}
+
+//
+//--------------------------------------------------------------------------------
+CAENComm_ErrorCode CAENComm_IRQDisable(int handle)
+{
+  Board *b = GetBoard(handle);
+  if (!b)
+    return CAENComm_InvalidHandler;
+  std::lock_guard<std::mutex> lock(b->mutex);
+  b->irq_enabled = false;
+  return CAENComm_Success;
+}
+
+//
+//--------------------------------------------------------------------------------
+/**
+ * Wait until DT5751_INTERRUPT_EVT_NB events are stored.
+ *
+ * \param   [in]  Timeout  in ms
+ */
+CAENComm_ErrorCode CAENComm_IRQWait(int handle, uint32_t Timeout)
+{
+  Board *b = GetBoard(handle);
+  if (!b)
+    return CAENComm_InvalidHandler;
+  uint64_t deadline = NowNs() + (uint64_t)Timeout * 1000000ull;
+  for (;;) {
+    uint64_t now = NowNs();
+    uint64_t wake;
+    {
+      std::lock_guard<std::mutex> lock(b->mutex);
+      Advance(*b, now);
+      uint32_t level = b->Reg(DT5751_INTERRUPT_EVT_NB);
+      if (b->irq_enabled && b->events.size() >= (level ? level : 1))
+        return CAENComm_Success;
+      wake = (b->running && Config().rate_hz > 0) ? b->next_trigger_ns : now + 1000000;
+    }
+    if (now >= deadline)
+      return CAENComm_CommTimeout;
+    if (wake > deadline) wake = deadline;
+    if (wake < now + 100000) wake = now + 100000;
+    SleepUntilNs(wake);
+  }
+}
+
+/* emacs
+ * Local Variables:
+ * mode:C
+ * mode:font-lock
+ * tab-width: 2
+ * c-basic-offset: 2
+ * End:
+ */
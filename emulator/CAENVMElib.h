@@ -0,0 +1,13 @@
+/*****************************************************************************/
+/**
+\file emulator/CAENVMElib.h
+
+## Contents
+
+Empty stand-in for the CAENVMElib header when building against the DT5751
+emulator.  Nothing from CAENVMElib is used by this frontend.
+ *****************************************************************************/
+
+#ifndef __CAENVMELIB_H
+#define __CAENVMELIB_H
+#endif // __CAENVMELIB_H
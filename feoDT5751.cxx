@@ -35,49 +35,155 @@ occations:
 - end_of_run:     Called on a request to stop a run. Can send
                 end-of-run event and close run gates.
 
-- pause_run:      When a run is paused. Should disable trigger events.
+- pause_run:      When a run is paused. Gates the triggers, the data
+                already acquired is kept.
 
-- resume_run:     When a run is resumed. Should enable trigger events.
+- resume_run:     When a run is resumed. Re-enables the triggers.
 
 \subsection notes Notes about this frontend
 
-This frontend has been designed so that it should compile and work
-by default without actual actual access to DT5751 hardware. We have turned
-off portions of code which make use of the driver to the actual hardware.
-Where data acquisition should be performed, we generate random data instead
-(see dt5751CONET2::ReadEvent()). See usage below to use real hardware.
-
-The code to use real hardware assumes this setup:
-- 1 A3818 PCI-e board per PC to receive optical connections
-- NBLINKSPERA3818 links per A3818 board
-- NBLINKSPERFE optical links controlled by each frontend
-- NBDT5751PERLINK  modules per optical link (daisy chained)
-- NBDT5751TOTAL DT5751 modules in total
+This frontend can be run without DT5751 hardware by linking it against the
+in-process CAENComm emulator (emulator/CAENCommEmu.cxx), which generates
+waveforms at a configurable trigger rate and models the optical link:
+
+    cmake -DDT5751_EMULATOR=ON ..
+
+See the emulator file header for its environment variables.
+
+A recorded run can also be fed through the event builder instead of reading
+the boards: set "Replay file" (.mid or .mid.gz) in the Settings of the data
+equipment before starting the frontend, and "Replay speed" (0: as fast as
+possible, 1: recorded rate).  The W2xx/ZLxx banks of the modules of this
+frontend and the ZMQ0 banks are replayed from the start of the file at every
+begin of run (see dt5751Replay.hxx).  See usage below to use real hardware.
+
+The link threads (one per optical link) and the ring buffers (one per board)
+are created once in frontend_init and kept until frontend_exit.  Between
+runs the threads are parked; the transitions only release or park them and
+empty the ring buffers, so short runs do not pay for thread start-up and
+buffer allocation.  A pause only disables the trigger sources of the boards,
+the threads keep running and no buffered event is dropped.
+
+For throughput and deadtime tests, a generator thread can send software
+triggers on its own clock: set "SW trigger pattern" to fixed, poisson or
+burst, with "SW trigger rate (Hz)" (and "SW trigger burst size", "SW trigger
+burst period (s)").  "SW trigger all boards" off triggers the first board
+only, for setups that fan its TRG-OUT to the others.  The rate achieved and
+the missed ticks are reported at end of run (see dt5751TrigGen.hxx).
+
+While a link thread runs, it is the only thread touching its link: register
+accesses from the main thread (software triggers, buffer level and
+temperature reads, run control) are queued and done by the link thread
+after each readout pass, triggers first (see dt5751LinkQueue.hxx).  The MT
+banks count them (link_commands) and time them (link_cmd_ns in Prometheus).
+
+With several boards daisy chained on a link, each pass of the link thread
+reads EVENT_STORED of the boards, then reads up to "Events per visit" events
+from each board holding some, fullest first.  A board found empty is not
+polled again for a backoff that doubles up to "Idle board backoff (us)"
+(see dt5751LinkScheduler.hxx and the board_polls and polls_skipped
+counters of the MT banks).
+
+Run start, stop and pause are single register writes sent to all the boards
+at once: the write of every board is queued on its link before waiting for
+any of them, so that the links carry them out in parallel (CONET has no
+multicast cycle, the boards of one daisy chain still follow each other).
+The boards are cleared (SW_CLEAR) the same way right before the start.
+"Sync clocks at start" also resynchronizes the clocks of all the boards
+(SW_CLOCK_SYNCH) before the clear, and "Run start delay step" (clock
+cycles) sets RUN_START_STOP_DELAY to (n-1-k) steps on the k-th of the n
+boards, compensating the propagation of a start chained in hardware; 0
+clears the delays.
+
+At high rates with short records, "Triggers per event" above 1 packs
+several merged triggers into one MIDAS event, with an EVIX bank giving the
+offset, size and time tag of the banks of each trigger (see
+dt5751Batch.hxx).  The number of triggers follows the trigger rate, so that
+the first trigger of an event never waits more than "Batch latency (us)"
+for the others.  The midas_events counter of the MT banks counts the events
+sent.
+
+"L2 filter" drops, before any bank is created, the merged events without a
+coincidence: at least "L2 min channels" channels further than "L2 threshold
+(ADC)" from their baseline (mean of the first "L2 baseline samples"), on at
+least "L2 min boards" boards, with first samples over threshold within "L2
+window (ns)".  One failing event in "L2 prescale" is written anyway (0 for
+none).  The events written carry an L2FL bank: 0 if accepted, 1 if kept by
+the prescaler, then the channels and boards of the best coincidence (see
+dt5751L2Filter.hxx).  The l2_* counters of the MT banks count the decisions.
+
+The time tag differences of the merged events, between the boards of each
+pair and between each board and the chronobox, are histogrammed online
+with bins of "Timing bin (ticks)" (Settings of the buffer level equipment)
+and published with the buffer levels in a TDIF bank, their means in
+/Equipment/DT5751_BufLvlXX/Timing (see dt5751Timing.hxx): clock drift and
+matching threshold margin can be followed during the run.
+
+"Baseline tracking" holds the baseline of every channel at "Baseline
+target (ADC)" against temperature drifts, without reinitializing the boards:
+one event in "Baseline sample interval" is sampled (first "Baseline samples"
+of each channel, windows spreading over more than "Baseline max spread
+(ADC)" ignored), and at each buffer level readout, at most every "Baseline
+update period (s)", a baseline off by more than "Baseline tolerance (ADC)"
+moves the DAC by "Baseline DAC per ADC" counts per ADC count (at most
+"Baseline max DAC step").  The self-trigger thresholds and ZLE baselines of
+the board settings, meant for a baseline at the target, are shifted with
+it.  The corrections are kept for the next runs; the estimates and DAC
+values are mirrored in /Equipment/DT5751_BufLvlXX/Baseline (see
+dt5751Baseline.hxx).
+
+For continuous self-triggered data, "Streaming mode" replaces the matching
+of triggers: each MIDAS event is a time frame of "Frame width (us)" of the
+extended trigger time tags, with the fragments of every board in it, and
+repeats the fragments of the last "Frame overlap (us)" of the previous frame
+(see dt5751EventBuilder.hxx for the FRAM bank).  The chronobox bank and the
+batching do not apply.  The time tags are extended by the firmware when FP
+I/O control bits [22:21] are 2, otherwise in software by counting their
+rollovers.
+
+Bursts that the ring buffers cannot absorb can spill to local disk: set
+"Spill directory" (and "Spill size (MB)" per board) before starting the
+frontend.  Above 75% ring buffer level the link thread appends the events to
+a preallocated file instead of stalling the readout, and moves them back in
+order once the ring buffer has drained below 25% (see dt5751Spill.hxx).
+
+The code to use real hardware assumes this setup, set in the Settings of
+the data equipment and read when the frontend starts (see dt5751Topology.hxx):
+- "A3818 cards": A3818 PCI-e boards per PC to receive optical connections
+- "Links per A3818": optical ports of each A3818; the links of all the cards
+  of a PC are numbered consecutively, card by card
+- "Links per frontend": optical links controlled by each frontend, possibly
+  on several cards
+- "Boards per link": modules per optical link (daisy chained)
+- "Boards total": DT5751 modules in total
+- "A3818 NUMA nodes": NUMA node of each card (e.g. "0,1"), empty to find
+  them in sysfs.  The link threads of a card run on the CPUs of its node,
+  so the ring buffers they fill are allocated there (first touch).
 - The event builder mechanism is used
 
 \subsection usage Usage
 
 
 \subsubsection real Real hardware
-Adjust NBLINKSPERA3818, NBLINKSPERFE, NBDT5751PERLINK and NBDT5751TOTAL below according
-to your setup.  NBDT5751TOTAL / (NBLINKSPERFE * NBDT5751PERLINK) frontends
+Adjust the settings above according to your setup.
+"Boards total" / ("Links per frontend" * "Boards per link") frontends
 must be started in total. When a frontend is started, it must be assigned an index
 number:
 
     ./frontend -i 0
 
-If no index number is supplied, it is assumed that only 1 frontend is used to control
-all boards on all links on that computer.
-
 For example, consider the following setup:
 
-    NBLINKSPERA3818    4     // Number of optical links used per A3818
-    NBLINKSPERFE       1     // Number of optical links controlled by each frontend
-    NBDT5751PERLINK    2     // Number of daisy-chained DT5751s per optical link
-    NBDT5751TOTAL      32    // Number of DT5751 boards in total
+    A3818 cards          1     // A3818 boards per PC
+    Links per A3818      4     // Number of optical links used per A3818
+    Links per frontend   2     // Number of optical links controlled by each frontend
+    Boards per link      2     // Number of daisy-chained DT5751s per optical link
+    Boards total         32    // Number of DT5751 boards in total
 
-We will need 32/(2*2) = 8 frontends (8 indexes; from 0 to 7).  Each frontend
-controls 2*2 = 4 DT5751 boards.  Compile and run:
+We will need 32/(2*2) = 8 frontends (8 indexes; from 0 to 7), two per PC.
+Each frontend controls 2*2 = 4 DT5751 boards.  With "A3818 cards" 2 and
+"Links per frontend" 8 instead, one frontend per PC reads 16 boards on two
+cards.  Compile and run:
 
     ./feodt5751.exe
 
@@ -87,16 +193,33 @@ controls 2*2 = 4 DT5751 boards.  Compile and run:
 #include <stdlib.h>
 #include <sys/time.h>
 #include <sched.h>
+#include <signal.h>
+#include <errno.h>
 #include <sys/resource.h>
 
 #include <fstream>
 #include <string>
 #include <vector>
 #include <memory>
+#include <atomic>
 
 #include "midas.h"
 #include "mfe.h"
 #include "dt5751CONET2.hxx"
+#include "dt5751Baseline.hxx"
+#include "dt5751Batch.hxx"
+#include "dt5751EventBuilder.hxx"
+#include "dt5751L2Filter.hxx"
+#include "dt5751LinkQueue.hxx"
+#include "dt5751LinkScheduler.hxx"
+#include "dt5751Metrics.hxx"
+#include "dt5751RegProfile.hxx"
+#include "dt5751Replay.hxx"
+#include "dt5751Spill.hxx"
+#include "dt5751Timing.hxx"
+#include "dt5751Topology.hxx"
+#include "dt5751Trace.hxx"
+#include "dt5751TrigGen.hxx"
 
 #include <zmq.h>
 
@@ -104,15 +227,6 @@ controls 2*2 = 4 DT5751 boards.  Compile and run:
 // --- General feodt5751 parameters
 
 
-#ifndef NBLINKSPERA3818
-#define NBLINKSPERA3818   1   //!< Number of optical links used per A3818
-#define NBLINKSPERFE      1   //!< Number of optical links controlled by each frontend
-#define NBDT5751PERLINK     1   //!< Number of daisy-chained dt5751s per optical link
-#define NBDT5751TOTAL      1  //!< Number of dt5751 boards in total
-#define NBCORES           4   //!< Number of cpu cores, for process/thread locking
-#endif
-
-
 #define SLEEP_TIME_BETWEEN_CONNECTS 50 // in milliseconds
 
 #define  EQ_EVID   1                //!< Event ID
@@ -151,19 +265,72 @@ INT event_buffer_size = 20 * max_event_size + 10000;
 #else
 INT event_buffer_size = 30 * max_event_size + 10000;
 #endif
+//! ring buffer level above which the link threads stop reading (or spill to disk)
+const double rb_high_water = 0.75;
+//! ring buffer level below which spilled fragments are moved back
+const double rb_low_water = 0.25;
+//! the buffer level and temperature equipments (1 s) share a slow-control snapshot this recent
+const uint64_t slow_control_max_age_ns = 500000000;
 
 bool runInProgress = false; //!< run is in progress
+bool runPaused = false;     //!< triggers gated by pause_run, run still in progress
 bool stopRunInProgress = false; //!<
 bool eor_transition_called = false; // already called EOR
-uint32_t timestamp_offset[NBLINKSPERFE*NBDT5751PERLINK]; //!< trigger time stamp offsets
 
 std::string chronoboxIP = "172.16.4.71";
 BOOL enableChronobox = true;
 BOOL enableMerging = true;
-int unmergedModuleToRead = -1;
 BOOL writePartiallyMergedEvents = false;
-BOOL flushBuffersAtEndOfRun = false;
+BOOL flushBuffersAtEndOfRun = true;        //!< Drain boards and ring buffers in a deferred stop
+DWORD drainTimeout = 10;                    //!< Deadline of the end of run drain (s)
+std::string swTrigPattern = "off";          //!< Software trigger generator: off, fixed, poisson or burst
+double swTrigRate = 1000;                   //!< Generator rate (mean rate for poisson)
+INT swTrigBurstSize = 100;                  //!< Triggers per burst
+double swTrigBurstPeriod = 1;               //!< Time between the starts of two bursts (s)
+BOOL swTrigAllBoards = TRUE;                //!< Trigger every board, or the first one (TRG-OUT fan-out)
 INT timestampMatchingThreshold = 50;
+BOOL streamingMode = false;                 //!< Time frames instead of triggers
+DWORD frameWidthUs = 1000;                  //!< Streaming frame width
+DWORD frameOverlapUs = 0;                   //!< Fragments repeated from the previous frame
+DWORD frameTimeoutMs = 100;                 //!< Wait for the boards behind
+std::string metricsFile = "";  //!< Prometheus text file, empty to disable
+DWORD timingBinTicks = 2;      //!< Bin width of the time tag difference histograms
+BOOL traceEnable = true;                    //!< Flight recorder on/off
+std::string traceDirectory = "/tmp";        //!< Where flight recorder dumps go
+BOOL regProfileEnable = false;              //!< Register access profile, written at end of run
+volatile sig_atomic_t traceDumpRequested = 0; //!< Set by SIGUSR1
+std::string replayFile = "";  //!< Recorded MIDAS file replayed instead of reading the boards, empty for hardware
+double replaySpeed = 0;       //!< Replay rate: 0 as fast as possible, 1 as recorded
+std::string spillDirectory = "";  //!< Local disk for the spill queues, empty to disable
+DWORD spillSizeMB = 4096;         //!< Size of the spill file of each board
+INT eventsPerVisit = 16;          //!< Events read from a board before the link thread moves on
+DWORD idleBackoffUs = 1000;       //!< Longest time an empty board is not polled
+BOOL syncClocksAtStart = false;   //!< SW_CLOCK_SYNCH all the boards at begin of run
+DWORD runStartDelayStep = 0;      //!< RUN_START_STOP_DELAY step between boards, 0 for none
+INT triggersPerEvent = 1;         //!< Triggers batched in a MIDAS event at most, 1 for no batching
+DWORD batchLatencyUs = 10000;     //!< Longest wait of the first trigger of a batch
+BOOL l2Enable = false;            //!< Level-2 filter of the merged events
+INT l2Threshold = 50;             //!< ADC counts from the baseline
+INT l2BaselineSamples = 16;       //!< Samples averaged for the baseline
+INT l2MinChannels = 2;            //!< Channels over threshold in the window
+INT l2MinBoards = 1;              //!< Boards with a channel over threshold in the window
+DWORD l2WindowNs = 100;           //!< Coincidence window
+DWORD l2Prescale = 0;             //!< Failing events kept: one in l2Prescale, 0 for none
+BOOL baselineTracking = false;    //!< DAC feedback on the measured baselines
+INT baselineTarget = 900;         //!< ADC counts
+INT baselineTolerance = 2;        //!< Error left alone, ADC counts
+INT baselineDacPerAdc = -64;      //!< DAC counts per ADC count of the baseline
+INT baselineMaxDacStep = 256;     //!< Largest DAC change of an update
+INT baselineSamples = 16;         //!< Samples of a baseline window
+INT baselineMaxSpread = 10;       //!< Max - min of a window without pulse
+INT baselineInterval = 100;       //!< One event sampled in baselineInterval
+DWORD baselinePeriodS = 10;       //!< Time between two DAC updates
+INT nbA3818 = 1;                  //!< A3818 cards in this PC
+INT nbLinksPerA3818 = 4;          //!< Optical ports of each A3818
+INT nbLinksPerFe = 4;             //!< Optical links controlled by each frontend
+INT nbDt5751PerLink = 1;          //!< Daisy-chained dt5751s per optical link
+INT nbDt5751Total = 4;            //!< dt5751 boards in total
+std::string a3818NumaNodes = "";  //!< NUMA node of each A3818, empty to find them in sysfs
 
 // __________________________________________________________________
 /*-- MIDAS Function declarations -----------------------------------------*/
@@ -177,10 +344,29 @@ INT frontend_loop();
 extern void interrupt_routine(void);  //!< Interrupt Service Routine
 
 BOOL wait_buffer_empty(int transition, BOOL first);
+int count_pending_events(int *inBoards, int *inRBs, int *inSpills);
+void unspill_fragments(dt5751CONET2 &module, int index);
+void give_up_spill(dt5751CONET2 &module, int index);
 INT read_event_from_ring_bufs(char *pevent, INT off);
+int read_trigger(char *pevent, uint32_t *ttt);
 INT read_buffer_level(char *pevent, INT off);
 INT read_temperature(char *pevent, INT off);
+void publish_metrics(char *pevent);
+void publish_timing(char *pevent);
+void update_baselines();
+void dump_trace(const char *reason);
+void write_register_profile(INT run_number);
 void * link_thread(void *);
+int link_read_event(int link, dt5751CONET2 &module, int index);
+bool wait_link_run(int link, unsigned int *seq);
+bool run_control_all(dt5751CONET2::RunControl op);
+bool write_all_boards(DWORD address, DWORD value);
+INT abort_begin_of_run(bool chronoboxStarted);
+bool start_link_threads();
+void run_link_threads();
+bool park_link_threads();
+void stop_link_threads();
+void reset_ring_buffer(dt5751CONET2 &module);
 void *subscriber;
 
 BOOL equipment_common_overwrite = false;
@@ -262,11 +448,36 @@ EQUIPMENT equipment[] =
 
 std::vector<dt5751CONET2> odt5751; //!< objects for the dt5751 modules controlled by this frontend
 std::vector<dt5751CONET2>::iterator itdt5751;  //!< Main thread iterator
-std::vector<dt5751CONET2>::iterator itdt5751_thread[NBLINKSPERFE];  //!< Link threads iterators
-
-pthread_t tid[NBLINKSPERFE];                            //!< Thread ID
-int thread_retval[NBLINKSPERFE] = {0};                  //!< Thread return value
-int thread_link[NBLINKSPERFE];                          //!< Link number associated with each thread
+std::vector<std::vector<dt5751CONET2>::iterator> itdt5751_thread;  //!< Link threads iterators
+dt5751Topology topology;                   //!< Cards, links and boards (ODB, read at startup)
+dt5751EventBuilder eventBuilder(odt5751);  //!< Merges the fragments of the ring buffers
+dt5751Batch batch;                         //!< Triggers packed in one MIDAS event
+dt5751L2Filter l2Filter;                   //!< Coincidence filter of the merged events
+dt5751Timing timing;                       //!< Time tag differences of the merged events
+dt5751Baseline baselineTracker;            //!< Baseline estimates and DAC feedback
+dt5751Replay replay(odt5751);              //!< Feeds the ring buffers from replayFile
+std::unique_ptr<dt5751Spill[]> spill;      //!< Disk overflow of each ring buffer (see link_thread)
+std::unique_ptr<bool[]> spill_refill;      //!< Moving fragments back (hysteresis), link threads only
+std::unique_ptr<bool[]> spill_off;         //!< Spill queue given up until the next run, link threads only
+std::unique_ptr<dt5751LinkQueue[]> link_queue;  //!< Register accesses of the other threads, served by link_thread
+std::unique_ptr<dt5751LinkScheduler[]> link_sched;  //!< Order of the boards of each daisy chain (link_thread)
+dt5751TrigGen trigGen(odt5751);            //!< Software trigger thread, after the link thread slots
+
+/* Sized from the topology in frontend_init */
+std::vector<pthread_t> tid;                             //!< Thread ID
+std::vector<int> thread_retval;                         //!< Thread return value
+std::vector<int> thread_link;                           //!< Link number associated with each thread
+
+/* The link threads and the ring buffers are created once in frontend_init.
+ * Between runs the threads are parked on link_cond; the transitions only
+ * change link_state (see run_link_threads() and park_link_threads()). */
+enum LinkState { LinkParked, LinkRunning, LinkExit };
+std::atomic<int> link_state(LinkParked);                //!< Requested state, polled by the readout loop
+unsigned int link_run_seq = 0;                          //!< Incremented at every start
+std::unique_ptr<bool[]> link_parked;                    //!< Thread waits for the next start
+bool link_threads_started = false;
+pthread_mutex_t link_mutex = PTHREAD_MUTEX_INITIALIZER; //!< Protects the link_ variables above
+pthread_cond_t link_cond = PTHREAD_COND_INITIALIZER;    //!< Broadcast on state and parked changes
 bool is_first_event = true;
 
 /********************************************************************/
@@ -293,6 +504,12 @@ void seq_callback(INT h, INT hseq, void *info){
   }
 }
 
+// Request a flight recorder dump; written by the next read_buffer_level() call
+void trace_signal_handler(int sig){
+  UNUSED(sig);
+  traceDumpRequested = 1;
+}
+
 // Start the chronobox run going.  TRUE=start run, FALSE=stop run)
 INT chronobox_start_stop(bool start){
 
@@ -379,6 +596,36 @@ INT frontend_init(){
     db_get_value(hDB, 0, partial_path, &writePartiallyMergedEvents, &size_bool, TID_BOOL, TRUE);
     db_get_value(hDB, 0, flush_path, &flushBuffersAtEndOfRun, &size_bool, TID_BOOL, TRUE);
     db_get_value(hDB, 0, thresh_path, &timestampMatchingThreshold, &size_dword, TID_DWORD, TRUE);
+    eventBuilder.Configure(enableMerging, timestampMatchingThreshold, writePartiallyMergedEvents);
+
+    // Offline replay of a recorded file (read at startup only)
+    char replay_path[255];
+    int size_double = sizeof(double);
+    sprintf(replay_path, "/Equipment/%s/Settings/Replay file", equipment[0].name);
+    db_get_value_string(hDB, 0, replay_path, 0, &replayFile, TRUE, 256);
+    sprintf(replay_path, "/Equipment/%s/Settings/Replay speed", equipment[0].name);
+    db_get_value(hDB, 0, replay_path, &replaySpeed, &size_double, TID_DOUBLE, TRUE);
+
+    // Disk spill queues (read at startup only, the files are preallocated)
+    char spill_path[255];
+    sprintf(spill_path, "/Equipment/%s/Settings/Spill directory", equipment[0].name);
+    db_get_value_string(hDB, 0, spill_path, 0, &spillDirectory, TRUE, 256);
+    sprintf(spill_path, "/Equipment/%s/Settings/Spill size (MB)", equipment[0].name);
+    db_get_value(hDB, 0, spill_path, &spillSizeMB, &size_dword, TID_DWORD, TRUE);
+
+    char metrics_path[255];
+    sprintf(metrics_path, "/Equipment/%s/Settings/Metrics file", equipment[1].name);
+    db_get_value_string(hDB, 0, metrics_path, 0, &metricsFile, TRUE, 256);
+
+    // Flight recorder
+    char trace_path[255];
+    BOOL traceDump = false;
+    sprintf(trace_path, "/Equipment/%s/Settings/Trace enable", equipment[1].name);
+    db_get_value(hDB, 0, trace_path, &traceEnable, &size_bool, TID_BOOL, TRUE);
+    sprintf(trace_path, "/Equipment/%s/Settings/Trace directory", equipment[1].name);
+    db_get_value_string(hDB, 0, trace_path, 0, &traceDirectory, TRUE, 256);
+    sprintf(trace_path, "/Equipment/%s/Settings/Trace dump", equipment[1].name);
+    db_set_value(hDB, 0, trace_path, &traceDump, sizeof(BOOL), 1, TID_BOOL);
   }
 
   // --- Suppress watchdog for PICe for now  ; what is this???
@@ -388,29 +635,83 @@ INT frontend_init(){
   int nActive = 0;   //Number of dt5751 boards activated at the end of frontend_init
   std::vector<std::pair<int,int> > errBoards;  //dt5751 boards which we couldn't connect to
 
-  if((NBDT5751TOTAL % (NBDT5751PERLINK*NBLINKSPERFE)) != 0){
-    printf("Incorrect setup: the number of boards controlled by each frontend"
-           " is not a fraction of the total number of boards. %i %i %i\n",NBDT5751TOTAL,NBDT5751PERLINK,NBLINKSPERFE);
+  {
+    // Hardware topology (read at startup only)
+    char topo_path[255];
+    int size_int = sizeof(INT);
+    sprintf(topo_path, "/Equipment/%s/Settings/A3818 cards", equipment[0].name);
+    db_get_value(hDB, 0, topo_path, &nbA3818, &size_int, TID_INT, TRUE);
+    sprintf(topo_path, "/Equipment/%s/Settings/Links per A3818", equipment[0].name);
+    db_get_value(hDB, 0, topo_path, &nbLinksPerA3818, &size_int, TID_INT, TRUE);
+    sprintf(topo_path, "/Equipment/%s/Settings/Links per frontend", equipment[0].name);
+    db_get_value(hDB, 0, topo_path, &nbLinksPerFe, &size_int, TID_INT, TRUE);
+    sprintf(topo_path, "/Equipment/%s/Settings/Boards per link", equipment[0].name);
+    db_get_value(hDB, 0, topo_path, &nbDt5751PerLink, &size_int, TID_INT, TRUE);
+    sprintf(topo_path, "/Equipment/%s/Settings/Boards total", equipment[0].name);
+    db_get_value(hDB, 0, topo_path, &nbDt5751Total, &size_int, TID_INT, TRUE);
+    sprintf(topo_path, "/Equipment/%s/Settings/A3818 NUMA nodes", equipment[0].name);
+    db_get_value_string(hDB, 0, topo_path, 0, &a3818NumaNodes, TRUE, 64);
   }
 
-  int maxIndex = (NBDT5751TOTAL/NBDT5751PERLINK)/NBLINKSPERFE - 1;
+  if (!topology.Configure(nbA3818, nbLinksPerA3818, nbLinksPerFe, nbDt5751PerLink, nbDt5751Total) ||
+      !topology.SetNumaNodes(a3818NumaNodes))
+    return FE_ERR_ODB;
+
+  int maxIndex = topology.GetNumFrontends() - 1;
   if(feIndex < 0 || feIndex > maxIndex){
     printf("Front end index (%i) must be between 0 and %d\n", feIndex, maxIndex);
     exit(FE_ERR_HW);
   }
 
-  int firstLink = (feIndex % (NBLINKSPERA3818 / NBLINKSPERFE)) * NBLINKSPERFE;
-  int lastLink = firstLink + NBLINKSPERFE - 1;
-  for (int iLink=firstLink; iLink <= lastLink; iLink++) {
-    for (int iBoard=0; iBoard < NBDT5751PERLINK; iBoard++) {
+  int nLinks = topology.GetLinksPerFe();
+  int nBoards = topology.GetBoardsPerFe();
+  for (int iLink=0; iLink < nLinks; iLink++) {
+    int card = topology.GetCard(feIndex, iLink);
+    printf("Link %d: A3818 %d link %d, NUMA node %d\n", iLink, card, topology.GetLink(feIndex, iLink),
+           topology.GetNumaNode(card));
+  }
+
+  // Per-link and per-board state of the link threads
+  itdt5751_thread.resize(nLinks);
+  spill.reset(new dt5751Spill[nBoards]);
+  spill_refill.reset(new bool[nBoards]());
+  spill_off.reset(new bool[nBoards]());
+  link_queue.reset(new dt5751LinkQueue[nLinks]);
+  link_sched.reset(new dt5751LinkScheduler[nLinks]);
+  tid.resize(nLinks);
+  thread_retval.assign(nLinks, 0);
+  thread_link.resize(nLinks);
+  link_parked.reset(new bool[nLinks]());
+
+  // One metrics slot for the main thread, one per link thread and one for the trigger generator
+  dt5751Metrics::Instance().Init(nLinks + 2, feIndex*nBoards, nBoards);
+  dt5751Metrics::SetThreadSlot(0);
+  trigGen.SetThreadSlot(nLinks + 1);
+  timing.Init(feIndex*nBoards, nBoards);
+  baselineTracker.Init(feIndex*nBoards, nBoards);
+
+  // Flight recorder: 64k records (1 MB) per thread
+  dt5751Trace::Instance().Init(nLinks + 2, 65536);
+  dt5751Trace::SetThreadSlot(0);
+  dt5751Trace::Instance().SetEnabled(traceEnable);
+  signal(SIGUSR1, trace_signal_handler);
+  dt5751RegProfile::Instance().Init(feIndex*nBoards, nBoards, topology.GetBoardsPerLink());
+  for (int iFeLink=0; iFeLink < nLinks; iFeLink++) {
+    int iLink = topology.GetLink(feIndex, iFeLink);
+    for (int iBoard=0; iBoard < topology.GetBoardsPerLink(); iBoard++) {
       printf("==== feIndex:%d, Link:%d, Board:%d ====\n", feIndex, iLink, iBoard);
 
       // Compose unique module ID
-      int moduleID = feIndex*NBLINKSPERFE*NBDT5751PERLINK + (iLink-firstLink)*NBDT5751PERLINK + iBoard;
+      int moduleID = feIndex*nBoards + iFeLink*topology.GetBoardsPerLink() + iBoard;
 
       // Create module objects
       odt5751.emplace_back(feIndex, iLink, iBoard, moduleID, hDB);
       odt5751.back().SetVerbosity(0);
+      // ODB Board%d: module ID modulo 8 as before, modulo the boards of the frontend above 8
+      odt5751.back().SetSettingsIndex(moduleID % (nBoards > 8 ? nBoards : 8));
+
+      // Replay: the boards are set offline once the file is opened
+      if (!replayFile.empty()) continue;
 
       // Open Optical interface
       switch(odt5751.back().Connect()){
@@ -431,13 +732,23 @@ INT frontend_init(){
         break;
       }
 
-      if(!((iLink == lastLink) && (iBoard == (NBDT5751PERLINK-1)))){
+      if(!((iFeLink == nLinks-1) && (iBoard == (topology.GetBoardsPerLink()-1)))){
         printf("Sleeping for %d milliseconds before next board\n", SLEEP_TIME_BETWEEN_CONNECTS);
         ss_sleep(SLEEP_TIME_BETWEEN_CONNECTS);
       }
     }
   }
 
+  if (!replayFile.empty()) {
+    if (!replay.Open(replayFile)) return FE_ERR_HW;
+    for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+      if (replay.HasModule(itdt5751->GetModuleID())) {
+        itdt5751->SetOffline(replay.GetDataType(itdt5751->GetModuleID()));
+        nActive++;
+      }
+    }
+  }
+
   /* This must be done _after_ filling the vector because we pass a pointer to config
    * to db_open_record.  The location of the object in memory must not change after
    * doing that. */
@@ -467,6 +778,30 @@ INT frontend_init(){
     cm_msg(MERROR, __FUNCTION__, "Unexpected number of active boards (%d vs %d)", nActive, nExpected);
     return FE_ERR_HW;
   } 
+
+  // Ring buffers are kept for the lifetime of the frontend, emptied at every end of run
+  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+    if (! itdt5751->IsConnected()) continue;   // Skip unconnected board
+
+    int rb_handle;
+    if (rb_create(event_buffer_size, max_event_size, &rb_handle) != DB_SUCCESS) {
+      cm_msg(MERROR, "feodt5751:Init", "Failed to create rb for board %d", itdt5751->GetModuleID());
+      return FE_ERR_HW;
+    }
+    itdt5751->SetRingBufferHandle(rb_handle);
+
+    // Optional disk overflow for bursts the ring buffer cannot absorb
+    if (!spillDirectory.empty() && !itdt5751->IsOffline()) {
+      char spill_file[512];
+      snprintf(spill_file, sizeof(spill_file), "%s/dt5751_spill_fe%02d_mod%02d.dat", spillDirectory.c_str(),
+               feIndex, itdt5751->GetModuleID());
+      dt5751Spill &sp = spill[itdt5751 - odt5751.begin()];
+      if (!sp.Open(spill_file, (uint64_t)spillSizeMB << 20))
+        return FE_ERR_HW;
+      cm_msg(MINFO, "feodt5751:Init", "Spill queue of board %d: %s (%u MB%s)", itdt5751->GetModuleID(),
+             spill_file, spillSizeMB, sp.IsDirect() ? ", O_DIRECT" : "");
+    }
+  }
   
   set_equipment_status(equipment[0].name, "Initialized", "#00ff00");
 
@@ -477,8 +812,13 @@ INT frontend_init(){
     printf("ERROR setting cpu affinity for main thread: %s\n", strerror(errno));
   }
 
+  // One thread per optical link, parked until the first begin of run.
+  // With a replay file, the replay thread takes their place.
+  if (replayFile.empty() && !start_link_threads())
+    return FE_ERR_HW;
+
   // Setup a deferred transition to wait till the DT5751 buffer is empty.
-  //cm_register_deferred_transition(TR_STOP, wait_buffer_empty);
+  cm_register_deferred_transition(TR_STOP, wait_buffer_empty);
 
   //-begin - ZMQ----------------------------------------------------------
 
@@ -514,7 +854,17 @@ INT frontend_exit(){
 
   set_equipment_status(equipment[0].name, "Exiting...", "#FFFF00");
 
+  replay.Close();
+  trigGen.Stop();
+  stop_link_threads();
+  for (size_t i = 0; i < odt5751.size(); i++)
+    spill[i].Close();
+
   for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+    if (itdt5751->GetRingBufferHandle() >= 0) {
+      rb_delete(itdt5751->GetRingBufferHandle());
+      itdt5751->SetRingBufferHandle(-1);
+    }
     if (itdt5751->IsConnected()){
       itdt5751->Disconnect();
     }
@@ -540,11 +890,9 @@ INT begin_of_run(INT run_number, char *error)
   cm_msg(MINFO,"BOR", "Start of begin_of_run");
   printf("<<< Start of begin_of_run\n");
 
-  int rb_handle;
-  int status;
-
   stopRunInProgress = false;
   eor_transition_called = false;
+  runPaused = false;
 
   runInProgress = true;
   {
@@ -572,6 +920,163 @@ INT begin_of_run(INT run_number, char *error)
     db_get_value(hDB, 0, flush_path, &flushBuffersAtEndOfRun, &size, TID_BOOL, TRUE);
     size = sizeof(DWORD);
     db_get_value(hDB, 0, thresh_path, &timestampMatchingThreshold, &size, TID_DWORD, TRUE);
+    sprintf(flush_path, "/Equipment/%s/Settings/Drain timeout (s)", equipment[0].name);
+    db_get_value(hDB, 0, flush_path, &drainTimeout, &size, TID_DWORD, TRUE);
+    eventBuilder.Configure(enableMerging, timestampMatchingThreshold, writePartiallyMergedEvents);
+
+    // Triggerless streaming in time frames (8 ns time tag ticks)
+    char stream_path[255];
+    size = sizeof(BOOL);
+    sprintf(stream_path, "/Equipment/%s/Settings/Streaming mode", equipment[0].name);
+    db_get_value(hDB, 0, stream_path, &streamingMode, &size, TID_BOOL, TRUE);
+    size = sizeof(DWORD);
+    sprintf(stream_path, "/Equipment/%s/Settings/Frame width (us)", equipment[0].name);
+    db_get_value(hDB, 0, stream_path, &frameWidthUs, &size, TID_DWORD, TRUE);
+    sprintf(stream_path, "/Equipment/%s/Settings/Frame overlap (us)", equipment[0].name);
+    db_get_value(hDB, 0, stream_path, &frameOverlapUs, &size, TID_DWORD, TRUE);
+    sprintf(stream_path, "/Equipment/%s/Settings/Frame timeout (ms)", equipment[0].name);
+    db_get_value(hDB, 0, stream_path, &frameTimeoutMs, &size, TID_DWORD, TRUE);
+    eventBuilder.ConfigureStreaming(streamingMode, (uint64_t)frameWidthUs*125, (uint64_t)frameOverlapUs*125,
+                                    (uint64_t)frameTimeoutMs*1000000);
+
+    // Software trigger generator
+    char trig_path[255];
+    sprintf(trig_path, "/Equipment/%s/Settings/SW trigger pattern", equipment[0].name);
+    db_get_value_string(hDB, 0, trig_path, 0, &swTrigPattern, TRUE, 32);
+    size = sizeof(double);
+    sprintf(trig_path, "/Equipment/%s/Settings/SW trigger rate (Hz)", equipment[0].name);
+    db_get_value(hDB, 0, trig_path, &swTrigRate, &size, TID_DOUBLE, TRUE);
+    sprintf(trig_path, "/Equipment/%s/Settings/SW trigger burst period (s)", equipment[0].name);
+    db_get_value(hDB, 0, trig_path, &swTrigBurstPeriod, &size, TID_DOUBLE, TRUE);
+    size = sizeof(INT);
+    sprintf(trig_path, "/Equipment/%s/Settings/SW trigger burst size", equipment[0].name);
+    db_get_value(hDB, 0, trig_path, &swTrigBurstSize, &size, TID_INT, TRUE);
+    size = sizeof(BOOL);
+    sprintf(trig_path, "/Equipment/%s/Settings/SW trigger all boards", equipment[0].name);
+    db_get_value(hDB, 0, trig_path, &swTrigAllBoards, &size, TID_BOOL, TRUE);
+
+    dt5751TrigGen::Pattern pattern;
+    if (!dt5751TrigGen::ParsePattern(swTrigPattern, &pattern)) {
+      cm_msg(MERROR, __FUNCTION__, "Unknown SW trigger pattern \"%s\" (off, fixed, poisson or burst)",
+             swTrigPattern.c_str());
+      return FE_ERR_ODB;
+    }
+    if (!trigGen.Configure(pattern, swTrigRate, swTrigBurstSize, swTrigBurstPeriod, swTrigAllBoards))
+      return FE_ERR_ODB;
+
+    // Daisy-chain readout scheduling, applied while the link threads are parked
+    char sched_path[255];
+    size = sizeof(INT);
+    sprintf(sched_path, "/Equipment/%s/Settings/Events per visit", equipment[0].name);
+    db_get_value(hDB, 0, sched_path, &eventsPerVisit, &size, TID_INT, TRUE);
+    size = sizeof(DWORD);
+    sprintf(sched_path, "/Equipment/%s/Settings/Idle board backoff (us)", equipment[0].name);
+    db_get_value(hDB, 0, sched_path, &idleBackoffUs, &size, TID_DWORD, TRUE);
+    for (int i = 0; link_sched && i < topology.GetLinksPerFe(); i++)
+      link_sched[i].Configure(eventsPerVisit, (uint64_t)idleBackoffUs*1000);
+
+    // Several triggers per MIDAS event
+    char batch_path[255];
+    size = sizeof(INT);
+    sprintf(batch_path, "/Equipment/%s/Settings/Triggers per event", equipment[0].name);
+    db_get_value(hDB, 0, batch_path, &triggersPerEvent, &size, TID_INT, TRUE);
+    size = sizeof(DWORD);
+    sprintf(batch_path, "/Equipment/%s/Settings/Batch latency (us)", equipment[0].name);
+    db_get_value(hDB, 0, batch_path, &batchLatencyUs, &size, TID_DWORD, TRUE);
+    batch.Configure(triggersPerEvent, batchLatencyUs, DT5751_MAX_EVENT_SIZE);
+
+    // Level-2 filter
+    char l2_path[255];
+    size = sizeof(BOOL);
+    sprintf(l2_path, "/Equipment/%s/Settings/L2 filter", equipment[0].name);
+    db_get_value(hDB, 0, l2_path, &l2Enable, &size, TID_BOOL, TRUE);
+    size = sizeof(INT);
+    sprintf(l2_path, "/Equipment/%s/Settings/L2 threshold (ADC)", equipment[0].name);
+    db_get_value(hDB, 0, l2_path, &l2Threshold, &size, TID_INT, TRUE);
+    sprintf(l2_path, "/Equipment/%s/Settings/L2 baseline samples", equipment[0].name);
+    db_get_value(hDB, 0, l2_path, &l2BaselineSamples, &size, TID_INT, TRUE);
+    sprintf(l2_path, "/Equipment/%s/Settings/L2 min channels", equipment[0].name);
+    db_get_value(hDB, 0, l2_path, &l2MinChannels, &size, TID_INT, TRUE);
+    sprintf(l2_path, "/Equipment/%s/Settings/L2 min boards", equipment[0].name);
+    db_get_value(hDB, 0, l2_path, &l2MinBoards, &size, TID_INT, TRUE);
+    size = sizeof(DWORD);
+    sprintf(l2_path, "/Equipment/%s/Settings/L2 window (ns)", equipment[0].name);
+    db_get_value(hDB, 0, l2_path, &l2WindowNs, &size, TID_DWORD, TRUE);
+    sprintf(l2_path, "/Equipment/%s/Settings/L2 prescale", equipment[0].name);
+    db_get_value(hDB, 0, l2_path, &l2Prescale, &size, TID_DWORD, TRUE);
+    l2Filter.Configure(l2Threshold, l2BaselineSamples, l2MinChannels, l2MinBoards, l2WindowNs, l2Prescale);
+    eventBuilder.SetFilter(l2Enable ? &l2Filter : NULL);
+
+    // Baseline tracking
+    char bl_path[255];
+    size = sizeof(BOOL);
+    sprintf(bl_path, "/Equipment/%s/Settings/Baseline tracking", equipment[0].name);
+    db_get_value(hDB, 0, bl_path, &baselineTracking, &size, TID_BOOL, TRUE);
+    size = sizeof(INT);
+    sprintf(bl_path, "/Equipment/%s/Settings/Baseline target (ADC)", equipment[0].name);
+    db_get_value(hDB, 0, bl_path, &baselineTarget, &size, TID_INT, TRUE);
+    sprintf(bl_path, "/Equipment/%s/Settings/Baseline tolerance (ADC)", equipment[0].name);
+    db_get_value(hDB, 0, bl_path, &baselineTolerance, &size, TID_INT, TRUE);
+    sprintf(bl_path, "/Equipment/%s/Settings/Baseline DAC per ADC", equipment[0].name);
+    db_get_value(hDB, 0, bl_path, &baselineDacPerAdc, &size, TID_INT, TRUE);
+    sprintf(bl_path, "/Equipment/%s/Settings/Baseline max DAC step", equipment[0].name);
+    db_get_value(hDB, 0, bl_path, &baselineMaxDacStep, &size, TID_INT, TRUE);
+    sprintf(bl_path, "/Equipment/%s/Settings/Baseline samples", equipment[0].name);
+    db_get_value(hDB, 0, bl_path, &baselineSamples, &size, TID_INT, TRUE);
+    sprintf(bl_path, "/Equipment/%s/Settings/Baseline max spread (ADC)", equipment[0].name);
+    db_get_value(hDB, 0, bl_path, &baselineMaxSpread, &size, TID_INT, TRUE);
+    sprintf(bl_path, "/Equipment/%s/Settings/Baseline sample interval", equipment[0].name);
+    db_get_value(hDB, 0, bl_path, &baselineInterval, &size, TID_INT, TRUE);
+    size = sizeof(DWORD);
+    sprintf(bl_path, "/Equipment/%s/Settings/Baseline update period (s)", equipment[0].name);
+    db_get_value(hDB, 0, bl_path, &baselinePeriodS, &size, TID_DWORD, TRUE);
+    baselineTracker.Configure(baselineTarget, baselineTolerance, baselineDacPerAdc, baselineMaxDacStep,
+                              baselineSamples, baselineMaxSpread);
+    eventBuilder.SetMonitor(baselineTracking ? &baselineTracker : NULL, baselineInterval);
+    if (!baselineTracking) {
+      // Back to the ODB settings
+      const dt5751CONET2::BaselineCorrection none = { 0, 0 };
+      for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751)
+        for (int ch = 0; ch < 4; ch++)
+          itdt5751->SetBaselineCorrection(ch, none);
+    }
+
+    // Synchronized start
+    char start_path[255];
+    size = sizeof(BOOL);
+    sprintf(start_path, "/Equipment/%s/Settings/Sync clocks at start", equipment[0].name);
+    db_get_value(hDB, 0, start_path, &syncClocksAtStart, &size, TID_BOOL, TRUE);
+    size = sizeof(DWORD);
+    sprintf(start_path, "/Equipment/%s/Settings/Run start delay step", equipment[0].name);
+    db_get_value(hDB, 0, start_path, &runStartDelayStep, &size, TID_DWORD, TRUE);
+
+    char metrics_path[255];
+    sprintf(metrics_path, "/Equipment/%s/Settings/Metrics file", equipment[1].name);
+    db_get_value_string(hDB, 0, metrics_path, 0, &metricsFile, TRUE, 256);
+    size = sizeof(DWORD);
+    sprintf(metrics_path, "/Equipment/%s/Settings/Timing bin (ticks)", equipment[1].name);
+    db_get_value(hDB, 0, metrics_path, &timingBinTicks, &size, TID_DWORD, TRUE);
+    timing.Configure(timingBinTicks);
+
+    char trace_path[255];
+    size = sizeof(BOOL);
+    sprintf(trace_path, "/Equipment/%s/Settings/Trace enable", equipment[1].name);
+    db_get_value(hDB, 0, trace_path, &traceEnable, &size, TID_BOOL, TRUE);
+    sprintf(trace_path, "/Equipment/%s/Settings/Trace directory", equipment[1].name);
+    db_get_value_string(hDB, 0, trace_path, 0, &traceDirectory, TRUE, 256);
+    dt5751Trace::Instance().SetEnabled(traceEnable);
+    dt5751Trace::Instance().Record(dt5751Trace::RunStart, -1, run_number);
+
+    char profile_path[255];
+    sprintf(profile_path, "/Equipment/%s/Settings/Register profile", equipment[1].name);
+    db_get_value(hDB, 0, profile_path, &regProfileEnable, &size, TID_BOOL, TRUE);
+    dt5751RegProfile::Instance().Reset();
+    dt5751RegProfile::Instance().SetEnabled(regProfileEnable);
+  }
+
+  if (replay.IsOpen()) {
+    // The chronobox banks come from the file, the chronobox itself is left alone
+    enableChronobox = replay.HasZmq();
   }
   
   if (enableChronobox && !enableMerging) {
@@ -580,7 +1085,7 @@ INT begin_of_run(INT run_number, char *error)
     return FE_ERR_ODB;
   }
 
-   if (enableChronobox) {
+   if (enableChronobox && !replay.IsOpen()) {
      /// Make sure the chronobox is stopped
      chronobox_start_stop(false);
    }
@@ -589,7 +1094,7 @@ INT begin_of_run(INT run_number, char *error)
     if (!itdt5751->IsConnected()) continue;   // Skip unconnected board
     DWORD vmeAcq, vmeStat;
     itdt5751->ReadReg(DT5751_ACQUISITION_STATUS, &vmeAcq);//Test the PLL lock once (it may have happened earlier)
-    if ((vmeAcq & 0x80) == 0) {
+    if (!itdt5751->IsOffline() && (vmeAcq & 0x80) == 0) {
       cm_msg(MERROR,"BeginOfRun","DT5751 PLL loss lock Board (sometime in the past):%d (vmeAcq=0x%x)"
              ,itdt5751->GetModuleID(), vmeAcq);
       // PLL loss lock reset by the READOUT_STATUS read!
@@ -603,35 +1108,59 @@ INT begin_of_run(INT run_number, char *error)
       }
     }
 
-    bool go = itdt5751->StartRun();
+    bool go = itdt5751->PrepareRun();
     if (go == false) return FE_ERR_HW;
+  }
 
-    //Create ring buffer for board
-    status = rb_create(event_buffer_size, max_event_size, &rb_handle);
-    if(status == DB_SUCCESS){
-      itdt5751->SetRingBufferHandle(rb_handle);
+  // Wake up the link threads first, they send the start of their boards in parallel
+  if (!replay.IsOpen())
+    run_link_threads();
+
+  bool armed = true;
+  if (syncClocksAtStart && !write_all_boards(DT5751_SW_CLOCK_SYNCH, 0x1))
+    armed = false;
+  if (armed) {
+    // Written even for a step of 0, to clear the delays of a previous run
+    int n = 0, k = 0;
+    for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751)
+      if (itdt5751->IsConnected() && !itdt5751->IsOffline()) n++;
+    for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+      if (!itdt5751->IsConnected() || itdt5751->IsOffline()) continue;
+      itdt5751->BeginWrite(DT5751_RUN_START_STOP_DELAY, (n - 1 - k++)*runStartDelayStep);
     }
-    else{
-      cm_msg(MERROR, "feodt5751:BOR", "Failed to create rb for board %d", itdt5751->GetModuleID());
+    for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+      if (!itdt5751->IsConnected() || itdt5751->IsOffline()) continue;
+      if (!itdt5751->EndWrite()) {
+        cm_msg(MERROR, "BOR", "Could not set the start delay of module %d", itdt5751->GetModuleID());
+        armed = false;
+      }
     }
   }
-
-  // Create one thread per optical link
-  for(int i=0; i<NBLINKSPERFE; ++i){
-    thread_link[i] = i;
-    status = pthread_create(&tid[i], NULL, &link_thread, (void*)&thread_link[i]);
-    if(status){
-      cm_msg(MERROR,"feodt5751:BOR", "Couldn't create thread for link %d. Return code: %d", i, status);
-    }
+  if (armed)
+    armed = write_all_boards(DT5751_SW_CLEAR, 0x1) && run_control_all(dt5751CONET2::CtlStart);
+  if (!armed)
+    return abort_begin_of_run(false);
+
+  if (replay.IsOpen()) {
+    // The replay thread takes the place of the link threads
+    replay.SetSpeed(replaySpeed);
+    if (!replay.Rewind() || !replay.Start()) return abort_begin_of_run(false);
   }
 
   // Need to discard the first ZMQ bank.
   is_first_event = true;
 
-  if (enableChronobox) {
+  bool chronoboxStarted = false;
+  if (enableChronobox && !replay.IsOpen()) {
     /// Sleep 1 second and start chronobox
     sleep(1);
     chronobox_start_stop(true);
+    chronoboxStarted = true;
+  }
+
+  if (trigGen.IsEnabled() && !replay.IsOpen()) {
+    if (!trigGen.Start()) return abort_begin_of_run(chronoboxStarted);
+    cm_msg(MINFO, "BOR", "Software trigger generator: %s at %g Hz", swTrigPattern.c_str(), swTrigRate);
   }
 
   set_equipment_status(equipment[0].name, "Started run", "#00ff00");
@@ -645,172 +1174,609 @@ INT begin_of_run(INT run_number, char *error)
 void * link_thread(void * arg)
 {
   int link = *(int*)arg;
-  std::cout << "Started thread for link " << link << " out of " << NBCORES << " cores" << std::endl;
+  int ncores = dt5751Topology::GetNumCpus();
+  int node = topology.GetNumaNode(topology.GetCard(get_frontend_index(), link));
+  std::cout << "Started thread for link " << link << " out of " << ncores << " cores" << std::endl;
 
-  //Lock each thread to a different cpu core
+  //Lock each thread to the cores next to its A3818, or to a different cpu core
   cpu_set_t mask;
   CPU_ZERO(&mask);
-  switch(NBCORES){
-  case 1:
-    //Don't do anything
-    break;
-  case 2:
-    CPU_SET(link % 2, &mask); //TRIUMF test PC. Even boards on core 0, odd boards on core 1
-    break;
-  default:
-    /* This will spread the threads on all cores except core 0 when the main thread resides.
-     * ex 1 (SNOLAB): NBCORES=8, 4 threads:
-     * threads (links) 0,1,2,3 will go on cores 1,2,3,4
-     * ex 2: NBCORES 4, 4 threads:
-     * threads (links) 0,1,2,3 will go on cores 1,2,3,1     */
-    CPU_SET((link + 1), &mask);
-    printf("core setting: NBCORES:%d link:%d core %d\n", NBCORES, link,(link + 1));
-    break;
+  if (dt5751Topology::GetNodeCpus(node, &mask)) {
+    /* The ring buffers of the link are first written here, so their pages
+     * end up on the same node as the card */
+    printf("core setting: link:%d NUMA node %d (%d cores)\n", link, node, CPU_COUNT(&mask));
+  } else {
+    switch(ncores){
+    case 1:
+      //Don't do anything
+      break;
+    case 2:
+      CPU_SET(link % 2, &mask); //TRIUMF test PC. Even boards on core 0, odd boards on core 1
+      break;
+    default:
+      /* This will spread the threads on all cores except core 0 when the main thread resides.
+       * ex 1 (SNOLAB): 8 cores, 4 threads:
+       * threads (links) 0,1,2,3 will go on cores 1,2,3,4
+       * ex 2: 4 cores, 4 threads:
+       * threads (links) 0,1,2,3 will go on cores 1,2,3,1     */
+      CPU_SET(1 + link % (ncores - 1), &mask);
+      printf("core setting: cores:%d link:%d core %d\n", ncores, link, 1 + link % (ncores - 1));
+      break;
+    }
   }
-  if( sched_setaffinity(0, sizeof(mask), &mask) < 0 ){
+  if( ncores > 1 && sched_setaffinity(0, sizeof(mask), &mask) < 0 ){
     printf("ERROR setting cpu affinity for thread %d: %s\n", link, strerror(errno));
   }
 
-  void *wp;
-  int status;
-  int rb_handle;
-  int moduleID;
-  int rb_level;
-  int firstBoard = link*NBDT5751PERLINK; //First board on this link
+  dt5751Metrics::SetThreadSlot(link + 1);
+  dt5751Trace::SetThreadSlot(link + 1);
+
+  int index;
+  int nRead;
+  int boardsPerLink = topology.GetBoardsPerLink();
+  int firstBoard = link*boardsPerLink; //First board on this link
+  unsigned int run_seq = 0;
 
-  while(1) {  // Indefinite until run stopped (!runInProgress)
-    // This loop is running until EOR flag (runInProgress)
+  while (wait_link_run(link, &run_seq)) {  // Parked between runs until frontend_exit
+    thread_retval[link] = 0;
+    link_queue[link].StartServing();
+    link_sched[link].Reset();
 
-    // process the addressed board for that link only
-    for (itdt5751_thread[link] = odt5751.begin() + firstBoard;
-         itdt5751_thread[link] != odt5751.begin() + firstBoard + NBDT5751PERLINK;
-         ++itdt5751_thread[link]){
+    while(1) {  // Indefinite until run stopped (link_state != LinkRunning)
 
-      // Shortcut
-      rb_handle = itdt5751_thread[link]->GetRingBufferHandle();
-      moduleID = itdt5751_thread[link]->GetModuleID();
+      // Spilled fragments go back first, in order
+      for (itdt5751_thread[link] = odt5751.begin() + firstBoard;
+           itdt5751_thread[link] != odt5751.begin() + firstBoard + boardsPerLink;
+           ++itdt5751_thread[link]){
+
+        index = itdt5751_thread[link] - odt5751.begin();
+        if (spill[index].IsOpen() && !spill[index].IsEmpty())
+          unspill_fragments(*itdt5751_thread[link], index);
 
 # if 0
-      // debug
-      if(itdt5751_thread[link]->IsEnabled())
-        odt5751_Status(itdt5751_thread[link]->GetDeviceHandle());
+        // debug
+        if(itdt5751_thread[link]->IsEnabled())
+          odt5751_Status(itdt5751_thread[link]->GetDeviceHandle());
 #endif
+      }
 
-      // Check if event in hardware to read
-      if (!stopRunInProgress && itdt5751_thread[link]->CheckEvent() && itdt5751_thread[link]->IsEnabled()){
-
-        /* If we've reached 75% of the ring buffer space, don't read
-         * the next event.  Wait until the ring buffer level goes down.
-         * It is better to let the dt5751 buffer fill up instead of
-         * the ring buffer, as this the dt5751 will generate the HW busy to the
-         * DTM.
-         */
-        rb_get_buffer_level(rb_handle, &rb_level);
-        if(rb_level > (int)(event_buffer_size*0.75)) {
-          continue;
+      // Boards of the daisy chain holding events, fullest first, a batch from each
+      nRead = 0;
+      if (!stopRunInProgress) {
+        const std::vector<dt5751LinkScheduler::Visit> &visits = link_sched[link].Poll();
+        for (size_t v = 0; v < visits.size() && thread_retval[link] == 0; v++) {
+          for (int n = 0; n < visits[v].events; n++) {
+            if (link_read_event(link, odt5751[visits[v].index], visits[v].index) <= 0)
+              break;   // Ring buffer full or error, next board
+            nRead++;
+          }
         }
+      }
 
-        // Ok to read data
-        status = rb_get_wp(rb_handle, &wp, 100);
-        if (status == DB_TIMEOUT) {
-          cm_msg(MERROR,"link_thread", "Got wp timeout for thread %d (module %d).  Is the ring buffer full?",
-                 link, moduleID);
-          cm_msg(MERROR,"link_thread", "Exiting thread %d with error", link);
-          thread_retval[link] = -1;
-          pthread_exit((void*)&thread_retval[link]);
-        }
+      // Sleep for 5us to avoid hammering the boards when there was nothing to read
+      if (nRead == 0)
+        usleep(1);
 
-        // Read data
-        if(itdt5751_thread[link]->ReadEvent(wp)) {
-        } else {
-          cm_msg(MERROR,"link_thread", "Readout routine error on thread %d (module %d)", link, moduleID);
-          cm_msg(MERROR,"link_thread", "Exiting thread %d with error", link);
-          thread_retval[link] = -1;
-          pthread_exit((void*)&thread_retval[link]);
-        }
-      } // CheckEvent
+      // Readout first, then the triggers and one slow-control access of the other threads
+      link_queue[link].Serve(1);
 
-      // Sleep for 5us to avoid hammering the board too much
-      usleep(1);
-    } // Done with all the modules
+      // Escape if run is done or on error -> park thread
+      if(thread_retval[link] != 0 || link_state.load(std::memory_order_relaxed) != LinkRunning)
+        break;
+    }
 
-    // Escape if run is done -> kill thread
-    if(!runInProgress)
-      break;
+    link_queue[link].StopServing();
+    std::cout << "Parking thread " << link << (thread_retval[link] ? " with error" : " clean") << std::endl;
   }
 
   std::cout << "Exiting thread " << link << " clean " << std::endl;
-  thread_retval[link] = 0;
   pthread_exit((void*)&thread_retval[link]);
 }
 
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Read one event of a board into its ring buffer or spill queue (link thread)
+ *
+ * \param   [in]  link    link of the calling thread
+ * \param   [in]  module  board known to hold an event
+ * \param   [in]  index   index of the board in odt5751
+ * \return  1 if read, 0 if the ring buffer is full, -1 on error (thread_retval set)
+ */
+int link_read_event(int link, dt5751CONET2 &module, int index)
+{
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  dt5751Trace &trace = dt5751Trace::Instance();
+  int rb_handle = module.GetRingBufferHandle();
+  int moduleID = module.GetModuleID();
+  dt5751Spill *sp = (spill[index].IsOpen() && !spill_off[index]) ? &spill[index] : NULL;
+  void *wp;
+  int rb_level;
+
+  /* If we've reached 75% of the ring buffer space, don't read
+   * the next event.  Wait until the ring buffer level goes down.
+   * It is better to let the dt5751 buffer fill up instead of
+   * the ring buffer, as this the dt5751 will generate the HW busy to the
+   * DTM.
+   * With a spill queue, the events go to disk instead as long as
+   * there is room, and keep going there until it is empty again
+   * to preserve the order.
+   */
+  rb_get_buffer_level(rb_handle, &rb_level);
+  trace.Record(dt5751Trace::RbLevel, moduleID, rb_level);
+  bool to_spill = sp && (!sp->IsEmpty() || rb_level > (int)(event_buffer_size*rb_high_water));
+  if((to_spill && !sp->HasRoom(max_event_size)) ||
+     (!to_spill && rb_level > (int)(event_buffer_size*rb_high_water))) {
+    metrics.Add(moduleID, dt5751Metrics::RbStalls);
+    trace.Record(dt5751Trace::RbStall, moduleID, rb_level);
+    return 0;
+  }
+
+  // Ok to read data
+  int status = rb_get_wp(rb_handle, &wp, 100);
+  if (status == DB_TIMEOUT) {
+    metrics.Add(moduleID, dt5751Metrics::RbWpTimeouts);
+    cm_msg(MERROR,"link_thread", "Got wp timeout for thread %d (module %d).  Is the ring buffer full?",
+           link, moduleID);
+    cm_msg(MERROR,"link_thread", "Parking thread %d with error until the next run", link);
+    dump_trace("link thread error");
+    thread_retval[link] = -1;
+    return -1;
+  }
+
+  // Read data; when spilling, the free ring buffer space is only scratch
+  if(to_spill) {
+    DWORD size_words = 0;
+    if(!module.ReadEventToBuffer(wp, &size_words)) {
+      metrics.Add(moduleID, dt5751Metrics::ReadErrors);
+      cm_msg(MERROR,"link_thread", "Readout routine error on thread %d (module %d)", link, moduleID);
+      cm_msg(MERROR,"link_thread", "Parking thread %d with error until the next run", link);
+      dump_trace("link thread error");
+      thread_retval[link] = -1;
+      return -1;
+    }
+    if(!sp->Push((DWORD *)wp, size_words)) {
+      // Disk full or I/O error: the event stays in the ring buffer, which
+      // goes back to stalling at the high-water mark
+      give_up_spill(module, index);
+      module.PushFragment((DWORD *)wp, size_words);
+      return 1;
+    }
+    metrics.Add(moduleID, dt5751Metrics::SpillEvents);
+    metrics.SetGauge(moduleID, dt5751Metrics::SpillBytes, sp->GetDepthBytes());
+  } else if(!module.ReadEvent(wp)) {
+    metrics.Add(moduleID, dt5751Metrics::ReadErrors);
+    cm_msg(MERROR,"link_thread", "Readout routine error on thread %d (module %d)", link, moduleID);
+    cm_msg(MERROR,"link_thread", "Parking thread %d with error until the next run", link);
+    dump_trace("link thread error");
+    thread_retval[link] = -1;
+    return -1;
+  }
+  return 1;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Park a link thread until the next start
+ *
+ * Returns once a run was started after the one given by seq (a thread
+ * that stopped on an error waits for the next run, not the current one).
+ *
+ * \param   [in]     link  link number of the calling thread
+ * \param   [in,out] seq   start counter of the last run of this thread
+ * \return  false if the thread must exit
+ */
+bool wait_link_run(int link, unsigned int *seq)
+{
+  pthread_mutex_lock(&link_mutex);
+  link_parked[link] = true;
+  pthread_cond_broadcast(&link_cond);
+  while (link_state == LinkParked || (link_state == LinkRunning && link_run_seq == *seq))
+    pthread_cond_wait(&link_cond, &link_mutex);
+  link_parked[link] = false;
+  *seq = link_run_seq;
+  bool run = (link_state == LinkRunning);
+  pthread_mutex_unlock(&link_mutex);
+  return run;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Start, stop, pause or resume all the connected boards at once
+ *
+ * The operation is started on every board before waiting for any, so the
+ * link threads carry it out in parallel (dt5751CONET2::BeginRunControl()).
+ *
+ * \param   [in]  op  operation
+ * \return  false if it failed on a board
+ */
+bool run_control_all(dt5751CONET2::RunControl op)
+{
+  const char *names[] = { "write", "start", "stop", "pause", "resume" };
+  std::vector<bool> begun(odt5751.size(), false);
+  bool ok = true;
+
+  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+    if (!itdt5751->IsConnected()) continue;   // Skip unconnected board
+    begun[itdt5751 - odt5751.begin()] = itdt5751->BeginRunControl(op);
+    if (!begun[itdt5751 - odt5751.begin()]) ok = false;
+  }
+  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+    if (!begun[itdt5751 - odt5751.begin()]) continue;
+    if (!itdt5751->EndRunControl()) {
+      cm_msg(MERROR, __FUNCTION__, "Could not %s the run for module %d", names[op], itdt5751->GetModuleID());
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Write a register of all the connected boards at once
+ *
+ * \param   [in]  address  register
+ * \param   [in]  value    value written to every board
+ * \return  false if the write failed on a board
+ */
+bool write_all_boards(DWORD address, DWORD value)
+{
+  std::vector<bool> begun(odt5751.size(), false);
+  bool ok = true;
+
+  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+    if (!itdt5751->IsConnected()) continue;   // Skip unconnected board
+    begun[itdt5751 - odt5751.begin()] = itdt5751->BeginWrite(address, value);
+    if (!begun[itdt5751 - odt5751.begin()]) ok = false;
+  }
+  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+    if (!begun[itdt5751 - odt5751.begin()]) continue;
+    if (!itdt5751->EndWrite()) {
+      cm_msg(MERROR, __FUNCTION__, "Could not write 0x%x to register 0x%x of module %d", value, address,
+             itdt5751->GetModuleID());
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Undo a begin_of_run that failed once the readout was woken up
+ *
+ * Stops the boards already started and parks the link threads (or stops
+ * the replay), so that nothing acquires for a run MIDAS counts as failed.
+ *
+ * \param   [in]  chronoboxStarted  the chronobox run was started
+ * \return  FE_ERR_HW
+ */
+INT abort_begin_of_run(bool chronoboxStarted)
+{
+  if (chronoboxStarted)
+    chronobox_start_stop(false);
+  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751)
+    if (itdt5751->IsRunning()) itdt5751->StopRun();
+  if (replay.IsOpen())
+    replay.Stop();
+  else
+    park_link_threads();
+  runInProgress = false;
+  return FE_ERR_HW;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Create the link threads (parked)
+ *
+ * \return  false if a thread could not be created
+ */
+bool start_link_threads()
+{
+  link_state = LinkParked;
+
+  // From now on every other thread accesses the boards through the link queues
+  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751)
+    itdt5751->SetLinkQueue(&link_queue[(itdt5751 - odt5751.begin())/topology.GetBoardsPerLink()]);
+
+  for(int i=0; i<topology.GetLinksPerFe(); ++i){
+    link_sched[i].Init(odt5751, i*topology.GetBoardsPerLink(), topology.GetBoardsPerLink());
+    thread_link[i] = i;
+    int status = pthread_create(&tid[i], NULL, &link_thread, (void*)&thread_link[i]);
+    if(status){
+      cm_msg(MERROR,"feodt5751:Init", "Couldn't create thread for link %d. Return code: %d", i, status);
+      pthread_mutex_lock(&link_mutex);
+      link_state = LinkExit;
+      pthread_cond_broadcast(&link_cond);
+      pthread_mutex_unlock(&link_mutex);
+      for (int j = 0; j < i; ++j) pthread_join(tid[j], NULL);
+      return false;
+    }
+  }
+  link_threads_started = true;
+  return true;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Release the parked link threads for a new run
+ */
+void run_link_threads()
+{
+  pthread_mutex_lock(&link_mutex);
+  link_run_seq++;
+  link_state = LinkRunning;
+  pthread_cond_broadcast(&link_cond);
+  pthread_mutex_unlock(&link_mutex);
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Stop the readout and wait until every link thread is parked
+ *
+ * The ring buffers and the boards may only be touched by the main thread
+ * once this returns true.
+ *
+ * \return  false if a thread did not park within 10 s
+ */
+bool park_link_threads()
+{
+  if (!link_threads_started) return true;
+
+  timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += 10;
+
+  bool parked = true;
+  pthread_mutex_lock(&link_mutex);
+  link_state = LinkParked;
+  pthread_cond_broadcast(&link_cond);
+  for (int i = 0; i < topology.GetLinksPerFe() && parked; ++i) {
+    while (!link_parked[i]) {
+      if (pthread_cond_timedwait(&link_cond, &link_mutex, &deadline) == ETIMEDOUT) {
+        cm_msg(MERROR, "park_link_threads", "Thread for link %d did not stop within 10 s", i);
+        parked = false;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&link_mutex);
+  return parked;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Make the link threads return and join them (frontend_exit)
+ */
+void stop_link_threads()
+{
+  if (!link_threads_started) return;
+
+  pthread_mutex_lock(&link_mutex);
+  link_state = LinkExit;
+  pthread_cond_broadcast(&link_cond);
+  pthread_mutex_unlock(&link_mutex);
+
+  for(int i=0; i < topology.GetLinksPerFe(); ++i){
+    pthread_join(tid[i], NULL);
+  }
+  link_threads_started = false;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Empty the ring buffer of a module at the end of a run
+ *
+ * The buffer is recreated if the events left in it could not be walked.
+ *
+ * \param   [in]  module  module whose link thread is parked
+ */
+void reset_ring_buffer(dt5751CONET2 &module)
+{
+  int n = module.DiscardRBEvents();
+  if (n > 0)
+    printf("Discarded %d events from the ring buffer of module %d\n", n, module.GetModuleID());
+  if (n >= 0)
+    return;
+
+  int rb_handle;
+  rb_delete(module.GetRingBufferHandle());
+  module.SetRingBufferHandle(-1);
+  if (rb_create(event_buffer_size, max_event_size, &rb_handle) == DB_SUCCESS)
+    module.SetRingBufferHandle(rb_handle);
+  else
+    cm_msg(MERROR, "reset_ring_buffer", "Failed to recreate rb for board %d", module.GetModuleID());
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Move spilled fragments back into the ring buffer (link thread)
+ *
+ * Refilling starts when the ring buffer drops below the low-water mark and
+ * goes on, a batch per call, until it is back at the high-water mark or the
+ * spill queue is empty.
+ *
+ * \param   [in]  module  board read by the calling link thread
+ * \param   [in]  index   index of the board in odt5751 and spill
+ */
+void unspill_fragments(dt5751CONET2 &module, int index)
+{
+  dt5751Spill &sp = spill[index];
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  int moduleID = module.GetModuleID();
+  int rb_level;
+
+  rb_get_buffer_level(module.GetRingBufferHandle(), &rb_level);
+  if (rb_level < (int)(event_buffer_size*rb_low_water))
+    spill_refill[index] = true;
+  if (!spill_refill[index])
+    return;
+
+  for (int n = 0; n < 64 && rb_level < (int)(event_buffer_size*rb_high_water); n++) {
+    DWORD size_words;
+    const DWORD *fragment = sp.Front(&size_words);
+    if (!fragment && sp.IsFailed()) {
+      give_up_spill(module, index);
+      return;
+    }
+    if (!fragment || !module.PushFragment(fragment, size_words))
+      break;
+    sp.Pop();
+    metrics.Add(moduleID, dt5751Metrics::UnspillEvents);
+    rb_get_buffer_level(module.GetRingBufferHandle(), &rb_level);
+  }
+
+  if (sp.IsEmpty() || rb_level >= (int)(event_buffer_size*rb_high_water))
+    spill_refill[index] = false;
+  metrics.SetGauge(moduleID, dt5751Metrics::SpillBytes, sp.GetDepthBytes());
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Stop using the spill queue of a board for the rest of the run (link thread)
+ *
+ * After an I/O error or a corrupted record the fragments still queued cannot
+ * be moved back in order; they are dropped and the board goes back to the
+ * ring buffer alone.  The queue is cleared again at the end of the run.
+ *
+ * \param   [in]  module  board read by the calling link thread
+ * \param   [in]  index   index of the board in odt5751 and spill
+ */
+void give_up_spill(dt5751CONET2 &module, int index)
+{
+  dt5751Spill &sp = spill[index];
+  cm_msg(MERROR, "link_thread", "Spill queue of module %d failed, %d spilled fragments lost; "
+         "ring buffer only until the next run", module.GetModuleID(), sp.GetNumEvents());
+  sp.Clear();
+  spill_off[index] = true;
+  spill_refill[index] = false;
+  dt5751Metrics::Instance().SetGauge(module.GetModuleID(), dt5751Metrics::SpillBytes, 0);
+}
+
 timeval wait_start;
+int drainPhase = 0;     //!< 0: emptying the board memories, 1: emptying the ring buffers
+int drainPending = 0;   //!< Events in the boards and ring buffers when the drain started
 
-// Check how many events we have in the ring buffer
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Count the events not sent yet
+ *
+ * \param   [out] inBoards  events in the board memories (EVENT_STORED)
+ * \param   [out] inRBs     fragments in the ring buffers
+ * \param   [out] inSpills  fragments in the spill queues
+ * \return  sum of all three
+ */
+int count_pending_events(int *inBoards, int *inRBs, int *inSpills)
+{
+  *inBoards = 0;
+  *inRBs = 0;
+  *inSpills = 0;
+  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+    if (!itdt5751->IsConnected()) continue;   // Skip unconnected board
+
+    DWORD eStored = 0;
+    if (!itdt5751->IsOffline() && itdt5751->Poll(&eStored))
+      *inBoards += eStored;
+    *inRBs += itdt5751->GetNumEventsInRB();
+    *inSpills += spill[itdt5751 - odt5751.begin()].GetNumEvents();
+  }
+  return *inBoards + *inRBs + *inSpills;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Deferred stop: drain the boards and the ring buffers
+ *
+ * The first call gates the triggers (chronobox and trigger source masks) but
+ * leaves the boards armed, so the link threads keep reading what is stored
+ * in the DT5751 memories while the main thread keeps building events.  Once
+ * EVENT_STORED is 0 on every board the link threads are parked and the
+ * builder is told no more fragments will come, so the events with missing
+ * boards are flushed as well.  The transition completes when the ring
+ * buffers are empty or after "Drain timeout (s)"; what is left is reported
+ * and dropped by end_of_run.
+ *
+ * \param   [in]  transition  TR_STOP
+ * \param   [in]  first       first call for this transition
+ * \return  TRUE to let the transition proceed
+ */
 BOOL wait_buffer_empty(int transition, BOOL first)
 {
-   if(first){
-      printf("\nDeferred transition.  First call of wait_buffer_empty. Stopping run\n");
+  int inBoards, inRBs, inSpills;
+
+  if(first){
+    if (!runInProgress) return TRUE;
+
+    printf("\nDeferred transition.  First call of wait_buffer_empty. Stopping triggers\n");
+    if (enableChronobox && !replay.IsOpen()) {
       // Some funny business here... need to pause the readout on the threads before
       // making the chronobox stop call... some sort of contention for the system resources.
-      if (enableChronobox) {
-        stopRunInProgress = true;
-        usleep(500);
-        chronobox_start_stop(false);
-        stopRunInProgress = false;
-        sleep(1);
-        // We'll stop the DT5751s later
-     } else {
-       printf("wait_buffer_empty: begin of boards stop\n");
-       for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
-         if (itdt5751->IsConnected()) {  // Skip unconnected board
-           itdt5751->StopRun();
-         }
-       }
-       printf("wait_buffer_empty: end of boards stop\n");
-       // gennaro
-       stopRunInProgress = true;
-     }
-
-     gettimeofday(&wait_start, NULL);
-
-     if (flushBuffersAtEndOfRun) {
-       cm_msg(MINFO, __FUNCTION__, "Deferring transition to flush more data from boards"); 
-       printf("wait_buffer_empty: return FALSE\n");	
-       return FALSE;
-     } else {
-       printf("wait_buffer_empty: return TRUE\n");	
-       return TRUE;
-     }
-   }
+      stopRunInProgress = true;
+      usleep(500);
+      chronobox_start_stop(false);
+      stopRunInProgress = false;
+    }
+    if (replay.IsOpen()) {
+      replay.Stop();
+    }
+    trigGen.Stop();
+    run_control_all(dt5751CONET2::CtlPause);
 
-   bool haveEventsInBuffer = true;
-   for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
-     if(itdt5751->IsConnected() && (itdt5751->GetNumEventsInRB() == 0)) {
-       haveEventsInBuffer = false;
-     }
-   }
-   
-   // Stay in deferred transition till all events are cleared
-   if(haveEventsInBuffer){
-
-     double wait_timeout_secs = 10;
-     timeval now;
-     gettimeofday(&now, NULL);
- 
-     if (now.tv_sec - wait_start.tv_sec + 1e-6 * (now.tv_usec - wait_start.tv_usec) > wait_timeout_secs) {
-        cm_msg(MINFO, __FUNCTION__, "Still have data on boards, but taking too long to flush it all. Completing transition now.");
-        return TRUE;
-     } else {
-        printf("Deferred transition: still have events\n");
-        return FALSE;
-     }
-   }
+    gettimeofday(&wait_start, NULL);
+    drainPhase = 0;
+    drainPending = count_pending_events(&inBoards, &inRBs, &inSpills);
 
-  cm_msg(MINFO, __FUNCTION__, "Finished flushing data from ring buffers");
-   printf("Deferred transition: cleared all events\n");
-   return TRUE;
- }
+    // Nothing is read out while paused; end_of_run reports what is left
+    if (!flushBuffersAtEndOfRun || runPaused || drainPending == 0) {
+      printf("wait_buffer_empty: return TRUE\n");
+      return TRUE;
+    }
+
+    cm_msg(MINFO, __FUNCTION__, "Draining %d events from the boards, %d from the ring buffers and %d from the spill queues (timeout %u s)",
+           inBoards, inRBs, inSpills, drainTimeout);
+    return FALSE;
+  }
+
+  count_pending_events(&inBoards, &inRBs, &inSpills);
+
+  if (drainPhase == 0 && inBoards == 0 && inSpills == 0) {
+    // Let the link threads finish their last BLT and unspill, then build what is left
+    if (!replay.IsOpen()) park_link_threads();
+    eventBuilder.SetDraining(true);
+    drainPhase = 1;
+    count_pending_events(&inBoards, &inRBs, &inSpills);
+  }
+
+  timeval now;
+  gettimeofday(&now, NULL);
+  double elapsed = now.tv_sec - wait_start.tv_sec + 1e-6 * (now.tv_usec - wait_start.tv_usec);
+
+  if (drainPhase == 1 && inRBs == 0) {
+    cm_msg(MINFO, __FUNCTION__, "Drained %d events in %.2f s", drainPending, elapsed);
+    return TRUE;
+  }
+
+  if (elapsed > drainTimeout) {
+    int left = inBoards + inRBs + inSpills;
+    cm_msg(MERROR, __FUNCTION__, "Drain timeout after %u s: %d events drained, %d abandoned (%d in the boards, %d in the ring buffers, %d in the spill queues)",
+           drainTimeout, drainPending - left, left, inBoards, inRBs, inSpills);
+    return TRUE;
+  }
+
+  return FALSE;
+}
 
 //
 //----------------------------------------------------------------------------
@@ -831,44 +1797,61 @@ INT end_of_run(INT run_number, char *error)
   printf("<<< Start of end_of_run \n");
 
   DWORD eStored;
-  bool result;
-  int * status;
+  bool parked = true;
 
   if(runInProgress){  //skip actions if we weren't running
 
-    runInProgress = false;  //Signal threads to quit
+    runInProgress = false;
+    runPaused = false;
+    dt5751Trace::Instance().Record(dt5751Trace::RunStop, -1, run_number);
+
+    if (trigGen.IsRunning() || trigGen.GetNumSent() > 0) {
+      trigGen.Stop();
+      double seconds = trigGen.GetSeconds();
+      cm_msg(MINFO, "EOR", "Software trigger generator: %llu sent (%.1f Hz), %llu missed, %llu errors, lateness mean %.1f us max %.1f us",
+             (unsigned long long)trigGen.GetNumSent(), seconds > 0 ? trigGen.GetNumSent()/seconds : 0.,
+             (unsigned long long)trigGen.GetNumMissed(), (unsigned long long)trigGen.GetNumErrors(),
+             trigGen.GetMeanLatenessUs(), trigGen.GetMaxLatenessUs());
+    }
 
+    // Stop the readout before touching the boards and ring buffers
+    if (replay.IsOpen()) {
+      replay.Stop();
+      printf(">>> Replay stopped after %llu events\n", (unsigned long long)replay.GetNumEvents());
+    } else {
+      parked = park_link_threads();
+      for(int i=0; i < topology.GetLinksPerFe(); ++i){
+        printf(">>> Thread %d parked, return code: %d\n", i, thread_retval[i]);
+      }
+    }
+    eventBuilder.SetDraining(false);
 
-    // Do not quit parent before children processes, wait for the proper
-    // child exit first.
-    for(int i=0; i < NBLINKSPERFE; ++i){
-      pthread_join(tid[i],(void**)&status);
-      printf(">>> Thread %d joined, return code: %d\n", i, *status);
+    int inBoards, inRBs, inSpills;
+    if (count_pending_events(&inBoards, &inRBs, &inSpills) > 0) {
+      cm_msg(MINFO, "EOR", "%d events abandoned at end of run (%d in the boards, %d in the ring buffers, %d in the spill queues)",
+             inBoards + inRBs + inSpills, inBoards, inRBs, inSpills);
     }
 
     // Stop run
+    run_control_all(dt5751CONET2::CtlStop);
+
     for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
       if (itdt5751->IsConnected()) {  // Skip unconnected board
-        if (1) { //(enableChronobox) {
-           // If no chronobox, we've already stopped the boards.
-           result = itdt5751->StopRun();
-
-           if(!result) {
-             cm_msg(MERROR, "EOR", "Could not stop the run for module %d", itdt5751->GetModuleID());
-           }
-        }
-
         printf("Number of events in ring buffer for module-%i: %i\n",itdt5751->GetModuleID(),itdt5751->GetNumEventsInRB());
 
-        rb_delete(itdt5751->GetRingBufferHandle());
-        itdt5751->SetRingBufferHandle(-1);
-	      itdt5751->ResetNumEventsInRB();
+        if (parked) {
+          reset_ring_buffer(*itdt5751);
+          spill[itdt5751 - odt5751.begin()].Clear();
+          spill_refill[itdt5751 - odt5751.begin()] = false;
+          spill_off[itdt5751 - odt5751.begin()] = false;
+          dt5751Metrics::Instance().SetGauge(itdt5751->GetModuleID(), dt5751Metrics::SpillBytes, 0);
+        }
       }
     }
 
 #if 0
     // Info about event in HW buffer
-    result = odt5751[0].Poll(&eStored);
+    odt5751[0].Poll(&eStored);
     if(eStored != 0x0) {
       cm_msg(MERROR, "EOR", "Events left in the dt5751-%d: %d",odt5751[0].GetModuleID(), eStored);
     }
@@ -887,6 +1870,8 @@ INT end_of_run(INT run_number, char *error)
       if(total_extra >0) cm_msg(MINFO, "EOR", "Events left in the chronobox: %d",total_extra);
     }
 
+    if (regProfileEnable)
+      write_register_profile(run_number);
   }
 
   printf(">>> End Of end_of_run\n\n");
@@ -900,7 +1885,11 @@ INT end_of_run(INT run_number, char *error)
 /**
  * \brief   Pause Run
  *
- * Called every pause run transition.
+ * Called every pause run transition.  Only the triggers are gated
+ * (dt5751CONET2::PauseRun()): the boards stay armed and the link threads
+ * keep moving the events already acquired into the ring buffers, which
+ * are read out again after resume_run.  If a board cannot be gated, the
+ * others are re-enabled and the run goes on unpaused.
  *
  * \param   [in]  run_number Number of the run being ended
  * \param   [out] error Can be used to write a message string to midas.log
@@ -913,39 +1902,26 @@ INT pause_run(INT run_number, char *error)
   cm_msg(MINFO,"PAUSE", "Beginning of pause_run");
   printf("<<< Beginning of pause_run \n");
 
-  DWORD eStored;
-  bool result;
-  int * status;
-
-  if(runInProgress){  //skip actions if we weren't running
-
-    runInProgress = false;  //Signal threads to quit
+  if(runInProgress && !runPaused){  //skip actions if we weren't running
 
-    for(int i=0; i < NBLINKSPERFE; ++i){
-      pthread_join(tid[i],(void**)&status);
-      printf(">>> Thread %d joined, return code: %d\n", i, *status);
+    if (replay.IsOpen()) {
+      replay.Stop();   // Resumes from the same file position
     }
+    trigGen.SetPaused(true);
 
-    // Stop run
-    for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
-      if (itdt5751->IsConnected()) {  // Skip unconnected board
-        result = itdt5751->StopRun();
-
-        if(!result)
-          cm_msg(MERROR, "EOR",
-                 "Could not stop the run for module %d", itdt5751->GetModuleID());
-
-        rb_delete(itdt5751->GetRingBufferHandle());
-        itdt5751->SetRingBufferHandle(-1);
-		itdt5751->ResetNumEventsInRB();
+    if (!run_control_all(dt5751CONET2::CtlPause)) {
+      // Roll back, the run goes on unpaused
+      for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+        if (itdt5751->IsConnected() && itdt5751->IsPaused())
+          itdt5751->ResumeRun();
       }
+      trigGen.SetPaused(false);
+      if (replay.IsOpen())
+        replay.Start();
+      return FE_ERR_HW;
     }
 
-    result = odt5751[0].Poll(&eStored);
-    if(eStored != 0x0) {
-      cm_msg(MERROR, "EOR", "Events left in the dt5751: %d",eStored);
-    }
-
+    runPaused = true;
   }
 
   cm_msg(MINFO,"PAUSE", "End of pause_run");
@@ -958,7 +1934,8 @@ INT pause_run(INT run_number, char *error)
 /**
  * \brief   Resume Run
  *
- * Called every resume run transition.
+ * Called every resume run transition.  Re-enable the triggers gated by
+ * pause_run.
  *
  * \param   [in]  run_number Number of the run being ended
  * \param   [out] error Can be used to write a message string to midas.log
@@ -970,37 +1947,17 @@ INT resume_run(INT run_number, char *error)
 
   printf("<<< Beginning of resume_run \n");
 
-  int rb_handle;
-  int status;
+  if(runInProgress && runPaused){
 
-  runInProgress = true;
+    if (!run_control_all(dt5751CONET2::CtlResume))
+      return FE_ERR_HW;
 
-  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
-    if (! itdt5751->IsConnected()) continue;   // Skip unconnected board
-
-    // Done in frontend_init, or StartRun if settings have changed
-    // itdt5751->InitializeForAcq();
-
-    bool go = itdt5751->StartRun();
-    if (go == false) return FE_ERR_HW;
-
-    //Create ring buffer for board
-    status = rb_create(event_buffer_size, max_event_size, &rb_handle);
-    if(status == DB_SUCCESS){
-      itdt5751->SetRingBufferHandle(rb_handle);
-    }
-    else{
-      cm_msg(MERROR, "feodt5751:Resume", "Failed to create rb for board %d", itdt5751->GetModuleID());
+    if (replay.IsOpen()) {
+      if (!replay.Start()) return FE_ERR_HW;
     }
-  }
+    trigGen.SetPaused(false);
 
-  //Create one thread per optical link
-  for(int i=0; i<NBLINKSPERFE; ++i){
-    thread_link[i] = i;
-    status = pthread_create(&tid[i], NULL, &link_thread, (void*)&thread_link[i]);
-    if(status){
-      cm_msg(MERROR,"feodt5751:Resume", "Couldn't create thread for link %d. Return code: %d", i, status);
-    }
+    runPaused = false;
   }
 
   printf("<<< End of resume_run \n");
@@ -1033,48 +1990,14 @@ INT poll_event(INT source, INT count, BOOL test)
   register int i;
 
   for (i = 0; i < count; i++) {
-    for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
+    // The generator thread replaces the per-board software triggers
+    for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end() && !trigGen.IsRunning(); ++itdt5751) {
       if(itdt5751->IsConnected()) {
         itdt5751->IssueSwTrigIfNeeded();
       }
     }
 
-    bool evtReady = true;
-    unmergedModuleToRead = -1;
-
-    if (enableMerging) {
-      //ready for readout only when data is present in all ring buffers
-      for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
-        if(itdt5751->IsConnected() && (itdt5751->GetNumEventsInRB() == 0)) {
-          evtReady = false;
-        }
-      }
-    } else {
-      // Ready for readout when data is present on any ring buffer.
-      // Read from the module with the most number of events backlogged.
-      evtReady = false;
-      int maxNumEvents = -1;
-
-      for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
-        if (!itdt5751->IsConnected()) {
-          continue;
-        }
-
-        int numEvents = itdt5751->GetNumEventsInRB();
-
-        if (numEvents > 0) {
-          evtReady = true;
-
-          if (numEvents > maxNumEvents) {
-            // Tell the readout routine to read data from the module with the
-            // most events in the buffer; this helps to more fairly read data
-            // from multiple boards when we're not merging the data.
-            unmergedModuleToRead = itdt5751->GetModuleID();
-            maxNumEvents = numEvents;
-          }
-        }
-      }      
-    }
+    bool evtReady = eventBuilder.IsEventReady();
 
     //If event not ready or we're in test phase, keep looping
     if (evtReady && !test)
@@ -1122,25 +2045,85 @@ INT interrupt_configure(INT cmd, INT source, POINTER_T adr)
 /**
  * \brief   Event readout
  *
- * Get data from all ring buffers and compose the MIDAS banks.
+ * Get data from all ring buffers and compose the MIDAS banks.  With
+ * "Triggers per event" above 1, the triggers that are ready within "Batch
+ * latency (us)" are packed into the same event, with an EVIX index bank
+ * (see dt5751Batch.hxx).
  */
 INT read_event_from_ring_bufs(char *pevent, INT off) {
 
-  DWORD *pdata;
-
   if (!runInProgress) return 0;
 
   sn = SERIAL_NUMBER(pevent);
 
   bk_init32(pevent);
 
+  uint32_t ttt;
+  if (eventBuilder.IsStreaming()) {
+    if (eventBuilder.BuildFrame(pevent) == dt5751EventBuilder::NoData) {
+      dump_trace("no events in ring buffer");
+      eor_transition_called = true;
+      return 0;
+    }
+  } else if (!batch.IsEnabled()) {
+    if (read_trigger(pevent, &ttt) <= 0)
+      return 0;
+  } else {
+    batch.Begin(pevent);
+    for (;;) {
+      int status = read_trigger(pevent, &ttt);
+      if (status > 0) {
+        batch.Add(pevent, ttt, eventBuilder.GetNumFragments(),
+                  eventBuilder.IsMerging() && eventBuilder.GetNumFragments() != eventBuilder.GetNumConnectedBoards());
+      } else {
+        batch.Rollback(pevent);
+        if (status < 0)
+          break;
+      }
+
+      // Wait for the next trigger, up to the latency cap
+      bool ready = false;
+      while (runInProgress && !eor_transition_called && batch.WantMore(pevent)) {
+        if ((ready = eventBuilder.IsEventReady()))
+          break;
+        usleep(20);
+      }
+      if (!ready)
+        break;
+      batch.Mark(pevent);
+    }
+    if (batch.Close(pevent) == 0)
+      return 0;
+  }
+  dt5751Metrics::Instance().Add(dt5751Metrics::kGlobal, dt5751Metrics::MidasEvents);
+
+  INT ev_size = bk_size(pevent);
+  if(ev_size == 0)
+    cm_msg(MINFO,"read_trigger_event", "******** Event size is 0, SN: %d", sn);
+  return ev_size;
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Add the banks of the next trigger to the event
+ *
+ * \param   [in]  pevent  event being composed
+ * \param   [out] ttt     trigger time tag of the first board fragment
+ * \return  1 if the banks are to be sent, 0 if the trigger is skipped, -1
+ *          if the readout failed (banks to be dropped as well)
+ */
+int read_trigger(char *pevent, uint32_t *ttt) {
+
+  DWORD *pdata;
+
   // Keep track of timestamps
   std::vector<uint32_t> timestamps;
 
   if (enableChronobox) {
     // Get the ChronoBox bank
     // If this is the first event, then read ZMQ buffer an extra time; want to discard first event.
-    if(is_first_event){
+    if(is_first_event && !replay.IsOpen()){
       uint32_t rcvbuf [100];
       int stat0 = zmq_recv (subscriber, rcvbuf, sizeof(rcvbuf), ZMQ_DONTWAIT);
       if(!stat0){
@@ -1162,7 +2145,10 @@ INT read_event_from_ring_bufs(char *pevent, INT off) {
     float zmq_time = 0;
 
     while (zmq_time < zmq_timeout_ms) {
-      stat = zmq_recv (subscriber, pdata, 1000, ZMQ_DONTWAIT);
+      if (replay.IsOpen())
+        stat = replay.PopZmqBank(pdata, 1000);
+      else
+        stat = zmq_recv (subscriber, pdata, 1000, ZMQ_DONTWAIT);
 
       if (stat > 0) {
         break;
@@ -1172,6 +2158,8 @@ INT read_event_from_ring_bufs(char *pevent, INT off) {
       usleep(1000 * zmq_retry_wait_ms);
     }
 
+    dt5751Trace::Instance().Record(dt5751Trace::ZmqRecv, -1, (stat > 0) ? stat : 0);
+
     if (stat > 0) {
 
       //printf("ZMQ: %x %x %x %x %x",pdata[0],pdata[1],pdata[2],pdata[3],pdata[4]);
@@ -1183,115 +2171,55 @@ INT read_event_from_ring_bufs(char *pevent, INT off) {
       // There should be ZMQ data for each bank.  If not, stop the run.
       if(!eor_transition_called){
         cm_msg(MERROR,"read_trigger_event", "Error: did not receive a ZMQ bank after %f ms.  Stopping run.", zmq_timeout_ms);
+        dump_trace("missing ZMQ bank");
         // gennaro
         // cm_transition(TR_STOP, 0, NULL, 0, TR_DETACH, 0);
         eor_transition_called = true;
-        return 0;
+        return -1;
       }
     }
   } // End of chronobox
 
-  if (!enableMerging && unmergedModuleToRead < 0) {
-    cm_msg(MERROR,"read_trigger_event", "Error: module to read is set to invalid value %d! Stopping run.", unmergedModuleToRead);
+  if (!enableMerging && eventBuilder.GetModuleToRead() < 0) {
+    cm_msg(MERROR,"read_trigger_event", "Error: module to read is set to invalid value %d! Stopping run.", eventBuilder.GetModuleToRead());
     // gennaro
     // cm_transition(TR_STOP, 0, NULL, 0, TR_DETACH, 0);
     eor_transition_called = true;
-    return 0;
+    return -1;
   }
 
-  int64_t minTimestamp = 0xFFFFFFFF;
-  int64_t rolloverTime = 0x80000000;
-  DWORD numConnectedBoards = 0;
-
-  if (enableMerging) {
-    // Merge by timestamp
-    for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
-      if (! itdt5751->IsConnected()) continue;   // Skip unconnected board
-
-      numConnectedBoards++;
-      int64_t thisTimestamp = itdt5751->PeekRBTimestamp();
-
-      //printf("this: %08lx, curr min: %08lx, rollover: %d\n", thisTimestamp, minTimestamp, std::abs(thisTimestamp - minTimestamp) > rolloverTime / 2);
-
-      if (minTimestamp == 0xFFFFFFFF) {
-        // First timestamp
-        minTimestamp = thisTimestamp;
-      } else if (std::abs(thisTimestamp - minTimestamp) > rolloverTime / 2) {
-        // Had rollover
-        if (thisTimestamp > minTimestamp) {
-          minTimestamp = thisTimestamp;
-        }
-      } else if (thisTimestamp < minTimestamp) {
-        // No rollover
-        minTimestamp = thisTimestamp;
-      }
-    }
+  size_t numZmq = timestamps.size();
+  dt5751EventBuilder::Outcome outcome = eventBuilder.Build(pevent, timestamps);
+  if (outcome == dt5751EventBuilder::NoData) {
+    dump_trace("no events in ring buffer");
+    // gennaro
+    // cm_transition(TR_STOP, 0, NULL, 0, TR_DETACH, 0);
+    eor_transition_called = true;
+    return -1;
   }
-
-  for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751) {
-    if (! itdt5751->IsConnected()) continue;   // Skip unconnected board
-
-    if (enableMerging && itdt5751->GetNumEventsInRB() == 0) {
-        cm_msg(MERROR,"read_trigger_event", "Error: no events in RB for module %d.  Stopping run.", itdt5751->GetModuleID());
-        // gennaro
-        // cm_transition(TR_STOP, 0, NULL, 0, TR_DETACH, 0);
-        eor_transition_called = true;
-        return 0;
-    }
-
-    if (!enableMerging && itdt5751->GetModuleID() != unmergedModuleToRead) {
-      continue;
-    }
-
-    DWORD thisTimestamp = itdt5751->PeekRBTimestamp();
-    DWORD deltaTimestamp = thisTimestamp - minTimestamp;
-
-    if (deltaTimestamp > 0x7FFFFFFF) {
-      // Handle rollover
-      deltaTimestamp -= 0x7FFFFFFF;
-    }
-
-    if (enableMerging && deltaTimestamp > timestampMatchingThreshold) {
-      continue;
-    }
-
-    // >>> Fill Event bank
-    uint32_t timestamp;
-    itdt5751->FillEventBank(pevent,timestamp);
-
-    // Save timestamp for ZLE bank.
-    timestamps.push_back((timestamp & 0x7fffffff));
-
-    if (!enableMerging) {
-      // Only saving data from 1 board.
-      break;
-    }
+  if (outcome == dt5751EventBuilder::Filtered)
+    return 0;
+  *ttt = (timestamps.size() > numZmq) ? timestamps[numZmq] : 0;
+
+  if (l2Enable) {
+    bk_create(pevent, "L2FL", TID_DWORD, (void **)&pdata);
+    *pdata++ = (eventBuilder.GetDecision() == dt5751EventBuilder::Filter::Prescaled) ? 1 : 0;
+    *pdata++ = l2Filter.GetChannels();
+    *pdata++ = l2Filter.GetBoards();
+    bk_close(pevent, pdata);
   }
 
+  // Time tag differences between the boards and with the chronobox
+  if (timestamps.size() > numZmq)
+    timing.Fill(eventBuilder.GetSelected(), &timestamps[numZmq], numZmq ? &timestamps[0] : NULL);
 
-  // Check the timestamps
-  if (timestamps.size() > 1) {
-    for(unsigned int i = 1; i < timestamps.size(); i++){
-      uint32_t diff1 = timestamps[0]-timestamps[i];
-      uint32_t diff2 = timestamps[i]-timestamps[0];
-      uint32_t diff = (diff1 < diff2) ? diff1 : diff2;
-      double fdiff = diff*0.000000008;
-
-      //printf("idx:%i sze:%zu [0]:0x%08x [%i]:0x%08x diff:%i secs:%f diff_secs:%f \n", i, timestamps.size(), timestamps[0], i,  timestamps[i], diff, timestamps[i]*0.000000008,fdiff);
-    }
-  } else {
-    //printf("only 1 timestamp, [0]:0x%08x secs:%f\n", timestamps[0], timestamps[0]*0.000000008);
-  }
-
-  if (enableMerging && !writePartiallyMergedEvents && timestamps.size() != numConnectedBoards) {
-    printf("Skipping event at time 0x%08x as only have data from %d/%d boards.\n", minTimestamp, (DWORD)timestamps.size(), numConnectedBoards);
+  if (outcome == dt5751EventBuilder::Skipped) {
+    printf("Skipping event at time 0x%08x as only have data from %d/%d boards.\n", eventBuilder.GetMinTimestamp(),
+           eventBuilder.GetNumFragments(), eventBuilder.GetNumConnectedBoards());
     return 0;
   }
 
-  INT ev_size = bk_size(pevent);
-  if(ev_size == 0)
-    cm_msg(MINFO,"read_trigger_event", "******** Event size is 0, SN: %d", sn);
-  return ev_size;
+  return 1;
 }
 
 //
@@ -1304,11 +2232,12 @@ INT read_buffer_level(char *pevent, INT off) {
     if (!itdt5751->IsConnected()) {
       continue;
     }
+    itdt5751->UpdateSlowControl(slow_control_max_age_ns);
     itdt5751->FillBufferLevelBank(pevent);
+    if (itdt5751->IsOffline() || !itdt5751->GetSlowControl().ok) continue;
 
     // Check the PLL lock
-    DWORD vmeStat, vmeAcq;
-    itdt5751->ReadReg(DT5751_ACQUISITION_STATUS, &vmeAcq);
+    DWORD vmeStat, vmeAcq = itdt5751->GetSlowControl().acq_status;
     if ((vmeAcq & 0x80) == 0) {
       PLLLockLossID= itdt5751->GetModuleID();
       cm_msg(MINFO,"read_buffer_level","DT5751 PLL loss lock Board:%d (vmeAcq=0x%x)"
@@ -1324,10 +2253,223 @@ INT read_buffer_level(char *pevent, INT off) {
     db_set_value(hDB, 0, Path, &(PLLLockLossID), sizeof(INT), 1, TID_INT);
     // PLL loss lock reset by the READOUT_STATUS read!
   }
-  printf(" | ");
+
+  publish_metrics(pevent);
+  publish_timing(pevent);
+  update_baselines();
+
+  // Flight recorder dump requested by SIGUSR1 or through the ODB
+  char trace_path[255];
+  BOOL traceDump = false;
+  INT size = sizeof(BOOL);
+  sprintf(trace_path, "/Equipment/%s/Settings/Trace dump", equipment[1].name);
+  db_get_value(hDB, 0, trace_path, &traceDump, &size, TID_BOOL, TRUE);
+  if (traceDump || traceDumpRequested) {
+    dump_trace(traceDump ? "ODB request" : "signal");
+    traceDumpRequested = 0;
+    traceDump = false;
+    db_set_value(hDB, 0, trace_path, &traceDump, sizeof(BOOL), 1, TID_BOOL);
+  }
+
   return bk_size(pevent);
 }
 
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Dump the flight recorder to the trace directory
+ *
+ * Convert the dump with dt5751trace2json.
+ *
+ * \param   [in]  reason  short description stored in the dump
+ */
+void dump_trace(const char *reason)
+{
+  dt5751Trace &trace = dt5751Trace::Instance();
+  if (!trace.IsEnabled())
+    return;
+
+  char path[512];
+  timeval now;
+  gettimeofday(&now, NULL);
+  snprintf(path, sizeof(path), "%s/dt5751_trace_fe%02d_%ld.%06ld.bin", traceDirectory.c_str(),
+           get_frontend_index(), (long)now.tv_sec, (long)now.tv_usec);
+
+  if (trace.Dump(path, reason))
+    cm_msg(MINFO, "dump_trace", "Flight recorder (%s) written to %s", reason, path);
+  else
+    cm_msg(MERROR, "dump_trace", "Cannot write flight recorder to %s", path);
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Write the register access profile of the run to the trace directory
+ *
+ * \param   [in]  run_number  run that just ended
+ */
+void write_register_profile(INT run_number)
+{
+  dt5751RegProfile &profile = dt5751RegProfile::Instance();
+  profile.SetEnabled(false);
+
+  char path[512];
+  snprintf(path, sizeof(path), "%s/dt5751_regprofile_fe%02d_run%05d.txt", traceDirectory.c_str(),
+           get_frontend_index(), run_number);
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL || !profile.WriteSummary(fp)) {
+    cm_msg(MERROR, "write_register_profile", "Cannot write register profile to %s", path);
+    if (fp) fclose(fp);
+    return;
+  }
+  fclose(fp);
+
+  cm_msg(MINFO, "write_register_profile", "%llu register accesses in %.1f s, profile written to %s",
+         (unsigned long long)profile.GetNumAccesses(), profile.GetSeconds(), path);
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Publish the metrics registry
+ *
+ * Called from the periodic buffer level readout, off the acquisition path.
+ * Adds per module
+ * - MTxx: counter increments since the last call (MTFE for frontend-wide counters)
+ * - LTxx: readout, ring buffer wait, bank and total latency percentiles
+ *         (p50, p90, p99, max in us) over the same period
+ *
+ * mirrors the totals in /Equipment/DT5751_BufLvlXX/Metrics and writes the
+ * Prometheus text file if "Metrics file" is set.
+ *
+ * \param   [in]  pevent  event being composed by read_buffer_level()
+ */
+void publish_metrics(char *pevent)
+{
+  static dt5751Metrics::Snapshot prev;
+  dt5751Metrics &metrics = dt5751Metrics::Instance();
+  dt5751Metrics::Snapshot snap, delta;
+  metrics.Collect(snap);
+  metrics.Difference(snap, prev, delta);
+
+  const dt5751Metrics::Histogram stages[] = { dt5751Metrics::ReadoutNs, dt5751Metrics::RbWaitNs,
+                                              dt5751Metrics::BankNs, dt5751Metrics::TotalNs };
+  const double quantiles[] = { 0.5, 0.9, 0.99, 1.0 };
+
+  char bankName[5];
+  char odbPath[255];
+  DWORD *pdata;
+  double totals[dt5751Metrics::NumCounters];
+  double latency[16];
+
+  for (int r = 0; r <= metrics.GetNumModules(); r++) {
+    int module = (r == metrics.GetNumModules()) ? (int)dt5751Metrics::kGlobal : metrics.GetFirstModuleID() + r;
+    if (module == dt5751Metrics::kGlobal)
+      snprintf(bankName, sizeof(bankName), "MTFE");
+    else if (odt5751[r].IsConnected())
+      snprintf(bankName, sizeof(bankName), "MT%02d", module);
+    else
+      continue;
+
+    bk_create(pevent, bankName, TID_DWORD, (void **)&pdata);
+    for (int c = 0; c < dt5751Metrics::NumCounters; c++) {
+      *pdata++ = (DWORD)metrics.GetCounter(delta, module, (dt5751Metrics::Counter)c);
+      totals[c] = (double)metrics.GetCounter(snap, module, (dt5751Metrics::Counter)c);
+    }
+    bk_close(pevent, pdata);
+
+    snprintf(odbPath, sizeof(odbPath), "/Equipment/%s/Metrics/%s", equipment[1].name, bankName);
+    db_set_value(hDB, 0, odbPath, totals, sizeof(totals), dt5751Metrics::NumCounters, TID_DOUBLE);
+
+    if (module == dt5751Metrics::kGlobal)
+      continue;
+
+    snprintf(bankName, sizeof(bankName), "LT%02d", module);
+    bk_create(pevent, bankName, TID_DWORD, (void **)&pdata);
+    for (int i = 0; i < 16; i++) {
+      uint64_t ns = metrics.Percentile(delta, module, stages[i/4], quantiles[i%4]);
+      *pdata++ = (DWORD)(ns/1000);
+      latency[i] = ns*1e-3;
+    }
+    bk_close(pevent, pdata);
+
+    snprintf(odbPath, sizeof(odbPath), "/Equipment/%s/Latency/%s", equipment[1].name, bankName);
+    db_set_value(hDB, 0, odbPath, latency, sizeof(latency), 16, TID_DOUBLE);
+  }
+
+  if (!metricsFile.empty() && !metrics.WritePrometheus(metricsFile.c_str(), snap)) {
+    static bool reported = false;
+    if (!reported)
+      cm_msg(MERROR, "publish_metrics", "Cannot write metrics file %s", metricsFile.c_str());
+    reported = true;
+  }
+
+  prev.counters.swap(snap.counters);
+  prev.buckets.swap(snap.buckets);
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Publish the time tag difference histograms
+ *
+ * Adds the TDIF bank (see dt5751Timing.hxx) and mirrors the mean of each
+ * histogram since the start of run in /Equipment/DT5751_BufLvlXX/Timing.
+ *
+ * \param   [in]  pevent  event being composed by read_buffer_level()
+ */
+void publish_timing(char *pevent)
+{
+  int n = timing.GetNumHistograms();
+  if (n == 0)
+    return;
+
+  timing.FillBank(pevent);
+
+  std::vector<double> means(n);
+  for (int i = 0; i < n; i++)
+    means[i] = timing.GetMean(i);
+  char odbPath[255];
+  snprintf(odbPath, sizeof(odbPath), "/Equipment/%s/Timing/Mean (ticks)", equipment[1].name);
+  db_set_value(hDB, 0, odbPath, &means[0], n*sizeof(double), n, TID_DOUBLE);
+}
+
+//
+//----------------------------------------------------------------------------
+/**
+ * \brief   Baseline tracking step
+ *
+ * Called from the periodic buffer level readout: a safe point, the register
+ * writes go through the slow control queues of the link threads, between
+ * two readouts.  At most once per "Baseline update period (s)"; mirrors the
+ * baseline estimates and the DAC values in /Equipment/DT5751_BufLvlXX/Baseline.
+ */
+void update_baselines()
+{
+  static uint64_t last_ns = 0;
+  uint64_t now = dt5751Metrics::NowNs();
+  if (!baselineTracking || !runInProgress || now - last_ns < (uint64_t)baselinePeriodS*1000000000ull)
+    return;
+  last_ns = now;
+
+  int changed = baselineTracker.Update(odt5751);
+  if (changed)
+    printf("Baseline tracking: %d channels corrected\n", changed);
+
+  int n = (int)odt5751.size()*4;
+  std::vector<double> measured(n);
+  std::vector<INT> dac(n);
+  for (int i = 0; i < n; i++) {
+    measured[i] = baselineTracker.GetBaseline(i/4, i%4);
+    dac[i] = odt5751[i/4].GetChannelDac(i%4);
+  }
+  char odbPath[255];
+  snprintf(odbPath, sizeof(odbPath), "/Equipment/%s/Baseline/Measured (ADC)", equipment[1].name);
+  db_set_value(hDB, 0, odbPath, &measured[0], n*sizeof(double), n, TID_DOUBLE);
+  snprintf(odbPath, sizeof(odbPath), "/Equipment/%s/Baseline/DAC", equipment[1].name);
+  db_set_value(hDB, 0, odbPath, &dac[0], n*sizeof(INT), n, TID_INT);
+}
+
 
 //
 //----------------------------------------------------------------------------
@@ -1336,22 +2478,18 @@ INT read_temperature(char *pevent, INT off) {
   DWORD *pdata;
   bk_init32(pevent);
 
-  // Read the temperature for each ADC...
-  DWORD temp;
+  // Temperature of each ADC, from the slow-control snapshot shared with read_buffer_level
   for (itdt5751 = odt5751.begin(); itdt5751 != odt5751.end(); ++itdt5751){
-    if (!itdt5751->IsConnected()) {
+    if (!itdt5751->IsConnected() || itdt5751->IsOffline()) {
       continue;
     }
+    itdt5751->UpdateSlowControl(slow_control_max_age_ns);
 
-    int addr;
     char bankName[5];
     sprintf(bankName,"TP%02d", itdt5751->GetModuleID());
     bk_create(pevent, bankName, TID_DWORD, (void **)&pdata);
     for (int i=0;i<4;i++) {
-     addr = DT5751_CHANNEL_TEMPERATURE | (i << 8);
-     itdt5751->ReadReg(addr, &temp);
-     *pdata++ =  temp;
-
+     *pdata++ = itdt5751->GetSlowControl().temperature[i];
     }
     bk_close(pevent,pdata);
   }
@@ -9,6 +9,8 @@
   Operation:
   > ./odt5751 -l 100 -l 0 -b 0
   > ./odt5751 -l 10000 -m 100 -l 1 -b 0
+  Throughput benchmark over 4 links, 2 boards each, CSV output:
+  > ./odt5751 -B -o 0 -L 4 -D 2 -S 16384,1048576 -E 1,16 -T 10
 
   $Id$
 *********************************************************************/
@@ -16,6 +18,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <unistd.h>
 #include "odt5751drv.h"
 
 #define LARGE_NUMBER 10000000
@@ -281,6 +284,252 @@ CAENComm_ErrorCode  odt5751_Setup(int handle, int mode)
 /*****************************************************************/
 /*-PAA- For test purpose only */
 #ifdef MAIN_ENABLE
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+/*
+  Throughput benchmark (-B)
+
+  One thread per optical link reads the boards of its link in turn, as the
+  frontend link threads do: readout status, then BLTs of the requested size
+  until the board ends the transfer (events per BLT reached or no more data).
+  For every events-per-BLT / BLT size pair, each link and the sum of all
+  links are reported: sustained MB/s, events/s and BLT latency percentiles.
+  The register round trip (Read32 of the board info) is measured first, one
+  board at a time.  Triggers come from the source selected with -g, the rest
+  of the board configuration is left as found.
+*/
+#define BENCH_MAX_LINKS           8
+#define BENCH_MAX_BOARDS_PER_LINK 8
+#define BENCH_MAX_POINTS          16
+#define BENCH_BUFFER_WORDS        (16*1024*1024)  // 64 MB per link
+
+typedef struct {
+  int link;
+  int nboards;
+  int handle[BENCH_MAX_BOARDS_PER_LINK];
+  int blt_bytes;
+  double seconds;
+  pthread_barrier_t *barrier;
+  uint32_t *buffer;
+  uint64_t bytes;
+  uint64_t events;
+  uint64_t elapsed_ns;
+  std::vector<uint32_t> blt_ns;   // one entry per BLT
+} BenchLink;
+
+/*****************************************************************/
+static uint64_t bench_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+/*****************************************************************/
+// Comma separated list of integers (decimal or 0x hex), returns the count
+static int bench_parse_list(const char *s, int *out, int max)
+{
+  int n = 0;
+  while (*s && n < max) {
+    char *end;
+    out[n++] = (int)strtol(s, &end, 0);
+    if (*end != ',') break;
+    s = end + 1;
+  }
+  return n;
+}
+
+/*****************************************************************/
+// p-th percentile in us of a sorted vector of ns
+static double bench_percentile(const std::vector<uint32_t> &v, double p)
+{
+  if (v.empty()) return 0;
+  return v[(size_t)(p*(v.size() - 1) + 0.5)]*1e-3;
+}
+
+/*****************************************************************/
+static void bench_print(int json, const char *test, int link, int board, int blt_bytes, int evnb,
+                        double seconds, double mbps, double evps, uint64_t calls,
+                        std::vector<uint32_t> &ns)
+{
+  std::sort(ns.begin(), ns.end());
+  double p50 = bench_percentile(ns, 0.5), p90 = bench_percentile(ns, 0.9);
+  double p99 = bench_percentile(ns, 0.99), pmax = bench_percentile(ns, 1.0);
+  if (json)
+    printf("{\"test\":\"%s\",\"link\":%d,\"board\":%d,\"blt_bytes\":%d,\"events_per_blt\":%d,\"seconds\":%.3f,"
+           "\"mb_per_s\":%.2f,\"events_per_s\":%.1f,\"calls\":%llu,\"p50_us\":%.2f,\"p90_us\":%.2f,"
+           "\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+           test, link, board, blt_bytes, evnb, seconds, mbps, evps, (unsigned long long)calls, p50, p90, p99, pmax);
+  else
+    printf("%s,%d,%d,%d,%d,%.3f,%.2f,%.1f,%llu,%.2f,%.2f,%.2f,%.2f\n",
+           test, link, board, blt_bytes, evnb, seconds, mbps, evps, (unsigned long long)calls, p50, p90, p99, pmax);
+  fflush(stdout);
+}
+
+/*****************************************************************/
+static void *bench_link_thread(void *arg)
+{
+  BenchLink *bl = (BenchLink *)arg;
+  int blt_words = bl->blt_bytes/4;
+  uint32_t *buffer_end = bl->buffer + BENCH_BUFFER_WORDS;
+
+  pthread_barrier_wait(bl->barrier);
+  uint64_t start = bench_now_ns();
+  uint64_t deadline = start + (uint64_t)(bl->seconds*1e9);
+  uint64_t now = start;
+
+  while (now < deadline) {
+    int idle = 1;
+    for (int b = 0; b < bl->nboards; b++) {
+      uint32_t stat = 0;
+      CAENComm_Read32(bl->handle[b], DT5751_READOUT_STATUS, &stat);
+      if ((stat & 0x1) == 0) continue;
+      idle = 0;
+
+      // BLTs until the board terminates the transfer
+      CAENComm_ErrorCode sCAEN;
+      uint32_t *pdata = bl->buffer;
+      int nw;
+      do {
+        if (pdata + blt_words > buffer_end) break;
+        uint64_t t0 = bench_now_ns();
+        sCAEN = CAENComm_BLTRead(bl->handle[b], DT5751_EVENT_READOUT_BUFFER, pdata, blt_words*4, &nw);
+        bl->blt_ns.push_back((uint32_t)(bench_now_ns() - t0));
+        pdata += nw;
+      } while (sCAEN == CAENComm_Success && nw == blt_words);
+
+      // Count the events by walking their headers
+      int ntotal = pdata - bl->buffer;
+      bl->bytes += ntotal*4;
+      for (int i = 0; i < ntotal; ) {
+        uint32_t size = bl->buffer[i] & 0x0FFFFFFF;
+        if ((bl->buffer[i] & 0xF0000000) != 0xA0000000 || size == 0) break;
+        bl->events++;
+        i += size;
+      }
+    }
+    now = bench_now_ns();
+    if (idle) sched_yield();
+  }
+  bl->elapsed_ns = now - start;
+  return NULL;
+}
+
+/*****************************************************************/
+static int odt5751_Benchmark(int c, int firstLink, int nlinks, int nboards, int *blt, int nblt,
+                             int *evnb, int nevnb, double seconds, uint32_t trigmask, int regIter, int json)
+{
+  static BenchLink links[BENCH_MAX_LINKS];
+  int nl = 0;
+
+  for (int l = firstLink; l < firstLink + nlinks && nl < BENCH_MAX_LINKS; l++) {
+    BenchLink &bl = links[nl];
+    bl.link = l;
+    bl.nboards = 0;
+    for (int d = 0; d < nboards && d < BENCH_MAX_BOARDS_PER_LINK; d++) {
+      int handle;
+      CAENComm_ErrorCode sCAEN = CAENComm_OpenDevice(CAENComm_PCIE_OpticalLink, l, d, c, &handle);
+      if (sCAEN != CAENComm_Success) {
+        fprintf(stderr, "CAENComm_OpenDevice [l:%d, d:%d]: Error %d\n", l, d, sCAEN);
+        continue;
+      }
+      CAENComm_Write32(handle, DT5751_ACQUISITION_CONTROL, 0x0);
+      CAENComm_Write32(handle, DT5751_TRIG_SRCE_EN_MASK, trigmask);
+      bl.handle[bl.nboards++] = handle;
+    }
+    if (bl.nboards == 0) continue;
+    bl.buffer = (uint32_t *)malloc(BENCH_BUFFER_WORDS*sizeof(uint32_t));
+    nl++;
+  }
+  if (nl == 0) {
+    fprintf(stderr, "No board found\n");
+    return -1;
+  }
+
+  if (!json)
+    printf("test,link,board,blt_bytes,events_per_blt,seconds,mb_per_s,events_per_s,calls,p50_us,p90_us,p99_us,max_us\n");
+
+  // Register round trip, one board at a time
+  for (int i = 0; i < nl; i++) {
+    for (int b = 0; b < links[i].nboards; b++) {
+      std::vector<uint32_t> ns;
+      ns.reserve(regIter);
+      uint32_t reg;
+      uint64_t start = bench_now_ns();
+      for (int k = 0; k < regIter; k++) {
+        uint64_t t0 = bench_now_ns();
+        CAENComm_Read32(links[i].handle[b], DT5751_BOARD_INFO, &reg);
+        ns.push_back((uint32_t)(bench_now_ns() - t0));
+      }
+      double secs = (bench_now_ns() - start)*1e-9;
+      bench_print(json, "reg", links[i].link, b, 0, 0, secs, 0, 0, regIter, ns);
+    }
+  }
+
+  pthread_barrier_t barrier;
+  for (int e = 0; e < nevnb; e++) {
+    for (int s = 0; s < nblt; s++) {
+      // Fresh start for every point
+      for (int i = 0; i < nl; i++) {
+        BenchLink &bl = links[i];
+        for (int b = 0; b < bl.nboards; b++) {
+          CAENComm_Write32(bl.handle[b], DT5751_ACQUISITION_CONTROL, 0x0);
+          CAENComm_Write32(bl.handle[b], DT5751_SW_CLEAR, 0);
+          CAENComm_Write32(bl.handle[b], DT5751_BLT_EVENT_NB, evnb[e]);
+        }
+        bl.blt_bytes = blt[s] & ~3;
+        bl.seconds = seconds;
+        bl.barrier = &barrier;
+        bl.bytes = bl.events = bl.elapsed_ns = 0;
+        bl.blt_ns.clear();
+        bl.blt_ns.reserve(1 << 20);
+      }
+      for (int i = 0; i < nl; i++)
+        for (int b = 0; b < links[i].nboards; b++)
+          odt5751_AcqCtl(links[i].handle[b], DT5751_RUN_START);
+
+      pthread_barrier_init(&barrier, NULL, nl);
+      pthread_t tid[BENCH_MAX_LINKS];
+      for (int i = 0; i < nl; i++)
+        pthread_create(&tid[i], NULL, bench_link_thread, &links[i]);
+      for (int i = 0; i < nl; i++)
+        pthread_join(tid[i], NULL);
+      pthread_barrier_destroy(&barrier);
+
+      for (int i = 0; i < nl; i++)
+        for (int b = 0; b < links[i].nboards; b++)
+          odt5751_AcqCtl(links[i].handle[b], DT5751_RUN_STOP);
+
+      std::vector<uint32_t> all;
+      double mbps = 0, evps = 0, secs = 0;
+      for (int i = 0; i < nl; i++) {
+        BenchLink &bl = links[i];
+        double t = bl.elapsed_ns*1e-9;
+        uint64_t calls = bl.blt_ns.size();
+        all.insert(all.end(), bl.blt_ns.begin(), bl.blt_ns.end());
+        mbps += bl.bytes/t*1e-6;
+        evps += bl.events/t;
+        secs = std::max(secs, t);
+        bench_print(json, "blt", bl.link, -1, bl.blt_bytes, evnb[e], t, bl.bytes/t*1e-6, bl.events/t,
+                    calls, bl.blt_ns);
+      }
+      if (nl > 1)
+        bench_print(json, "blt", -1, -1, links[0].blt_bytes, evnb[e], secs, mbps, evps, all.size(), all);
+    }
+  }
+
+  for (int i = 0; i < nl; i++) {
+    for (int b = 0; b < links[i].nboards; b++)
+      CAENComm_CloseDevice(links[i].handle[b]);
+    free(links[i].buffer);
+  }
+  return 0;
+}
+
 int main (int argc, char* argv[]) {
 
   /* Lock the process to an arbitrary core (#3)
@@ -307,6 +556,12 @@ int main (int argc, char* argv[]) {
   // Added to test optivca communication (Alex 26/02/12)
   int testCom    = 0;
   uint32_t regRd = 0;
+  // Throughput benchmark (-B)
+  int bench = 0, json = 0, nlinks = 1, nboards = 1, regIter = 10000;
+  int blt[BENCH_MAX_POINTS] = {4096, 16384, 65536, 262144, 1048576}, nblt = 5;
+  int evnb[BENCH_MAX_POINTS] = {1, 8, 64}, nevnb = 3;
+  double seconds = 5;
+  uint32_t trigmask = 0x40000000;
 
    /* get parameters */
    /* parse command line parameters */
@@ -317,6 +572,10 @@ int main (int argc, char* argv[]) {
       bshowData = 1;
     else if (strncmp(argv[i], "-t", 2) == 0)
       testCom = 1;
+    else if (strncmp(argv[i], "-B", 2) == 0)
+      bench = 1;
+    else if (strncmp(argv[i], "-j", 2) == 0)
+      json = 1;
     else if (argv[i][0] == '-') {
       if (i + 1 >= argc || argv[i + 1][0] == '-')
 	goto usage;
@@ -332,6 +591,20 @@ int main (int argc, char* argv[]) {
 	Nmodulo =  (atoi(argv[++i]));
       else if (strncmp(argv[i], "-d", 2) == 0)
 	d =  (atoi(argv[++i]));
+      else if (strncmp(argv[i], "-L", 2) == 0)
+	nlinks =  (atoi(argv[++i]));
+      else if (strncmp(argv[i], "-D", 2) == 0)
+	nboards =  (atoi(argv[++i]));
+      else if (strncmp(argv[i], "-S", 2) == 0)
+	nblt = bench_parse_list(argv[++i], blt, BENCH_MAX_POINTS);
+      else if (strncmp(argv[i], "-E", 2) == 0)
+	nevnb = bench_parse_list(argv[++i], evnb, BENCH_MAX_POINTS);
+      else if (strncmp(argv[i], "-T", 2) == 0)
+	seconds =  (atof(argv[++i]));
+      else if (strncmp(argv[i], "-g", 2) == 0)
+	trigmask =  (strtoul(argv[++i], NULL, 0));
+      else if (strncmp(argv[i], "-R", 2) == 0)
+	regIter =  (atoi(argv[++i]));
     } else {
     usage:
       printf("usage: odt5751 -l (loop count) \n");
@@ -341,12 +614,21 @@ int main (int argc, char* argv[]) {
       printf("              -d daisy#\n");
       printf("              -m modulo display\n");
       printf("              -s show data\n");
-      printf("              -t test communication\n\n");
+      printf("              -t test communication\n");
+      printf("              -B throughput benchmark, options:\n");
+      printf("                 -o first link#, -L links, -D boards per link\n");
+      printf("                 -S BLT sizes in bytes (4096,16384,65536,262144,1048576)\n");
+      printf("                 -E events per BLT (1,8,64)\n");
+      printf("                 -T seconds per point (5), -R register reads (10000)\n");
+      printf("                 -g trigger source mask (0x40000000), -j JSON lines\n\n");
       return 0;
          }
   }
   
   //  printf("in odt5751, l %d, d %d, c %d\n", l, d, c);
+
+  if (bench)
+    return odt5751_Benchmark(c, l, nlinks, nboards, blt, nblt, evnb, nevnb, seconds, trigmask, regIter, json);
   
 #if 1
 
@@ -448,15 +730,15 @@ int main (int argc, char* argv[]) {
     
     sCAEN = odt5751_AcqCtl(handle[h], 0x3);
     sCAEN = CAENComm_Write32(handle[h], DT5751_BOARD_CONFIG        , 0x10);
-    sCAEN = CAENComm_Write32(handle[h], DT5751_BUFFER_ORGANIZATION   , 0xa);
+    sCAEN = CAENComm_Write32(handle[h], DT5751RAW_BUFFER_ORGANIZATION, 0xa);
     sCAEN = CAENComm_Write32(handle[h], DT5751_CHANNEL_EN_MASK       , 0x3);
     sCAEN = CAENComm_Write32(handle[h], DT5751_TRIG_SRCE_EN_MASK     , 0x40000000);
     sCAEN = CAENComm_Write32(handle[h], DT5751_MONITOR_MODE          , 0x3);  // buffer occupancy
     // 
     // Set Channel threshold
     for (i=0;i<8;i++) {
-      odt5751_ChannelSet(handle[h], i, DT5751_CHANNEL_THRESHOLD, 0x820);
-      sCAEN = odt5751_ChannelGet(handle[h], i, DT5751_CHANNEL_THRESHOLD, &temp);
+      odt5751_ChannelSet(handle[h], i, DT5751RAW_CHANNEL_THRESHOLD, 0x820);
+      sCAEN = odt5751_ChannelGet(handle[h], i, DT5751RAW_CHANNEL_THRESHOLD, &temp);
       printf("Board: %d Threshold[%i] = %d \n", h, i, temp);
     }
 
@@ -498,7 +780,7 @@ int main (int argc, char* argv[]) {
       // Check if data ready
       lcount=LARGE_NUMBER;
       do {
-	sCAEN = CAENComm_Read32(handle[h], DT5751_VME_STATUS, &lam);
+	sCAEN = CAENComm_Read32(handle[h], DT5751_READOUT_STATUS, &lam);
 	lam &= 0x1;
       } while ((lam==0) && (lcount--));
       if (h==1) savelcount = LARGE_NUMBER - lcount;
@@ -525,7 +807,7 @@ int main (int argc, char* argv[]) {
       pdata = &data[0];
       eloop = 0;
       do {
-	sCAEN = CAENComm_BLTRead(handle[h], DT5751_EVENT_READOUT_BUFFER, pdata, eSize < 1028 ? eSize : 1028, &nw);
+	sCAEN = CAENComm_BLTRead(handle[h], DT5751_EVENT_READOUT_BUFFER, pdata, (eSize < 1028 ? eSize : 1028)*4, &nw);
 	eSize -= nw;
 	pdata += nw;
 	tcount += nw;  // debugging